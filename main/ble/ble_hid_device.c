@@ -6,9 +6,10 @@
 #include <stdio.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
-#include "freertos/timers.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 #include "esp_bt.h"
 #include "esp_hidd_prf_api.h"
@@ -17,39 +18,135 @@
 #include "esp_bt_main.h"
 #include "storage.h"
 #include "connection.h"
+#include "reconnect.h"
+#include "hid_dev.h"
+#include "power_manager.h"
+#include "perf_counters.h"
 
 #define BLE_STATS_INTERVAL_SEC 1
-#define HIGH_SPEED_DEVICE_THRESHOLD_MS 6
-#define HIGH_SPEED_DEVICE_THRESHOLD_EVENTS 5
+#define CONN_INTERVAL_UNIT_US 1250
+#define DEFAULT_CONN_INTERVAL 0x06 // assumed until the central reports the negotiated interval
+#define DEFAULT_MTU 23
+// Fits one 251 byte PDU with Data Length Extension, room for a full packed motion report
+#define LOCAL_MTU 247
+#define PACKED_PKT_DATA_LEN 251
+
+typedef struct {
+    uint16_t min_int; // x 1.25ms
+    uint16_t max_int;
+    uint16_t latency; // connection events the peripheral may skip
+    uint16_t timeout; // x 10ms
+} conn_params_preset_t;
+
+// Parameters of the active host per link mode. With slave latency the radio sleeps through idle events,
+// but a report can still go out at the very next connection event, so resuming costs one interval.
+static const conn_params_preset_t s_link_presets[] = {
+    [BLE_LINK_ACTIVE] = { .min_int = 0x06, .max_int = 0x06, .latency = 0, .timeout = 0xA0 },
+    [BLE_LINK_IDLE] = { .min_int = 0x18, .max_int = 0x30, .latency = 4, .timeout = 0x12C },
+    [BLE_LINK_SLEEP] = { .min_int = 0x28, .max_int = 0x50, .latency = 10, .timeout = 0x258 },
+};
+
+// Standby hosts are kept warm for instant switching at a fraction of the radio time
+static const conn_params_preset_t s_standby_preset = { .min_int = 0x30, .max_int = 0x40, .latency = 4, .timeout = 0x12C };
+
+typedef struct {
+    bool connected;
+    uint16_t conn_id;
+    esp_bd_addr_t bda;
+    esp_ble_addr_type_t addr_type;
+    uint32_t conn_interval_us;
+    uint16_t mtu;
+    bool packed;        // the host enabled packed motion, its mouse report only carries congested button edges
+    uint8_t res_mult;   // Resolution Multiplier feature the host wrote, HID_RES_MULT_WHEEL/HID_RES_MULT_PAN
+} ble_host_t;
 
 static const char *TAG = "BLE_HID";
-static uint16_t s_current_rps = 0;
 static TaskHandle_t s_stats_task_handle = NULL;
+static ble_host_t s_hosts[HID_MAX_APPS];
+static int8_t s_active_host = -1;
+static ble_link_mode_t s_link_mode = BLE_LINK_ACTIVE;
+static volatile bool s_parked = false;
+static ble_hid_ready_cb_t s_ready_cb = NULL;
+// s_conn_id/s_connected always describe the active host
 static uint16_t s_conn_id = 0;
 static bool s_connected = false;
-static bool s_is_high_speed = false;
-static int s_reconnect_delay = 3;
-static int64_t s_last_event_time = 0;
-static int s_fast_events_count = 0;
-static int s_batch_count = 0;
-static TimerHandle_t s_accumulator_timer = NULL;
-static int16_t s_acc_x = 0;
-static int16_t s_acc_y = 0;
-static int8_t s_acc_wheel = 0;
-static int8_t s_acc_pan = 0;
-static uint8_t s_acc_buttons = 0;
-static uint8_t s_batch_size = 3;
+
+// Report interval estimate per mouse report stream, an EWMA of the USB arrival deltas in Q4 microseconds.
+// Mode thresholds are ratios of the connection interval in 1/16, entering and leaving a mode differ.
+#define RATE_MAX_STREAMS     4
+#define RATE_EWMA_SHIFT      3       // new delta weighs 1/8
+#define RATE_IDLE_RESET_US   (100 * 1000)
+#define RATE_PASS_ENTER_Q4   20      // interval above 1.25 connection intervals
+#define RATE_PASS_EXIT_Q4    16      // below 1.0
+#define RATE_ALIGN_ENTER_Q4  6       // below 0.375
+#define RATE_ALIGN_EXIT_Q4   10      // above 0.625
+typedef struct {
+    uint16_t stream;
+    uint8_t mode;           // ble_motion_mode_t
+    uint32_t interval_q4;   // 0 until the first delta after idle
+    int64_t last_us;
+} rate_estimate_t;
+static rate_estimate_t s_rates[RATE_MAX_STREAMS];
+static volatile uint8_t s_motion_mode = BLE_MOTION_PASS_THROUGH;
+static int64_t s_last_flush_us = 0;
+static uint32_t s_conn_interval_us = DEFAULT_CONN_INTERVAL * CONN_INTERVAL_UNIT_US;
+static esp_timer_handle_t s_coalesce_timer = NULL;
+// Serializes everything sent to the active host with host switching
+static StaticSemaphore_t s_tx_mutex_struct;
+static SemaphoreHandle_t s_tx_mutex = NULL;
+// Limits of the BLE mouse report (see hidReportMap), anything beyond is left in the accumulator
+#define MOTION_XY_MIN -32768
+#define MOTION_XY_MAX 32767
+#define MOTION_WHEEL_MIN -32767
+#define MOTION_WHEEL_MAX 32767
+static int32_t s_acc_x = 0;
+static int32_t s_acc_y = 0;
+// Wheel and pan in HID_WHEEL_RESOLUTION counts per detent, hosts without the multiplier get whole detents
+// and the rest of a detent waits for the next step
+static int32_t s_acc_wheel = 0;
+static int32_t s_acc_pan = 0;
+static int32_t s_wheel_div = HID_WHEEL_RESOLUTION;
+static int32_t s_pan_div = HID_WHEEL_RESOLUTION;
+static uint16_t s_acc_buttons = 0;
+static bool s_acc_pending = false;
+static latency_stamp_t s_acc_stamp = {0}; // stamp of the oldest sample held in the accumulator
+// Packed motion to the active host, the accumulator only holds what didn't fit a sample yet
+typedef struct {
+    uint16_t dt_us;
+    int16_t x;
+    int16_t y;
+    int8_t wheel;
+    int8_t pan;
+} packed_sample_t;
+#define PACKED_XY_MIN -32768
+#define PACKED_XY_MAX 32767
+#define PACKED_WHEEL_MIN -127
+#define PACKED_WHEEL_MAX 127
+static packed_sample_t s_pack[HID_PACKED_MAX_SAMPLES];
+static uint8_t s_pack_count = 0;
+static uint8_t s_pack_capacity = 1;         // samples per notification at the MTU of the active host
+static int64_t s_pack_motion_us = 0;        // USB arrival of the newest motion in the accumulator
+static int64_t s_pack_last_us = 0;          // USB arrival of the last sample, 0 after a reset
+static latency_stamp_t s_pack_stamp = {0};  // stamp of the oldest sample
+// Last key and consumer state sent to the active host, reports that don't change it are dropped
+static key_bitmap_t s_kb_sent = {0};
+static bool s_kb_nkro = false; // state is on the NKRO report, the 6KRO report is released
+static uint16_t s_cc_sent = 0;
 static bool g_verbose = false;
 static bool g_enabled = true;
-typedef enum {
-    SPEED_MODE_SLOW = 0,
-    SPEED_MODE_FAST,
-    SPEED_MODE_VERYFAST
-} speed_mode_t;
 
 static esp_ble_addr_type_t s_connected_device_addr_type = BLE_ADDR_TYPE_PUBLIC;
 static esp_bd_addr_t s_connected_device_addr;
-static speed_mode_t s_high_speed_submode = SPEED_MODE_SLOW;
+
+static void coalescer_reset(void);
+static void host_connected(uint16_t conn_id, const esp_bd_addr_t bda);
+static bool host_disconnected(uint16_t conn_id, ble_host_t *lost);
+static void host_mtu_changed(uint16_t conn_id, uint16_t mtu);
+static void host_set_packed(uint16_t conn_id, bool packed);
+static void host_set_res_mult(uint16_t conn_id, uint8_t res_mult);
+static uint8_t connected_hosts(void);
+static void advertise_free_slots(void);
+
 static uint8_t hidd_service_uuid128[] = {
     /* LSB <--------------------------------------------------------------------------------> MSB */
     // first uuid, 16bit, [12],[13] is the value
@@ -106,6 +203,21 @@ static void update_tx_power(void) {
     esp_ble_tx_power_set(ESP_BLE_PWR_TYPE_SCAN, power_level);
 }
 
+// GAP calls are queued to the Bluedroid task, so applying straight from the web server task is safe
+static void on_settings_changed(const uint32_t changed, const device_settings_t *settings, void *arg) {
+    if (!g_enabled) {
+        return;
+    }
+
+    if (changed & SETTING_BIT(SETTING_BLE_TX_POWER)) {
+        update_tx_power();
+    }
+
+    if (changed & SETTING_BIT(SETTING_DEVICE_NAME)) {
+        ble_hid_device_start_advertising();
+    }
+}
+
 static void hidd_event_callback(esp_hidd_cb_event_t event, esp_hidd_cb_param_t *param) {
     if (!is_ble_enabled() || !g_enabled)
         return;
@@ -124,18 +236,28 @@ static void hidd_event_callback(esp_hidd_cb_event_t event, esp_hidd_cb_param_t *
         }
         case ESP_HIDD_EVENT_BLE_CONNECT: {
             ESP_LOGI(TAG, "ESP_HIDD_EVENT_BLE_CONNECT");
+            perf_count(PERF_BLE_CONNECTS);
             update_tx_power();
-            save_connected_device(param->connect.remote_bda, s_connected_device_addr_type);
-            s_conn_id = param->connect.conn_id;
-            s_connected = true;
+            host_connected(param->connect.conn_id, param->connect.remote_bda);
             break;
         }
         case ESP_HIDD_EVENT_BLE_DISCONNECT: {
-            s_connected = false;
             ESP_LOGI(TAG, "ESP_HIDD_EVENT_BLE_DISCONNECT");
+            perf_count(PERF_BLE_DISCONNECTS);
+            ble_host_t lost;
+            const bool found = host_disconnected(param->disconnect.conn_id, &lost);
+            // While parked advertising resumes with the next report
+            if (s_parked) {
+                break;
+            }
 
-            vTaskDelay(pdMS_TO_TICKS(s_reconnect_delay * 1000));
-            esp_ble_gap_start_advertising(&hidd_adv_params);
+            perf_count(PERF_BLE_RECONNECTS);
+            if (found) {
+                // The host that just went away is the most likely one to come back
+                reconnect_start(lost.bda, lost.addr_type);
+            } else {
+                reconnect_start(NULL, BLE_ADDR_TYPE_PUBLIC);
+            }
             break;
         }
         case ESP_HIDD_EVENT_BLE_LED_REPORT_WRITE_EVT: {
@@ -143,6 +265,22 @@ static void hidd_event_callback(esp_hidd_cb_event_t event, esp_hidd_cb_param_t *
             ESP_LOG_BUFFER_HEX(TAG, param->led_write.data, param->led_write.length);
             break;
         }
+        case ESP_HIDD_EVENT_BLE_VENDOR_REPORT_WRITE_EVT: {
+            if (param->vendor_write.report_id == HID_RPT_ID_VENDOR && param->vendor_write.length >= 1) {
+                host_set_packed(param->vendor_write.conn_id, param->vendor_write.data[0] & HID_PACKED_ENABLE);
+            }
+            break;
+        }
+        case ESP_HIDD_EVENT_BLE_MTU: {
+            host_mtu_changed(param->mtu.conn_id, param->mtu.mtu);
+            break;
+        }
+        case ESP_HIDD_EVENT_BLE_FEATURE_REPORT_WRITE_EVT: {
+            if (param->feature_write.report_id == HID_RPT_ID_MOUSE_IN && param->feature_write.length >= 1) {
+                host_set_res_mult(param->feature_write.conn_id, param->feature_write.data[0]);
+            }
+            break;
+        }
         default:
             break;
     }
@@ -154,7 +292,7 @@ static void gap_event_handler(const esp_gap_ble_cb_event_t event, esp_ble_gap_cb
 
     switch (event) {
         case ESP_GAP_BLE_ADV_DATA_SET_COMPLETE_EVT:
-            esp_ble_gap_start_advertising(&hidd_adv_params);
+            advertise_free_slots();
             break;
         case ESP_GAP_BLE_SEC_REQ_EVT:
             esp_ble_gap_security_rsp(param->ble_security.ble_req.bd_addr, true);
@@ -164,6 +302,11 @@ static void gap_event_handler(const esp_gap_ble_cb_event_t event, esp_ble_gap_cb
             memcpy(bd_addr, param->ble_security.auth_cmpl.bd_addr, sizeof(esp_bd_addr_t));
             memcpy(s_connected_device_addr, param->ble_security.auth_cmpl.bd_addr, sizeof(esp_bd_addr_t));
             s_connected_device_addr_type = param->ble_security.auth_cmpl.addr_type;
+            for (int i = 0; i < HID_MAX_APPS; i++) {
+                if (s_hosts[i].connected && memcmp(s_hosts[i].bda, bd_addr, sizeof(esp_bd_addr_t)) == 0) {
+                    s_hosts[i].addr_type = s_connected_device_addr_type;
+                }
+            }
             update_tx_power();
 
             ESP_LOGI(TAG, "remote BD_ADDR: %08x%04x",\
@@ -179,6 +322,32 @@ static void gap_event_handler(const esp_gap_ble_cb_event_t event, esp_ble_gap_cb
                 }
             } else {
                 save_connected_device(bd_addr, s_connected_device_addr_type);
+                hidd_le_host_authenticated(bd_addr);
+                if (s_ready_cb != NULL && s_active_host >= 0 &&
+                    memcmp(s_hosts[s_active_host].bda, bd_addr, sizeof(esp_bd_addr_t)) == 0) {
+                    s_ready_cb();
+                }
+            }
+            break;
+        case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
+            if (param->update_conn_params.status != ESP_BT_STATUS_SUCCESS || param->update_conn_params.conn_int == 0) {
+                break;
+            }
+            for (int i = 0; i < HID_MAX_APPS; i++) {
+                if (!s_hosts[i].connected ||
+                    memcmp(param->update_conn_params.bda, s_hosts[i].bda, sizeof(esp_bd_addr_t)) != 0) {
+                    continue;
+                }
+
+                s_hosts[i].conn_interval_us = param->update_conn_params.conn_int * CONN_INTERVAL_UNIT_US;
+                ESP_LOGI(TAG, "Host %d connection interval %lu us, latency %d", i + 1, s_hosts[i].conn_interval_us,
+                         param->update_conn_params.latency);
+                if (i == s_active_host) {
+                    s_conn_interval_us = s_hosts[i].conn_interval_us;
+                    if (s_coalesce_timer != NULL && esp_timer_is_active(s_coalesce_timer)) {
+                        esp_timer_restart(s_coalesce_timer, s_conn_interval_us);
+                    }
+                }
             }
             break;
         default:
@@ -188,37 +357,493 @@ static void gap_event_handler(const esp_gap_ble_cb_event_t event, esp_ble_gap_cb
 
 static void ble_stats_task(void *arg) {
     TickType_t last_wake_time = xTaskGetTickCount();
-    uint16_t s_prev_rps = 0;
+    uint32_t prev_reports = perf_read(PERF_BLE_REPORTS);
+    uint32_t prev_suppressed = hid_dev_get_suppressed();
     while (1) {
         if (!s_connected) {
             vTaskDelay(pdMS_TO_TICKS(100));
             continue;
         }
 
-        const uint32_t reports_per_sec = (s_current_rps - s_prev_rps) / BLE_STATS_INTERVAL_SEC;
+        const uint32_t reports = perf_read(PERF_BLE_REPORTS);
+        const uint32_t reports_per_sec = (reports - prev_reports) / BLE_STATS_INTERVAL_SEC;
+        const uint32_t suppressed = hid_dev_get_suppressed();
+        const uint32_t suppressed_per_sec = (suppressed - prev_suppressed) / BLE_STATS_INTERVAL_SEC;
+        prev_suppressed = suppressed;
         if (reports_per_sec > 0) {
-            ESP_LOGI(TAG, "BLE: %lu rps", reports_per_sec);
+            ESP_LOGI(TAG, "BLE: %lu rps, %lu repeats/s suppressed", reports_per_sec, suppressed_per_sec);
+            if (g_verbose) {
+                latency_trace_log();
+            }
             if (esp_bt_controller_is_sleeping()) {
                 esp_bt_controller_wakeup_request();
             }
         }
 
-        s_prev_rps = s_current_rps;
+        prev_reports = reports;
         vTaskDelayUntil(&last_wake_time, pdMS_TO_TICKS(BLE_STATS_INTERVAL_SEC * 1000));
     }
 }
 
-static void accumulator_timer_callback(TimerHandle_t timer) {
-    if (s_acc_x != 0 || s_acc_y != 0 || s_acc_wheel != 0 || s_acc_pan != 0 || s_acc_buttons != 0) {
-        esp_hidd_send_mouse_value(s_conn_id, s_acc_buttons, s_acc_x, s_acc_y, s_acc_wheel, s_acc_pan);
-        s_acc_x = 0;
-        s_acc_y = 0;
-        s_acc_wheel = 0;
-        s_acc_pan = 0;
+__attribute__((section(".iram1.text"))) static int32_t add_saturated(const int32_t a, const int32_t b) {
+    const int64_t sum = (int64_t)a + b;
+    if (sum > INT32_MAX) return INT32_MAX;
+    if (sum < INT32_MIN) return INT32_MIN;
+    return (int32_t)sum;
+}
+
+// Takes as much of *acc as the report can carry and leaves the rest for the next notification
+__attribute__((section(".iram1.text"))) static int32_t take_clamped(int32_t *acc, const int32_t min, const int32_t max) {
+    const int32_t value = *acc < min ? min : *acc > max ? max : *acc;
+    *acc -= value;
+    return value;
+}
+
+// Takes whole steps at the resolution of the active host, the rest of a detent stays in *acc
+__attribute__((section(".iram1.text"))) static int32_t take_wheel(int32_t *acc, const int32_t div, const int32_t min,
+                                                                   const int32_t max) {
+    int32_t steps = *acc / div;
+    steps = steps < min ? min : steps > max ? max : steps;
+    *acc -= steps * div;
+    return steps;
+}
+
+// Anything the host would see, a wheel step short of a detent is not
+__attribute__((section(".iram1.text"))) static bool motion_pending_locked(void) {
+    return s_acc_x != 0 || s_acc_y != 0 || s_acc_wheel / s_wheel_div != 0 || s_acc_pan / s_pan_div != 0;
+}
+
+// Sends everything accumulated since the last connection event as one notification
+__attribute__((section(".iram1.text"))) static bool coalescer_flush_locked(const ble_flush_reason_t reason) {
+    if (!s_acc_pending) {
+        return false;
+    }
+
+    const int16_t x = (int16_t)take_clamped(&s_acc_x, MOTION_XY_MIN, MOTION_XY_MAX);
+    const int16_t y = (int16_t)take_clamped(&s_acc_y, MOTION_XY_MIN, MOTION_XY_MAX);
+    const int16_t wheel = (int16_t)take_wheel(&s_acc_wheel, s_wheel_div, MOTION_WHEEL_MIN, MOTION_WHEEL_MAX);
+    const int16_t pan = (int16_t)take_wheel(&s_acc_pan, s_pan_div, MOTION_WHEEL_MIN, MOTION_WHEEL_MAX);
+
+    latency_trace_record(LAT_STAGE_ACCUMULATOR, esp_timer_get_time() - s_acc_stamp.bridge_us);
+    esp_hidd_send_mouse_value(s_conn_id, s_acc_buttons, (uint16_t)x, (uint16_t)y, wheel, pan, &s_acc_stamp);
+    perf_count(PERF_BLE_REPORTS);
+    perf_count(PERF_FLUSH_DIRECT + reason);
+    s_last_flush_us = esp_timer_get_time();
+
+    // Saturated motion stays pending and goes out with the next connection event
+    s_acc_pending = motion_pending_locked();
+    return true;
+}
+
+__attribute__((section(".iram1.text"))) static bool packed_active(void) {
+    return s_active_host >= 0 && s_hosts[s_active_host].packed;
+}
+
+static uint8_t packed_capacity(const uint16_t mtu) {
+    // Notifications carry MTU - 3 bytes
+    const int samples = ((int)mtu - 3 - HID_PACKED_HEADER_LEN) / HID_PACKED_SAMPLE_LEN;
+    return samples < 1 ? 1 : samples > HID_PACKED_MAX_SAMPLES ? HID_PACKED_MAX_SAMPLES : samples;
+}
+
+// Moves the accumulator into samples while there is room, motion beyond a sample continues with dt 0
+__attribute__((section(".iram1.text"))) static void packed_fill_locked(void) {
+    while (s_acc_pending && s_pack_count < s_pack_capacity) {
+        if (s_pack_count == 0) {
+            s_pack_stamp = s_acc_stamp;
+        }
+
+        const int64_t dt = s_pack_motion_us - s_pack_last_us;
+        packed_sample_t *sample = &s_pack[s_pack_count++];
+        sample->dt_us = s_pack_last_us == 0 || dt < 0 || dt >= HID_PACKED_DT_UNKNOWN ? HID_PACKED_DT_UNKNOWN
+                                                                                      : (uint16_t)dt;
+        sample->x = (int16_t)take_clamped(&s_acc_x, PACKED_XY_MIN, PACKED_XY_MAX);
+        sample->y = (int16_t)take_clamped(&s_acc_y, PACKED_XY_MIN, PACKED_XY_MAX);
+        sample->wheel = (int8_t)take_wheel(&s_acc_wheel, s_wheel_div, PACKED_WHEEL_MIN, PACKED_WHEEL_MAX);
+        sample->pan = (int8_t)take_wheel(&s_acc_pan, s_pan_div, PACKED_WHEEL_MIN, PACKED_WHEEL_MAX);
+        s_pack_last_us = s_pack_motion_us;
+        s_acc_pending = motion_pending_locked();
+    }
+}
+
+// A packed notification is never queued by hid_dev, so a button edge to a congested link goes out as a
+// standard mouse report instead, with the motion held so far. hid_dev queues that one as a state change.
+__attribute__((section(".iram1.text"))) static void packed_congested_edge_locked(const ble_flush_reason_t reason) {
+    int32_t x = 0, y = 0, wheel = 0, pan = 0;
+    for (int i = 0; i < s_pack_count; i++) {
+        x += s_pack[i].x;
+        y += s_pack[i].y;
+        wheel += s_pack[i].wheel;
+        pan += s_pack[i].pan;
+    }
+    const int16_t report_x = (int16_t)take_clamped(&x, MOTION_XY_MIN, MOTION_XY_MAX);
+    const int16_t report_y = (int16_t)take_clamped(&y, MOTION_XY_MIN, MOTION_XY_MAX);
+    const int16_t report_wheel = (int16_t)take_clamped(&wheel, MOTION_WHEEL_MIN, MOTION_WHEEL_MAX);
+    const int16_t report_pan = (int16_t)take_clamped(&pan, MOTION_WHEEL_MIN, MOTION_WHEEL_MAX);
+    // What the report can't carry goes back to the accumulator
+    s_acc_x = add_saturated(s_acc_x, x);
+    s_acc_y = add_saturated(s_acc_y, y);
+    s_acc_wheel = add_saturated(s_acc_wheel, wheel * s_wheel_div);
+    s_acc_pan = add_saturated(s_acc_pan, pan * s_pan_div);
+
+    esp_hidd_send_mouse_value(s_conn_id, s_acc_buttons, (uint16_t)report_x, (uint16_t)report_y, report_wheel,
+                              report_pan, s_pack_count > 0 ? &s_pack_stamp : NULL);
+    perf_count(PERF_BLE_REPORTS);
+    perf_count(PERF_FLUSH_DIRECT + reason);
+    s_last_flush_us = esp_timer_get_time();
+    s_pack_count = 0;
+    s_acc_pending = motion_pending_locked();
+    packed_fill_locked();
+}
+
+/**
+ * @brief Send the packed samples as one notification, caller holds s_tx_mutex
+ *
+ * While the link is congested samples are held and, once they fill a notification, motion backs up in the
+ * accumulator: it is never lost, only its timing gets coarser. Button edges go out regardless, as a queued
+ * standard mouse report while the link is congested.
+ *
+ * @param reason Flush reason for the counters
+ * @param force Send even without samples or while congested, the button state changed
+ * @return true if something was sent or is still held
+ */
+__attribute__((section(".iram1.text"))) static bool packed_flush_locked(const ble_flush_reason_t reason,
+                                                                        const bool force) {
+    if (!force && s_pack_count == 0 && !s_acc_pending) {
+        return false;
+    }
+    if (hid_dev_congested(s_conn_id)) {
+        if (force) {
+            packed_congested_edge_locked(reason);
+        }
+        return true;
+    }
+
+    static uint8_t buf[HID_PACKED_RPT_LEN];
+    const int64_t age = s_pack_count > 0 ? esp_timer_get_time() - s_pack_last_us : 0;
+    const uint16_t age_us = age < 0 ? 0 : age > UINT16_MAX ? UINT16_MAX : (uint16_t)age;
+    buf[0] = s_pack_count;
+    buf[1] = s_acc_buttons & 0xFF;
+    buf[2] = s_acc_buttons >> 8;
+    buf[3] = age_us & 0xFF;
+    buf[4] = age_us >> 8;
+    uint8_t *out = &buf[HID_PACKED_HEADER_LEN];
+    for (int i = 0; i < s_pack_count; i++, out += HID_PACKED_SAMPLE_LEN) {
+        const packed_sample_t *sample = &s_pack[i];
+        out[0] = sample->dt_us & 0xFF;
+        out[1] = sample->dt_us >> 8;
+        out[2] = (uint16_t)sample->x & 0xFF;
+        out[3] = (uint16_t)sample->x >> 8;
+        out[4] = (uint16_t)sample->y & 0xFF;
+        out[5] = (uint16_t)sample->y >> 8;
+        out[6] = (uint8_t)sample->wheel;
+        out[7] = (uint8_t)sample->pan;
+    }
+
+    if (s_pack_count > 0) {
+        latency_trace_record(LAT_STAGE_ACCUMULATOR, esp_timer_get_time() - s_pack_stamp.bridge_us);
+    }
+    esp_hidd_send_packed_motion(s_conn_id, buf, out - buf, s_pack_count > 0 ? &s_pack_stamp : NULL);
+    perf_count(PERF_BLE_REPORTS);
+    perf_count(PERF_FLUSH_DIRECT + reason);
+    for (int i = 0; i < s_pack_count; i++) {
+        perf_count(PERF_PACKED_SAMPLES);
+    }
+    s_last_flush_us = esp_timer_get_time();
+    s_pack_count = 0;
+
+    // Motion held back by congestion or a full notification starts the next one
+    packed_fill_locked();
+    return true;
+}
+
+// Fires once per connection interval while motion keeps coming, stops itself on the first idle interval.
+// Coalescing devices use it one-shot, to send a held report.
+static void coalesce_timer_callback(void *arg) {
+    xSemaphoreTake(s_tx_mutex, portMAX_DELAY);
+    const bool pending = packed_active() ? packed_flush_locked(BLE_FLUSH_CONN_EVENT, false)
+                                         : coalescer_flush_locked(BLE_FLUSH_CONN_EVENT);
+    if (!s_connected || !pending) {
+        esp_timer_stop(s_coalesce_timer);
+    }
+    xSemaphoreGive(s_tx_mutex);
+}
+
+static void coalescer_reset(void) {
+    if (s_coalesce_timer != NULL) {
+        esp_timer_stop(s_coalesce_timer);
+    }
+
+    if (s_tx_mutex != NULL) {
+        xSemaphoreTake(s_tx_mutex, portMAX_DELAY);
+    }
+    s_acc_x = 0;
+    s_acc_y = 0;
+    s_acc_wheel = 0;
+    s_acc_pan = 0;
+    s_acc_buttons = 0;
+    s_acc_pending = false;
+    s_pack_count = 0;
+    s_pack_last_us = 0;
+    memset(s_rates, 0, sizeof(s_rates));
+    s_motion_mode = BLE_MOTION_PASS_THROUGH;
+    if (s_tx_mutex != NULL) {
+        xSemaphoreGive(s_tx_mutex);
+    }
+}
+
+static void request_conn_params(const esp_bd_addr_t bda, const conn_params_preset_t *preset) {
+    esp_ble_conn_update_params_t conn_params = {0};
+    memcpy(conn_params.bda, bda, sizeof(esp_bd_addr_t));
+    conn_params.min_int = preset->min_int;
+    conn_params.max_int = preset->max_int;
+    conn_params.latency = preset->latency;
+    conn_params.timeout = preset->timeout;
+    esp_ble_gap_update_conn_params(&conn_params);
+}
+
+static uint8_t connected_hosts(void) {
+    uint8_t count = 0;
+    for (int i = 0; i < HID_MAX_APPS; i++) {
+        if (s_hosts[i].connected) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Directed to the saved host when nothing is connected, undirected while slots are free, nothing while parked
+static void advertise_free_slots(void) {
+    const uint8_t hosts = connected_hosts();
+    if (s_parked || hosts >= HID_MAX_APPS) {
+        reconnect_stop();
+    } else if (hosts == 0) {
+        reconnect_start(NULL, BLE_ADDR_TYPE_PUBLIC);
+    } else {
+        reconnect_start_undirected();
+    }
+}
+
+/**
+ * @brief Retarget reports to another host, caller holds s_tx_mutex
+ *
+ * Pending motion is flushed and all keys and buttons are released on the previous host first,
+ * so nothing stays stuck there. The previous host drops to standby parameters.
+ */
+static void activate_host_locked(const int8_t index) {
+    const int8_t previous = s_active_host;
+    if (previous >= 0 && s_hosts[previous].connected) {
+        if (s_hosts[previous].packed) {
+            packed_flush_locked(BLE_FLUSH_HOST_SWITCH, true);
+            // The standard release below is queued and covers a congested link
+            if (!hid_dev_congested(s_hosts[previous].conn_id)) {
+                static uint8_t no_motion[HID_PACKED_HEADER_LEN] = {0};
+                esp_hidd_send_packed_motion(s_hosts[previous].conn_id, no_motion, sizeof(no_motion), NULL);
+            }
+        } else {
+            coalescer_flush_locked(BLE_FLUSH_HOST_SWITCH);
+        }
+        static const uint8_t no_keys[6] = {0};
+        esp_hidd_send_keyboard_value(s_hosts[previous].conn_id, 0, no_keys, NULL);
+        if (s_kb_nkro) {
+            static const key_bitmap_t no_bitmap = {0};
+            esp_hidd_send_nkro_value(s_hosts[previous].conn_id, &no_bitmap, NULL);
+        }
+        if (s_cc_sent) {
+            esp_hidd_send_consumer_value(s_hosts[previous].conn_id, 0, NULL);
+        }
+        esp_hidd_send_mouse_value(s_hosts[previous].conn_id, 0, 0, 0, 0, 0, NULL);
+        request_conn_params(s_hosts[previous].bda, &s_standby_preset);
+    }
+
+    s_acc_x = 0;
+    s_acc_y = 0;
+    s_acc_wheel = 0;
+    s_acc_pan = 0;
+    s_acc_buttons = 0;
+    s_acc_pending = false;
+    s_pack_count = 0;
+    s_pack_last_us = 0;
+    key_bitmap_clear(&s_kb_sent);
+    s_kb_nkro = false;
+    s_cc_sent = 0;
+
+    if (index < 0 || !s_hosts[index].connected) {
+        s_active_host = -1;
+        s_connected = false;
+        power_manager_state_changed();
+        return;
+    }
+
+    s_active_host = index;
+    s_conn_id = s_hosts[index].conn_id;
+    s_conn_interval_us = s_hosts[index].conn_interval_us;
+    s_pack_capacity = packed_capacity(s_hosts[index].mtu);
+    s_wheel_div = s_hosts[index].res_mult & HID_RES_MULT_WHEEL ? 1 : HID_WHEEL_RESOLUTION;
+    s_pan_div = s_hosts[index].res_mult & HID_RES_MULT_PAN ? 1 : HID_WHEEL_RESOLUTION;
+    s_connected = true;
+    power_manager_state_changed();
+    request_conn_params(s_hosts[index].bda, &s_link_presets[s_link_mode]);
+    latency_trace_reset();
+    ESP_LOGI(TAG, "Active host %d (conn_id %d)", index + 1, s_conn_id);
+}
+
+static void host_connected(const uint16_t conn_id, const esp_bd_addr_t bda) {
+    int8_t index = -1;
+    for (int i = 0; i < HID_MAX_APPS; i++) {
+        if (!s_hosts[i].connected) {
+            index = i;
+            break;
+        }
+    }
+
+    if (index < 0) {
+        ESP_LOGW(TAG, "No free host slot, dropping connection %d", conn_id);
+        esp_ble_gap_disconnect((uint8_t *)bda);
+        return;
+    }
+
+    xSemaphoreTake(s_tx_mutex, portMAX_DELAY);
+    s_hosts[index].connected = true;
+    s_hosts[index].conn_id = conn_id;
+    memcpy(s_hosts[index].bda, bda, sizeof(esp_bd_addr_t));
+    s_hosts[index].addr_type = BLE_ADDR_TYPE_PUBLIC;
+    s_hosts[index].conn_interval_us = DEFAULT_CONN_INTERVAL * CONN_INTERVAL_UNIT_US;
+    s_hosts[index].mtu = DEFAULT_MTU;
+    s_hosts[index].packed = false;
+    s_hosts[index].res_mult = 0;
+    if (s_active_host < 0) {
+        activate_host_locked(index);
+    } else {
+        request_conn_params(bda, &s_standby_preset);
+        ESP_LOGI(TAG, "Host %d connected in standby (conn_id %d)", index + 1, conn_id);
+    }
+    xSemaphoreGive(s_tx_mutex);
+
+    // Advertising stops on connect, keep accepting hosts until every slot is taken
+    advertise_free_slots();
+}
+
+static void host_mtu_changed(const uint16_t conn_id, const uint16_t mtu) {
+    xSemaphoreTake(s_tx_mutex, portMAX_DELAY);
+    for (int i = 0; i < HID_MAX_APPS; i++) {
+        if (s_hosts[i].connected && s_hosts[i].conn_id == conn_id) {
+            s_hosts[i].mtu = mtu;
+            // Exchanged once per connection, the MTU only grows from the default
+            if (i == s_active_host) {
+                s_pack_capacity = packed_capacity(mtu);
+            }
+            ESP_LOGI(TAG, "Host %d MTU %d, %d packed samples per notification", i + 1, mtu, packed_capacity(mtu));
+        }
+    }
+    xSemaphoreGive(s_tx_mutex);
+}
+
+// The receiver writes HID_PACKED_ENABLE to the vendor output report, stock hosts never do
+static void host_set_packed(const uint16_t conn_id, const bool packed) {
+    xSemaphoreTake(s_tx_mutex, portMAX_DELAY);
+    for (int i = 0; i < HID_MAX_APPS; i++) {
+        if (!s_hosts[i].connected || s_hosts[i].conn_id != conn_id || s_hosts[i].packed == packed) {
+            continue;
+        }
+
+        if (i == s_active_host) {
+            // Whatever is pending goes out the old way, the switch is clean between two notifications
+            if (packed) {
+                while (coalescer_flush_locked(BLE_FLUSH_DIRECT)) {}
+            } else {
+                do {
+                    packed_flush_locked(BLE_FLUSH_DIRECT, true);
+                } while (s_pack_count > 0);
+            }
+            s_pack_count = 0;
+            s_pack_last_us = 0;
+        }
+        s_hosts[i].packed = packed;
+        if (packed) {
+            // Lets the controller carry a full packed notification in one PDU
+            esp_ble_gap_set_pkt_data_len(s_hosts[i].bda, PACKED_PKT_DATA_LEN);
+        }
+        ESP_LOGI(TAG, "Host %d packed motion %s", i + 1, packed ? "on" : "off");
+    }
+    xSemaphoreGive(s_tx_mutex);
+}
+
+// Windows and Linux set the multiplier when they start the device, hosts that don't get whole detents
+static void host_set_res_mult(const uint16_t conn_id, const uint8_t res_mult) {
+    xSemaphoreTake(s_tx_mutex, portMAX_DELAY);
+    for (int i = 0; i < HID_MAX_APPS; i++) {
+        if (!s_hosts[i].connected || s_hosts[i].conn_id != conn_id) {
+            continue;
+        }
+
+        s_hosts[i].res_mult = res_mult;
+        if (i == s_active_host) {
+            s_wheel_div = res_mult & HID_RES_MULT_WHEEL ? 1 : HID_WHEEL_RESOLUTION;
+            s_pan_div = res_mult & HID_RES_MULT_PAN ? 1 : HID_WHEEL_RESOLUTION;
+        }
+        ESP_LOGI(TAG, "Host %d hi-res wheel %s, pan %s", i + 1, res_mult & HID_RES_MULT_WHEEL ? "on" : "off",
+                 res_mult & HID_RES_MULT_PAN ? "on" : "off");
+    }
+    xSemaphoreGive(s_tx_mutex);
+}
+
+static bool host_disconnected(const uint16_t conn_id, ble_host_t *lost) {
+    bool found = false;
+    xSemaphoreTake(s_tx_mutex, portMAX_DELAY);
+    for (int i = 0; i < HID_MAX_APPS; i++) {
+        if (!s_hosts[i].connected || s_hosts[i].conn_id != conn_id) {
+            continue;
+        }
+
+        found = true;
+        *lost = s_hosts[i];
+        s_hosts[i].connected = false;
+        hid_dev_forget_conn(conn_id);
+        if (i == s_active_host) {
+            s_active_host = -1;
+            s_connected = false;
+            int8_t next = -1;
+            for (int j = 1; j <= HID_MAX_APPS; j++) {
+                const int k = (i + j) % HID_MAX_APPS;
+                if (s_hosts[k].connected) {
+                    next = k;
+                    break;
+                }
+            }
+            activate_host_locked(next);
+        }
+        break;
+    }
+    xSemaphoreGive(s_tx_mutex);
+
+    if (!s_connected && s_coalesce_timer != NULL) {
+        esp_timer_stop(s_coalesce_timer);
     }
+    return found;
 }
 
-static TickType_t acc_window = pdMS_TO_TICKS(8);
+static esp_err_t coalescer_init(void) {
+    if (s_tx_mutex == NULL) {
+        s_tx_mutex = xSemaphoreCreateMutexStatic(&s_tx_mutex_struct);
+    }
+
+    if (s_coalesce_timer == NULL) {
+        const esp_timer_create_args_t timer_args = {
+            .callback = coalesce_timer_callback,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "ble_coalesce",
+            .skip_unhandled_events = true,
+        };
+        const esp_err_t ret = esp_timer_create(&timer_args, &s_coalesce_timer);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to create coalesce timer: %s", esp_err_to_name(ret));
+            return ret;
+        }
+    }
+
+    coalescer_reset();
+    return ESP_OK;
+}
 
 esp_err_t ble_hid_device_init(const bool verbose) {
     g_enabled = true;
@@ -230,37 +855,12 @@ esp_err_t ble_hid_device_init(const bool verbose) {
     }
     ESP_ERROR_CHECK(ret);
 
-    char mode_str[16] = {0};
-    storage_get_string_setting("power.highSpeedSubmode", mode_str, sizeof(mode_str));
-    if (mode_str[0] == 'f') {
-        s_high_speed_submode = SPEED_MODE_FAST;
-    } else if (mode_str[0] == 'v') {
-        s_high_speed_submode = SPEED_MODE_VERYFAST;
-    } else {
-        s_high_speed_submode = SPEED_MODE_SLOW;
-    }
-
-    // careful with this values
-    // wrong combination = "choppy" feeling
-    switch (s_high_speed_submode) {
-        case SPEED_MODE_VERYFAST:
-            s_batch_size = 3;
-            acc_window = pdMS_TO_TICKS(4);
-            break;
-        case SPEED_MODE_FAST:
-            s_batch_size = 5;
-            acc_window = pdMS_TO_TICKS(7);
-            break;
-        default:
-            s_batch_size = 7;
-            acc_window = pdMS_TO_TICKS(11);
-            break;
+    if ((ret = coalescer_init()) != ESP_OK) {
+        return ret;
     }
 
-    int reconnect_delay;
-    if (storage_get_int_setting("connectivity.bleReconnectDelay", &reconnect_delay) == ESP_OK) {
-        s_reconnect_delay = reconnect_delay;
-        ESP_LOGI(TAG, "BLE reconnect delay set to %d seconds", s_reconnect_delay);
+    if ((ret = reconnect_init(&hidd_adv_params)) != ESP_OK) {
+        return ret;
     }
 
     ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT));
@@ -298,7 +898,8 @@ esp_err_t ble_hid_device_init(const bool verbose) {
     esp_hidd_register_callbacks(hidd_event_callback);
 
     if (g_verbose) {
-        xTaskCreatePinnedToCore(ble_stats_task, "ble_stats", 1600, NULL, 5, &s_stats_task_handle, 1);
+        xTaskCreatePinnedToCore(ble_stats_task, "ble_stats", 1600, NULL, TASK_STATS_PRIO, &s_stats_task_handle,
+                                TASK_STATS_CORE);
     }
 
     esp_ble_auth_req_t auth_req = ESP_LE_AUTH_REQ_SC_MITM_BOND;
@@ -311,23 +912,24 @@ esp_err_t ble_hid_device_init(const bool verbose) {
     esp_ble_gap_set_security_param(ESP_BLE_SM_MAX_KEY_SIZE, &key_size, sizeof(uint8_t));
     esp_ble_gap_set_security_param(ESP_BLE_SM_SET_INIT_KEY, &init_key, sizeof(uint8_t));
     esp_ble_gap_set_security_param(ESP_BLE_SM_SET_RSP_KEY, &rsp_key, sizeof(uint8_t));
-    esp_ble_gatt_set_local_mtu(64);
-    // esp_bt_sleep_enable();
+    esp_ble_gatt_set_local_mtu(LOCAL_MTU);
+    // Modem sleep between connection events, the controller keeps the main XTAL up through light sleep
+    esp_bt_sleep_enable();
     update_tx_power();
-
-    // if (has_saved_device()) {
-    //     connect_to_saved_device(get_gatts_if());
-    // }
+    storage_subscribe(SETTING_BIT(SETTING_BLE_TX_POWER) | SETTING_BIT(SETTING_DEVICE_NAME), on_settings_changed, NULL);
 
     return ESP_OK;
 }
 
 esp_err_t ble_hid_device_deinit(void) {
     g_enabled = false;
-    if (s_accumulator_timer != NULL) {
-        xTimerDelete(s_accumulator_timer, 0);
-        s_accumulator_timer = NULL;
-    }
+    s_parked = false;
+    coalescer_reset();
+    reconnect_stop();
+    memset(s_hosts, 0, sizeof(s_hosts));
+    s_active_host = -1;
+    s_connected = false;
+    power_manager_state_changed();
 
     if (s_stats_task_handle != NULL) {
         vTaskDelete(s_stats_task_handle);
@@ -378,88 +980,317 @@ bool ble_hid_device_connected(void) {
     return s_connected;
 }
 
-static bool check_high_speed_device() {
-    if (s_is_high_speed == true) {
-        return true;
+void ble_hid_device_set_battery_level(const uint8_t level) {
+    if (s_tx_mutex == NULL) {
+        // Before init, the table gets created with it
+        esp_hidd_set_battery_level(level);
+        return;
     }
 
-    const int64_t current_time = esp_timer_get_time() / 1000;
-    if (s_last_event_time > 0) {
-        const int64_t delay = current_time - s_last_event_time;
-        if (delay < HIGH_SPEED_DEVICE_THRESHOLD_MS) {
-            s_fast_events_count++;
-            if (s_fast_events_count >= HIGH_SPEED_DEVICE_THRESHOLD_EVENTS) {
-                ESP_LOGI(TAG, "High speed device detected");
-                s_is_high_speed = true;
-            }
-        } else {
-            s_fast_events_count = 0;
+    xSemaphoreTake(s_tx_mutex, portMAX_DELAY);
+    esp_hidd_set_battery_level(level);
+    for (int i = 0; i < HID_MAX_APPS; i++) {
+        if (g_enabled && s_hosts[i].connected) {
+            esp_hidd_send_battery_level(s_hosts[i].conn_id);
         }
     }
-    s_last_event_time = current_time;
-    return s_is_high_speed;
+    xSemaphoreGive(s_tx_mutex);
 }
 
-esp_err_t ble_hid_device_send_keyboard_report(const keyboard_report_t *report) {
-    if (!s_connected) {
+esp_err_t ble_hid_device_select_host(const uint8_t index) {
+    if (index >= HID_MAX_APPS || s_tx_mutex == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(s_tx_mutex, portMAX_DELAY);
+    esp_err_t ret = ESP_OK;
+    if (!s_hosts[index].connected) {
+        ret = ESP_ERR_NOT_FOUND;
+    } else if (index != s_active_host) {
+        activate_host_locked(index);
+    }
+    xSemaphoreGive(s_tx_mutex);
+    return ret;
+}
+
+esp_err_t ble_hid_device_cycle_host(const int8_t direction) {
+    if (direction == 0 || s_active_host < 0) {
         return ESP_ERR_INVALID_STATE;
     }
 
-    s_current_rps++;
-    esp_hidd_send_keyboard_value(s_conn_id, report->modifier, report->keycodes);
+    const int step = direction > 0 ? 1 : HID_MAX_APPS - 1;
+    for (int i = 1; i < HID_MAX_APPS; i++) {
+        const int index = (s_active_host + i * step) % HID_MAX_APPS;
+        if (s_hosts[index].connected) {
+            return ble_hid_device_select_host(index);
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+uint8_t ble_hid_device_num_hosts(void) {
+    return connected_hosts();
+}
+
+int8_t ble_hid_device_active_host(void) {
+    return s_active_host;
+}
+
+esp_err_t ble_hid_device_set_link_mode(const ble_link_mode_t mode) {
+    if (mode > BLE_LINK_SLEEP || s_tx_mutex == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(s_tx_mutex, portMAX_DELAY);
+    const bool changed = mode != s_link_mode;
+    s_link_mode = mode;
+    if (changed && s_active_host >= 0) {
+        request_conn_params(s_hosts[s_active_host].bda, &s_link_presets[mode]);
+    }
+    xSemaphoreGive(s_tx_mutex);
+
+    if (changed && g_verbose) {
+        ESP_LOGI(TAG, "Link mode %d", mode);
+    }
     return ESP_OK;
 }
 
-// goal is to map any high (up to 1000hz) report rate to lower BLE report rate
-__attribute__((section(".iram1.text"))) esp_err_t ble_hid_device_send_mouse_report(const mouse_report_t *report) {
-    if (!s_connected) {
+esp_err_t ble_hid_device_park(void) {
+    if (!g_enabled || s_tx_mutex == NULL) {
         return ESP_ERR_INVALID_STATE;
     }
 
-    if (check_high_speed_device()) {
-        if (s_accumulator_timer == NULL) {
-            s_accumulator_timer = xTimerCreate("acc_timer", acc_window, pdTRUE, NULL, accumulator_timer_callback);
-            xTimerStart(s_accumulator_timer, 0);
-        }
+    if (s_parked) {
+        return ESP_OK;
+    }
 
-        if (s_acc_buttons != report->buttons || s_batch_count >= s_batch_size) {
-            esp_hidd_send_mouse_value(s_conn_id, report->buttons, s_acc_x, s_acc_y, s_acc_wheel, s_acc_pan);
-            s_current_rps++;
-            s_acc_buttons = report->buttons;
-            if (s_batch_count >= s_batch_size) {
-                s_acc_x = 0;
-                s_acc_y = 0;
-                s_acc_wheel = 0;
-                s_acc_pan = 0;
-                s_batch_count = 0;
-            }
+    s_parked = true;
+    reconnect_stop();
+    ble_hid_device_set_link_mode(BLE_LINK_SLEEP);
+    ESP_LOGI(TAG, "Link parked with %d host(s) connected", connected_hosts());
+    return ESP_OK;
+}
 
-            xTimerReset(s_accumulator_timer, 0);
-            return ESP_OK;
+esp_err_t ble_hid_device_resume(void) {
+    if (!g_enabled || s_tx_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (!s_parked) {
+        return ESP_OK;
+    }
+
+    s_parked = false;
+    ble_hid_device_set_link_mode(BLE_LINK_ACTIVE);
+    advertise_free_slots();
+    ESP_LOGI(TAG, "Link resumed");
+    return ESP_OK;
+}
+
+bool ble_hid_device_parked(void) {
+    return s_parked;
+}
+
+void ble_hid_device_set_ready_callback(const ble_hid_ready_cb_t cb) {
+    s_ready_cb = cb;
+}
+
+uint32_t ble_hid_device_get_conn_interval_us(void) {
+    return s_conn_interval_us;
+}
+
+void ble_hid_device_get_stats(ble_hid_stats_t *stats) {
+    stats->reports = perf_read(PERF_BLE_REPORTS);
+    stats->suppressed = perf_read(PERF_BLE_SUPPRESSED);
+    for (int i = 0; i < BLE_FLUSH_REASON_COUNT; i++) {
+        stats->flushes[i] = perf_read(PERF_FLUSH_DIRECT + i);
+    }
+    stats->conn_interval_us = s_conn_interval_us;
+    stats->motion_mode = s_motion_mode;
+}
+
+static const char *const motion_mode_names[] = {"pass-through", "coalescing", "aligned"};
+
+// Next mode from the estimated interval, with hysteresis so jitter around a threshold doesn't flap
+__attribute__((section(".iram1.text"))) static uint8_t next_motion_mode(const rate_estimate_t *rate) {
+    // interval / conn interval in 1/16, interval_q4 is already x16
+    const uint32_t ratio = rate->interval_q4 / (s_conn_interval_us > 0 ? s_conn_interval_us : 1);
+    switch (rate->mode) {
+        case BLE_MOTION_PASS_THROUGH:
+            return ratio < RATE_ALIGN_ENTER_Q4 ? BLE_MOTION_ALIGNED
+                 : ratio < RATE_PASS_EXIT_Q4   ? BLE_MOTION_COALESCE
+                                               : BLE_MOTION_PASS_THROUGH;
+        case BLE_MOTION_ALIGNED:
+            return ratio > RATE_PASS_ENTER_Q4 ? BLE_MOTION_PASS_THROUGH
+                 : ratio > RATE_ALIGN_EXIT_Q4 ? BLE_MOTION_COALESCE
+                                              : BLE_MOTION_ALIGNED;
+        default:
+            return ratio > RATE_PASS_ENTER_Q4  ? BLE_MOTION_PASS_THROUGH
+                 : ratio < RATE_ALIGN_ENTER_Q4 ? BLE_MOTION_ALIGNED
+                                               : BLE_MOTION_COALESCE;
+    }
+}
+
+// Updates the estimate of the report's stream and returns the mode to send it with. Streams are kept
+// in a few slots, the least recently seen one is reused. Called with s_tx_mutex held.
+__attribute__((section(".iram1.text"))) static uint8_t estimate_motion_mode(const mouse_report_t *report) {
+    if (report->stream == 0 || report->stamp.usb_us == 0) {
+        return s_motion_mode;
+    }
+
+    rate_estimate_t *rate = &s_rates[0];
+    for (int i = 0; i < RATE_MAX_STREAMS; i++) {
+        if (s_rates[i].stream == report->stream) {
+            rate = &s_rates[i];
+            break;
+        }
+        if (s_rates[i].last_us < rate->last_us) {
+            rate = &s_rates[i];
         }
+    }
+    if (rate->stream != report->stream) {
+        *rate = (rate_estimate_t) { .stream = report->stream, .mode = BLE_MOTION_PASS_THROUGH };
+    }
 
-        s_acc_buttons = report->buttons;
-        s_acc_x += report->x;
-        s_acc_y += report->y;
-        s_acc_wheel += report->wheel;
-        s_acc_pan += report->pan;
-        s_batch_count++;
+    const int64_t delta = report->stamp.usb_us - rate->last_us;
+    rate->last_us = report->stamp.usb_us;
+    if (delta <= 0 || delta > RATE_IDLE_RESET_US) {
+        // After idle the first report goes out as it comes and the next delta seeds a fresh estimate
+        rate->interval_q4 = 0;
+        rate->mode = BLE_MOTION_PASS_THROUGH;
+    } else if (rate->interval_q4 == 0) {
+        rate->interval_q4 = (uint32_t)delta << 4;
+        rate->mode = next_motion_mode(rate);
     } else {
-        esp_hidd_send_mouse_value(s_conn_id, report->buttons, report->x, report->y, report->wheel, report->pan);
-        s_current_rps++;
+        rate->interval_q4 += (int32_t)(((uint32_t)delta << 4) - rate->interval_q4) >> RATE_EWMA_SHIFT;
+        const uint8_t mode = next_motion_mode(rate);
+        if (mode != rate->mode) {
+            ESP_LOGD(TAG, "Stream %04x at %lu us per report, %s", report->stream,
+                     (unsigned long)(rate->interval_q4 >> 4), motion_mode_names[mode]);
+            rate->mode = mode;
+        }
+    }
 
-        if (s_accumulator_timer != NULL) {
-            xTimerDelete(s_accumulator_timer, 0);
-            s_accumulator_timer = NULL;
-            s_acc_buttons = 0;
-            s_acc_x = 0;
-            s_acc_y = 0;
-            s_acc_wheel = 0;
-            s_acc_pan = 0;
+    s_motion_mode = rate->mode;
+    return rate->mode;
+}
 
-            return ESP_OK;
+esp_err_t ble_hid_device_send_keyboard_report(const keyboard_report_t *report) {
+    if (!s_connected) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(s_tx_mutex, portMAX_DELAY);
+    if (key_bitmap_equal(&report->keys, &s_kb_sent)) {
+        xSemaphoreGive(s_tx_mutex);
+        return ESP_OK;
+    }
+
+    perf_count(PERF_BLE_REPORTS);
+    uint8_t keycodes[6];
+    const uint8_t modifier = key_bitmap_modifiers(&report->keys);
+    const uint8_t num_keys = key_bitmap_to_array(&report->keys, keycodes, sizeof(keycodes));
+    if (num_keys > sizeof(keycodes) || (s_kb_nkro && num_keys > 0)) {
+        // Press the full state on the NKRO report before releasing the 6KRO one, so no key bounces
+        esp_hidd_send_nkro_value(s_conn_id, &report->keys, &report->stamp);
+        if (!s_kb_nkro) {
+            static const uint8_t no_keys[6] = {0};
+            esp_hidd_send_keyboard_value(s_conn_id, 0, no_keys, NULL);
+            s_kb_nkro = true;
+        }
+    } else {
+        esp_hidd_send_keyboard_value(s_conn_id, modifier, keycodes, &report->stamp);
+        if (s_kb_nkro) {
+            static const key_bitmap_t no_bitmap = {0};
+            esp_hidd_send_nkro_value(s_conn_id, &no_bitmap, NULL);
+            s_kb_nkro = false;
+        }
+    }
+    s_kb_sent = report->keys;
+    xSemaphoreGive(s_tx_mutex);
+    return ESP_OK;
+}
+
+esp_err_t ble_hid_device_send_consumer_report(const uint16_t usage, const latency_stamp_t *stamp) {
+    if (!s_connected) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(s_tx_mutex, portMAX_DELAY);
+    if (usage != s_cc_sent) {
+        perf_count(PERF_BLE_REPORTS);
+        esp_hidd_send_consumer_value(s_conn_id, usage, stamp);
+        s_cc_sent = usage;
+    }
+    xSemaphoreGive(s_tx_mutex);
+    return ESP_OK;
+}
+
+// Fast devices (up to 1000 Hz) are merged down to one notification per connection event: the link can't
+// carry more than that, anything extra only queues up in the controller and adds latency. Devices at about
+// one report per interval go out as they come unless the last notification was less than an interval ago,
+// then they wait for the rest of it. Slow devices are never held back, only motion beyond the report range
+// is. The first sample after idle and every button edge go out immediately.
+__attribute__((section(".iram1.text"))) esp_err_t ble_hid_device_send_mouse_report(const mouse_report_t *report) {
+    if (!s_connected) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(s_tx_mutex, portMAX_DELAY);
+    const uint8_t mode = estimate_motion_mode(report);
+    const bool was_pending = s_acc_pending;
+    const bool button_edge = s_acc_buttons != report->buttons;
+    s_acc_buttons = report->buttons;
+    s_acc_x = add_saturated(s_acc_x, report->x);
+    s_acc_y = add_saturated(s_acc_y, report->y);
+    s_acc_wheel = add_saturated(s_acc_wheel, report->wheel);
+    s_acc_pan = add_saturated(s_acc_pan, report->pan);
+    s_acc_pending = was_pending || button_edge || motion_pending_locked();
+    if (!s_acc_pending) {
+        // Nothing the host would see, a hi-res wheel step short of a detent waits for the rest
+        xSemaphoreGive(s_tx_mutex);
+        return ESP_OK;
+    }
+    if (!was_pending) {
+        s_acc_stamp = report->stamp;
+    }
+
+    const bool timer_active = esp_timer_is_active(s_coalesce_timer);
+    if (packed_active()) {
+        // Samples keep their own timing, so the link only needs one notification per connection event
+        s_pack_motion_us = report->stamp.usb_us != 0 ? report->stamp.usb_us : esp_timer_get_time();
+        s_acc_pending = motion_pending_locked();
+        packed_fill_locked();
+        if (button_edge || !timer_active || s_pack_count >= s_pack_capacity) {
+            packed_flush_locked(button_edge ? BLE_FLUSH_BUTTON : timer_active ? BLE_FLUSH_DIRECT : BLE_FLUSH_FIRST,
+                                button_edge);
+        }
+        if (!timer_active) {
+            esp_timer_start_periodic(s_coalesce_timer, s_conn_interval_us);
+        }
+    } else if (mode == BLE_MOTION_ALIGNED) {
+        if (button_edge || !timer_active) {
+            coalescer_flush_locked(button_edge ? BLE_FLUSH_BUTTON : BLE_FLUSH_FIRST);
+            if (!timer_active) {
+                esp_timer_start_periodic(s_coalesce_timer, s_conn_interval_us);
+            }
+        }
+    } else if (mode == BLE_MOTION_COALESCE && !button_edge && !timer_active) {
+        const int64_t since_flush = esp_timer_get_time() - s_last_flush_us;
+        if (since_flush >= s_conn_interval_us) {
+            coalescer_flush_locked(BLE_FLUSH_DIRECT);
+        } else {
+            esp_timer_start_once(s_coalesce_timer, s_conn_interval_us - since_flush);
+        }
+    } else if (!timer_active || button_edge || mode == BLE_MOTION_PASS_THROUGH) {
+        // A pending one-shot or periodic flush takes coalesced motion, edges and pass-through go now
+        coalescer_flush_locked(button_edge ? BLE_FLUSH_BUTTON : BLE_FLUSH_DIRECT);
+        if (!timer_active && s_acc_pending) {
+            // Saturated motion left over
+            esp_timer_start_periodic(s_coalesce_timer, s_conn_interval_us);
         }
     }
+    xSemaphoreGive(s_tx_mutex);
 
     return ESP_OK;
 }
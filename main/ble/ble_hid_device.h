@@ -2,18 +2,55 @@
 
 #include <stdbool.h>
 #include "esp_err.h"
+#include "latency_trace.h"
+#include "key_bitmap.h"
 
 typedef struct {
-    uint8_t modifier;
-    uint8_t keycodes[6];
+    key_bitmap_t keys;
+    latency_stamp_t stamp;
 } keyboard_report_t;
 
+typedef enum {
+    BLE_LINK_ACTIVE,    // input is flowing, shortest interval, no slave latency
+    BLE_LINK_IDLE,      // no input for a short while
+    BLE_LINK_SLEEP,     // no input for the sleep timeout
+} ble_link_mode_t;
+
+// Why the motion accumulator was sent, counted per reason for telemetry
+typedef enum {
+    BLE_FLUSH_DIRECT,       // pass-through, or a coalescing device a connection interval after the last send
+    BLE_FLUSH_BUTTON,       // button edge, never delayed to the next connection event
+    BLE_FLUSH_FIRST,        // first report after the coalesce timer stopped
+    BLE_FLUSH_CONN_EVENT,   // coalesce timer, a held report or once per connection interval
+    BLE_FLUSH_HOST_SWITCH,  // pending motion sent to the previous host
+    BLE_FLUSH_REASON_COUNT,
+} ble_flush_reason_t;
+
+// How mouse reports are sent, chosen per report stream from its estimated report interval
+typedef enum {
+    BLE_MOTION_PASS_THROUGH,    // slower than the connection interval, every report goes out as it comes
+    BLE_MOTION_COALESCE,        // about one report per interval, held only if the last send was too recent
+    BLE_MOTION_ALIGNED,         // several reports per interval, merged and sent once per connection event
+} ble_motion_mode_t;
+
 typedef struct {
-    uint8_t buttons;
-    uint16_t x;
-    uint16_t y;
-    int8_t wheel;
-    int8_t pan;
+    uint32_t reports;                           // notifications sent, wraps
+    uint32_t suppressed;                        // repeated reports not sent
+    uint32_t flushes[BLE_FLUSH_REASON_COUNT];   // accumulator flushes per reason
+    uint32_t conn_interval_us;
+    uint8_t motion_mode;                        // ble_motion_mode_t of the last mouse report
+} ble_hid_stats_t;
+
+// Motion is full range, ble_hid_device saturates it to the BLE report map and spills the excess
+// into the next notification
+typedef struct {
+    uint16_t buttons;
+    int32_t x;
+    int32_t y;
+    int32_t wheel;
+    int32_t pan;
+    latency_stamp_t stamp;
+    uint16_t stream;    // (USB device address << 8) | report ID, 0 for reports the bridge made up
 } mouse_report_t;
 
 /**
@@ -40,13 +77,122 @@ esp_err_t ble_hid_device_start_advertising(void);
  */
 bool ble_hid_device_connected(void);
 
+/**
+ * @brief Set the Battery Service level and notify it to every connected host
+ *
+ * @param level Percent, 0..100
+ */
+void ble_hid_device_set_battery_level(uint8_t level);
+
+/**
+ * @brief Send reports to another connected host
+ *
+ * Keys and buttons are released on the previous host, which stays connected at a long interval.
+ *
+ * @param index Host slot, 0 based
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if no host is connected in that slot
+ */
+esp_err_t ble_hid_device_select_host(uint8_t index);
+
+/**
+ * @brief Switch to the next or previous connected host
+ * @param direction Positive for next, negative for previous
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if there is no other host
+ */
+esp_err_t ble_hid_device_cycle_host(int8_t direction);
+
+/**
+ * @brief Request connection parameters of the active host for a link mode
+ *
+ * Standby hosts are not affected. Requests for the current mode are ignored.
+ *
+ * @param mode Link mode
+ * @return ESP_OK on success
+ */
+esp_err_t ble_hid_device_set_link_mode(ble_link_mode_t mode);
+
+/**
+ * @brief Park the link: sleep parameters on the active host and no advertising
+ *
+ * Bluedroid and the controller stay initialized and modem-sleep between connection events,
+ * ble_hid_device_resume() is instant compared to a full ble_hid_device_init().
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t ble_hid_device_park(void);
+
+/**
+ * @brief Leave parked mode and advertise again for free host slots
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t ble_hid_device_resume(void);
+
+/**
+ * @brief Check if the link is parked
+ *
+ * @return true if parked
+ */
+bool ble_hid_device_parked(void);
+
+/**
+ * @brief Called from the Bluedroid task once the active host is encrypted and accepts reports
+ */
+typedef void (*ble_hid_ready_cb_t)(void);
+
+/**
+ * @brief Register the ready callback, NULL to unregister
+ *
+ * @param cb Callback, must not block
+ */
+void ble_hid_device_set_ready_callback(ble_hid_ready_cb_t cb);
+
+/**
+ * @brief Get the connection interval of the active host as last reported by the central
+ * @return Connection interval in microseconds
+ */
+uint32_t ble_hid_device_get_conn_interval_us(void);
+
+/**
+ * @brief Snapshot the running counters, deltas between two calls give the rates
+ * @param stats Output counters
+ */
+void ble_hid_device_get_stats(ble_hid_stats_t *stats);
+
+/**
+ * @brief Get the number of connected hosts
+ * @return Number of connected hosts
+ */
+uint8_t ble_hid_device_num_hosts(void);
+
+/**
+ * @brief Get the slot of the host reports go to
+ * @return Host slot, -1 if none
+ */
+int8_t ble_hid_device_active_host(void);
+
 /**
  * @brief Send keyboard report
+ *
+ * Only changes of the key state go out. Up to 6 keys use the 6KRO report, beyond that the NKRO
+ * report takes over until every key is released.
+ *
  * @param report Keyboard report structure
  * @return ESP_OK on success
  */
 esp_err_t ble_hid_device_send_keyboard_report(const keyboard_report_t *report);
 
+/**
+ * @brief Send consumer control report
+ *
+ * Repeats of the last usage sent to the active host are dropped.
+ *
+ * @param usage Consumer page usage, 0 when released
+ * @param stamp Latency stamp of the USB report
+ * @return ESP_OK on success
+ */
+esp_err_t ble_hid_device_send_consumer_report(uint16_t usage, const latency_stamp_t *stamp);
+
 /**
  * @brief Send mouse report
  * @param report Mouse report structure
@@ -6,6 +6,7 @@
 #include <freertos/task.h>
 
 #include "nvs.h"
+#include "nvs_writer.h"
 
 #define STORAGE_NAMESPACE "hid_dev"
 #define ADDR_KEY "last_addr"
@@ -20,60 +21,94 @@ static struct {
 } saved_device_cache = {
     .is_valid = false
 };
+static portMUX_TYPE s_cache_lock = portMUX_INITIALIZER_UNLOCKED;
+static int8_t s_writer_id = -1;
+static bool s_cache_authoritative = false;
 
-/**
- * @brief Save the current connected device address and type to NVS and cache
- *
- * @param bda Bluetooth device address to save
- * @param addr_type Address type (public or random)
- * @return esp_err_t ESP_OK on success, error code otherwise
- */
-esp_err_t save_connected_device(esp_bd_addr_t bda, esp_ble_addr_type_t addr_type) {
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
-
-    // Update in-memory cache first
-    memcpy(saved_device_cache.bda, bda, ESP_BD_ADDR_LEN);
-    saved_device_cache.addr_type = addr_type;
-    saved_device_cache.is_valid = true;
+// Writes the cache to NVS from the write-behind task, an invalid cache erases the keys
+static esp_err_t flush_saved_device(void *arg) {
+    esp_bd_addr_t bda;
+    esp_ble_addr_type_t addr_type;
+    taskENTER_CRITICAL(&s_cache_lock);
+    memcpy(bda, saved_device_cache.bda, ESP_BD_ADDR_LEN);
+    addr_type = saved_device_cache.addr_type;
+    const bool is_valid = saved_device_cache.is_valid;
+    taskEXIT_CRITICAL(&s_cache_lock);
 
-    // Open NVS
-    err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
         return err;
     }
 
-    // Save the device address
-    err = nvs_set_blob(nvs_handle, ADDR_KEY, bda, ESP_BD_ADDR_LEN);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error saving device address: %s", esp_err_to_name(err));
-        nvs_close(nvs_handle);
-        return err;
+    if (is_valid) {
+        err = nvs_set_blob(nvs_handle, ADDR_KEY, bda, ESP_BD_ADDR_LEN);
+        if (err == ESP_OK) {
+            err = nvs_set_u8(nvs_handle, ADDR_TYPE_KEY, (uint8_t)addr_type);
+        }
+    } else {
+        err = nvs_erase_key(nvs_handle, ADDR_KEY);
+        if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) {
+            err = nvs_erase_key(nvs_handle, ADDR_TYPE_KEY);
+        }
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
     }
 
-    // Save the address type
-    err = nvs_set_u8(nvs_handle, ADDR_TYPE_KEY, (uint8_t)addr_type);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error saving address type: %s", esp_err_to_name(err));
-        nvs_close(nvs_handle);
-        return err;
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs_handle);
     }
+    nvs_close(nvs_handle);
 
-    // Commit changes
-    err = nvs_commit(nvs_handle);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error committing NVS: %s", esp_err_to_name(err));
-        nvs_close(nvs_handle);
+        ESP_LOGE(TAG, "Error writing saved device: %s", esp_err_to_name(err));
         return err;
     }
 
-    // Close NVS
-    nvs_close(nvs_handle);
+    if (is_valid) {
+        ESP_LOGI(TAG, "Saved device: %02x:%02x:%02x:%02x:%02x:%02x, type: %d",
+                 bda[0], bda[1], bda[2], bda[3], bda[4], bda[5], addr_type);
+    } else {
+        ESP_LOGI(TAG, "Cleared saved device data");
+    }
+    return ESP_OK;
+}
+
+static void schedule_flush(void) {
+    if (s_writer_id < 0) {
+        s_writer_id = nvs_writer_register(flush_saved_device, NULL);
+    }
+
+    if (s_writer_id < 0) {
+        flush_saved_device(NULL);
+        return;
+    }
+    nvs_writer_mark_dirty(s_writer_id);
+}
 
-    ESP_LOGI(TAG, "Saved device: %02x:%02x:%02x:%02x:%02x:%02x, type: %d",
-             bda[0], bda[1], bda[2], bda[3], bda[4], bda[5], addr_type);
+/**
+ * @brief Save the current connected device address and type to the cache, NVS is written behind
+ *
+ * @param bda Bluetooth device address to save
+ * @param addr_type Address type (public or random)
+ * @return esp_err_t ESP_OK on success, error code otherwise
+ */
+esp_err_t save_connected_device(esp_bd_addr_t bda, esp_ble_addr_type_t addr_type) {
+    // Reconnects of the same host are the common case, they don't touch flash at all
+    taskENTER_CRITICAL(&s_cache_lock);
+    const bool unchanged = saved_device_cache.is_valid && saved_device_cache.addr_type == addr_type &&
+                           memcmp(saved_device_cache.bda, bda, ESP_BD_ADDR_LEN) == 0;
+    memcpy(saved_device_cache.bda, bda, ESP_BD_ADDR_LEN);
+    saved_device_cache.addr_type = addr_type;
+    saved_device_cache.is_valid = true;
+    s_cache_authoritative = true;
+    taskEXIT_CRITICAL(&s_cache_lock);
 
+    if (!unchanged) {
+        schedule_flush();
+    }
     return ESP_OK;
 }
 
@@ -88,6 +123,11 @@ esp_err_t load_saved_device_to_cache(void) {
         return ESP_OK;
     }
 
+    // A cleared cache is newer than NVS until the write-behind commit lands
+    if (s_cache_authoritative) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
     nvs_handle_t nvs_handle;
     esp_err_t err;
     size_t addr_size = ESP_BD_ADDR_LEN;
@@ -233,53 +273,18 @@ esp_err_t get_saved_device(esp_bd_addr_t bda, esp_ble_addr_type_t *addr_type) {
 }
 
 /**
- * @brief Clear saved device data from both cache and NVS
+ * @brief Clear saved device data from the cache, NVS is written behind
  *
  * @return esp_err_t ESP_OK if data cleared successfully, error code otherwise
  */
 esp_err_t clear_saved_device(void) {
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
-
-    // Clear in-memory cache
+    taskENTER_CRITICAL(&s_cache_lock);
     memset(saved_device_cache.bda, 0, ESP_BD_ADDR_LEN);
     saved_device_cache.addr_type = BLE_ADDR_TYPE_PUBLIC;
     saved_device_cache.is_valid = false;
+    s_cache_authoritative = true;
+    taskEXIT_CRITICAL(&s_cache_lock);
 
-    // Open NVS
-    err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
-        return err;
-    }
-
-    // Erase the keys
-    err = nvs_erase_key(nvs_handle, ADDR_KEY);
-    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
-        ESP_LOGE(TAG, "Error erasing device address: %s", esp_err_to_name(err));
-        nvs_close(nvs_handle);
-        return err;
-    }
-
-    err = nvs_erase_key(nvs_handle, ADDR_TYPE_KEY);
-    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
-        ESP_LOGE(TAG, "Error erasing address type: %s", esp_err_to_name(err));
-        nvs_close(nvs_handle);
-        return err;
-    }
-
-    // Commit changes
-    err = nvs_commit(nvs_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error committing NVS: %s", esp_err_to_name(err));
-        nvs_close(nvs_handle);
-        return err;
-    }
-
-    // Close NVS
-    nvs_close(nvs_handle);
-
-    ESP_LOGI(TAG, "Cleared saved device data");
-
+    schedule_flush();
     return ESP_OK;
 }
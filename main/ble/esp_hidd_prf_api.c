@@ -1,13 +1,18 @@
 #include "esp_hidd_prf_api.h"
 #include "hid_device_le_prf.h"
 #include "hid_dev.h"
+#include "hid_report_data.h"
 #include <string.h>
 #include "esp_log.h"
 
-#define HID_KEYBOARD_IN_RPT_LEN     63
-#define HID_MOUSE_IN_RPT_LEN        7
+// Report lengths without the report ID, see hidReportMap
+#define HID_KEYBOARD_IN_RPT_LEN     9
+#define HID_KEYBOARD_NUM_KEYS       6
+#define HID_NKRO_IN_RPT_LEN         (1 + (HID_NKRO_NUM_USAGES + 7) / 8)
+#define HID_CC_IN_RPT_LEN           2
+#define HID_MOUSE_IN_RPT_LEN        10
 
-static uint8_t s_report_buffer[HID_KEYBOARD_IN_RPT_LEN+2] __attribute__((section(".dram1.data")));
+static uint8_t s_report_buffer[HID_NKRO_IN_RPT_LEN] __attribute__((section(".dram1.data")));
 static bool s_enabled = true;
 
 bool is_ble_enabled(void) {
@@ -71,29 +76,75 @@ uint16_t esp_hidd_get_version(void) {
     return HIDD_VERSION;
 }
 
-void esp_hidd_send_keyboard_value(const uint16_t conn_id, const key_mask_t special_key_mask, const uint8_t *keyboard_cmd) {
+void esp_hidd_send_keyboard_value(const uint16_t conn_id, const key_mask_t special_key_mask, const uint8_t *keyboard_cmd,
+                                  const latency_stamp_t *stamp) {
     // ESP_LOGI(HID_LE_PRF_TAG, "mask=%02X data=%08X%08X", special_key_mask, *(const uint32_t *const)keyboard_cmd, *(const uint32_t*const)&keyboard_cmd[4]);
 
     s_report_buffer[0] = special_key_mask;
-    memset(&s_report_buffer[1], 0, HID_KEYBOARD_IN_RPT_LEN - 1);
-    for (int i = 1; i < HID_KEYBOARD_IN_RPT_LEN - 1; i++) {
-        s_report_buffer[i + 1] = keyboard_cmd[i - 1];
-    }
+    s_report_buffer[1] = 0;
+    memcpy(&s_report_buffer[2], keyboard_cmd, HID_KEYBOARD_NUM_KEYS);
+    s_report_buffer[HID_KEYBOARD_IN_RPT_LEN - 1] = 0;
+
+    hid_dev_send_report(hidd_le_env.gatt_if,
+        conn_id, HID_RPT_ID_KEY_IN, HID_REPORT_TYPE_INPUT, HID_KEYBOARD_IN_RPT_LEN, s_report_buffer, true, stamp);
+}
+
+void esp_hidd_send_nkro_value(const uint16_t conn_id, const key_bitmap_t *keys, const latency_stamp_t *stamp) {
+    s_report_buffer[0] = key_bitmap_modifiers(keys);
+    key_bitmap_pack(keys, &s_report_buffer[1], HID_NKRO_NUM_USAGES);
+
+    hid_dev_send_report(hidd_le_env.gatt_if,
+        conn_id, HID_RPT_ID_NKRO_IN, HID_REPORT_TYPE_INPUT, HID_NKRO_IN_RPT_LEN, s_report_buffer, true, stamp);
+}
+
+void esp_hidd_send_consumer_value(const uint16_t conn_id, const uint16_t usage, const latency_stamp_t *stamp) {
+    s_report_buffer[0] = usage & 0xFF;
+    s_report_buffer[1] = usage >> 8;
 
     hid_dev_send_report(hidd_le_env.gatt_if,
-        conn_id, HID_RPT_ID_KEY_IN, HID_REPORT_TYPE_INPUT, HID_KEYBOARD_IN_RPT_LEN, s_report_buffer);
+        conn_id, HID_RPT_ID_CC_IN, HID_REPORT_TYPE_INPUT, HID_CC_IN_RPT_LEN, s_report_buffer, true, stamp);
 }
 
-__attribute__((section(".iram1.text"))) void esp_hidd_send_mouse_value(const uint16_t conn_id, const uint8_t mouse_button, const uint16_t mickeys_x,
-                               const uint16_t mickeys_y, const int8_t wheel, const int8_t pan) {
+__attribute__((section(".iram1.text"))) void esp_hidd_send_mouse_value(const uint16_t conn_id, const uint16_t mouse_button, const uint16_t mickeys_x,
+                               const uint16_t mickeys_y, const int16_t wheel, const int16_t pan,
+                               const latency_stamp_t *stamp) {
     s_report_buffer[0] = mickeys_x & 0xFF;
     s_report_buffer[1] = (mickeys_x >> 8);
     s_report_buffer[2] = mickeys_y & 0xFF;
     s_report_buffer[3] = (mickeys_y >> 8);
-    s_report_buffer[4] = wheel;
-    s_report_buffer[5] = pan;
-    s_report_buffer[6] = mouse_button;
-
+    s_report_buffer[4] = wheel & 0xFF;
+    s_report_buffer[5] = (uint16_t) wheel >> 8;
+    s_report_buffer[6] = pan & 0xFF;
+    s_report_buffer[7] = (uint16_t) pan >> 8;
+    s_report_buffer[8] = mouse_button & 0xFF;
+    s_report_buffer[9] = mouse_button >> 8;
+
+    // Only a report without motion is pure button state, repeated motion is still motion.
+    // Motion leads the report, see HID_DEV_MOTION_BYTES.
+    const bool idle = mickeys_x == 0 && mickeys_y == 0 && wheel == 0 && pan == 0;
     hid_dev_send_report(hidd_le_env.gatt_if, conn_id, HID_RPT_ID_MOUSE_IN, HID_REPORT_TYPE_INPUT, HID_MOUSE_IN_RPT_LEN,
-                        s_report_buffer);
+                        s_report_buffer, idle, stamp);
+}
+
+__attribute__((section(".iram1.text"))) void esp_hidd_send_packed_motion(const uint16_t conn_id, uint8_t *data,
+                                                                         const uint8_t length,
+                                                                         const latency_stamp_t *stamp) {
+    // Never queued by hid_dev, the caller holds samples back while the link is congested
+    hid_dev_send_report(hidd_le_env.gatt_if, conn_id, HID_RPT_ID_VENDOR, HID_REPORT_TYPE_INPUT, length, data, false,
+                        stamp);
+}
+
+void esp_hidd_set_battery_level(const uint8_t level) {
+    hid_battery_level = level;
+    if (hidd_le_env.bas_lvl_hdl != 0) {
+        esp_ble_gatts_set_attr_value(hidd_le_env.bas_lvl_hdl, sizeof(hid_battery_level), &hid_battery_level);
+    }
+}
+
+void esp_hidd_send_battery_level(const uint16_t conn_id) {
+    // Hosts read the level, notifications only go to the ones that asked for them
+    if (hidd_le_env.bas_lvl_hdl != 0 && hidd_le_battery_notify_enabled(conn_id)) {
+        esp_ble_gatts_send_indicate(hidd_le_env.gatt_if, conn_id, hidd_le_env.bas_lvl_hdl,
+                                    sizeof(hid_battery_level), &hid_battery_level, false);
+    }
 }
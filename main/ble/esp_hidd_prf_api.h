@@ -10,6 +10,41 @@
 extern "C" {
 #endif
 
+// Usages 0x00..HID_NKRO_NUM_USAGES-1 are covered by the NKRO report, see hidReportMap
+#define HID_NKRO_NUM_USAGES 0x98
+
+// Resolution Multiplier feature of the mouse report, a host that sets one gets HID_WHEEL_RESOLUTION
+// counts per detent on that axis instead of whole detents
+#define HID_RES_MULT_WHEEL  0x03
+#define HID_RES_MULT_PAN    0x0C
+
+/**
+ * Packed motion, a vendor report (page 0xFF00, report ID HID_RPT_ID_VENDOR) for receivers with their
+ * own driver. Writing HID_PACKED_ENABLE to its output report switches the connection over: motion
+ * goes out on this report, each notification carrying every sample since the previous one. The mouse
+ * report is still sent for a button change while the link is congested, with the motion held so far,
+ * because packed notifications aren't queued; receivers must keep handling it.
+ *
+ *   uint8_t  count       samples that follow
+ *   uint16_t buttons     button state, applies after the last sample
+ *   uint16_t age_us      from the USB arrival of the last sample to the notification
+ *   count x {
+ *     uint16_t dt_us     since the previous sample, HID_PACKED_DT_UNKNOWN for the first one after idle
+ *     int16_t  x, y
+ *     int8_t   wheel, pan
+ *   }
+ *
+ * Wheel and pan follow the Resolution Multiplier the receiver set, see HID_RES_MULT_WHEEL.
+ * All fields little endian. Motion beyond the range of a sample continues in samples with dt_us 0.
+ * A notification never exceeds the ATT MTU, at the default MTU it holds a single sample.
+ */
+#define HID_PACKED_ENABLE        0x01
+#define HID_PACKED_MAX_SAMPLES   16
+#define HID_PACKED_HEADER_LEN    5
+#define HID_PACKED_SAMPLE_LEN    8
+#define HID_PACKED_RPT_LEN       (HID_PACKED_HEADER_LEN + HID_PACKED_MAX_SAMPLES * HID_PACKED_SAMPLE_LEN)
+#define HID_PACKED_DT_UNKNOWN    0xFFFF
+
 typedef enum {
     ESP_HIDD_EVENT_REG_FINISH = 0,
     ESP_BAT_EVENT_REG,
@@ -18,6 +53,8 @@ typedef enum {
     ESP_HIDD_EVENT_BLE_DISCONNECT,
     ESP_HIDD_EVENT_BLE_VENDOR_REPORT_WRITE_EVT,
     ESP_HIDD_EVENT_BLE_LED_REPORT_WRITE_EVT,
+    ESP_HIDD_EVENT_BLE_MTU,
+    ESP_HIDD_EVENT_BLE_FEATURE_REPORT_WRITE_EVT,
 } esp_hidd_cb_event_t;
 
 /// HID config status
@@ -69,6 +106,7 @@ typedef union {
      * @brief ESP_HIDD_EVENT_DISCONNECT
 	 */
     struct __attribute__((packed)) hidd_disconnect_evt_param {
+        uint16_t conn_id;
         esp_bd_addr_t remote_bda;                   /*!< HID Remote bluetooth device address */
     } disconnect;									/*!< HID callback param of ESP_HIDD_EVENT_DISCONNECT */
 
@@ -91,6 +129,24 @@ typedef union {
         uint8_t length;
         uint8_t *data;
     } led_write;
+
+    /**
+     * @brief ESP_HIDD_EVENT_BLE_FEATURE_REPORT_WRITE_EVT
+     */
+    struct __attribute__((packed)) hidd_feature_write_evt_param {
+        uint16_t conn_id;
+        uint8_t report_id;
+        uint8_t length;
+        uint8_t *data;
+    } feature_write;
+
+    /**
+     * @brief ESP_HIDD_EVENT_BLE_MTU
+     */
+    struct __attribute__((packed)) hidd_mtu_evt_param {
+        uint16_t conn_id;
+        uint16_t mtu;                               /*!< ATT MTU negotiated with the central */
+    } mtu;
 } esp_hidd_cb_param_t;
 
 /**
@@ -140,9 +196,43 @@ esp_err_t esp_hidd_profile_deinit(void);
  */
 uint16_t esp_hidd_get_version(void);
 
-void esp_hidd_send_keyboard_value(uint16_t conn_id, key_mask_t special_key_mask, const uint8_t *keyboard_cmd);
+void esp_hidd_send_keyboard_value(uint16_t conn_id, key_mask_t special_key_mask, const uint8_t *keyboard_cmd,
+                                  const latency_stamp_t *stamp);
 
-void esp_hidd_send_mouse_value(uint16_t conn_id, uint8_t mouse_button, uint16_t mickeys_x, uint16_t mickeys_y, int8_t wheel, int8_t pan);
+/**
+ * @brief Send the NKRO keyboard report, modifiers plus one bit per usage up to HID_NKRO_NUM_USAGES
+ */
+void esp_hidd_send_nkro_value(uint16_t conn_id, const key_bitmap_t *keys, const latency_stamp_t *stamp);
+
+/**
+ * @brief Send the consumer control report
+ *
+ * @param usage Consumer page usage, 0 when released
+ */
+void esp_hidd_send_consumer_value(uint16_t conn_id, uint16_t usage, const latency_stamp_t *stamp);
+
+void esp_hidd_send_mouse_value(uint16_t conn_id, uint16_t mouse_button, uint16_t mickeys_x, uint16_t mickeys_y, int16_t wheel, int16_t pan,
+                               const latency_stamp_t *stamp);
+
+/**
+ * @brief Send a packed motion report, see HID_PACKED_ENABLE for the layout
+ *
+ * @param data Report, count and buttons first
+ * @param length Length of data, at most HID_PACKED_RPT_LEN and the MTU of the connection less 3
+ */
+void esp_hidd_send_packed_motion(uint16_t conn_id, uint8_t *data, uint8_t length, const latency_stamp_t *stamp);
+
+/**
+ * @brief Set the Battery Service level value read by hosts
+ *
+ * @param level Percent, 0..100
+ */
+void esp_hidd_set_battery_level(uint8_t level);
+
+/**
+ * @brief Notify the Battery Service level to a host
+ */
+void esp_hidd_send_battery_level(uint16_t conn_id);
 
 bool is_ble_enabled(void);
 
@@ -3,77 +3,337 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stddef.h>
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "perf_counters.h"
 
 static hid_report_map_t *hid_dev_rpt_tbl;
 static uint8_t hid_dev_rpt_tbl_Len;
 
-#define CACHE_SIZE 8
-#define DIRECT_CACHE_SIZE 4
+// Slot in hid_rpt_map by report ID, every input report has an ID of its own
+static const int8_t DRAM_ATTR s_slot_by_id[HID_RPT_ID_MAX + 1] = {
+    [0 ... HID_RPT_ID_MAX] = -1,
+    [HID_RPT_ID_MOUSE_IN] = HID_RPT_SLOT_MOUSE,
+    [HID_RPT_ID_SYS_IN] = HID_RPT_SLOT_SYS_CTRL,
+    [HID_RPT_ID_CC_IN] = HID_RPT_SLOT_CONSUMER,
+    [HID_RPT_ID_KEY_IN] = HID_RPT_SLOT_KEY,
+    [HID_RPT_ID_NKRO_IN] = HID_RPT_SLOT_NKRO,
+    [HID_RPT_ID_VENDOR] = HID_RPT_SLOT_VENDOR,
+};
+
+// Last payload sent per report, byte-identical repeats to the same connection are dropped
+#define LAST_SENT_MAX_LEN 20
+
+typedef struct {
+    bool valid;
+    uint8_t length;
+    uint16_t conn_id;
+    uint8_t data[LAST_SENT_MAX_LEN];
+} last_sent_t;
+
+static last_sent_t __attribute__((section(".dram1.data"))) s_last_sent[HID_NUM_REPORTS];
+
+// While the controller reports congestion for a connection, its notifications wait here, one queue per
+// report. Motion is added into the newest waiting motion entry, state entries are kept in order. A full
+// queue makes room by merging or dropping motion; state changes may also take the reserved slots, so a
+// click under congestion still reaches the host as down and up.
+#define TX_QUEUE_DEPTH  4   // entries for any report
+#define TX_EDGE_RESERVE 4   // further entries only state changes may take
+#define TX_QUEUE_SLOTS  (TX_QUEUE_DEPTH + TX_EDGE_RESERVE)
 
 typedef struct {
-    uint16_t key; // id << 8 | type
-    uint16_t _pad;  // 32-bit alignment
-    hid_report_map_t *value;
-} cache_entry_t;
-
-static cache_entry_t __attribute__((section(".dram1.data"))) cache[CACHE_SIZE];
-static hid_report_map_t * __attribute__((section(".dram1.data"))) direct_cache[DIRECT_CACHE_SIZE];
-static uint8_t __attribute__((section(".dram1.data"))) cache_size = 0;
+    uint16_t conn_id;
+    uint8_t length;
+    bool motion;
+    uint8_t data[LAST_SENT_MAX_LEN];
+    latency_stamp_t stamp;
+} tx_entry_t;
+
+typedef struct {
+    tx_entry_t entries[TX_QUEUE_SLOTS];
+    uint8_t head;
+    uint8_t count;
+} tx_queue_t;
+
+static tx_queue_t s_tx_queues[HID_NUM_REPORTS];
+static esp_gatt_if_t s_tx_gatts_if = ESP_GATT_IF_NONE;
+// Congested connections, bit conn_id % 32
+static volatile uint32_t s_congested = 0;
+// Set while the queues are sent, direct sends then queue up behind so nothing is reordered
+static bool s_draining = false;
+static uint8_t s_queued = 0;
+static portMUX_TYPE s_tx_lock = portMUX_INITIALIZER_UNLOCKED;
 // static uint8_t s_report_buffer[96] __attribute__((section(".dram1.data")));
 
 static IRAM_ATTR hid_report_map_t *hid_dev_rpt_by_id(const uint8_t id, const uint8_t type) {
-    // Direct indexing for most common reports (assuming IDs 0-3 are most frequent)
-    if (id < DIRECT_CACHE_SIZE && direct_cache[id] && 
-        direct_cache[id]->id == id && 
-        direct_cache[id]->type == type) {
-        return direct_cache[id];
-    }
-
-    const uint16_t key = (id << 8) | type;
-    
-    // Unrolled cache lookup for better branch prediction
-    if (cache_size > 0 && cache[0].key == key) return cache[0].value;
-    if (cache_size > 1 && cache[1].key == key) return cache[1].value;
-    if (cache_size > 2 && cache[2].key == key) return cache[2].value;
-    if (cache_size > 3 && cache[3].key == key) return cache[3].value;
-
-    hid_report_map_t *rpt = hid_dev_rpt_tbl;
-    for (uint8_t i = hid_dev_rpt_tbl_Len; i > 0; i--, rpt++) {
-        if (rpt->id == id && rpt->type == type) {
-            // Update direct cache for frequent IDs
-            if (id < DIRECT_CACHE_SIZE) {
-                direct_cache[id] = rpt;
+    const int8_t slot = id <= HID_RPT_ID_MAX ? s_slot_by_id[id] : -1;
+    if (slot < 0 || slot >= hid_dev_rpt_tbl_Len || hid_dev_rpt_tbl[slot].type != type) {
+        return NULL;
+    }
+    return &hid_dev_rpt_tbl[slot];
+}
+
+void hid_dev_register_reports(uint8_t num_reports, hid_report_map_t *p_report) {
+    for (int i = 0; i < num_reports; i++) {
+        if (p_report[i].id > HID_RPT_ID_MAX || s_slot_by_id[p_report[i].id] != i) {
+            ESP_LOGE(HID_LE_PRF_TAG, "Report %d (ID %d) is not in its slot, reports are dropped", i, p_report[i].id);
+            num_reports = 0;
+            break;
+        }
+    }
+    hid_dev_rpt_tbl = p_report;
+    hid_dev_rpt_tbl_Len = num_reports;
+    memset(s_last_sent, 0, sizeof(s_last_sent));
+    taskENTER_CRITICAL(&s_tx_lock);
+    memset(s_tx_queues, 0, sizeof(s_tx_queues));
+    s_queued = 0;
+    s_congested = 0;
+    taskEXIT_CRITICAL(&s_tx_lock);
+}
+
+void hid_dev_forget_conn(const uint16_t conn_id) {
+    for (int i = 0; i < HID_NUM_REPORTS; i++) {
+        if (s_last_sent[i].conn_id == conn_id) {
+            s_last_sent[i].valid = false;
+        }
+    }
+
+    // Entries of other connections move up, the queues stay in order
+    taskENTER_CRITICAL(&s_tx_lock);
+    for (int i = 0; i < HID_NUM_REPORTS; i++) {
+        tx_queue_t *queue = &s_tx_queues[i];
+        uint8_t kept = 0;
+        for (uint8_t j = 0; j < queue->count; j++) {
+            const tx_entry_t *entry = &queue->entries[(queue->head + j) % TX_QUEUE_SLOTS];
+            if (entry->conn_id != conn_id) {
+                queue->entries[(queue->head + kept++) % TX_QUEUE_SLOTS] = *entry;
             }
-            // Update LRU cache
-            if (cache_size < CACHE_SIZE) {
-                cache[cache_size].key = key;
-                cache[cache_size].value = rpt;
-                cache_size++;
-            } else {
-                // Move everything down and put new entry at front
-                memmove(&cache[1], &cache[0], sizeof(cache_entry_t) * (CACHE_SIZE - 1));
-                cache[0].key = key;
-                cache[0].value = rpt;
+        }
+        s_queued -= queue->count - kept;
+        queue->count = kept;
+    }
+    s_congested &= ~(1UL << (conn_id % 32));
+    taskEXIT_CRITICAL(&s_tx_lock);
+
+    // Whatever waited behind the dropped entries
+    hid_dev_drain();
+}
+
+// Adds the motion of data into entry if the rest of the report matches and nothing saturates
+__attribute__((section(".iram1.text"))) static bool merge_motion(tx_entry_t *entry, const uint8_t *data,
+                                                                 const uint8_t length) {
+    if (!entry->motion || entry->length != length || length < HID_DEV_MOTION_BYTES ||
+        memcmp(&entry->data[HID_DEV_MOTION_BYTES], &data[HID_DEV_MOTION_BYTES], length - HID_DEV_MOTION_BYTES) != 0) {
+        return false;
+    }
+
+    int16_t sums[HID_DEV_MOTION_BYTES / 2];
+    for (int i = 0; i < HID_DEV_MOTION_BYTES / 2; i++) {
+        const int32_t sum = (int16_t)(entry->data[2 * i] | entry->data[2 * i + 1] << 8) +
+                            (int16_t)(data[2 * i] | data[2 * i + 1] << 8);
+        if (sum < INT16_MIN || sum > INT16_MAX) {
+            return false;
+        }
+        sums[i] = (int16_t)sum;
+    }
+
+    for (int i = 0; i < HID_DEV_MOTION_BYTES / 2; i++) {
+        entry->data[2 * i] = (uint16_t)sums[i] & 0xFF;
+        entry->data[2 * i + 1] = (uint16_t)sums[i] >> 8;
+    }
+    return true;
+}
+
+__attribute__((section(".iram1.text"))) static tx_entry_t *queue_at(tx_queue_t *queue, const uint8_t position) {
+    return &queue->entries[(queue->head + position) % TX_QUEUE_SLOTS];
+}
+
+// True if data holds the same buttons and keys as entry, only the motion bytes may differ
+__attribute__((section(".iram1.text"))) static bool same_state(const tx_entry_t *entry, const uint16_t conn_id,
+                                                               const uint8_t *data, const uint8_t length) {
+    return entry->conn_id == conn_id && entry->length == length && length >= HID_DEV_MOTION_BYTES &&
+           memcmp(&entry->data[HID_DEV_MOTION_BYTES], &data[HID_DEV_MOTION_BYTES], length - HID_DEV_MOTION_BYTES) == 0;
+}
+
+__attribute__((section(".iram1.text"))) static void queue_remove(tx_queue_t *queue, const uint8_t position) {
+    for (uint8_t j = position; j + 1 < queue->count; j++) {
+        *queue_at(queue, j) = *queue_at(queue, j + 1);
+    }
+    queue->count--;
+    s_queued--;
+}
+
+// Frees one entry by merging or dropping motion, false if only state changes are queued. Called under s_tx_lock.
+__attribute__((section(".iram1.text"))) static bool make_room(tx_queue_t *queue) {
+    for (uint8_t j = 0; j + 1 < queue->count; j++) {
+        tx_entry_t *entry = queue_at(queue, j);
+        const tx_entry_t *next = queue_at(queue, j + 1);
+        if (next->motion && entry->conn_id == next->conn_id && merge_motion(entry, next->data, next->length)) {
+            queue_remove(queue, j + 1);
+            perf_count(PERF_BLE_TX_MERGED);
+            return true;
+        }
+    }
+
+    // Motion whose buttons a neighbour carries as well, only its deltas are lost
+    for (uint8_t j = 0; j < queue->count; j++) {
+        const tx_entry_t *entry = queue_at(queue, j);
+        if (!entry->motion) {
+            continue;
+        }
+        const tx_entry_t *prev = j > 0 ? queue_at(queue, j - 1) : NULL;
+        const tx_entry_t *next = j + 1 < queue->count ? queue_at(queue, j + 1) : NULL;
+        if ((prev != NULL && same_state(prev, entry->conn_id, entry->data, entry->length)) ||
+            (next != NULL && same_state(next, entry->conn_id, entry->data, entry->length))) {
+            queue_remove(queue, j);
+            perf_count(PERF_BLE_TX_MOTION_DROPPED);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called under s_tx_lock
+__attribute__((section(".iram1.text"))) static void enqueue(const ptrdiff_t index, const uint16_t conn_id,
+                                                            const uint8_t length, const uint8_t *data,
+                                                            const bool motion, const latency_stamp_t *stamp) {
+    tx_queue_t *queue = &s_tx_queues[index];
+    tx_entry_t *newest = queue->count > 0 ? queue_at(queue, queue->count - 1) : NULL;
+    if (motion && newest != NULL && newest->conn_id == conn_id && merge_motion(newest, data, length)) {
+        perf_count(PERF_BLE_TX_MERGED);
+        return;
+    }
+
+    // Motion with the buttons of the newest entry changes no state, anything else is an edge
+    const bool edge = !motion || newest == NULL || !same_state(newest, conn_id, data, length);
+    tx_entry_t *entry;
+    if (queue->count < (edge ? TX_QUEUE_SLOTS : TX_QUEUE_DEPTH) || make_room(queue)) {
+        entry = queue_at(queue, queue->count++);
+        s_queued++;
+        perf_count(PERF_BLE_TX_QUEUED);
+    } else if (!edge) {
+        perf_count(PERF_BLE_TX_MOTION_DROPPED);
+        return;
+    } else {
+        // Nothing but state changes waiting, the newest of them is lost so the final state still gets through
+        entry = newest;
+        perf_count(PERF_BLE_TX_EDGE_DROPPED);
+    }
+
+    entry->conn_id = conn_id;
+    entry->length = length;
+    entry->motion = motion;
+    memcpy(entry->data, data, length);
+    entry->stamp = stamp != NULL ? *stamp : (latency_stamp_t) {0};
+}
+
+void hid_dev_set_congested(const uint16_t conn_id, const bool congested) {
+    taskENTER_CRITICAL(&s_tx_lock);
+    if (congested) {
+        s_congested |= 1UL << (conn_id % 32);
+    } else {
+        s_congested &= ~(1UL << (conn_id % 32));
+    }
+    taskEXIT_CRITICAL(&s_tx_lock);
+
+    if (congested) {
+        perf_count(PERF_BLE_CONGESTED);
+        return;
+    }
+    hid_dev_drain();
+}
+
+void hid_dev_drain(void) {
+    taskENTER_CRITICAL(&s_tx_lock);
+    if (s_draining) {
+        taskEXIT_CRITICAL(&s_tx_lock);
+        return;
+    }
+    s_draining = true;
+
+    // Round robin over the reports, one entry each, until the queues are empty or everything left is congested
+    bool sent = true;
+    while (s_queued > 0 && sent) {
+        sent = false;
+        for (int i = 0; i < HID_NUM_REPORTS; i++) {
+            tx_queue_t *queue = &s_tx_queues[i];
+            if (queue->count == 0 || (s_congested & (1UL << (queue->entries[queue->head].conn_id % 32)))) {
+                continue;
             }
-            return rpt;
+
+            const tx_entry_t entry = queue->entries[queue->head];
+            queue->head = (queue->head + 1) % TX_QUEUE_SLOTS;
+            queue->count--;
+            s_queued--;
+            taskEXIT_CRITICAL(&s_tx_lock);
+
+            const esp_err_t ret = esp_ble_gatts_send_indicate(s_tx_gatts_if, entry.conn_id, hid_dev_rpt_tbl[i].handle,
+                                                              entry.length, (uint8_t *)entry.data, false);
+            perf_count(ret == ESP_OK ? PERF_BLE_NOTIFIES : PERF_BLE_NOTIFY_ERRORS);
+            if (ret != ESP_OK && s_last_sent[i].conn_id == entry.conn_id) {
+                s_last_sent[i].valid = false;
+            }
+            latency_trace_sent(&entry.stamp);
+
+            taskENTER_CRITICAL(&s_tx_lock);
+            sent = true;
         }
     }
 
-    return NULL;
+    s_draining = false;
+    taskEXIT_CRITICAL(&s_tx_lock);
 }
 
-void hid_dev_register_reports(const uint8_t num_reports, hid_report_map_t *p_report) {
-    hid_dev_rpt_tbl = p_report;
-    hid_dev_rpt_tbl_Len = num_reports;
-    cache_size = 0;
-    memset(direct_cache, 0, sizeof(direct_cache));
+bool hid_dev_congested(const uint16_t conn_id) {
+    return (s_congested & (1UL << (conn_id % 32))) != 0;
+}
+
+uint32_t hid_dev_get_suppressed(void) {
+    return perf_read(PERF_BLE_SUPPRESSED);
 }
 
 __attribute__((section(".iram1.text"))) void hid_dev_send_report(const esp_gatt_if_t gatts_if, const uint16_t conn_id,
-                         const uint8_t id, const uint8_t type, const uint8_t length, uint8_t *data) {
+                         const uint8_t id, const uint8_t type, const uint8_t length, uint8_t *data,
+                         const bool suppress_repeat, const latency_stamp_t *stamp) {
     hid_report_map_t *p_rpt;
-    if ((p_rpt = hid_dev_rpt_by_id(id, type)) != NULL) {
-        esp_ble_gatts_send_indicate(gatts_if, conn_id, p_rpt->handle, length, data, false);
+    if ((p_rpt = hid_dev_rpt_by_id(id, type)) == NULL) {
+        return;
+    }
+
+    const ptrdiff_t index = p_rpt - hid_dev_rpt_tbl;
+    // Packed motion doesn't lead with HID_DEV_MOTION_BYTES, it can't be merged and is never queued
+    last_sent_t *last = index < HID_NUM_REPORTS && length <= LAST_SENT_MAX_LEN && id != HID_RPT_ID_VENDOR
+                            ? &s_last_sent[index]
+                            : NULL;
+    if (suppress_repeat && last && last->valid && last->conn_id == conn_id && last->length == length &&
+        memcmp(last->data, data, length) == 0) {
+        perf_count(PERF_BLE_SUPPRESSED);
+        return;
+    }
+
+    // Behind a congested link or reports already waiting, the report waits too
+    taskENTER_CRITICAL(&s_tx_lock);
+    s_tx_gatts_if = gatts_if;
+    if (last && ((s_congested & (1UL << (conn_id % 32))) || s_draining || s_tx_queues[index].count > 0)) {
+        enqueue(index, conn_id, length, data, !suppress_repeat, stamp);
+        taskEXIT_CRITICAL(&s_tx_lock);
+        last->valid = true;
+        last->conn_id = conn_id;
+        last->length = length;
+        memcpy(last->data, data, length);
+        return;
+    }
+    taskEXIT_CRITICAL(&s_tx_lock);
+
+    const esp_err_t ret = esp_ble_gatts_send_indicate(gatts_if, conn_id, p_rpt->handle, length, data, false);
+    perf_count(ret == ESP_OK ? PERF_BLE_NOTIFIES : PERF_BLE_NOTIFY_ERRORS);
+    if (last) {
+        // A failed send leaves the host state unknown, the next report must go out whatever it holds
+        last->valid = ret == ESP_OK;
+        last->conn_id = conn_id;
+        last->length = length;
+        memcpy(last->data, data, length);
     }
+    latency_trace_sent(stamp);
 }
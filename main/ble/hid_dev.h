@@ -25,8 +25,48 @@ typedef struct
 
 void hid_dev_register_reports(uint8_t num_reports, hid_report_map_t *p_report);
 
+/**
+ * @brief Notify a report
+ *
+ * @param suppress_repeat The payload is absolute state: drop it if it matches the last one sent to conn_id.
+ *                        Must be false for payloads carrying relative motion.
+ */
 void hid_dev_send_report(esp_gatt_if_t gatts_if, uint16_t conn_id,
-                        uint8_t id, uint8_t type, uint8_t length, uint8_t *data);
+                        uint8_t id, uint8_t type, uint8_t length, uint8_t *data,
+                        bool suppress_repeat, const latency_stamp_t *stamp);
+
+// Relative payloads (suppress_repeat false) start with this many bytes of int16 little endian motion
+#define HID_DEV_MOTION_BYTES 8
+
+/**
+ * @brief Drop the last sent payloads and the queued reports of a connection, call when it goes away
+ */
+void hid_dev_forget_conn(uint16_t conn_id);
+
+/**
+ * @brief Track ESP_GATTS_CONGEST_EVT, reports to a congested connection are queued
+ *
+ * Clearing the congestion sends what was queued.
+ *
+ * @param conn_id Connection
+ * @param congested Congestion state reported by the controller
+ */
+void hid_dev_set_congested(uint16_t conn_id, bool congested);
+
+/**
+ * @brief Send queued reports of connections that aren't congested
+ */
+void hid_dev_drain(void);
+
+/**
+ * @brief Check if the controller reported a connection as congested
+ */
+bool hid_dev_congested(uint16_t conn_id);
+
+/**
+ * @brief Number of reports dropped as repeats since boot
+ */
+uint32_t hid_dev_get_suppressed(void);
 
 void hid_keyboard_build_report(uint8_t *buffer, keyboard_cmd_t cmd);
 
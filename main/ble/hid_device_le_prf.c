@@ -9,6 +9,12 @@
 #define STORAGE_NAMESPACE "hid_dev"
 #define ADDR_KEY "last_addr"
 #define ADDR_TYPE_KEY "addr_type"
+#define GATT_LAYOUT_KEY "gatt_layout"
+
+// Bump whenever attributes are added to or removed from the tables: bonded hosts cache the handles, and
+// are told to rediscover once when they reconnect after an update. 2 added the vendor report, 3 the
+// resolution multiplier feature report.
+#define HID_GATT_LAYOUT_VERSION 3
 
 struct gatts_profile_inst {
     esp_gatts_cb_t gatts_cb;
@@ -19,8 +25,32 @@ struct gatts_profile_inst {
 
 hidd_le_env_t hidd_le_env;
 static esp_gatt_if_t s_gatts_if;
+
+// Handles of the first bring-up, kept across stack restarts. The stack assigns the same handles for the
+// same tables in the same order, so later bring-ups create the HID table right behind the battery one
+// instead of waiting for the battery handles, and keep hid_rpt_map as it is.
+static uint16_t s_bas_start_hdl = 0;
+static uint16_t s_hid_handles[HIDD_LE_IDX_NB] = {0};
+static bool s_hid_created_early = false;
+static bool s_hid_stale = false;    // created with an include the battery service didn't end up at
 uint8_t hidProtocolMode = HID_PROTOCOL_MODE_REPORT;
 
+// Bonded hosts still to be sent Service Changed for the current layout
+static bool s_layout_checked = false;
+static bool s_layout_stale = false;
+static esp_bd_addr_t s_layout_told[CONFIG_BT_SMP_MAX_BONDS];
+static uint8_t s_layout_told_count = 0;
+
+// Battery Level CCC by host address, so a bonded host that doesn't write it again on reconnect keeps it
+typedef struct {
+    esp_bd_addr_t bda;
+    bool notify;
+} bas_ccc_t;
+static bas_ccc_t s_bas_ccc[CONFIG_BT_SMP_MAX_BONDS];
+static uint8_t s_bas_ccc_count = 0;
+
+static void bas_ccc_store(uint16_t conn_id, bool notify);
+
 uint16_t get_gatts_if(void) {
     if (hidd_le_env.hidd_cb != NULL) {
         return hidd_le_env.gatt_if;
@@ -58,6 +88,9 @@ static void __attribute__((section(".iram1.text"))) esp_hidd_prf_cb_hdl(esp_gatt
             }
             break;
         }
+        case ESP_GATTS_CONGEST_EVT:
+            hid_dev_set_congested(param->congest.conn_id, param->congest.congested);
+            break;
         case ESP_GATTS_CONF_EVT:
         case ESP_GATTS_CREATE_EVT:
         case ESP_GATTS_CLOSE_EVT:
@@ -69,24 +102,18 @@ static void __attribute__((section(".iram1.text"))) esp_hidd_prf_cb_hdl(esp_gatt
             cb_param.connect.conn_id = param->connect.conn_id;
             hidd_clcb_alloc(param->connect.conn_id, param->connect.remote_bda);
             esp_ble_set_encryption(param->connect.remote_bda, ESP_BLE_SEC_ENCRYPT_MITM);
+            // Connection parameters depend on whether this host becomes the active one, see ble_hid_device.c
             if (hidd_le_env.hidd_cb != NULL) {
                 (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_CONNECT, &cb_param);
             }
-
-            esp_ble_conn_update_params_t conn_params;
-            memcpy(conn_params.bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
-
-            conn_params.latency = 0x00;
-            conn_params.min_int = 0x06; // x 1.25ms
-            conn_params.max_int = 0x06; // x 1.25ms
-            conn_params.timeout = 0xA0; // x 6.25ms
-
-            esp_ble_gap_update_conn_params(&conn_params);
             break;
         }
         case ESP_GATTS_DISCONNECT_EVT: {
+            esp_hidd_cb_param_t cb_param = {0};
+            cb_param.disconnect.conn_id = param->disconnect.conn_id;
+            memcpy(cb_param.disconnect.remote_bda, param->disconnect.remote_bda, sizeof(esp_bd_addr_t));
             if (hidd_le_env.hidd_cb != NULL) {
-                (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_DISCONNECT, NULL);
+                (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_DISCONNECT, &cb_param);
             }
             hidd_clcb_dealloc(param->disconnect.conn_id);
             break;
@@ -99,6 +126,30 @@ static void __attribute__((section(".iram1.text"))) esp_hidd_prf_cb_hdl(esp_gatt
                 cb_param.led_write.length = param->write.len;
                 cb_param.led_write.data = param->write.value;
                 (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_LED_REPORT_WRITE_EVT, &cb_param);
+            } else if (param->write.handle == hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_VENDOR_OUT_VAL]) {
+                cb_param.vendor_write.conn_id = param->write.conn_id;
+                cb_param.vendor_write.report_id = HID_RPT_ID_VENDOR;
+                cb_param.vendor_write.length = param->write.len;
+                cb_param.vendor_write.data = param->write.value;
+                (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_VENDOR_REPORT_WRITE_EVT, &cb_param);
+            } else if (param->write.handle == hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_MOUSE_FEATURE_VAL]) {
+                cb_param.feature_write.conn_id = param->write.conn_id;
+                cb_param.feature_write.report_id = HID_RPT_ID_MOUSE_IN;
+                cb_param.feature_write.length = param->write.len;
+                cb_param.feature_write.data = param->write.value;
+                (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_FEATURE_REPORT_WRITE_EVT, &cb_param);
+            } else if (param->write.handle == hidd_le_env.bas_ccc_hdl && hidd_le_env.bas_ccc_hdl != 0 &&
+                       param->write.len == 2) {
+                bas_ccc_store(param->write.conn_id, (param->write.value[0] & 0x01) != 0);
+            }
+            break;
+        }
+        case ESP_GATTS_MTU_EVT: {
+            esp_hidd_cb_param_t cb_param = {0};
+            cb_param.mtu.conn_id = param->mtu.conn_id;
+            cb_param.mtu.mtu = param->mtu.mtu;
+            if (hidd_le_env.hidd_cb != NULL) {
+                (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_MTU, &cb_param);
             }
             break;
         }
@@ -106,18 +157,46 @@ static void __attribute__((section(".iram1.text"))) esp_hidd_prf_cb_hdl(esp_gatt
             if (param->add_attr_tab.num_handle == BAS_IDX_NB &&
                 param->add_attr_tab.svc_uuid.uuid.uuid16 == ESP_GATT_UUID_BATTERY_SERVICE_SVC &&
                 param->add_attr_tab.status == ESP_GATT_OK) {
-                incl_svc.start_hdl = param->add_attr_tab.handles[BAS_IDX_SVC];
-                incl_svc.end_hdl = incl_svc.start_hdl + BAS_IDX_NB - 1;
-                ESP_LOGI(HID_LE_PRF_TAG, "%s(), start added the hid service to the stack database. incl_handle = %d",
-                         __func__, incl_svc.start_hdl);
-                esp_ble_gatts_create_attr_tab(hidd_le_gatt_db, gatts_if, HIDD_LE_IDX_NB, 0);
+                const uint16_t start_hdl = param->add_attr_tab.handles[BAS_IDX_SVC];
+                if (s_hid_created_early && start_hdl != s_bas_start_hdl) {
+                    // The HID table is already on its way with the old include, it gets recreated
+                    ESP_LOGW(HID_LE_PRF_TAG, "Battery service moved from %d to %d", s_bas_start_hdl, start_hdl);
+                    s_hid_stale = true;
+                }
+                s_bas_start_hdl = start_hdl;
+                hidd_le_env.bas_lvl_hdl = param->add_attr_tab.handles[BAS_IDX_BATT_LVL_VAL];
+                hidd_le_env.bas_ccc_hdl = param->add_attr_tab.handles[BAS_IDX_BATT_LVL_NTF_CFG];
+                if (!s_hid_created_early) {
+                    incl_svc.start_hdl = start_hdl;
+                    incl_svc.end_hdl = start_hdl + BAS_IDX_NB - 1;
+                    ESP_LOGI(HID_LE_PRF_TAG, "%s(), start added the hid service to the stack database. incl_handle = %d",
+                             __func__, incl_svc.start_hdl);
+                    esp_ble_gatts_create_attr_tab(hidd_le_gatt_db, gatts_if, HIDD_LE_IDX_NB, 0);
+                }
             }
             if (param->add_attr_tab.num_handle == HIDD_LE_IDX_NB &&
                 param->add_attr_tab.status == ESP_GATT_OK) {
+                s_hid_created_early = false;
+                if (s_hid_stale) {
+                    s_hid_stale = false;
+                    incl_svc.start_hdl = s_bas_start_hdl;
+                    incl_svc.end_hdl = s_bas_start_hdl + BAS_IDX_NB - 1;
+                    esp_ble_gatts_delete_service(param->add_attr_tab.handles[HIDD_LE_IDX_SVC]);
+                    esp_ble_gatts_create_attr_tab(hidd_le_gatt_db, gatts_if, HIDD_LE_IDX_NB, 0);
+                    break;
+                }
+
                 memcpy(hidd_le_env.hidd_inst.att_tbl, param->add_attr_tab.handles,
                        HIDD_LE_IDX_NB * sizeof(uint16_t));
                 ESP_LOGI(HID_LE_PRF_TAG, "hid svc handle = %x", hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_SVC]);
-                hid_add_id_tbl();
+                if (memcmp(s_hid_handles, param->add_attr_tab.handles, sizeof(s_hid_handles)) != 0) {
+                    if (s_hid_handles[HIDD_LE_IDX_SVC] != 0) {
+                        ESP_LOGW(HID_LE_PRF_TAG, "HID service handles changed, hosts caching the database re-pair");
+                    }
+                    memcpy(s_hid_handles, param->add_attr_tab.handles, sizeof(s_hid_handles));
+                    hid_add_id_tbl();
+                }
+                hid_dev_register_reports(HID_NUM_REPORTS, hid_rpt_map);
                 esp_ble_gatts_start_service(hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_SVC]);
             } else {
                 esp_ble_gatts_start_service(param->add_attr_tab.handles[0]);
@@ -129,8 +208,132 @@ static void __attribute__((section(".iram1.text"))) esp_hidd_prf_cb_hdl(esp_gatt
     }
 }
 
+static const uint8_t *clcb_bda(const uint16_t conn_id) {
+    for (int i = 0; i < HID_MAX_APPS; i++) {
+        if (hidd_le_env.hidd_clcb[i].in_use && hidd_le_env.hidd_clcb[i].conn_id == conn_id) {
+            return hidd_le_env.hidd_clcb[i].remote_bda;
+        }
+    }
+    return NULL;
+}
+
+static bas_ccc_t *bas_ccc_find(const uint8_t *bda) {
+    for (int i = 0; i < s_bas_ccc_count; i++) {
+        if (memcmp(s_bas_ccc[i].bda, bda, sizeof(esp_bd_addr_t)) == 0) {
+            return &s_bas_ccc[i];
+        }
+    }
+    return NULL;
+}
+
+static void bas_ccc_store(const uint16_t conn_id, const bool notify) {
+    const uint8_t *bda = clcb_bda(conn_id);
+    if (bda == NULL) {
+        return;
+    }
+    bas_ccc_t *entry = bas_ccc_find(bda);
+    if (entry == NULL) {
+        // Full: the oldest host gives up its entry
+        if (s_bas_ccc_count == CONFIG_BT_SMP_MAX_BONDS) {
+            memmove(&s_bas_ccc[0], &s_bas_ccc[1], sizeof(bas_ccc_t) * (CONFIG_BT_SMP_MAX_BONDS - 1));
+            s_bas_ccc_count--;
+        }
+        entry = &s_bas_ccc[s_bas_ccc_count++];
+        memcpy(entry->bda, bda, sizeof(esp_bd_addr_t));
+    }
+    entry->notify = notify;
+}
+
+bool hidd_le_battery_notify_enabled(const uint16_t conn_id) {
+    const uint8_t *bda = clcb_bda(conn_id);
+    const bas_ccc_t *entry = bda != NULL ? bas_ccc_find(bda) : NULL;
+    return entry != NULL && entry->notify;
+}
+
+static void layout_store(void) {
+    nvs_handle_t nvs_handle;
+    if (nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_u8(nvs_handle, GATT_LAYOUT_KEY, HID_GATT_LAYOUT_VERSION) == ESP_OK) {
+        nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+}
+
+// Once per boot, the bond list is only available with the stack up
+static void layout_check(void) {
+    if (s_layout_checked) {
+        return;
+    }
+    s_layout_checked = true;
+
+    uint8_t version = 0;
+    nvs_handle_t nvs_handle;
+    if (nvs_open(STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle) == ESP_OK) {
+        nvs_get_u8(nvs_handle, GATT_LAYOUT_KEY, &version);
+        nvs_close(nvs_handle);
+    }
+    if (version == HID_GATT_LAYOUT_VERSION) {
+        return;
+    }
+    if (esp_ble_get_bond_device_num() <= 0) {
+        layout_store();
+        return;
+    }
+    ESP_LOGW(HID_LE_PRF_TAG, "GATT layout changed (%d -> %d), bonded hosts are told to rediscover", version,
+             HID_GATT_LAYOUT_VERSION);
+    s_layout_stale = true;
+}
+
+void hidd_le_host_authenticated(esp_bd_addr_t bda) {
+    if (!s_layout_stale) {
+        return;
+    }
+    for (int i = 0; i < s_layout_told_count; i++) {
+        if (memcmp(s_layout_told[i], bda, sizeof(esp_bd_addr_t)) == 0) {
+            return;
+        }
+    }
+
+    if (esp_ble_gatts_send_service_change_indication(hidd_le_env.gatt_if, bda) != ESP_OK) {
+        ESP_LOGW(HID_LE_PRF_TAG, "Failed to send Service Changed");
+        return;
+    }
+    if (s_layout_told_count < CONFIG_BT_SMP_MAX_BONDS) {
+        memcpy(s_layout_told[s_layout_told_count++], bda, sizeof(esp_bd_addr_t));
+    }
+
+    // Stored once every bonded host has been told
+    static esp_ble_bond_dev_t bonds[CONFIG_BT_SMP_MAX_BONDS];
+    int num_bonds = CONFIG_BT_SMP_MAX_BONDS;
+    if (esp_ble_get_bond_device_list(&num_bonds, bonds) != ESP_OK) {
+        return;
+    }
+    for (int i = 0; i < num_bonds; i++) {
+        bool told = false;
+        for (int j = 0; j < s_layout_told_count && !told; j++) {
+            told = memcmp(s_layout_told[j], bonds[i].bd_addr, sizeof(esp_bd_addr_t)) == 0;
+        }
+        if (!told) {
+            return;
+        }
+    }
+    ESP_LOGI(HID_LE_PRF_TAG, "All bonded hosts told about the GATT layout");
+    layout_store();
+    s_layout_stale = false;
+}
+
 void hidd_le_create_service(const esp_gatt_if_t gatts_if) {
+    layout_check();
     esp_ble_gatts_create_attr_tab(bas_att_db, gatts_if, BAS_IDX_NB, 0);
+    s_hid_stale = false;
+    s_hid_created_early = s_bas_start_hdl != 0;
+    if (s_hid_created_early) {
+        incl_svc.start_hdl = s_bas_start_hdl;
+        incl_svc.end_hdl = s_bas_start_hdl + BAS_IDX_NB - 1;
+        esp_ble_gatts_create_attr_tab(hidd_le_gatt_db, gatts_if, HIDD_LE_IDX_NB, 0);
+    }
 }
 
 void __attribute__((section(".iram1.text"))) hidd_clcb_alloc(const uint16_t conn_id, esp_bd_addr_t bda) {
@@ -152,8 +355,11 @@ bool __attribute__((section(".iram1.text"))) hidd_clcb_dealloc(uint16_t conn_id)
     uint8_t i_clcb = 0;
     hidd_clcb_t *p_clcb = NULL;
     for (i_clcb = 0, p_clcb = hidd_le_env.hidd_clcb; i_clcb < HID_MAX_APPS; i_clcb++, p_clcb++) {
-        memset(p_clcb, 0, sizeof(hidd_clcb_t));
-        return true;
+        // Other hosts stay connected, only the slot of this connection is freed
+        if (p_clcb->in_use && p_clcb->conn_id == conn_id) {
+            memset(p_clcb, 0, sizeof(hidd_clcb_t));
+            return true;
+        }
     }
     return false;
 }
@@ -212,35 +418,10 @@ void hidd_get_attr_value(const uint16_t handle, uint16_t *length, uint8_t **valu
     }
 }
 
-static void __attribute__((section(".iram1.text"))) hid_add_id_tbl(void) {
-    // Mouse input report
-    hid_rpt_map[0].id = hidReportRefMouseIn[0];
-    hid_rpt_map[0].type = hidReportRefMouseIn[1];
-    hid_rpt_map[0].handle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_MOUSE_IN_VAL];
-    hid_rpt_map[0].cccdHandle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_MOUSE_IN_CCC];
-    hid_rpt_map[0].mode = HID_PROTOCOL_MODE_REPORT;
-
-    // System Control input report
-    hid_rpt_map[1].id = hidReportRefSysCtrlIn[0];
-    hid_rpt_map[1].type = hidReportRefSysCtrlIn[1];
-    hid_rpt_map[1].handle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_SYS_CTRL_IN_VAL];
-    hid_rpt_map[1].cccdHandle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_SYS_CTRL_IN_CCC];
-    hid_rpt_map[1].mode = HID_PROTOCOL_MODE_REPORT;
-
-    // Consumer Control input report
-    hid_rpt_map[2].id = hidReportRefConsumerIn[0];
-    hid_rpt_map[2].type = hidReportRefConsumerIn[1];
-    hid_rpt_map[2].handle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_CONSUMER_IN_VAL];
-    hid_rpt_map[2].cccdHandle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_CONSUMER_IN_CCC];
-    hid_rpt_map[2].mode = HID_PROTOCOL_MODE_REPORT;
-
-    // Key input report
-    hid_rpt_map[3].id = hidReportRefKeyIn[0];
-    hid_rpt_map[3].type = hidReportRefKeyIn[1];
-    hid_rpt_map[3].handle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_KEY_IN_VAL];
-    hid_rpt_map[3].cccdHandle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_KEY_IN_CCC];
-    hid_rpt_map[3].mode = HID_PROTOCOL_MODE_REPORT;
-
-    // Setup report ID map
-    hid_dev_register_reports(4, hid_rpt_map);
+// Fills the handles of the report slots, IDs and types are set in hid_rpt_map already
+static void hid_add_id_tbl(void) {
+    for (int i = 0; i < HID_NUM_REPORTS; i++) {
+        hid_rpt_map[i].handle = hidd_le_env.hidd_inst.att_tbl[hid_rpt_att_idx[i][0]];
+        hid_rpt_map[i].cccdHandle = hidd_le_env.hidd_inst.att_tbl[hid_rpt_att_idx[i][1]];
+    }
 }
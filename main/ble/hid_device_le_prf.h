@@ -9,19 +9,32 @@
 #define SUPPORT_REPORT_VENDOR                 false
 #define HID_LE_PRF_TAG                        "HID_LE_PRF"
 #define HIDD_LE_NB_HIDS_INST_MAX              (1)
-#define HID_NUM_REPORTS                       4
 
 #define HIDD_GREAT_VER   0x01  //Version + Subversion
 #define HIDD_SUB_VER     0x00  //Version + Subversion
 #define HIDD_VERSION     ((HIDD_GREAT_VER<<8)|HIDD_SUB_VER)  //Version + Subversion
 
-#define HID_MAX_APPS             1
+#define HID_MAX_APPS             3 // concurrently connected centrals
 #define HID_RPT_ID_MOUSE_IN      1   // Mouse input report ID
 #define HID_RPT_ID_KEY_IN        6   // Keyboard input report ID
+#define HID_RPT_ID_NKRO_IN       7   // NKRO keyboard input report ID
 #define HID_RPT_ID_CC_IN         4   // Consumer Control input report ID
 #define HID_RPT_ID_SYS_IN        3   // System Control input report ID
+#define HID_RPT_ID_VENDOR        8   // Packed motion input and its enable output report ID
 #define HID_RPT_ID_LED_OUT       2  // ToDo: LED output report ID
 #define HID_RPT_ID_FEATURE       0  // ToDo: Feature report ID
+#define HID_RPT_ID_MAX           HID_RPT_ID_VENDOR
+
+// Input reports in hid_rpt_map order, hid_dev finds a report's slot from its ID with one load
+enum {
+    HID_RPT_SLOT_MOUSE,
+    HID_RPT_SLOT_SYS_CTRL,
+    HID_RPT_SLOT_CONSUMER,
+    HID_RPT_SLOT_KEY,
+    HID_RPT_SLOT_NKRO,
+    HID_RPT_SLOT_VENDOR,
+    HID_NUM_REPORTS,
+};
 
 #define HIDD_APP_ID		     0x1812 // ATT_SVC_HID
 #define BATTERY_APP_ID       0x180f
@@ -33,7 +46,7 @@
 /// Maximal length of Report Char. Value
 #define HIDD_LE_REPORT_MAX_LEN                (64)
 /// Maximal length of Report Map Char. Value
-#define HIDD_LE_REPORT_MAP_MAX_LEN            (255)
+#define HIDD_LE_REPORT_MAP_MAX_LEN            (512)
 
 /// Length of Boot Report Char. Value Maximal Length
 #define HIDD_LE_BOOT_REPORT_MAX_LEN           (8)
@@ -117,6 +130,11 @@ enum {
     HIDD_LE_IDX_REPORT_MOUSE_IN_CCC,
     HIDD_LE_IDX_REPORT_MOUSE_REP_REF,
 
+    // Mouse Resolution Multiplier feature
+    HIDD_LE_IDX_REPORT_MOUSE_FEATURE_CHAR,
+    HIDD_LE_IDX_REPORT_MOUSE_FEATURE_VAL,
+    HIDD_LE_IDX_REPORT_MOUSE_FEATURE_REP_REF,
+
     // System Control input
     HIDD_LE_IDX_REPORT_SYS_CTRL_IN_CHAR,
     HIDD_LE_IDX_REPORT_SYS_CTRL_IN_VAL,
@@ -135,6 +153,23 @@ enum {
     HIDD_LE_IDX_REPORT_KEY_IN_CCC,
     HIDD_LE_IDX_REPORT_KEY_IN_REP_REF,
 
+    // Report NKRO key input
+    HIDD_LE_IDX_REPORT_NKRO_IN_CHAR,
+    HIDD_LE_IDX_REPORT_NKRO_IN_VAL,
+    HIDD_LE_IDX_REPORT_NKRO_IN_CCC,
+    HIDD_LE_IDX_REPORT_NKRO_IN_REP_REF,
+
+    // Packed motion vendor input
+    HIDD_LE_IDX_REPORT_VENDOR_IN_CHAR,
+    HIDD_LE_IDX_REPORT_VENDOR_IN_VAL,
+    HIDD_LE_IDX_REPORT_VENDOR_IN_CCC,
+    HIDD_LE_IDX_REPORT_VENDOR_IN_REP_REF,
+
+    // Packed motion enable, vendor output
+    HIDD_LE_IDX_REPORT_VENDOR_OUT_CHAR,
+    HIDD_LE_IDX_REPORT_VENDOR_OUT_VAL,
+    HIDD_LE_IDX_REPORT_VENDOR_OUT_REP_REF,
+
     // Report Led output
     HIDD_LE_IDX_REPORT_LED_OUT_CHAR,
     HIDD_LE_IDX_REPORT_LED_OUT_VAL,
@@ -300,6 +335,8 @@ typedef struct {
     hidd_inst_t hidd_inst;
     esp_hidd_event_cb_t hidd_cb;
     uint8_t inst_id;
+    uint16_t bas_lvl_hdl;                /* battery level value, 0 until the battery table exists */
+    uint16_t bas_ccc_hdl;                /* battery level client configuration */
 } hidd_le_env_t;
 
 extern hidd_le_env_t hidd_le_env;
@@ -311,6 +348,19 @@ bool hidd_clcb_dealloc(uint16_t conn_id);
 
 void hidd_le_create_service(esp_gatt_if_t gatts_if);
 
+/**
+ * @brief Send Service Changed to a bonded host that hasn't rediscovered since the GATT layout changed
+ * @param bda Address of the host that just completed authentication
+ */
+void hidd_le_host_authenticated(esp_bd_addr_t bda);
+
+/**
+ * @brief Check if a host enabled battery level notifications in the Battery Level CCC
+ * @param conn_id Connection of the host
+ * @return true if notifications are enabled
+ */
+bool hidd_le_battery_notify_enabled(uint16_t conn_id);
+
 void hidd_set_attr_value(uint16_t handle, uint16_t val_len, const uint8_t *value);
 
 void hidd_get_attr_value(uint16_t handle, uint16_t *length, uint8_t **value);
@@ -19,17 +19,41 @@ struct prf_char_pres_fmt {
     uint8_t name_space;
 };
 
-// HID report mapping table
-hid_report_map_t hid_rpt_map[HID_NUM_REPORTS];
+// HID report mapping table. IDs and types are fixed, the handles are filled in when the stack creates the
+// attribute table and stay valid across stack restarts as long as it assigns the same ones.
+hid_report_map_t hid_rpt_map[HID_NUM_REPORTS] = {
+    [HID_RPT_SLOT_MOUSE] = {.id = HID_RPT_ID_MOUSE_IN, .type = HID_REPORT_TYPE_INPUT, .mode = HID_PROTOCOL_MODE_REPORT},
+    [HID_RPT_SLOT_SYS_CTRL] = {.id = HID_RPT_ID_SYS_IN, .type = HID_REPORT_TYPE_INPUT, .mode = HID_PROTOCOL_MODE_REPORT},
+    [HID_RPT_SLOT_CONSUMER] = {.id = HID_RPT_ID_CC_IN, .type = HID_REPORT_TYPE_INPUT, .mode = HID_PROTOCOL_MODE_REPORT},
+    [HID_RPT_SLOT_KEY] = {.id = HID_RPT_ID_KEY_IN, .type = HID_REPORT_TYPE_INPUT, .mode = HID_PROTOCOL_MODE_REPORT},
+    [HID_RPT_SLOT_NKRO] = {.id = HID_RPT_ID_NKRO_IN, .type = HID_REPORT_TYPE_INPUT, .mode = HID_PROTOCOL_MODE_REPORT},
+    [HID_RPT_SLOT_VENDOR] = {.id = HID_RPT_ID_VENDOR, .type = HID_REPORT_TYPE_INPUT, .mode = HID_PROTOCOL_MODE_REPORT},
+};
+
+// Value and CCC attribute of each report slot in hidd_le_gatt_db
+const uint8_t hid_rpt_att_idx[HID_NUM_REPORTS][2] = {
+    [HID_RPT_SLOT_MOUSE] = {HIDD_LE_IDX_REPORT_MOUSE_IN_VAL, HIDD_LE_IDX_REPORT_MOUSE_IN_CCC},
+    [HID_RPT_SLOT_SYS_CTRL] = {HIDD_LE_IDX_REPORT_SYS_CTRL_IN_VAL, HIDD_LE_IDX_REPORT_SYS_CTRL_IN_CCC},
+    [HID_RPT_SLOT_CONSUMER] = {HIDD_LE_IDX_REPORT_CONSUMER_IN_VAL, HIDD_LE_IDX_REPORT_CONSUMER_IN_CCC},
+    [HID_RPT_SLOT_KEY] = {HIDD_LE_IDX_REPORT_KEY_IN_VAL, HIDD_LE_IDX_REPORT_KEY_IN_CCC},
+    [HID_RPT_SLOT_NKRO] = {HIDD_LE_IDX_REPORT_NKRO_IN_VAL, HIDD_LE_IDX_REPORT_NKRO_IN_CCC},
+    [HID_RPT_SLOT_VENDOR] = {HIDD_LE_IDX_REPORT_VENDOR_IN_VAL, HIDD_LE_IDX_REPORT_VENDOR_IN_CCC},
+};
 
 // Report reference definitions
 uint8_t hidReportRefMouseIn[HID_REPORT_REF_LEN] = {HID_RPT_ID_MOUSE_IN, HID_REPORT_TYPE_INPUT};
+uint8_t hidReportRefMouseFeature[HID_REPORT_REF_LEN] = {HID_RPT_ID_MOUSE_IN, HID_REPORT_TYPE_FEATURE};
 uint8_t hidReportRefSysCtrlIn[HID_REPORT_REF_LEN] = {HID_RPT_ID_SYS_IN, HID_REPORT_TYPE_INPUT};
 uint8_t hidReportRefConsumerIn[HID_REPORT_REF_LEN] = {HID_RPT_ID_CC_IN, HID_REPORT_TYPE_INPUT};
 uint8_t hidReportRefKeyIn[HID_REPORT_REF_LEN] = {HID_RPT_ID_KEY_IN, HID_REPORT_TYPE_INPUT};
+uint8_t hidReportRefNkroIn[HID_REPORT_REF_LEN] = {HID_RPT_ID_NKRO_IN, HID_REPORT_TYPE_INPUT};
+uint8_t hidReportRefVendorIn[HID_REPORT_REF_LEN] = {HID_RPT_ID_VENDOR, HID_REPORT_TYPE_INPUT};
+uint8_t hidReportRefVendorOut[HID_REPORT_REF_LEN] = {HID_RPT_ID_VENDOR, HID_REPORT_TYPE_OUTPUT};
 uint8_t hidReportRefFeature[HID_REPORT_REF_LEN] = {HID_RPT_ID_FEATURE, HID_REPORT_TYPE_FEATURE};
 
 static const uint16_t hid_ccc_default = 0x0100;
+// Both multipliers off, HID_RES_MULT_WHEEL/HID_RES_MULT_PAN
+static uint8_t hid_res_mult_default = 0;
 
 // HID Report Map characteristic value
 const uint8_t hidReportMap[] __attribute__((section(".rodata"))) = {
@@ -49,26 +73,50 @@ const uint8_t hidReportMap[] __attribute__((section(".rodata"))) = {
     0x16, 0x00, 0x80, // Logical Minimum (-32768)
     0x26, 0xFF, 0x7F, // Logical Maximum (32767)
     0x81, 0x06, // Input (Data, Variable, Relative)
-    // Vertical Wheel
-    0x09, 0x38, // Usage (Wheel)
-    0x95, 0x01, // Report Count (1)
-    0x75, 0x08, // Report Size (8)
-    0x15, 0x81, // Logical Minimum (-127)
-    0x25, 0x7F, // Logical Maximum (127)
-    0x81, 0x06, // Input (Data, Variable, Relative)
-    // Horizontal Wheel
-    0x05, 0x0C, // Usage Page (Consumer)
-    0x0A, 0x38, 0x02, // Usage (AC Pan)
-    0x95, 0x01, // Report Count (1)
-    0x75, 0x08, // Report Size (8)
-    0x15, 0x81, // Logical Minimum (-127)
-    0x25, 0x7F, // Logical Maximum (127)
-    0x81, 0x06, // Input (Data, Variable, Relative)
+    // Vertical Wheel, whole detents until the host sets its Resolution Multiplier (feature bits 0-1)
+    0xA1, 0x02, // Collection (Logical)
+    0x09, 0x48, //  Usage (Resolution Multiplier)
+    0x95, 0x01, //  Report Count (1)
+    0x75, 0x02, //  Report Size (2)
+    0x15, 0x00, //  Logical Minimum (0)
+    0x25, 0x01, //  Logical Maximum (1)
+    0x35, 0x01, //  Physical Minimum (1)
+    0x45, HID_WHEEL_RESOLUTION, //  Physical Maximum (120)
+    0xB1, 0x02, //  Feature (Data, Variable, Absolute)
+    0x35, 0x00, //  Physical Minimum (0)
+    0x45, 0x00, //  Physical Maximum (0)
+    0x09, 0x38, //  Usage (Wheel)
+    0x75, 0x10, //  Report Size (16)
+    0x16, 0x01, 0x80, //  Logical Minimum (-32767)
+    0x26, 0xFF, 0x7F, //  Logical Maximum (32767)
+    0x81, 0x06, //  Input (Data, Variable, Relative)
+    0xC0, // End Collection
+    // Horizontal Wheel, feature bits 2-3
+    0xA1, 0x02, // Collection (Logical)
+    0x09, 0x48, //  Usage (Resolution Multiplier)
+    0x95, 0x01, //  Report Count (1)
+    0x75, 0x02, //  Report Size (2)
+    0x15, 0x00, //  Logical Minimum (0)
+    0x25, 0x01, //  Logical Maximum (1)
+    0x35, 0x01, //  Physical Minimum (1)
+    0x45, HID_WHEEL_RESOLUTION, //  Physical Maximum (120)
+    0xB1, 0x02, //  Feature (Data, Variable, Absolute)
+    0x35, 0x00, //  Physical Minimum (0)
+    0x45, 0x00, //  Physical Maximum (0)
+    0x05, 0x0C, //  Usage Page (Consumer)
+    0x0A, 0x38, 0x02, //  Usage (AC Pan)
+    0x75, 0x10, //  Report Size (16)
+    0x16, 0x01, 0x80, //  Logical Minimum (-32767)
+    0x26, 0xFF, 0x7F, //  Logical Maximum (32767)
+    0x81, 0x06, //  Input (Data, Variable, Relative)
+    0xC0, // End Collection
+    0x75, 0x04, // Report Size (4)
+    0xB1, 0x03, // Feature (Constant) - pads the feature report to a byte
     // Buttons
     0x05, 0x09, // Usage Page (Buttons)
     0x19, 0x01, // Usage Minimum (01) - Button 1
-    0x29, 0x08, // Usage Maximum (08) - Button 8
-    0x95, 0x08, // Report Count (8)
+    0x29, 0x10, // Usage Maximum (16) - Button 16
+    0x95, 0x10, // Report Count (16)
     0x75, 0x01, // Report Size (1)
     0x15, 0x00, // Logical Minimum (0)
     0x25, 0x01, // Logical Maximum (1)
@@ -129,9 +177,47 @@ const uint8_t hidReportMap[] __attribute__((section(".rodata"))) = {
     0x75, 0x08, //  Report Size (8)
     0x81, 0x01, //  Input (Cnst,Arr,Abs)
     0xc0, // End Collection
+
+    // NKRO keyboard, only used while more than 6 keys are down. The bitmap stops at 0x97 (Keyboard LANG8)
+    // so the whole report fits a 20 byte notification at the default MTU.
+    0x05, 0x01, // Usage Page (Generic Desktop)
+    0x09, 0x06, // Usage (Keyboard)
+    0xa1, 0x01, // Collection (Application)
+    0x85, 0x07, //  Report ID (7)
+    0x05, 0x07, //  Usage Page (Keyboard)
+    0x19, 0xe0, //  Usage Minimum (224)
+    0x29, 0xe7, //  Usage Maximum (231)
+    0x15, 0x00, //  Logical Minimum (0)
+    0x25, 0x01, //  Logical Maximum (1)
+    0x95, 0x08, //  Report Count (8)
+    0x75, 0x01, //  Report Size (1)
+    0x81, 0x02, //  Input (Data,Var,Abs)
+    0x19, 0x00, //  Usage Minimum (0)
+    0x29, 0x97, //  Usage Maximum (151)
+    0x95, 0x98, //  Report Count (152)
+    0x81, 0x02, //  Input (Data,Var,Abs)
+    0xc0, // End Collection
+
+    // Packed motion, opaque to stock hosts and only sent once a receiver enables it, see HID_PACKED_ENABLE
+    0x06, 0x00, 0xff, // Usage Page (Vendor Defined 0xFF00)
+    0x09, 0x01, // Usage (0x01)
+    0xa1, 0x01, // Collection (Application)
+    0x85, HID_RPT_ID_VENDOR, //  Report ID (8)
+    0x15, 0x00, //  Logical Minimum (0)
+    0x26, 0xff, 0x00, //  Logical Maximum (255)
+    0x75, 0x08, //  Report Size (8)
+    0x95, HID_PACKED_RPT_LEN, //  Report Count (133)
+    0x09, 0x02, //  Usage (0x02)
+    0x81, 0x02, //  Input (Data,Var,Abs)
+    0x95, 0x01, //  Report Count (1)
+    0x09, 0x03, //  Usage (0x03)
+    0x91, 0x02, //  Output (Data,Var,Abs)
+    0xc0, // End Collection
 };
 
-uint8_t hidReportMapLen = sizeof(hidReportMap);
+_Static_assert(sizeof(hidReportMap) <= HIDD_LE_REPORT_MAP_MAX_LEN, "report map exceeds its characteristic");
+
+uint16_t hidReportMapLen = sizeof(hidReportMap);
 
 static const uint8_t hidInfo[HID_INFORMATION_LEN] = {
     LO_UINT16(0x0111), HI_UINT16(0x0111), // bcdHID (USB HID version)
@@ -142,7 +228,7 @@ static const uint8_t hidInfo[HID_INFORMATION_LEN] = {
 static uint16_t hidExtReportRefDesc = ESP_GATT_UUID_BATTERY_LEVEL;
 static uint16_t hid_le_svc = ATT_SVC_HID;
 static const uint8_t bat_lev_ccc[2] = {0x00, 0x00};
-static uint8_t battery_lev = 95;
+uint8_t hid_battery_level = 100;
 
 static const uint16_t primary_service_uuid = ESP_GATT_UUID_PRI_SERVICE;
 static const uint16_t include_service_uuid = ESP_GATT_UUID_INCLUDE_SERVICE;
@@ -187,7 +273,7 @@ const esp_gatts_attr_db_t bas_att_db[BAS_IDX_NB] __attribute__((section(".rodata
     [BAS_IDX_BATT_LVL_VAL] = {
         {ESP_GATT_AUTO_RSP}, {
             ESP_UUID_LEN_16, (uint8_t *) &bat_lev_uuid, ESP_GATT_PERM_READ,
-            sizeof(uint8_t), sizeof(uint8_t), &battery_lev
+            sizeof(uint8_t), sizeof(uint8_t), &hid_battery_level
         }
     },
 
@@ -209,7 +295,7 @@ const esp_gatts_attr_db_t bas_att_db[BAS_IDX_NB] __attribute__((section(".rodata
 };
 
 /// Full Hid device Database Description - Used to add attributes into the database
-esp_gatts_attr_db_t hidd_le_gatt_db[HIDD_LE_IDX_NB] =
+const esp_gatts_attr_db_t hidd_le_gatt_db[HIDD_LE_IDX_NB] __attribute__((section(".rodata"))) =
 {
     // HID Service Declaration
     [HIDD_LE_IDX_SVC] = {
@@ -341,6 +427,30 @@ esp_gatts_attr_db_t hidd_le_gatt_db[HIDD_LE_IDX_NB] =
             hidReportRefMouseIn
         }
     },
+    [HIDD_LE_IDX_REPORT_MOUSE_FEATURE_CHAR] = {
+        {ESP_GATT_AUTO_RSP}, {
+            ESP_UUID_LEN_16, (uint8_t *) &character_declaration_uuid,
+            ESP_GATT_PERM_READ,
+            CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE,
+            (uint8_t *) &char_prop_read_write
+        }
+    },
+    [HIDD_LE_IDX_REPORT_MOUSE_FEATURE_VAL] = {
+        {ESP_GATT_AUTO_RSP}, {
+            ESP_UUID_LEN_16, (uint8_t *) &hid_report_uuid,
+            ESP_GATT_PERM_READ_ENCRYPTED | ESP_GATT_PERM_WRITE_ENCRYPTED,
+            sizeof(uint8_t), sizeof(hid_res_mult_default),
+            &hid_res_mult_default
+        }
+    },
+    [HIDD_LE_IDX_REPORT_MOUSE_FEATURE_REP_REF] = {
+        {ESP_GATT_AUTO_RSP}, {
+            ESP_UUID_LEN_16, (uint8_t *) &hid_report_ref_descr_uuid,
+            ESP_GATT_PERM_READ,
+            sizeof(hidReportRefMouseFeature), sizeof(hidReportRefMouseFeature),
+            hidReportRefMouseFeature
+        }
+    },
     [HIDD_LE_IDX_REPORT_SYS_CTRL_IN_CHAR] = {
         {ESP_GATT_AUTO_RSP}, {
             ESP_UUID_LEN_16, (uint8_t *) &character_declaration_uuid,
@@ -437,6 +547,94 @@ esp_gatts_attr_db_t hidd_le_gatt_db[HIDD_LE_IDX_NB] =
             hidReportRefKeyIn
         }
     },
+    [HIDD_LE_IDX_REPORT_NKRO_IN_CHAR] = {
+        {ESP_GATT_AUTO_RSP}, {
+            ESP_UUID_LEN_16, (uint8_t *) &character_declaration_uuid,
+            ESP_GATT_PERM_READ,
+            CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE,
+            (uint8_t *) &char_prop_read_notify
+        }
+    },
+    [HIDD_LE_IDX_REPORT_NKRO_IN_VAL] = {
+        {ESP_GATT_AUTO_RSP}, {
+            ESP_UUID_LEN_16, (uint8_t *) &hid_report_uuid,
+            ESP_GATT_PERM_READ_ENCRYPTED,
+            HIDD_LE_REPORT_MAX_LEN, 0,
+            NULL
+        }
+    },
+    [HIDD_LE_IDX_REPORT_NKRO_IN_CCC] = {
+        {ESP_GATT_AUTO_RSP}, {
+            ESP_UUID_LEN_16, (uint8_t *) &character_client_config_uuid,
+            (ESP_GATT_PERM_READ_ENCRYPTED | ESP_GATT_PERM_WRITE_ENCRYPTED),
+            sizeof(uint16_t), sizeof(uint16_t),
+            (uint8_t *) &hid_ccc_default
+        }
+    },
+    [HIDD_LE_IDX_REPORT_NKRO_IN_REP_REF] = {
+        {ESP_GATT_AUTO_RSP}, {
+            ESP_UUID_LEN_16, (uint8_t *) &hid_report_ref_descr_uuid,
+            ESP_GATT_PERM_READ,
+            sizeof(hidReportRefNkroIn), sizeof(hidReportRefNkroIn),
+            hidReportRefNkroIn
+        }
+    },
+    [HIDD_LE_IDX_REPORT_VENDOR_IN_CHAR] = {
+        {ESP_GATT_AUTO_RSP}, {
+            ESP_UUID_LEN_16, (uint8_t *) &character_declaration_uuid,
+            ESP_GATT_PERM_READ,
+            CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE,
+            (uint8_t *) &char_prop_read_notify
+        }
+    },
+    [HIDD_LE_IDX_REPORT_VENDOR_IN_VAL] = {
+        {ESP_GATT_AUTO_RSP}, {
+            ESP_UUID_LEN_16, (uint8_t *) &hid_report_uuid,
+            ESP_GATT_PERM_READ_ENCRYPTED,
+            HID_PACKED_RPT_LEN, 0,
+            NULL
+        }
+    },
+    [HIDD_LE_IDX_REPORT_VENDOR_IN_CCC] = {
+        {ESP_GATT_AUTO_RSP}, {
+            ESP_UUID_LEN_16, (uint8_t *) &character_client_config_uuid,
+            (ESP_GATT_PERM_READ_ENCRYPTED | ESP_GATT_PERM_WRITE_ENCRYPTED),
+            sizeof(uint16_t), sizeof(uint16_t),
+            (uint8_t *) &hid_ccc_default
+        }
+    },
+    [HIDD_LE_IDX_REPORT_VENDOR_IN_REP_REF] = {
+        {ESP_GATT_AUTO_RSP}, {
+            ESP_UUID_LEN_16, (uint8_t *) &hid_report_ref_descr_uuid,
+            ESP_GATT_PERM_READ,
+            sizeof(hidReportRefVendorIn), sizeof(hidReportRefVendorIn),
+            hidReportRefVendorIn
+        }
+    },
+    [HIDD_LE_IDX_REPORT_VENDOR_OUT_CHAR] = {
+        {ESP_GATT_AUTO_RSP}, {
+            ESP_UUID_LEN_16, (uint8_t *) &character_declaration_uuid,
+            ESP_GATT_PERM_READ,
+            CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE,
+            (uint8_t *) &char_prop_read_write
+        }
+    },
+    [HIDD_LE_IDX_REPORT_VENDOR_OUT_VAL] = {
+        {ESP_GATT_AUTO_RSP}, {
+            ESP_UUID_LEN_16, (uint8_t *) &hid_report_uuid,
+            ESP_GATT_PERM_READ_ENCRYPTED | ESP_GATT_PERM_WRITE_ENCRYPTED,
+            HIDD_LE_REPORT_MAX_LEN, 0,
+            NULL
+        }
+    },
+    [HIDD_LE_IDX_REPORT_VENDOR_OUT_REP_REF] = {
+        {ESP_GATT_AUTO_RSP}, {
+            ESP_UUID_LEN_16, (uint8_t *) &hid_report_ref_descr_uuid,
+            ESP_GATT_PERM_READ,
+            sizeof(hidReportRefVendorOut), sizeof(hidReportRefVendorOut),
+            hidReportRefVendorOut
+        }
+    },
     [HIDD_LE_IDX_REPORT_LED_OUT_CHAR] = {
         {ESP_GATT_AUTO_RSP}, {
             ESP_UUID_LEN_16, (uint8_t *) &character_declaration_uuid,
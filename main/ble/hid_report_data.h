@@ -15,15 +15,22 @@ extern esp_gatts_incl_svc_desc_t incl_svc;
 
 // HID report mapping table
 extern hid_report_map_t hid_rpt_map[HID_NUM_REPORTS];
+extern const uint8_t hid_rpt_att_idx[HID_NUM_REPORTS][2];
 
 // HID Report Map characteristic value
 extern const uint8_t hidReportMap[];
-extern uint8_t hidReportMapLen;
+extern uint16_t hidReportMapLen;
 
 extern uint8_t hidReportRefMouseIn[HID_REPORT_REF_LEN];
+extern uint8_t hidReportRefMouseFeature[HID_REPORT_REF_LEN];
 extern uint8_t hidReportRefSysCtrlIn[HID_REPORT_REF_LEN];
 extern uint8_t hidReportRefConsumerIn[HID_REPORT_REF_LEN];
 extern uint8_t hidReportRefKeyIn[HID_REPORT_REF_LEN];
+extern uint8_t hidReportRefNkroIn[HID_REPORT_REF_LEN];
+extern uint8_t hidReportRefVendorIn[HID_REPORT_REF_LEN];
+extern uint8_t hidReportRefVendorOut[HID_REPORT_REF_LEN];
+// Battery level the table is created with, esp_hidd_set_battery_level() keeps it current
+extern uint8_t hid_battery_level;
 extern uint8_t hidReportRefFeature[HID_REPORT_REF_LEN];
 
 // Battery Service Attributes Indexes
@@ -40,4 +47,4 @@ enum {
 extern const esp_gatts_attr_db_t bas_att_db[BAS_IDX_NB];
 
 /// Full Hid device Database Description - Used to add attributes into the database
-extern esp_gatts_attr_db_t hidd_le_gatt_db[HIDD_LE_IDX_NB];
+extern const esp_gatts_attr_db_t hidd_le_gatt_db[HIDD_LE_IDX_NB];
@@ -0,0 +1,172 @@
+#include "reconnect.h"
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "connection.h"
+
+// High duty cycle directed advertising is limited to 1.28 s by the spec
+#define DIRECTED_ADV_DURATION_US   (1280 * 1000)
+#define FAST_ADV_DURATION_US       (30 * 1000 * 1000)
+#define BACKOFF_STEP_DURATION_US   (60 * 1000 * 1000)
+#define FAST_ADV_INTERVAL          0x20  // x 0.625ms
+#define MAX_ADV_INTERVAL           0x800 // 1.28 s
+
+static const char *TAG = "BLE_RECONNECT";
+
+static esp_timer_handle_t s_timer = NULL;
+static esp_ble_adv_params_t s_adv_params;
+// Changed from the GAP callback, the caller's task and the timer task
+static reconnect_state_t s_state = RECONNECT_IDLE;
+static uint16_t s_interval = FAST_ADV_INTERVAL;
+static portMUX_TYPE s_state_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static reconnect_state_t get_state(void) {
+    taskENTER_CRITICAL(&s_state_lock);
+    const reconnect_state_t state = s_state;
+    taskEXIT_CRITICAL(&s_state_lock);
+    return state;
+}
+
+// A reconnect_stop() that raced the start queued its stop before the start, so the start is undone
+static void confirm_started(void) {
+    if (get_state() == RECONNECT_IDLE) {
+        esp_ble_gap_stop_advertising();
+    }
+}
+
+static void start_undirected(const uint16_t interval) {
+    esp_ble_adv_params_t params = s_adv_params;
+    params.adv_type = ADV_TYPE_IND;
+    params.adv_int_min = interval;
+    params.adv_int_max = interval + interval / 2 > MAX_ADV_INTERVAL ? MAX_ADV_INTERVAL : interval + interval / 2;
+
+    esp_ble_gap_stop_advertising();
+    const esp_err_t ret = esp_ble_gap_start_advertising(&params);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start advertising: %s", esp_err_to_name(ret));
+    }
+}
+
+static void arm_timer(const uint64_t timeout_us) {
+    esp_timer_stop(s_timer);
+    esp_timer_start_once(s_timer, timeout_us);
+}
+
+static void enter_fast(void) {
+    taskENTER_CRITICAL(&s_state_lock);
+    s_state = RECONNECT_FAST;
+    s_interval = FAST_ADV_INTERVAL;
+    taskEXIT_CRITICAL(&s_state_lock);
+    start_undirected(FAST_ADV_INTERVAL);
+    arm_timer(FAST_ADV_DURATION_US);
+    confirm_started();
+}
+
+static void timer_callback(void *arg) {
+    taskENTER_CRITICAL(&s_state_lock);
+    const reconnect_state_t state = s_state;
+    if (state == RECONNECT_FAST || state == RECONNECT_BACKOFF) {
+        s_state = RECONNECT_BACKOFF;
+        s_interval = s_interval * 2 > MAX_ADV_INTERVAL ? MAX_ADV_INTERVAL : s_interval * 2;
+    }
+    const uint16_t interval = s_interval;
+    taskEXIT_CRITICAL(&s_state_lock);
+
+    switch (state) {
+        case RECONNECT_DIRECTED:
+            ESP_LOGI(TAG, "Directed advertising timed out, advertising to everyone");
+            enter_fast();
+            break;
+        case RECONNECT_FAST:
+        case RECONNECT_BACKOFF:
+            ESP_LOGI(TAG, "Advertising interval backed off to %d ms", interval * 625 / 1000);
+            start_undirected(interval);
+            if (interval < MAX_ADV_INTERVAL) {
+                arm_timer(BACKOFF_STEP_DURATION_US);
+            }
+            confirm_started();
+            break;
+        default:
+            break;
+    }
+}
+
+esp_err_t reconnect_init(const esp_ble_adv_params_t *adv_params) {
+    s_adv_params = *adv_params;
+    taskENTER_CRITICAL(&s_state_lock);
+    s_state = RECONNECT_IDLE;
+    taskEXIT_CRITICAL(&s_state_lock);
+
+    if (s_timer == NULL) {
+        const esp_timer_create_args_t timer_args = {
+            .callback = timer_callback,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "ble_reconnect",
+        };
+        const esp_err_t ret = esp_timer_create(&timer_args, &s_timer);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to create timer: %s", esp_err_to_name(ret));
+            return ret;
+        }
+    }
+
+    return ESP_OK;
+}
+
+void reconnect_start(const uint8_t *peer, const esp_ble_addr_type_t peer_type) {
+    if (s_timer == NULL) {
+        return;
+    }
+
+    esp_ble_adv_params_t params = s_adv_params;
+    if (peer != NULL) {
+        memcpy(params.peer_addr, peer, ESP_BD_ADDR_LEN);
+        params.peer_addr_type = peer_type;
+    } else if (get_saved_device(params.peer_addr, &params.peer_addr_type) != ESP_OK) {
+        enter_fast();
+        return;
+    }
+
+    ESP_LOGI(TAG, "Directed advertising to %02x:%02x:%02x:%02x:%02x:%02x",
+             params.peer_addr[0], params.peer_addr[1], params.peer_addr[2],
+             params.peer_addr[3], params.peer_addr[4], params.peer_addr[5]);
+
+    params.adv_type = ADV_TYPE_DIRECT_IND_HIGH;
+    taskENTER_CRITICAL(&s_state_lock);
+    s_state = RECONNECT_DIRECTED;
+    taskEXIT_CRITICAL(&s_state_lock);
+    esp_ble_gap_stop_advertising();
+    if (esp_ble_gap_start_advertising(&params) != ESP_OK) {
+        enter_fast();
+        return;
+    }
+    arm_timer(DIRECTED_ADV_DURATION_US);
+    confirm_started();
+}
+
+void reconnect_start_undirected(void) {
+    if (s_timer == NULL) {
+        return;
+    }
+
+    enter_fast();
+}
+
+void reconnect_stop(void) {
+    if (s_timer != NULL) {
+        esp_timer_stop(s_timer);
+    }
+
+    taskENTER_CRITICAL(&s_state_lock);
+    const reconnect_state_t previous = s_state;
+    s_state = RECONNECT_IDLE;
+    taskEXIT_CRITICAL(&s_state_lock);
+    if (previous != RECONNECT_IDLE) {
+        esp_ble_gap_stop_advertising();
+    }
+}
+
+reconnect_state_t reconnect_get_state(void) {
+    return get_state();
+}
@@ -0,0 +1,65 @@
+/**
+ * @file reconnect.h
+ * @brief Advertising state machine used to get hosts back after a disconnect
+ *
+ * Directed advertising to the lost (or last bonded) host first, then undirected
+ * advertising that starts fast and backs off exponentially. Everything runs from
+ * an esp_timer, nothing blocks the Bluedroid callback thread.
+ */
+
+#ifndef BLE_RECONNECT_H
+#define BLE_RECONNECT_H
+
+#include "esp_err.h"
+#include "esp_bt_defs.h"
+#include "esp_gap_ble_api.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    RECONNECT_IDLE,         // not advertising
+    RECONNECT_DIRECTED,     // high duty cycle directed advertising to one peer
+    RECONNECT_FAST,         // undirected, shortest interval
+    RECONNECT_BACKOFF,      // undirected, interval doubling up to the cap
+} reconnect_state_t;
+
+/**
+ * @brief Create the state machine timer
+ *
+ * @param adv_params Undirected advertising parameters, intervals are overridden per state
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t reconnect_init(const esp_ble_adv_params_t *adv_params);
+
+/**
+ * @brief Start advertising, directed to a peer first if one is known
+ *
+ * @param peer Peer to direct to, NULL to use the saved device from connection.c
+ * @param peer_type Address type of peer, ignored if peer is NULL
+ */
+void reconnect_start(const uint8_t *peer, esp_ble_addr_type_t peer_type);
+
+/**
+ * @brief Start undirected advertising at the fast interval, skipping directed advertising
+ */
+void reconnect_start_undirected(void);
+
+/**
+ * @brief Stop advertising and the timer
+ */
+void reconnect_stop(void);
+
+/**
+ * @brief Get the current state
+ *
+ * @return reconnect_state_t Current state
+ */
+reconnect_state_t reconnect_get_state(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BLE_RECONNECT_H */
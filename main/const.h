@@ -9,6 +9,50 @@
 #define FIRMWARE_VERSION "0.1.39"
 #define HARDWARE_VERSION "rev. 02"
 
+/*
+ * Core and priority layout. The report ring is the only hand-off between the cores:
+ *
+ *   core 1 (CORE_USB)  hid_host -> process_report() -> ring       USB producer, nothing else runs here
+ *   core 0 (CORE_BLE)  ring -> hid_bridge -> Bluedroid/controller  BLE consumer, plus background work
+ *
+ * Bluedroid and the controller are pinned to core 0 in sdkconfig (CONFIG_BT_*_PINNED_TO_CORE), Wi-Fi and lwIP
+ * as well. Background tasks (LEDs, web, monitoring, NVS) share core 0 below the bridge priority so they only
+ * get the time BLE leaves over, and never preempt the USB side.
+ */
+#define CORE_USB        1
+#define CORE_BLE        0
+#define CORE_BACKGROUND 0
+
+//                              core              priority
+#define TASK_HID_HOST_CORE      CORE_USB
+#define TASK_HID_HOST_PRIO                        16
+#define TASK_USB_EVENTS_CORE    CORE_USB
+#define TASK_USB_EVENTS_PRIO                      13
+#define TASK_DEV_EVT_CORE       CORE_USB
+#define TASK_DEV_EVT_PRIO                         6
+#define TASK_USB_INIT_CORE      CORE_USB
+#define TASK_USB_INIT_PRIO                        5
+#define TASK_HID_BRIDGE_CORE    CORE_BLE
+#define TASK_HID_BRIDGE_PRIO                      12
+#define TASK_ROTARY_CORE        CORE_BLE
+#define TASK_ROTARY_PRIO                          11
+#define TASK_WEB_CORE           CORE_BACKGROUND
+#define TASK_WEB_PRIO                             8
+#define TASK_OTA_WRITER_CORE    CORE_BACKGROUND
+#define TASK_OTA_WRITER_PRIO                      7
+#define TASK_LED_CORE           CORE_BACKGROUND
+#define TASK_LED_PRIO                             7
+#define TASK_TELEMETRY_CORE     CORE_BACKGROUND
+#define TASK_TELEMETRY_PRIO                       4
+#define TASK_STATS_CORE         CORE_BACKGROUND
+#define TASK_STATS_PRIO                           5
+#define TASK_MONITOR_CORE       CORE_BACKGROUND
+#define TASK_MONITOR_PRIO                         3
+#define TASK_DNS_CORE           CORE_BACKGROUND
+#define TASK_DNS_PRIO                             3
+#define TASK_NVS_WRITER_CORE    CORE_BACKGROUND
+#define TASK_NVS_WRITER_PRIO                      2
+
 #ifdef HW01
 #define GPIO_MUX_OE 34
 #define GPIO_MUX_SEL 33
@@ -44,6 +88,9 @@
 #define GPIO_BAT_CE GPIO_NUM_36
 #define GPIO_ADC_BAT GPIO_NUM_5
 #define GPIO_ADC_VIN GPIO_NUM_6
+// Resistor dividers in front of the ADC pins
+#define ADC_BAT_DIVIDER 2
+#define ADC_VIN_DIVIDER 2
 #define NUM_LEDS 17
 
 #endif
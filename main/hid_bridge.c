@@ -1,29 +1,32 @@
 #include "hid_bridge.h"
 
+#include <const.h>
 #include <esp_gap_ble_api.h>
 #include <string.h>
 #include "esp_log.h"
-#include "esp_sleep.h"
-#include "esp_pm.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/queue.h"
 #include "freertos/timers.h"
 #include "freertos/semphr.h"
 #include "usb/usb_hid_host.h"
+#include "usb/descriptor_parser.h"
+#include "hid_report_ring.h"
+#include "key_remap.h"
 #include "ble_hid_device.h"
 #include "web/wifi_manager.h"
 #include "utils/storage.h"
-
-// ToDo can't increase this because of usb_hid_host
-#define HID_QUEUE_SIZE 1
-#define HID_QUEUE_ITEM_SIZE sizeof(usb_hid_report_t)
+#include "utils/nvs_writer.h"
+#include "utils/power_manager.h"
+#include "utils/perf_counters.h"
+#include "utils/boot_profile.h"
+#include "utils/rotary_enc.h"
 
 static const char *TAG = "HID_BRIDGE";
-static StaticQueue_t s_hid_report_queue_struct;
-static uint8_t s_hid_report_queue_storage[HID_QUEUE_SIZE * HID_QUEUE_ITEM_SIZE];
-static QueueHandle_t s_hid_report_queue = NULL;
+static hid_report_ring_t s_hid_report_ring;
 static StaticTimer_t s_inactivity_timer_struct;
+static StaticTimer_t s_activity_timer_struct;
+static TimerHandle_t s_activity_timer = NULL;
 static StaticSemaphore_t s_ble_stack_mutex_struct;
 static TaskHandle_t s_hid_bridge_task_handle = NULL;
 static TimerHandle_t s_inactivity_timer = NULL;
@@ -33,13 +36,111 @@ static bool s_hid_bridge_running = false;
 static bool s_ble_stack_active = true;
 static uint16_t s_sensitivity = 100;
 
+// Sensitivity is applied in Q16.16, the fractional part is carried into the next report
+#define MOTION_FRAC_BITS 16
+static int32_t s_sensitivity_q16 = 1 << MOTION_FRAC_BITS;
+static int32_t s_carry_x = 0;
+static int32_t s_carry_y = 0;
+
+// Activity governor: the link is boosted on the first report and relaxed after ACTIVITY_IDLE_TIMEOUT_MS
+// without input. Reports only store a timestamp, the timer re-arms itself for the remaining time.
+#define ACTIVITY_IDLE_TIMEOUT_MS 2000
+static volatile int64_t s_last_activity_us = 0;
+static volatile ble_link_mode_t s_link_mode = BLE_LINK_ACTIVE;
+
+// Reports that arrive while a parked link is reconnecting are held here and replayed once the host is ready.
+// Motion is dropped, only button and key state changes are kept. Anything older than REPLAY_MAX_AGE_US is
+// discarded. The depth covers several seconds of typing, a full buffer only loses states in between.
+#define REPLAY_DEPTH 32
+#define REPLAY_MAX_AGE_US (5 * 1000 * 1000)
+typedef struct {
+    bool is_mouse;
+    union {
+        keyboard_report_t keyboard;
+        mouse_report_t mouse;
+    };
+} replay_entry_t;
+static replay_entry_t s_replay[REPLAY_DEPTH];
+static uint8_t s_replay_count = 0;
+static uint8_t s_replay_lost = 0;
+static bool s_resuming = false;
+static int64_t s_resume_started_us = 0;
+static volatile bool s_replay_ready = false;
+
+// Set by the settings subscription, applied by the bridge task between reports
+static volatile bool s_settings_dirty = false;
+
+// Macro steps are sent by the bridge task between reports, the timer only wakes it
+static esp_timer_handle_t s_macro_timer = NULL;
+static volatile bool s_macro_due = false;
+
+// What the dial sends, in hosts mode it stays with the rotary callback
+typedef enum {
+    DIAL_MODE_HOSTS = 0,
+    DIAL_MODE_VOLUME,
+    DIAL_MODE_SCROLL,
+} dial_mode_t;
+// Own rate estimate stream, USB streams are (device address << 8 | report ID) with addresses below 128
+#define DIAL_STREAM         0xFFFF
+// Volume goes out one step per connection event, the rest waits here. A pending sweep beyond
+// DIAL_MAX_PENDING steps covers the full range of any common host anyway.
+#define DIAL_MAX_PENDING    50
+#define DIAL_MIN_STEP_US    7500
+static dial_mode_t s_dial_mode = DIAL_MODE_HOSTS;
+static int32_t s_dial_volume = 0;
+static esp_timer_handle_t s_dial_timer = NULL;
+static volatile bool s_dial_due = false;
+
+// USB host install runs on its own core while BLE comes up, hid_bridge_init() joins it
+#define USB_INIT_TASK_STACK_SIZE 3072
+typedef struct {
+    TaskHandle_t waiter;
+    bool verbose;
+    esp_err_t err;
+} usb_init_job_t;
+
 static void hid_bridge_task(void *arg);
+static void replay_push(const keyboard_report_t *keyboard, const mouse_report_t *mouse);
+static void replay_flush(void);
+static void on_ble_ready(void);
+static void macro_timer_callback(void *arg);
+static void dial_timer_callback(void *arg);
 static void inactivity_timer_callback(TimerHandle_t xTimer);
+static void activity_timer_callback(TimerHandle_t xTimer);
 
 static int s_inactivity_timeout_ms = 30 * 1000;
+// Low battery shortens the timeout, picked up by the bridge task on its next wake
+static uint8_t s_sleep_scale = 100;
 static bool s_enable_sleep = true;
 static bool s_verbose = false;
 
+static void set_link_mode(const ble_link_mode_t mode) {
+    s_link_mode = mode;
+    ble_hid_device_set_link_mode(mode);
+}
+
+__attribute__((section(".iram1.text"))) static void activity_on_input(void) {
+    s_last_activity_us = esp_timer_get_time();
+    nvs_writer_note_activity();
+    if (s_link_mode != BLE_LINK_ACTIVE) {
+        set_link_mode(BLE_LINK_ACTIVE);
+        xTimerChangePeriod(s_activity_timer, pdMS_TO_TICKS(ACTIVITY_IDLE_TIMEOUT_MS), 0);
+    }
+}
+
+static void activity_timer_callback(TimerHandle_t xTimer) {
+    const int64_t idle_ms = (esp_timer_get_time() - s_last_activity_us) / 1000;
+    if (idle_ms < ACTIVITY_IDLE_TIMEOUT_MS) {
+        const TickType_t remaining = pdMS_TO_TICKS(ACTIVITY_IDLE_TIMEOUT_MS - idle_ms);
+        xTimerChangePeriod(xTimer, remaining > 0 ? remaining : 1, 0);
+        return;
+    }
+
+    if (s_link_mode == BLE_LINK_ACTIVE) {
+        set_link_mode(BLE_LINK_IDLE);
+    }
+}
+
 static void inactivity_timer_callback(TimerHandle_t xTimer) {
     if (xSemaphoreTake(s_ble_stack_mutex, pdMS_TO_TICKS(250)) != pdTRUE) {
         ESP_LOGW(TAG, "Failed to take BLE stack mutex in inactivity timer");
@@ -51,7 +152,7 @@ static void inactivity_timer_callback(TimerHandle_t xTimer) {
         return;
     }
 
-    if (!usb_hid_host_device_connected() || !ble_hid_device_connected()) {
+    if (!usb_hid_host_device_connected()) {
         xSemaphoreGive(s_ble_stack_mutex);
         return;
     }
@@ -68,20 +169,78 @@ static void inactivity_timer_callback(TimerHandle_t xTimer) {
         return;
     }
 
-    ESP_LOGI(TAG, "No USB HID events for a while, stopping BLE stack");
-    const esp_err_t ret = ble_hid_device_deinit();
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to deinitialize BLE HID device: %s", esp_err_to_name(ret));
-        s_ble_stack_active = true;
-    } else {
-        ESP_LOGI(TAG, "BLE stack stopped");
-        s_ble_stack_active = false;
-        // esp_light_sleep_start();
-    }
+    // Connected hosts stay up at a long interval with slave latency, the next report goes out within one interval
+    ESP_LOGI(TAG, "No USB HID events for a while, parking BLE link");
+    s_link_mode = BLE_LINK_SLEEP;
+    ble_hid_device_park();
+    s_ble_stack_active = false;
+    power_manager_state_changed();
 
     xSemaphoreGive(s_ble_stack_mutex);
 }
 
+// Runs on the bridge task (or in init before it exists), so reports never see a half-applied change
+static void apply_settings(void) {
+    const device_settings_t *settings = storage_settings();
+
+    s_sleep_scale = power_manager_sleep_scale();
+    const int timeout_ms = settings->power.sleep_timeout * 10 * s_sleep_scale; // Convert to milliseconds
+    if (timeout_ms != s_inactivity_timeout_ms && timeout_ms > 0) {
+        s_inactivity_timeout_ms = timeout_ms;
+        if (s_inactivity_timer != NULL) {
+            xTimerChangePeriod(s_inactivity_timer, pdMS_TO_TICKS(s_inactivity_timeout_ms), 0);
+        }
+    }
+    ESP_LOGI(TAG, "Sleep timeout set to %d seconds", s_inactivity_timeout_ms / 1000);
+
+    s_enable_sleep = settings->power.enable_sleep;
+    ESP_LOGI(TAG, "Sleep %s", s_enable_sleep ? "enabled" : "disabled");
+
+    if (settings->mouse.sensitivity != s_sensitivity) {
+        s_sensitivity = settings->mouse.sensitivity;
+        s_sensitivity_q16 = (int32_t)((((int64_t)s_sensitivity << MOTION_FRAC_BITS) + 50) / 100);
+        s_carry_x = 0;
+        s_carry_y = 0;
+    }
+    ESP_LOGI(TAG, "Mouse sensitivity set to %d%%", s_sensitivity);
+
+    if (s_macro_timer != NULL) {
+        esp_timer_stop(s_macro_timer);
+    }
+    s_macro_due = false;
+    if (key_remap_compile(settings->remap.keys, settings->remap.macros) != ESP_OK) {
+        ESP_LOGW(TAG, "Some remap settings are malformed and were ignored");
+    }
+
+    s_dial_mode = strcmp(settings->dial.mode, "volume") == 0 ? DIAL_MODE_VOLUME
+                : strcmp(settings->dial.mode, "scroll") == 0 ? DIAL_MODE_SCROLL
+                                                             : DIAL_MODE_HOSTS;
+    if (s_dial_mode != DIAL_MODE_VOLUME) {
+        s_dial_volume = 0;
+    }
+    rotary_enc_set_consumer(s_dial_mode != DIAL_MODE_HOSTS ? s_hid_bridge_task_handle : NULL);
+}
+
+static void on_settings_changed(const uint32_t changed, const device_settings_t *settings, void *arg) {
+    s_settings_dirty = true;
+    if (s_hid_bridge_task_handle != NULL) {
+        xTaskNotifyGive(s_hid_bridge_task_handle);
+    }
+}
+
+static void usb_init_task_body(usb_init_job_t *job) {
+    boot_phase_begin(BOOT_PHASE_USB_HOST);
+    job->err = usb_hid_host_init(&s_hid_report_ring, job->verbose);
+    boot_phase_end(BOOT_PHASE_USB_HOST);
+}
+
+static void usb_init_task(void *arg) {
+    usb_init_job_t *job = arg;
+    usb_init_task_body(job);
+    xTaskNotifyGive(job->waiter);
+    vTaskDelete(NULL);
+}
+
 esp_err_t hid_bridge_init(const bool verbose) {
     s_verbose = verbose;
     if (s_hid_bridge_initialized) {
@@ -89,22 +248,34 @@ esp_err_t hid_bridge_init(const bool verbose) {
         return ESP_OK;
     }
 
-    int sleep_timeout;
-    if (storage_get_int_setting("power.sleepTimeout", &sleep_timeout) == ESP_OK) {
-        s_inactivity_timeout_ms = sleep_timeout * 1000; // Convert to milliseconds
-        ESP_LOGI(TAG, "Sleep timeout set to %d seconds", sleep_timeout);
-    } else {
-        ESP_LOGW(TAG, "Failed to get sleep timeout from settings, using default");
+    if (s_macro_timer == NULL) {
+        const esp_timer_create_args_t timer_args = {
+            .callback = macro_timer_callback,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "remap_macro",
+        };
+        const esp_err_t err = esp_timer_create(&timer_args, &s_macro_timer);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to create macro timer: %s", esp_err_to_name(err));
+            return err;
+        }
     }
 
-    bool enable_sleep;
-    if (storage_get_bool_setting("power.enableSleep", &enable_sleep) == ESP_OK) {
-        s_enable_sleep = enable_sleep;
-        ESP_LOGI(TAG, "Sleep %s", enable_sleep ? "enabled" : "disabled");
-    } else {
-        ESP_LOGW(TAG, "Failed to get enable sleep setting, using default (enabled)");
+    if (s_dial_timer == NULL) {
+        const esp_timer_create_args_t timer_args = {
+            .callback = dial_timer_callback,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "dial_step",
+        };
+        const esp_err_t err = esp_timer_create(&timer_args, &s_dial_timer);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to create dial timer: %s", esp_err_to_name(err));
+            return err;
+        }
     }
 
+    apply_settings();
+
     s_ble_stack_mutex = xSemaphoreCreateMutexStatic(&s_ble_stack_mutex_struct);
     if (s_ble_stack_mutex == NULL) {
         ESP_LOGE(TAG, "Failed to create BLE stack mutex");
@@ -112,57 +283,69 @@ esp_err_t hid_bridge_init(const bool verbose) {
     }
 
     s_ble_stack_active = true;
-    s_hid_report_queue = xQueueCreateStatic(HID_QUEUE_SIZE,
-        HID_QUEUE_ITEM_SIZE, s_hid_report_queue_storage, &s_hid_report_queue_struct);
-    if (s_hid_report_queue == NULL) {
-        ESP_LOGE(TAG, "Failed to create HID report queue");
-        vSemaphoreDelete(s_ble_stack_mutex);
-        s_ble_stack_mutex = NULL;
-        return ESP_ERR_NO_MEM;
-    }
+    hid_report_ring_init(&s_hid_report_ring);
 
     s_inactivity_timer = xTimerCreateStatic("inactivity_timer", pdMS_TO_TICKS(s_inactivity_timeout_ms),
         pdFALSE, NULL, inactivity_timer_callback, &s_inactivity_timer_struct);
     if (s_inactivity_timer == NULL) {
         ESP_LOGE(TAG, "Failed to create inactivity timer");
-        vQueueDelete(s_hid_report_queue);
-        s_hid_report_queue = NULL;
         vSemaphoreDelete(s_ble_stack_mutex);
         s_ble_stack_mutex = NULL;
         return ESP_ERR_NO_MEM;
     }
 
-    esp_err_t ret = usb_hid_host_init(s_hid_report_queue, verbose);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to initialize USB HID host: %s", esp_err_to_name(ret));
-        xTimerDelete(s_inactivity_timer, 0);
-        vQueueDelete(s_hid_report_queue);
-        s_hid_report_queue = NULL;
-        return ret;
+    s_activity_timer = xTimerCreateStatic("activity_timer", pdMS_TO_TICKS(ACTIVITY_IDLE_TIMEOUT_MS),
+        pdFALSE, NULL, activity_timer_callback, &s_activity_timer_struct);
+    s_link_mode = BLE_LINK_ACTIVE;
+
+    s_replay_count = 0;
+    s_replay_lost = 0;
+    s_resuming = false;
+    s_replay_ready = false;
+
+    usb_init_job_t usb_job = { .waiter = xTaskGetCurrentTaskHandle(), .verbose = verbose, .err = ESP_OK };
+    const bool usb_parallel = xTaskCreatePinnedToCore(usb_init_task, "usb_init", USB_INIT_TASK_STACK_SIZE, &usb_job,
+                                                      TASK_USB_INIT_PRIO, NULL, TASK_USB_INIT_CORE) == pdPASS;
+    if (!usb_parallel) {
+        usb_init_task_body(&usb_job);
     }
 
-    ret = ble_hid_device_init(verbose);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to initialize BLE HID device: %s", esp_err_to_name(ret));
-        usb_hid_host_deinit();
-        xTimerDelete(s_inactivity_timer, 0);
-        vQueueDelete(s_hid_report_queue);
-        s_hid_report_queue = NULL;
-        return ret;
+    boot_phase_begin(BOOT_PHASE_BLE);
+    const esp_err_t ble_ret = ble_hid_device_init(verbose);
+    boot_phase_end(BOOT_PHASE_BLE);
+
+    if (usb_parallel) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
     }
 
-    int mouse_sens;
-    if (storage_get_int_setting("mouse.sensitivity", &mouse_sens) == ESP_OK) {
-        s_sensitivity = mouse_sens;
-        ESP_LOGI(TAG, "Sleep timeout set to %d seconds", sleep_timeout);
+    if (usb_job.err != ESP_OK || ble_ret != ESP_OK) {
+        if (usb_job.err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to initialize USB HID host: %s", esp_err_to_name(usb_job.err));
+        } else {
+            usb_hid_host_deinit();
+        }
+        if (ble_ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to initialize BLE HID device: %s", esp_err_to_name(ble_ret));
+        } else {
+            ble_hid_device_deinit();
+        }
+        xTimerDelete(s_inactivity_timer, 0);
+        return usb_job.err != ESP_OK ? usb_job.err : ble_ret;
     }
 
+    ble_hid_device_set_ready_callback(on_ble_ready);
+    storage_subscribe(SETTING_BIT(SETTING_POWER_SLEEP_TIMEOUT) | SETTING_BIT(SETTING_POWER_ENABLE_SLEEP) |
+                      SETTING_BIT(SETTING_MOUSE_SENSITIVITY) | SETTING_BIT(SETTING_REMAP_KEYS) |
+                      SETTING_BIT(SETTING_REMAP_MACROS) | SETTING_BIT(SETTING_DIAL_MODE), on_settings_changed, NULL);
+
     s_hid_bridge_initialized = true;
     ESP_LOGI(TAG, "HID bridge initialized");
 
     if (xTimerStart(s_inactivity_timer, 0) != pdPASS) {
         ESP_LOGE(TAG, "Failed to start inactivity timer");
     }
+    s_last_activity_us = esp_timer_get_time();
+    xTimerStart(s_activity_timer, 0);
 
     return ESP_OK;
 }
@@ -176,6 +359,7 @@ esp_err_t hid_bridge_deinit(void) {
     if (s_hid_bridge_running) {
         hid_bridge_stop();
     }
+    storage_unsubscribe(on_settings_changed, NULL);
 
     if (s_inactivity_timer != NULL) {
         xTimerStop(s_inactivity_timer, 0);
@@ -183,6 +367,25 @@ esp_err_t hid_bridge_deinit(void) {
         s_inactivity_timer = NULL;
     }
 
+    if (s_activity_timer != NULL) {
+        xTimerStop(s_activity_timer, 0);
+        xTimerDelete(s_activity_timer, 0);
+        s_activity_timer = NULL;
+    }
+
+    if (s_macro_timer != NULL) {
+        esp_timer_stop(s_macro_timer);
+        esp_timer_delete(s_macro_timer);
+        s_macro_timer = NULL;
+    }
+
+    if (s_dial_timer != NULL) {
+        esp_timer_stop(s_dial_timer);
+        esp_timer_delete(s_dial_timer);
+        s_dial_timer = NULL;
+    }
+    s_dial_volume = 0;
+
     if (xSemaphoreTake(s_ble_stack_mutex, pdMS_TO_TICKS(250)) != pdTRUE) {
         ESP_LOGE(TAG, "Failed to take BLE stack mutex in deinit");
         return ESP_FAIL;
@@ -206,11 +409,6 @@ esp_err_t hid_bridge_deinit(void) {
         return ret;
     }
 
-    if (s_hid_report_queue != NULL) {
-        vQueueDelete(s_hid_report_queue);
-        s_hid_report_queue = NULL;
-    }
-
     if (s_ble_stack_mutex != NULL) {
         vSemaphoreDelete(s_ble_stack_mutex);
         s_ble_stack_mutex = NULL;
@@ -234,13 +432,15 @@ esp_err_t hid_bridge_start(void) {
         return ESP_OK;
     }
 
-    const BaseType_t task_created = xTaskCreatePinnedToCore(hid_bridge_task, "hid_bridge", 2150, NULL, 12,
-                                                      &s_hid_bridge_task_handle, 1);
+    const BaseType_t task_created = xTaskCreatePinnedToCore(hid_bridge_task, "hid_bridge", 2150, NULL, TASK_HID_BRIDGE_PRIO,
+                                                      &s_hid_bridge_task_handle, TASK_HID_BRIDGE_CORE);
     if (task_created != pdTRUE) {
         ESP_LOGE(TAG, "Failed to create HID bridge task");
         return ESP_ERR_NO_MEM;
     }
 
+    hid_report_ring_set_consumer(&s_hid_report_ring, s_hid_bridge_task_handle);
+    rotary_enc_set_consumer(s_dial_mode != DIAL_MODE_HOSTS ? s_hid_bridge_task_handle : NULL);
     s_hid_bridge_running = true;
     ESP_LOGI(TAG, "HID bridge started");
     return ESP_OK;
@@ -257,6 +457,8 @@ esp_err_t hid_bridge_stop(void) {
         return ESP_OK;
     }
 
+    hid_report_ring_set_consumer(&s_hid_report_ring, NULL);
+    rotary_enc_set_consumer(NULL);
     if (s_hid_bridge_task_handle != NULL) {
         vTaskDelete(s_hid_bridge_task_handle);
         s_hid_bridge_task_handle = NULL;
@@ -267,72 +469,377 @@ esp_err_t hid_bridge_stop(void) {
     return ESP_OK;
 }
 
-static esp_err_t process_keyboard_report(const usb_hid_report_t *report) {
-    const uint8_t expected_fields = usb_hid_host_get_num_fields(report->report_id, report->if_id);
-    if (expected_fields != report->info->num_fields) {
-        ESP_LOGW(TAG, "Unexpected number of fields: expected=%d, got=%d", expected_fields, report->info->num_fields);
+// Right Ctrl + Right Shift + F1..F3 selects BLE host 1..3, the combo itself is not forwarded
+#define HOST_SWITCH_MODIFIERS (RIGHT_CONTROL_KEY_MASK | RIGHT_SHIFT_KEY_MASK)
+#define HOST_SWITCH_FIRST_KEY HID_KEY_F1
+#define HOST_SWITCH_NUM_KEYS  3
+
+static bool handle_host_switch(const keyboard_report_t *kb_report) {
+    if ((key_bitmap_modifiers(&kb_report->keys) & HOST_SWITCH_MODIFIERS) != HOST_SWITCH_MODIFIERS) {
+        return false;
+    }
+
+    for (int i = 0; i < HOST_SWITCH_NUM_KEYS; i++) {
+        if (key_bitmap_test(&kb_report->keys, HOST_SWITCH_FIRST_KEY + i)) {
+            const esp_err_t ret = ble_hid_device_select_host(i);
+            if (ret != ESP_OK) {
+                ESP_LOGW(TAG, "Host %d not available: %s", i + 1, esp_err_to_name(ret));
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static esp_err_t send_keyboard_report(const keyboard_report_t *kb_report) {
+    if (s_resuming) {
+        replay_push(kb_report, NULL);
+        return ESP_OK;
+    }
+
+    const esp_err_t ret = ble_hid_device_send_keyboard_report(kb_report);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to send keyboard report: %s", esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+__attribute__((section(".iram1.text"))) static esp_err_t send_mouse_report(const mouse_report_t *mouse_report) {
+    if (s_resuming) {
+        replay_push(NULL, mouse_report);
         return ESP_OK;
     }
 
-    static keyboard_report_t ble_kb_report = {0};
-    memset(&ble_kb_report, 0, sizeof(keyboard_report_t));
+    return ble_hid_device_send_mouse_report(mouse_report);
+}
+
+// Sends the next macro chord or release and re-arms the step timer until playback is done
+static void play_macro_step(void) {
+    keyboard_report_t kb_report = {
+        .stamp = { .usb_us = 0, .bridge_us = esp_timer_get_time() },
+    };
+    if (!key_remap_macro_step(&kb_report.keys)) {
+        return;
+    }
+
+    // Without a host the macro still runs to its end, so it can't fire late on reconnect
+    if (ble_hid_device_connected() || s_resuming) {
+        send_keyboard_report(&kb_report);
+    }
+    esp_timer_start_once(s_macro_timer, REMAP_MACRO_STEP_US);
+}
 
-    uint8_t btn_idx = 0;
+static void macro_timer_callback(void *arg) {
+    s_macro_due = true;
+    if (s_hid_bridge_task_handle != NULL) {
+        xTaskNotifyGive(s_hid_bridge_task_handle);
+    }
+}
+
+// Starts playback of a macro queued by the report just remapped, unless one is already stepping
+static void kick_macro(void) {
+    if (key_remap_macro_pending() && !s_macro_due && !esp_timer_is_active(s_macro_timer)) {
+        play_macro_step();
+    }
+}
+
+static esp_err_t process_keyboard_report(const usb_hid_report_t *report, const latency_stamp_t *stamp) {
+    keyboard_report_t ble_kb_report;
+    ble_kb_report.stamp = *stamp;
+    if (report->decoded) {
+        ble_kb_report.keys = report->keyboard.keys;
+    } else {
+        decode_keyboard_fields(report->info, report->fields, &ble_kb_report.keys);
+    }
+
+    if (handle_host_switch(&ble_kb_report)) {
+        return ESP_OK;
+    }
+
+    if (!key_remap_enabled()) {
+        return send_keyboard_report(&ble_kb_report);
+    }
+
+    const key_bitmap_t physical = ble_kb_report.keys;
+    const bool buttons_changed = key_remap_keyboard(&physical, &ble_kb_report.keys);
+    const esp_err_t ret = send_keyboard_report(&ble_kb_report);
+    if (buttons_changed) {
+        // Keys mapped to mouse buttons, motion stays with the mouse reports
+        const mouse_report_t mouse_report = { .buttons = key_remap_current_buttons(), .stamp = *stamp };
+        send_mouse_report(&mouse_report);
+    }
+    kick_macro();
+    return ret;
+}
+
+// Consumer reports are rare, they always take the generic path. Only the first active usage is forwarded,
+// the BLE consumer report carries one.
+static uint16_t consumer_usage_from_fields(const usb_hid_report_t *report) {
     for (int i = 0; i < report->info->num_fields; i++) {
         const usb_hid_field_t *field = &report->fields[i];
-        if (field->value == NULL) {
+        if (field->value == NULL || field->attr.usage_page != HID_USAGE_PAGE_CONSUMER || field->attr.constant) {
             continue;
         }
 
-        if (field->attr.usage_page == HID_USAGE_KEYPAD && !field->attr.constant) {
-            if (field->attr.usage == HID_KEY_LEFT_CTRL) {
-                // field->value is a pointer to the first report array item out of field->attr.report_count
-                // for keyboard, field->value[0] will be HID_KEY_LEFT_CTRL
-                ble_kb_report.modifier = field->value[0];
+        const uint16_t size = field->attr.report_size;
+        const uint16_t bits = MIN(size * field->attr.report_count, 64);
+        const uint64_t raw = (uint64_t) *field->value;
+        const uint64_t mask = size >= 64 ? UINT64_MAX : (1ULL << size) - 1;
+        for (uint16_t bit = 0; size > 0 && bit + size <= bits; bit += size) {
+            const int32_t value = (int32_t) ((raw >> bit) & mask);
+            if (field->attr.array) {
+                // Array items index the usage range, out of range or usage 0 means nothing pressed
+                if (value < field->attr.logical_min || value > field->attr.logical_max) {
+                    continue;
+                }
+                const uint16_t usage = field->attr.usage + (value - field->attr.logical_min);
+                if (usage != 0) {
+                    return usage;
+                }
+            } else if (value != 0) {
+                return field->attr.usage_maximum > field->attr.usage ? field->attr.usage + bit / size
+                                                                      : field->attr.usage;
             }
-            else if (field->attr.usage == 0 && field->attr.array && !field->attr.constant) {
-                memcpy(&ble_kb_report.keycodes[btn_idx], &((uint8_t*)(field->value))[btn_idx], sizeof(uint8_t));
-                btn_idx++;
-            } 
-        } 
+        }
     }
 
-    const esp_err_t ret = ble_hid_device_send_keyboard_report(&ble_kb_report);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to send keyboard report: %s", esp_err_to_name(ret));
+    return 0;
+}
+
+static esp_err_t process_consumer_report(const usb_hid_report_t *report, const latency_stamp_t *stamp) {
+    if (s_resuming) {
+        // Media keys aren't worth replaying after a reconnect
+        return ESP_OK;
     }
-    return ret;
+
+    return ble_hid_device_send_consumer_report(consumer_usage_from_fields(report), stamp);
 }
 
 static mouse_report_t ble_mouse_report = {0};
 
-__attribute__((section(".iram1.text"))) static esp_err_t process_mouse_report(const usb_hid_report_t *report)
+// Floor division keeps the carry in [0, 1), so slow movement in either direction adds up instead of vanishing
+__attribute__((section(".iram1.text"))) static int32_t scale_motion(const int32_t value, int32_t *carry) {
+    const int64_t scaled = (int64_t)value * s_sensitivity_q16 + *carry;
+    const int64_t whole = scaled >> MOTION_FRAC_BITS;
+    *carry = (int32_t)(scaled - (whole << MOTION_FRAC_BITS));
+    if (whole > INT32_MAX) return INT32_MAX;
+    if (whole < INT32_MIN) return INT32_MIN;
+    return (int32_t)whole;
+}
+
+__attribute__((section(".iram1.text"))) static esp_err_t process_mouse_report(const usb_hid_report_t *report,
+                                                                         const latency_stamp_t *stamp)
 {
-    const usb_hid_field_t* const btn_field_info = &report->fields[report->info->mouse_fields.buttons];
-    ble_mouse_report.buttons = ((uint8_t const*)btn_field_info->value)[0];
-    if (report->fields[report->info->mouse_fields.x].attr.report_size == 16) {
-        ble_mouse_report.x = ((int16_t const*)report->fields[report->info->mouse_fields.x].value)[0];
-        ble_mouse_report.y = ((int16_t const*)report->fields[report->info->mouse_fields.y].value)[0];
-    } else if (report->fields[report->info->mouse_fields.x].attr.report_size == 8) {
-        ble_mouse_report.x = ((int8_t const*)report->fields[report->info->mouse_fields.x].value)[0];
-        ble_mouse_report.y = ((int8_t const*)report->fields[report->info->mouse_fields.y].value)[0];
+    hid_mouse_sample_t fallback;
+    const hid_mouse_sample_t *sample = &report->mouse;
+    if (!report->decoded) {
+        // Same translation table, fed from the generic field values
+        decode_mouse_fields(&report->info->plan.pointer, report->fields, &fallback);
+        sample = &fallback;
+    }
+
+    bool keys_changed = false;
+    uint32_t buttons = sample->buttons;
+    if (key_remap_enabled()) {
+        keys_changed = key_remap_buttons(sample->buttons, &buttons);
+    }
+    ble_mouse_report.buttons = buttons;
+    ble_mouse_report.x = sample->x;
+    ble_mouse_report.y = sample->y;
+    ble_mouse_report.wheel = sample->wheel;
+    ble_mouse_report.pan = sample->pan;
+    ble_mouse_report.stamp = *stamp;
+    ble_mouse_report.stream = report->dev_addr << 8 | report->report_id;
+
+    if (s_sensitivity != 100) {
+        ble_mouse_report.x = scale_motion(ble_mouse_report.x, &s_carry_x);
+        ble_mouse_report.y = scale_motion(ble_mouse_report.y, &s_carry_y);
     }
 
-    ble_mouse_report.wheel = ((uint8_t const*)report->fields[report->info->mouse_fields.wheel].value)[0];
-    ble_mouse_report.pan = ((uint8_t const*)report->fields[report->info->mouse_fields.pan].value)[0];
+    const esp_err_t ret = send_mouse_report(&ble_mouse_report);
+    if (keys_changed) {
+        // Buttons mapped to keys
+        keyboard_report_t kb_report = { .stamp = *stamp };
+        key_remap_current_keys(&kb_report.keys);
+        send_keyboard_report(&kb_report);
+    }
+    if (key_remap_enabled()) {
+        kick_macro();
+    }
+    return ret;
+}
 
-    if (s_sensitivity != 100) {
-        ble_mouse_report.x = (int32_t)(int16_t)ble_mouse_report.x * s_sensitivity / 100;
-        ble_mouse_report.y = (int32_t)(int16_t)ble_mouse_report.y * s_sensitivity / 100;
+// Called from the bridge task only, the buffer needs no locking
+static void replay_push(const keyboard_report_t *keyboard, const mouse_report_t *mouse) {
+    // Only a state the host wouldn't already have by then is a change, repeats and motion are dropped
+    for (int i = s_replay_count - 1; i >= 0; i--) {
+        const replay_entry_t *last = &s_replay[i];
+        if (last->is_mouse != (mouse != NULL)) {
+            continue;
+        }
+        if (mouse != NULL ? last->mouse.buttons == mouse->buttons
+                          : memcmp(&last->keyboard.keys, &keyboard->keys, sizeof(key_bitmap_t)) == 0) {
+            return;
+        }
+        break;
+    }
+
+    replay_entry_t *entry;
+    if (s_replay_count < REPLAY_DEPTH) {
+        entry = &s_replay[s_replay_count++];
+    } else {
+        // The state in the last slot is lost, the final one still gets through
+        entry = &s_replay[REPLAY_DEPTH - 1];
+        if (s_replay_lost < UINT8_MAX) {
+            s_replay_lost++;
+        }
+    }
+    entry->is_mouse = mouse != NULL;
+    if (mouse != NULL) {
+        entry->mouse = (mouse_report_t) { .buttons = mouse->buttons, .stamp = mouse->stamp };
+    } else {
+        entry->keyboard = *keyboard;
+    }
+}
+
+static void replay_flush(void) {
+    s_replay_ready = false;
+    s_resuming = false;
+    if (s_replay_count == 0) {
+        return;
+    }
+
+    const int64_t now = esp_timer_get_time();
+    uint8_t sent = 0;
+    for (int i = 0; i < s_replay_count; i++) {
+        replay_entry_t *entry = &s_replay[i];
+        latency_stamp_t *stamp = entry->is_mouse ? &entry->mouse.stamp : &entry->keyboard.stamp;
+        if (now - stamp->bridge_us > REPLAY_MAX_AGE_US) {
+            continue;
+        }
+
+        // Time spent waiting for the host would only skew the latency histograms
+        *stamp = (latency_stamp_t) { .usb_us = 0, .bridge_us = now };
+        const esp_err_t ret = entry->is_mouse ? ble_hid_device_send_mouse_report(&entry->mouse)
+                                              : ble_hid_device_send_keyboard_report(&entry->keyboard);
+        if (ret == ESP_OK) {
+            sent++;
+        }
     }
 
-    return ble_hid_device_send_mouse_report(&ble_mouse_report);
+    ESP_LOGI(TAG, "Replayed %d of %d report(s) held during resume", sent, s_replay_count);
+    if (s_replay_lost > 0) {
+        ESP_LOGW(TAG, "%d state change(s) didn't fit the replay buffer", s_replay_lost);
+    }
+    s_replay_count = 0;
+    s_replay_lost = 0;
+}
+
+// Gives up on the resume, the held reports are discarded without being sent
+static void replay_drop(void) {
+    ESP_LOGW(TAG, "No host ready after resume, dropping %d held report(s)", s_replay_count);
+    s_replay_ready = false;
+    s_resuming = false;
+    s_replay_count = 0;
+    s_replay_lost = 0;
+    s_dial_volume = 0;
+}
+
+static void on_ble_ready(void) {
+    if (!s_resuming) {
+        return;
+    }
+
+    s_replay_ready = true;
+    if (s_hid_bridge_task_handle != NULL) {
+        xTaskNotifyGive(s_hid_bridge_task_handle);
+    }
+}
+
+int64_t hid_bridge_last_input_us(void) {
+    return s_last_activity_us;
 }
 
 bool hid_bridge_is_ble_paused(void) {
     return !s_ble_stack_active && usb_hid_host_device_connected();
 }
 
+// Resumes the BLE link for an input and counts it as activity, false if there's no host to send it to
+static bool input_begin(const int64_t now_us) {
+    if (!s_ble_stack_active) {
+        ESP_LOGI(TAG, "Input received, resuming BLE link");
+        s_ble_stack_active = true;
+        power_manager_state_changed();
+        ble_hid_device_resume();
+        // Without a host the waking report is held until one reconnects
+        s_resuming = !ble_hid_device_connected();
+        s_resume_started_us = now_us;
+        s_replay_count = 0;
+        s_replay_lost = 0;
+    } else if (s_resuming && now_us - s_resume_started_us > REPLAY_MAX_AGE_US) {
+        replay_drop();
+    }
+    activity_on_input();
+
+    if (!ble_hid_device_connected() && !s_resuming) {
+        ESP_LOGD(TAG, "BLE HID device not connected");
+        return false;
+    }
+    return true;
+}
+
+static void dial_timer_callback(void *arg) {
+    s_dial_due = true;
+    if (s_hid_bridge_task_handle != NULL) {
+        xTaskNotifyGive(s_hid_bridge_task_handle);
+    }
+}
+
+// One held volume step per connection event, a burst would only collapse in the congestion queue.
+// Held while the host is reconnecting, like the replayed reports.
+static void dial_volume_step(void) {
+    if (s_dial_volume == 0 || s_resuming || esp_timer_is_active(s_dial_timer)) {
+        return;
+    }
+    if (!ble_hid_device_connected()) {
+        s_dial_volume = 0;
+        return;
+    }
+
+    const latency_stamp_t stamp = { .usb_us = 0, .bridge_us = esp_timer_get_time() };
+    ble_hid_device_send_consumer_report(s_dial_volume > 0 ? HID_CONSUMER_VOLUME_UP : HID_CONSUMER_VOLUME_DOWN, &stamp);
+    ble_hid_device_send_consumer_report(0, &stamp);
+    s_dial_volume += s_dial_volume > 0 ? -1 : 1;
+    esp_timer_start_once(s_dial_timer, MAX(ble_hid_device_get_conn_interval_us(), DIAL_MIN_STEP_US));
+}
+
+// Detents of the dial, sent like a USB consumer or mouse report. Clockwise is volume up or scroll down.
+static void process_dial(const int32_t detents) {
+    const latency_stamp_t stamp = { .usb_us = 0, .bridge_us = esp_timer_get_time() };
+    if (!input_begin(stamp.bridge_us)) {
+        return;
+    }
+    if (s_inactivity_timer != NULL) {
+        xTimerReset(s_inactivity_timer, 0);
+    }
+
+    if (s_dial_mode == DIAL_MODE_VOLUME) {
+        // Turning back cancels steps not sent yet
+        s_dial_volume = MAX(MIN(s_dial_volume + detents, DIAL_MAX_PENDING), -DIAL_MAX_PENDING);
+        dial_volume_step();
+    } else {
+        // Held buttons stay held, the dial only adds wheel detents
+        const mouse_report_t mouse = {
+            .buttons = ble_mouse_report.buttons,
+            .wheel = -detents * HID_WHEEL_RESOLUTION,
+            .stamp = stamp,
+            .stream = DIAL_STREAM,
+        };
+        send_mouse_report(&mouse);
+    }
+}
+
 esp_err_t hid_bridge_process_report(const usb_hid_report_t *const report) {
     if (!s_hid_bridge_initialized) {
         ESP_LOGE(TAG, "HID bridge not initialized");
@@ -344,44 +851,28 @@ esp_err_t hid_bridge_process_report(const usb_hid_report_t *const report) {
         return ESP_ERR_INVALID_ARG;
     }
 
-    if (!s_ble_stack_active) {
-        if (xSemaphoreTake(s_ble_stack_mutex, pdMS_TO_TICKS(25)) != pdTRUE) {
-            ESP_LOGW(TAG, "Failed to take BLE stack mutex in process_report");
-            return ESP_FAIL;
-        }
-
-        if (!s_ble_stack_active) {
-            ESP_LOGI(TAG, "USB HID event received, restarting BLE stack");
-
-            const esp_err_t ret = ble_hid_device_init(s_verbose);
-            if (ret != ESP_OK) {
-                s_ble_stack_active = false;
-                ESP_LOGE(TAG, "Failed to initialize BLE HID device: %s", esp_err_to_name(ret));
-                xSemaphoreGive(s_ble_stack_mutex);
-                return ret;
-            }
-
-            s_ble_stack_active = true;
-            xSemaphoreGive(s_ble_stack_mutex);
-            return ESP_OK;
-        }
-
-        xSemaphoreGive(s_ble_stack_mutex);
+    const latency_stamp_t stamp = {
+        .usb_us = report->ts_usb,
+        .bridge_us = esp_timer_get_time(),
+    };
+    if (report->ts_queued) {
+        latency_trace_record(LAT_STAGE_QUEUE_TO_BRIDGE, stamp.bridge_us - report->ts_queued);
     }
 
-    if (!ble_hid_device_connected()) {
-        ESP_LOGD(TAG, "BLE HID device not connected");
+    if (!input_begin(stamp.bridge_us)) {
         return ESP_OK;
     }
 
     esp_err_t ret = ESP_OK;
     if (report->info->is_keyboard) {
-        ret = process_keyboard_report(report);
+        ret = process_keyboard_report(report, &stamp);
     } else if (report->info->is_mouse) {
-        ret = process_mouse_report(report);
+        ret = process_mouse_report(report, &stamp);
+    } else if (report->info->is_consumer) {
+        ret = process_consumer_report(report, &stamp);
     }
 
-    if (s_inactivity_timer != NULL && usb_hid_host_device_connected() && ble_hid_device_connected()) {
+    if (s_inactivity_timer != NULL && usb_hid_host_device_connected()) {
         xTimerReset(s_inactivity_timer, 0);
     }
 
@@ -390,7 +881,7 @@ esp_err_t hid_bridge_process_report(const usb_hid_report_t *const report) {
 
 static void hid_bridge_task(void *arg) {
     ESP_LOGI(TAG, "HID bridge task started");
-    usb_hid_report_t report;
+    bool first_report_sent = false;
 
     if (s_inactivity_timer != NULL) {
         if (xTimerStart(s_inactivity_timer, 0) != pdPASS) {
@@ -399,8 +890,50 @@ static void hid_bridge_task(void *arg) {
     }
 
     while (1) {
-        if (xQueueReceive(s_hid_report_queue, &report, portMAX_DELAY) == pdTRUE) {
-            hid_bridge_process_report(&report);
+        if (s_settings_dirty || s_sleep_scale != power_manager_sleep_scale()) {
+            s_settings_dirty = false;
+            apply_settings();
         }
+
+        if (s_replay_ready) {
+            replay_flush();
+            dial_volume_step();
+        }
+
+        if (s_macro_due) {
+            s_macro_due = false;
+            play_macro_step();
+        }
+
+        if (s_dial_mode != DIAL_MODE_HOSTS) {
+            const int32_t detents = rotary_enc_take_detents();
+            if (detents != 0) {
+                process_dial(detents);
+            }
+        }
+        if (s_dial_due) {
+            s_dial_due = false;
+            dial_volume_step();
+        }
+
+        // Drain before blocking: reports committed before the consumer was registered don't notify
+        // Full clock only for as long as reports are in flight
+        const hid_report_slot_t *slot;
+        while ((slot = hid_report_ring_peek(&s_hid_report_ring)) != NULL) {
+            power_manager_reports_busy();
+            perf_count(PERF_BRIDGE_REPORTS);
+            // Queued before its interface went away, the report map it points to is cleared
+            if (usb_hid_host_report_current(slot->source, slot->generation)) {
+                hid_bridge_process_report(&slot->report);
+            }
+            hid_report_ring_release(&s_hid_report_ring);
+            if (__builtin_expect(!first_report_sent, 0) && ble_hid_device_connected()) {
+                first_report_sent = true;
+                boot_profile_first_report();
+            }
+        }
+        power_manager_reports_idle();
+
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
     }
 }
@@ -2,12 +2,15 @@
 
 #include "esp_err.h"
 #include "usb/hid_host.h"
+#include "latency_trace.h"
+#include "key_bitmap.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define USB_HOST_MAX_INTERFACES      4
+// One source is one (device address, interface) pair, a keyboard and a mouse behind a hub are four or so
+#define USB_HID_MAX_SOURCES          6
 #define USB_HID_MAX_RAW_REPORT_SIZE  24
 #define MAX_REPORT_FIELDS            16
 #define MAX_COLLECTION_DEPTH         3
@@ -46,6 +49,7 @@ extern "C" {
 #define HID_USAGE_DIAL       0x37
 #define HID_USAGE_WHEEL      0x38
 #define HID_USAGE_HAT_SWITCH 0x39
+#define HID_USAGE_RESOLUTION_MULTIPLIER 0x48
 
 // Mouse Buttons
 #define HID_MOUSE_LEFT       253
@@ -267,6 +271,92 @@ typedef struct {
     uint16_t bit_size;
 } report_field_info_t;
 
+typedef enum {
+    HID_DECODE_NONE = 0,  // Field not present, decodes as 0
+    HID_DECODE_U8,        // Byte-aligned 8-bit
+    HID_DECODE_S8,
+    HID_DECODE_U16,       // Byte-aligned 16-bit little-endian
+    HID_DECODE_S16,
+    HID_DECODE_BITS,      // Anything else up to 25 bits: load, shift, mask, sign-extend
+} hid_decode_kind_t;
+
+typedef struct {
+    uint8_t kind;
+    uint8_t shift;
+    uint8_t num_bytes;
+    bool is_signed;
+    uint16_t byte_offset;
+    uint8_t bits;
+    uint32_t mask;
+} hid_decode_op_t;
+
+// Pointer targets of the translation table, in hid_mouse_sample_t order
+typedef enum {
+    HID_TARGET_BUTTONS = 0,
+    HID_TARGET_X,
+    HID_TARGET_Y,
+    HID_TARGET_WHEEL,
+    HID_TARGET_PAN,
+    HID_TARGET_COUNT,
+} hid_target_t;
+
+#define HID_TRANSLATION_MAX_ENTRIES 8
+// Wheel and pan counts per detent the bridge works in, hi-res wheels are scaled up to it and the BLE
+// mouse report declares it as the Physical Maximum of its Resolution Multiplier
+#define HID_WHEEL_RESOLUTION        120
+#define HID_RES_MULT_MAX_FIELDS     2
+#define HID_TRANSLATION_MAX_BUTTONS 16
+
+/**
+ * One source field of a translation table. Button fields are OR-ed into the target at `shift`,
+ * everything else is multiplied by `scale` and added, so several fields can feed one target.
+ */
+typedef struct {
+    hid_decode_op_t op;
+    uint8_t field_index;  // source field in report_info_t, used when the report takes the generic path
+    uint8_t target;       // hid_target_t
+    uint8_t shift;
+    bool merge_bits;
+    int16_t scale;
+} hid_translation_entry_t;
+
+typedef struct {
+    uint8_t num_entries;
+    bool decodable;       // every op can read the raw report, otherwise the field values are used
+    hid_translation_entry_t entries[HID_TRANSLATION_MAX_ENTRIES];
+} hid_translation_t;
+
+/**
+ * Compact per-report decode plan built by parse_report_descriptor(), covering only the fields the
+ * bridge actually forwards. When valid, the USB callback uses it instead of decoding every field.
+ */
+typedef struct {
+    bool valid;
+    hid_translation_t pointer;
+    hid_decode_op_t modifier;
+    uint16_t keys_byte_offset;
+    uint8_t keys_count;          // keycode array, 0 if the report has none
+    uint16_t bitmap_bit_offset;
+    uint16_t bitmap_usage_min;
+    uint16_t bitmap_count;       // NKRO bitmap, 0 if the report has none
+} hid_decode_plan_t;
+
+// Wheel and pan are device counts as decoded, HID_WHEEL_RESOLUTION per detent once set_wheel_resolution() ran
+typedef union {
+    struct {
+        uint32_t buttons;
+        int32_t x;
+        int32_t y;
+        int32_t wheel;
+        int32_t pan;
+    };
+    int32_t targets[HID_TARGET_COUNT];
+} hid_mouse_sample_t;
+
+typedef struct {
+    key_bitmap_t keys;
+} hid_keyboard_sample_t;
+
 typedef struct {
     report_field_info_t fields[MAX_REPORT_FIELDS];
     uint8_t num_fields;
@@ -275,29 +365,47 @@ typedef struct {
     uint8_t usage_stack_pos;
     bool is_mouse;
     bool is_keyboard;
-    struct {
-        uint8_t x;
-        uint8_t y;
-        uint8_t wheel;
-        uint8_t pan;
-        uint8_t buttons;
-    } mouse_fields;
+    bool is_consumer;
+    hid_decode_plan_t plan;
 } report_info_t;
 
+/**
+ * Resolution Multiplier feature of a hi-res wheel. Until the bridge writes every field at its logical
+ * maximum the wheel counts whole detents, after that `multiplier` counts per detent.
+ */
+typedef struct {
+    uint8_t num_fields;         // 0 if the device has no multiplier
+    uint8_t report_id;
+    uint8_t report_len;         // feature report bytes, without the report ID
+    uint8_t multiplier;         // 0 if the fields disagree, the wheel then stays at whole detents
+    uint16_t bit_offset[HID_RES_MULT_MAX_FIELDS];
+    uint8_t bits[HID_RES_MULT_MAX_FIELDS];
+    uint8_t value[HID_RES_MULT_MAX_FIELDS];
+} hid_res_mult_t;
+
 typedef struct {
     report_info_t reports[MAX_REPORTS_PER_INTERFACE];
     uint8_t report_ids[MAX_REPORTS_PER_INTERFACE];
+    hid_res_mult_t res_mult;
     uint8_t num_reports;
     uint16_t collection_stack[MAX_COLLECTION_DEPTH];
     uint8_t collection_depth;
 } report_map_t;
 
 typedef struct {
+    uint8_t dev_addr;
     uint8_t if_id;
     uint8_t report_id;
     usb_hid_field_type_t type;
     usb_hid_field_t* fields;
     report_info_t* info;
+    bool decoded; // true if filled from info->plan, fields are then not populated
+    int64_t ts_usb;    // esp_timer_get_time() in the USB HID host callback
+    int64_t ts_queued; // esp_timer_get_time() when committed to the report ring
+    union {
+        hid_mouse_sample_t mouse;
+        hid_keyboard_sample_t keyboard;
+    };
 } usb_hid_report_t;
 
 /**
@@ -346,6 +454,13 @@ esp_err_t hid_bridge_process_report(const usb_hid_report_t *report);
  */
 bool hid_bridge_is_ble_paused(void);
 
+/**
+ * @brief Get the time of the last keyboard or mouse input
+ *
+ * @return esp_timer_get_time() of the last input report
+ */
+int64_t hid_bridge_last_input_us(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,92 @@
+#include "hid_report_ring.h"
+
+#include <string.h>
+
+#define RING_MASK (HID_REPORT_RING_SIZE - 1)
+
+_Static_assert((HID_REPORT_RING_SIZE & RING_MASK) == 0, "HID_REPORT_RING_SIZE must be a power of two");
+
+void hid_report_ring_init(hid_report_ring_t *ring) {
+    memset(ring->slots, 0, sizeof(ring->slots));
+    for (int i = 0; i < HID_REPORT_RING_SIZE; i++) {
+        hid_report_slot_t *slot = &ring->slots[i];
+        slot->report.fields = slot->fields;
+        for (int j = 0; j < MAX_REPORT_FIELDS; j++) {
+            slot->fields[j].value = &slot->values[j];
+        }
+    }
+
+    atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, 0, memory_order_relaxed);
+    ring->consumer = NULL;
+    for (int i = 0; i < USB_HID_MAX_SOURCES; i++) {
+        ring->src_committed[i] = 0;
+        atomic_store_explicit(&ring->src_released[i], 0, memory_order_relaxed);
+    }
+    ring->pushed = 0;
+    ring->dropped = 0;
+    ring->high_water = 0;
+}
+
+void hid_report_ring_set_consumer(hid_report_ring_t *ring, const TaskHandle_t consumer) {
+    ring->consumer = consumer;
+}
+
+__attribute__((section(".iram1.text"))) hid_report_slot_t *hid_report_ring_acquire(hid_report_ring_t *ring,
+                                                                                   const uint8_t source) {
+    const uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    const uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    const uint32_t held = ring->src_committed[source] -
+                          atomic_load_explicit(&ring->src_released[source], memory_order_acquire);
+    if (head - tail >= HID_REPORT_RING_SIZE || held >= HID_REPORT_RING_SOURCE_CAP) {
+        ring->dropped++;
+        return NULL;
+    }
+
+    hid_report_slot_t *slot = &ring->slots[head & RING_MASK];
+    slot->source = source;
+    return slot;
+}
+
+__attribute__((section(".iram1.text"))) void hid_report_ring_commit(hid_report_ring_t *ring) {
+    const uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed) + 1;
+    ring->src_committed[ring->slots[(head - 1) & RING_MASK].source]++;
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+    ring->pushed++;
+
+    const uint32_t depth = head - atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (depth > ring->high_water) {
+        ring->high_water = depth;
+    }
+
+    const TaskHandle_t consumer = ring->consumer;
+    if (consumer != NULL) {
+        xTaskNotifyGive(consumer);
+    }
+}
+
+__attribute__((section(".iram1.text"))) hid_report_slot_t *hid_report_ring_peek(hid_report_ring_t *ring) {
+    const uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    const uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail) {
+        return NULL;
+    }
+
+    return &ring->slots[tail & RING_MASK];
+}
+
+__attribute__((section(".iram1.text"))) void hid_report_ring_release(hid_report_ring_t *ring) {
+    const uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ring->src_released[ring->slots[tail & RING_MASK].source], 1, memory_order_release);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+uint32_t hid_report_ring_source_held(const hid_report_ring_t *ring, const uint8_t source) {
+    return ring->src_committed[source] - atomic_load_explicit(&ring->src_released[source], memory_order_acquire);
+}
+
+void hid_report_ring_get_stats(const hid_report_ring_t *ring, hid_report_ring_stats_t *stats) {
+    stats->pushed = ring->pushed;
+    stats->dropped = ring->dropped;
+    stats->high_water = ring->high_water;
+}
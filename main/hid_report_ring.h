@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "hid_bridge.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Must be a power of two
+#define HID_REPORT_RING_SIZE 16
+// One source may hold at most this many slots, the rest stays free for the others
+#define HID_REPORT_RING_SOURCE_CAP (HID_REPORT_RING_SIZE * 3 / 4)
+
+/**
+ * @brief One ring entry, fully self-contained
+ *
+ * report.fields points into this slot's own fields[] and every fields[i].value
+ * points into this slot's own values[], so a slot stays valid until the consumer
+ * releases it regardless of what the producer writes into other slots.
+ */
+typedef struct {
+    usb_hid_report_t report;
+    usb_hid_field_t fields[MAX_REPORT_FIELDS];
+    int64_t values[MAX_REPORT_FIELDS];
+    uint8_t source;
+    // Generation of the source when the report was produced, report.info is stale once it moved on
+    uint32_t generation;
+} hid_report_slot_t;
+
+typedef struct {
+    uint32_t pushed;
+    uint32_t dropped;
+    uint32_t high_water;
+} hid_report_ring_stats_t;
+
+/**
+ * @brief Single-producer single-consumer report ring
+ *
+ * The producer (USB HID host callback) never blocks: when the ring is full the
+ * report is dropped and counted. The consumer is woken with a task notification.
+ * Every USB source is capped at HID_REPORT_RING_SOURCE_CAP slots, so a flooding
+ * mouse can't starve a keyboard behind the same hub.
+ */
+typedef struct {
+    hid_report_slot_t slots[HID_REPORT_RING_SIZE];
+    atomic_uint_fast32_t head;
+    atomic_uint_fast32_t tail;
+    TaskHandle_t consumer;
+    // Slots held per source: committed is written by the producer only, released by the consumer only
+    uint32_t src_committed[USB_HID_MAX_SOURCES];
+    atomic_uint_fast32_t src_released[USB_HID_MAX_SOURCES];
+    volatile uint32_t pushed;
+    volatile uint32_t dropped;
+    volatile uint32_t high_water;
+} hid_report_ring_t;
+
+/**
+ * @brief Reset the ring and bind every slot's field pointers to its own storage
+ *
+ * @param ring Ring to initialize
+ */
+void hid_report_ring_init(hid_report_ring_t *ring);
+
+/**
+ * @brief Set the task to notify when a report is committed
+ *
+ * @param ring Ring
+ * @param consumer Consumer task handle, or NULL to stop notifications
+ */
+void hid_report_ring_set_consumer(hid_report_ring_t *ring, TaskHandle_t consumer);
+
+/**
+ * @brief Producer: get the next free slot
+ *
+ * @param ring Ring
+ * @param source Index of the USB source the report comes from, < USB_HID_MAX_SOURCES
+ * @return Slot to fill, or NULL if the ring or the source's share is full (the drop is counted)
+ */
+hid_report_slot_t *hid_report_ring_acquire(hid_report_ring_t *ring, uint8_t source);
+
+/**
+ * @brief Producer: publish the slot returned by the last acquire and wake the consumer
+ *
+ * @param ring Ring
+ */
+void hid_report_ring_commit(hid_report_ring_t *ring);
+
+/**
+ * @brief Consumer: get the oldest published slot without removing it
+ *
+ * @param ring Ring
+ * @return Oldest slot, or NULL if the ring is empty
+ */
+hid_report_slot_t *hid_report_ring_peek(hid_report_ring_t *ring);
+
+/**
+ * @brief Consumer: hand the slot returned by peek back to the producer
+ *
+ * @param ring Ring
+ */
+void hid_report_ring_release(hid_report_ring_t *ring);
+
+/**
+ * @brief Slots of a source committed but not yet released by the consumer
+ *
+ * @param ring Ring
+ * @param source Index of the USB source, < USB_HID_MAX_SOURCES
+ * @return Number of slots the source holds
+ */
+uint32_t hid_report_ring_source_held(const hid_report_ring_t *ring, uint8_t source);
+
+/**
+ * @brief Get ring counters
+ *
+ * @param ring Ring
+ * @param stats Output counters
+ */
+void hid_report_ring_get_stats(const hid_report_ring_t *ring, hid_report_ring_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
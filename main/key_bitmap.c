@@ -0,0 +1,75 @@
+#include "key_bitmap.h"
+
+__attribute__((section(".iram1.text"))) void key_bitmap_add_array(key_bitmap_t *bm, const uint8_t *keys,
+                                                                  const uint8_t count) {
+    for (uint8_t i = 0; i < count; i++) {
+        if (keys[i] >= KEY_USAGE_FIRST_KEY) {
+            key_bitmap_set(bm, keys[i]);
+        }
+    }
+}
+
+__attribute__((section(".iram1.text"))) void key_bitmap_add_bits(key_bitmap_t *bm, const uint8_t *data,
+                                                                 const uint16_t bit_offset, const uint16_t usage_min,
+                                                                 uint16_t count) {
+    if (usage_min > 0xFF) {
+        return;
+    }
+    if (usage_min + count > 0x100) {
+        count = 0x100 - usage_min;
+    }
+
+    // Most bytes are zero, only set bits cost anything
+    for (uint16_t i = 0; i < count;) {
+        const uint16_t bit = bit_offset + i;
+        const uint8_t shift = bit % 8;
+        const uint8_t byte = data[bit / 8] >> shift;
+        const uint16_t span = 8 - shift < count - i ? 8 - shift : count - i;
+        uint8_t pending = span >= 8 ? byte : byte & ((1U << span) - 1);
+        while (pending) {
+            const uint8_t pos = __builtin_ctz(pending);
+            key_bitmap_set(bm, usage_min + i + pos);
+            pending &= pending - 1;
+        }
+        i += span;
+    }
+}
+
+__attribute__((section(".iram1.text"))) uint8_t key_bitmap_to_array(const key_bitmap_t *bm, uint8_t *keys,
+                                                                    const uint8_t max) {
+    uint8_t total = 0;
+    for (int w = 0; w < KEY_BITMAP_WORDS; w++) {
+        uint32_t bits = bm->words[w];
+        if (w == 0) {
+            bits &= ~((1UL << KEY_USAGE_FIRST_KEY) - 1);
+        } else if (w == KEY_BITMAP_MODIFIER_WORD) {
+            bits &= ~0xFFUL;
+        }
+
+        while (bits) {
+            if (total < max) {
+                keys[total] = (w << 5) | __builtin_ctz(bits);
+            }
+            total++;
+            bits &= bits - 1;
+        }
+    }
+
+    if (total > max) {
+        memset(keys, KEY_USAGE_ERROR_ROLLOVER, max);
+    } else {
+        memset(keys + total, 0, max - total);
+    }
+    return total;
+}
+
+__attribute__((section(".iram1.text"))) void key_bitmap_pack(const key_bitmap_t *bm, uint8_t *out,
+                                                             const uint16_t count) {
+    const uint16_t bytes = (count + 7) / 8;
+    for (uint16_t i = 0; i < bytes; i++) {
+        out[i] = bm->words[i >> 2] >> ((i & 3) * 8);
+    }
+    if (count % 8) {
+        out[bytes - 1] &= (1U << (count % 8)) - 1;
+    }
+}
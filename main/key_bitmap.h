@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KEY_BITMAP_WORDS 8
+
+// Usages 0xE0..0xE7 (LeftControl..RightGUI) are the low byte of the last word
+#define KEY_BITMAP_MODIFIER_WORD 7
+
+// Keyboard page usages 0x00..0x03 are error codes, not keys
+#define KEY_USAGE_FIRST_KEY     0x04
+#define KEY_USAGE_ERROR_ROLLOVER 0x01
+
+/**
+ * @brief State of every Keyboard/Keypad page usage, one bit each
+ *
+ * Both array (boot style) and bitmap (NKRO) USB reports decode into this, the BLE side
+ * builds whatever report it sends from it.
+ */
+typedef struct {
+    uint32_t words[KEY_BITMAP_WORDS];
+} key_bitmap_t;
+
+static inline void key_bitmap_clear(key_bitmap_t *bm) {
+    memset(bm, 0, sizeof(key_bitmap_t));
+}
+
+static inline void key_bitmap_set(key_bitmap_t *bm, const uint8_t usage) {
+    bm->words[usage >> 5] |= 1UL << (usage & 31);
+}
+
+static inline bool key_bitmap_test(const key_bitmap_t *bm, const uint8_t usage) {
+    return (bm->words[usage >> 5] >> (usage & 31)) & 1;
+}
+
+static inline bool key_bitmap_equal(const key_bitmap_t *a, const key_bitmap_t *b) {
+    return memcmp(a->words, b->words, sizeof(a->words)) == 0;
+}
+
+static inline uint8_t key_bitmap_modifiers(const key_bitmap_t *bm) {
+    return bm->words[KEY_BITMAP_MODIFIER_WORD] & 0xFF;
+}
+
+static inline void key_bitmap_set_modifiers(key_bitmap_t *bm, const uint8_t modifiers) {
+    bm->words[KEY_BITMAP_MODIFIER_WORD] = (bm->words[KEY_BITMAP_MODIFIER_WORD] & ~0xFFUL) | modifiers;
+}
+
+/**
+ * @brief Add the keys of an array field, error codes and empty slots are skipped
+ *
+ * @param bm Bitmap to add to
+ * @param keys Keycodes, one byte each
+ * @param count Number of keycodes
+ */
+void key_bitmap_add_array(key_bitmap_t *bm, const uint8_t *keys, uint8_t count);
+
+/**
+ * @brief Add the keys of a bitmap field, one bit per usage starting at usage_min
+ *
+ * @param bm Bitmap to add to
+ * @param data Raw report data
+ * @param bit_offset Offset of the first bit in data
+ * @param usage_min Usage of the first bit
+ * @param count Number of bits, usages past 0xFF are ignored
+ */
+void key_bitmap_add_bits(key_bitmap_t *bm, const uint8_t *data, uint16_t bit_offset, uint16_t usage_min,
+                         uint16_t count);
+
+/**
+ * @brief Build the keycode array of a 6KRO report
+ *
+ * Modifiers are not included, see key_bitmap_modifiers(). If more keys are down than fit,
+ * every slot is set to ErrorRollOver like a boot keyboard does.
+ *
+ * @param bm Key state
+ * @param keys Output keycodes, zero padded
+ * @param max Size of keys
+ * @return Number of non-modifier keys down, can be larger than max
+ */
+uint8_t key_bitmap_to_array(const key_bitmap_t *bm, uint8_t *keys, uint8_t max);
+
+/**
+ * @brief Pack usages [0, count) into a bitmap report body, LSB first
+ *
+ * @param bm Key state
+ * @param out Output, (count + 7) / 8 bytes
+ * @param count Number of usages
+ */
+void key_bitmap_pack(const key_bitmap_t *bm, uint8_t *out, uint16_t count);
+
+#ifdef __cplusplus
+}
+#endif
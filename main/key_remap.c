@@ -0,0 +1,342 @@
+#include "key_remap.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+
+static const char *TAG = "KEY_REMAP";
+
+typedef enum {
+    ACTION_KEY = 0,     // arg: usage, 0 sends nothing
+    ACTION_BUTTON,      // arg: button index
+    ACTION_LAYER,       // arg: layer
+    ACTION_MACRO,       // arg: macro index
+} action_type_t;
+
+#define ACTION(type, arg) ((uint16_t)((type) << 8 | (arg)))
+#define ACTION_TYPE(action) ((action) >> 8)
+#define ACTION_ARG(action) ((action) & 0xFF)
+
+// Lookup tables, layer 0 is the base every other layer is copied from
+static uint16_t s_key_lut[REMAP_MAX_LAYERS][256];
+static uint16_t s_button_lut[REMAP_MAX_LAYERS][REMAP_MAX_BUTTONS];
+static bool s_enabled = false;
+
+static uint8_t s_macro_steps[REMAP_MAX_MACRO_STEPS][REMAP_CHORD_KEYS];
+static uint8_t s_macro_start[REMAP_MAX_MACROS];
+static uint8_t s_macro_len[REMAP_MAX_MACROS];
+
+// Output of the last keyboard and mouse report, each side also feeds the other
+static uint8_t s_key_layer = 0;
+static uint8_t s_button_layer = 0;
+static key_bitmap_t s_key_keys;
+static key_bitmap_t s_button_keys;
+static uint32_t s_key_buttons = 0;
+static uint32_t s_button_buttons = 0;
+static uint8_t s_key_macros = 0;
+static uint8_t s_button_macros = 0;
+
+// Playback: one macro at a time, even steps press a chord and odd steps release it
+static uint8_t s_macro_queue = 0;
+static int8_t s_macro_playing = -1;
+static uint8_t s_macro_step = 0;
+
+static bool parse_number(const char **s, const int base, const unsigned long min, const unsigned long max,
+                         unsigned long *value) {
+    char *end;
+    *value = strtoul(*s, &end, base);
+    if (end == *s || *value < min || *value > max) {
+        return false;
+    }
+    *s = end;
+    return true;
+}
+
+// b1..b8, l1..l3, m1..m8 or a hex usage. A usage starting with b needs a leading 0.
+static bool parse_action(const char **s, uint16_t *action) {
+    unsigned long n;
+    switch (tolower((unsigned char)**s)) {
+        case 'b':
+            (*s)++;
+            if (!parse_number(s, 10, 1, REMAP_MAX_BUTTONS, &n)) return false;
+            *action = ACTION(ACTION_BUTTON, n - 1);
+            return true;
+        case 'l':
+            (*s)++;
+            if (!parse_number(s, 10, 1, REMAP_MAX_LAYERS - 1, &n)) return false;
+            *action = ACTION(ACTION_LAYER, n);
+            return true;
+        case 'm':
+            (*s)++;
+            if (!parse_number(s, 10, 1, REMAP_MAX_MACROS, &n)) return false;
+            *action = ACTION(ACTION_MACRO, n - 1);
+            return true;
+        default:
+            if (!parse_number(s, 16, 0, 0xFF, &n)) return false;
+            *action = ACTION(ACTION_KEY, n);
+            return true;
+    }
+}
+
+// [layer:]source=action, source is a usage or b1..b8
+static bool parse_entry(const char *s, const char *end, uint8_t *layer, uint16_t *source, uint16_t *action) {
+    *layer = 0;
+    if (isdigit((unsigned char)s[0]) && s[1] == ':') {
+        *layer = s[0] - '0';
+        s += 2;
+    }
+
+    if (*layer >= REMAP_MAX_LAYERS || !parse_action(&s, source) ||
+        (ACTION_TYPE(*source) != ACTION_KEY && ACTION_TYPE(*source) != ACTION_BUTTON) || *s++ != '=') {
+        return false;
+    }
+    return parse_action(&s, action) && s == end;
+}
+
+// Applies the entries of layer 0 or of all other layers, returns the number of malformed entries
+static int apply_entries(const char *spec, const bool base) {
+    int skipped = 0;
+    const char *s = spec;
+    while (*s != '\0') {
+        if (isspace((unsigned char)*s)) {
+            s++;
+            continue;
+        }
+
+        const char *end = s;
+        while (*end != '\0' && !isspace((unsigned char)*end)) {
+            end++;
+        }
+
+        uint8_t layer;
+        uint16_t source;
+        uint16_t action;
+        if (!parse_entry(s, end, &layer, &source, &action)) {
+            skipped++;
+            if (base) {
+                ESP_LOGW(TAG, "Skipping remap \"%.*s\"", (int)(end - s), s);
+            }
+        } else if ((layer == 0) == base) {
+            if (ACTION_TYPE(source) == ACTION_BUTTON) {
+                s_button_lut[layer][ACTION_ARG(source)] = action;
+            } else {
+                s_key_lut[layer][ACTION_ARG(source)] = action;
+            }
+            s_enabled = true;
+        }
+        s = end;
+    }
+    return skipped;
+}
+
+// Chords separated by spaces, keys of a chord by '+', macros by ';'
+static int compile_macros(const char *spec) {
+    memset(s_macro_len, 0, sizeof(s_macro_len));
+    int skipped = 0;
+    int macro = 0;
+    int steps = 0;
+    s_macro_start[0] = 0;
+
+    const char *s = spec;
+    while (*s != '\0' && macro < REMAP_MAX_MACROS) {
+        if (*s == ';') {
+            s++;
+            if (++macro < REMAP_MAX_MACROS) {
+                s_macro_start[macro] = steps;
+            }
+            continue;
+        }
+        if (isspace((unsigned char)*s)) {
+            s++;
+            continue;
+        }
+
+        uint8_t chord[REMAP_CHORD_KEYS] = {0};
+        int keys = 0;
+        bool ok = true;
+        do {
+            unsigned long usage;
+            if (!parse_number(&s, 16, 1, 0xFF, &usage)) {
+                ok = false;
+                break;
+            }
+            if (keys < REMAP_CHORD_KEYS) {
+                chord[keys++] = usage;
+            }
+        } while (*s == '+' && *++s != '\0');
+
+        if (!ok || (*s != '\0' && *s != ';' && !isspace((unsigned char)*s)) || steps >= REMAP_MAX_MACRO_STEPS) {
+            skipped++;
+            // Skip the rest of the chord
+            while (*s != '\0' && *s != ';' && !isspace((unsigned char)*s)) {
+                s++;
+            }
+            continue;
+        }
+
+        memcpy(s_macro_steps[steps++], chord, sizeof(chord));
+        s_macro_len[macro]++;
+    }
+
+    if (skipped > 0) {
+        ESP_LOGW(TAG, "Skipped %d macro chord(s)", skipped);
+    }
+    return skipped;
+}
+
+esp_err_t key_remap_compile(const char *keys, const char *macros) {
+    s_enabled = false;
+    for (int i = 0; i < 256; i++) {
+        s_key_lut[0][i] = ACTION(ACTION_KEY, i);
+    }
+    for (int i = 0; i < REMAP_MAX_BUTTONS; i++) {
+        s_button_lut[0][i] = ACTION(ACTION_BUTTON, i);
+    }
+
+    int skipped = apply_entries(keys, true);
+    for (int layer = 1; layer < REMAP_MAX_LAYERS; layer++) {
+        memcpy(s_key_lut[layer], s_key_lut[0], sizeof(s_key_lut[0]));
+        memcpy(s_button_lut[layer], s_button_lut[0], sizeof(s_button_lut[0]));
+    }
+    apply_entries(keys, false);
+    skipped += compile_macros(macros);
+
+    s_key_layer = 0;
+    s_button_layer = 0;
+    key_bitmap_clear(&s_key_keys);
+    key_bitmap_clear(&s_button_keys);
+    s_key_buttons = 0;
+    s_button_buttons = 0;
+    s_key_macros = 0;
+    s_button_macros = 0;
+    s_macro_queue = 0;
+    s_macro_playing = -1;
+
+    ESP_LOGI(TAG, "Remapping %s", s_enabled ? "enabled" : "disabled");
+    return skipped > 0 ? ESP_ERR_INVALID_ARG : ESP_OK;
+}
+
+bool key_remap_enabled(void) {
+    return s_enabled;
+}
+
+__attribute__((section(".iram1.text"))) static void apply_action(const uint16_t action, key_bitmap_t *keys,
+                                                                 uint32_t *buttons, uint8_t *macros) {
+    switch (ACTION_TYPE(action)) {
+        case ACTION_KEY:
+            if (ACTION_ARG(action) != 0) {
+                key_bitmap_set(keys, ACTION_ARG(action));
+            }
+            break;
+        case ACTION_BUTTON:
+            *buttons |= 1UL << ACTION_ARG(action);
+            break;
+        case ACTION_MACRO:
+            *macros |= 1 << ACTION_ARG(action);
+            break;
+        default:
+            break;
+    }
+}
+
+static inline uint8_t active_layer(void) {
+    return s_key_layer > s_button_layer ? s_key_layer : s_button_layer;
+}
+
+__attribute__((section(".iram1.text"))) bool key_remap_keyboard(const key_bitmap_t *in, key_bitmap_t *out) {
+    // Layer keys are looked up on layer 0, so holding one can't switch itself off
+    uint8_t layer = 0;
+    for (int word = 0; word < KEY_BITMAP_WORDS; word++) {
+        for (uint32_t bits = in->words[word]; bits != 0; bits &= bits - 1) {
+            const uint16_t action = s_key_lut[0][word * 32 + __builtin_ctz(bits)];
+            if (ACTION_TYPE(action) == ACTION_LAYER && ACTION_ARG(action) > layer) {
+                layer = ACTION_ARG(action);
+            }
+        }
+    }
+    s_key_layer = layer;
+
+    const uint16_t *lut = s_key_lut[active_layer()];
+    uint32_t buttons = 0;
+    uint8_t macros = 0;
+    key_bitmap_clear(&s_key_keys);
+    for (int word = 0; word < KEY_BITMAP_WORDS; word++) {
+        for (uint32_t bits = in->words[word]; bits != 0; bits &= bits - 1) {
+            apply_action(lut[word * 32 + __builtin_ctz(bits)], &s_key_keys, &buttons, &macros);
+        }
+    }
+
+    s_macro_queue |= macros & ~s_key_macros;
+    s_key_macros = macros;
+    key_remap_current_keys(out);
+
+    const bool buttons_changed = buttons != s_key_buttons;
+    s_key_buttons = buttons;
+    return buttons_changed;
+}
+
+__attribute__((section(".iram1.text"))) bool key_remap_buttons(const uint32_t in, uint32_t *out) {
+    uint8_t layer = 0;
+    for (uint32_t bits = in & ((1UL << REMAP_MAX_BUTTONS) - 1); bits != 0; bits &= bits - 1) {
+        const uint16_t action = s_button_lut[0][__builtin_ctz(bits)];
+        if (ACTION_TYPE(action) == ACTION_LAYER && ACTION_ARG(action) > layer) {
+            layer = ACTION_ARG(action);
+        }
+    }
+    s_button_layer = layer;
+
+    const uint16_t *lut = s_button_lut[active_layer()];
+    uint32_t buttons = in & ~((1UL << REMAP_MAX_BUTTONS) - 1);
+    uint8_t macros = 0;
+    key_bitmap_t keys;
+    key_bitmap_clear(&keys);
+    for (uint32_t bits = in & ((1UL << REMAP_MAX_BUTTONS) - 1); bits != 0; bits &= bits - 1) {
+        apply_action(lut[__builtin_ctz(bits)], &keys, &buttons, &macros);
+    }
+
+    s_macro_queue |= macros & ~s_button_macros;
+    s_button_macros = macros;
+    s_button_buttons = buttons;
+    *out = buttons | s_key_buttons;
+
+    const bool keys_changed = !key_bitmap_equal(&keys, &s_button_keys);
+    s_button_keys = keys;
+    return keys_changed;
+}
+
+void key_remap_current_keys(key_bitmap_t *out) {
+    for (int word = 0; word < KEY_BITMAP_WORDS; word++) {
+        out->words[word] = s_key_keys.words[word] | s_button_keys.words[word];
+    }
+}
+
+uint32_t key_remap_current_buttons(void) {
+    return s_key_buttons | s_button_buttons;
+}
+
+bool key_remap_macro_pending(void) {
+    return s_macro_playing >= 0 || s_macro_queue != 0;
+}
+
+bool key_remap_macro_step(key_bitmap_t *out) {
+    while (s_macro_playing < 0 || s_macro_step >= s_macro_len[s_macro_playing] * 2) {
+        if (s_macro_queue == 0) {
+            s_macro_playing = -1;
+            return false;
+        }
+        s_macro_playing = __builtin_ctz(s_macro_queue);
+        s_macro_queue &= s_macro_queue - 1;
+        s_macro_step = 0;
+    }
+
+    key_remap_current_keys(out);
+    if ((s_macro_step & 1) == 0) {
+        const uint8_t *chord = s_macro_steps[s_macro_start[s_macro_playing] + s_macro_step / 2];
+        for (int i = 0; i < REMAP_CHORD_KEYS && chord[i] != 0; i++) {
+            key_bitmap_set(out, chord[i]);
+        }
+    }
+    s_macro_step++;
+    return true;
+}
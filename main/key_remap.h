@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "key_bitmap.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Key and mouse button remapping with momentary layers and macros, applied by the bridge to every
+ * keyboard and mouse report before it goes to BLE.
+ *
+ * Settings compile into one 256-entry lookup table per layer, so a held key costs one load however
+ * many remaps exist. Layers start as a copy of layer 0, a layer only lists what it changes.
+ *
+ * Remaps ("remap.keys"), space separated [layer:]source=action entries, numbers in hex:
+ *
+ *   39=e0          Caps Lock -> Left Control
+ *   e6=l1          Right Alt switches to layer 1 while held
+ *   1:0b=50        H on layer 1 -> Left Arrow
+ *   b4=m1          mouse button 4 plays macro 1
+ *   e3=0           Left GUI disabled
+ *
+ * A source is a Keyboard page usage or b1..b8, a mouse button. An action is a usage, b1..b8,
+ * l1..l3 (layer) or m1..m8 (macro, counted in "remap.macros"). Usages starting with b take a
+ * leading 0 ("0b4").
+ *
+ * Macros ("remap.macros"), separated by ';', each a list of chords tapped in order, keys of a chord
+ * joined with '+':  "e1+0b 08 0f 0f 12;29"
+ */
+#define REMAP_MAX_LAYERS        4
+#define REMAP_MAX_BUTTONS       8
+#define REMAP_MAX_MACROS        8
+#define REMAP_MAX_MACRO_STEPS   64     // chords over all macros
+#define REMAP_CHORD_KEYS        4
+// A macro chord is pressed for one step and released for the next
+#define REMAP_MACRO_STEP_US     (12 * 1000)
+
+/**
+ * @brief Compile the remap settings into the lookup tables
+ *
+ * Not thread safe, call from the task that applies the remaps. Malformed entries are skipped.
+ *
+ * @param keys "remap.keys" spec
+ * @param macros "remap.macros" spec
+ * @return esp_err_t ESP_OK on success, ESP_ERR_INVALID_ARG if an entry was skipped
+ */
+esp_err_t key_remap_compile(const char *keys, const char *macros);
+
+/**
+ * @brief Check if anything is remapped
+ *
+ * @return true if the reports need to go through the remap functions
+ */
+bool key_remap_enabled(void);
+
+/**
+ * @brief Remap the physical keyboard state
+ *
+ * @param in Keys held on the USB keyboard
+ * @param out Keys to send, includes the ones mouse buttons are mapped to
+ * @return true if the mouse buttons keys are mapped to changed, a mouse report is due
+ */
+bool key_remap_keyboard(const key_bitmap_t *in, key_bitmap_t *out);
+
+/**
+ * @brief Remap the physical mouse buttons
+ *
+ * @param in Buttons held on the USB mouse
+ * @param out Buttons to send, includes the ones keys are mapped to
+ * @return true if the keys buttons are mapped to changed, a keyboard report is due
+ */
+bool key_remap_buttons(uint32_t in, uint32_t *out);
+
+/**
+ * @brief Current remapped keyboard state, for reports the bridge synthesizes
+ *
+ * @param out Keys to send
+ */
+void key_remap_current_keys(key_bitmap_t *out);
+
+/**
+ * @brief Current remapped button state, for reports the bridge synthesizes
+ *
+ * @return Buttons to send
+ */
+uint32_t key_remap_current_buttons(void);
+
+/**
+ * @brief Check if a macro is playing or queued
+ *
+ * @return true if key_remap_macro_step() has steps left
+ */
+bool key_remap_macro_pending(void);
+
+/**
+ * @brief Advance macro playback by one step, call every REMAP_MACRO_STEP_US while a macro is pending
+ *
+ * @param out Keys to send, the current remapped state plus the chord of this step
+ * @return true if out holds a step, false once playback is finished
+ */
+bool key_remap_macro_step(key_bitmap_t *out);
+
+#ifdef __cplusplus
+}
+#endif
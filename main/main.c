@@ -10,7 +10,6 @@
 #include "freertos/task.h"
 #include "freertos/queue.h"
 #include "esp_log.h"
-#include "esp_pm.h"
 #include "esp_err.h"
 #include "nvs_flash.h"
 #include "nvs.h"
@@ -20,47 +19,73 @@
 #include "hid_bridge.h"
 #include "utils/rgb_leds.h"
 #include "utils/storage.h"
+#include "utils/nvs_writer.h"
 #include "utils/rotary_enc.h"
+#include "utils/power_manager.h"
+#include "utils/battery.h"
+#include "utils/boot_profile.h"
+#include "utils/heap_report.h"
+#include "utils/perf_counters.h"
 #include "web/http_server.h"
 
 static const char *TAG = "MAIN";
 static QueueHandle_t intrQueue = NULL;
 
+// Re-check interval while the LED pattern debounces a state change
+#define LED_RECHECK_MS 50
+
 static void init_variables(void);
-static void init_pm(void);
 static void init_gpio(void);
 static void run_hid_bridge(void);
 static void init_web_stack(void);
 static void rot_long_press_cb(void);
+static void rot_cb(int8_t direction);
 
 void app_main(void) {
     ESP_LOGI(TAG, "Starting USB HID to BLE HID bridge");
+    perf_counters_init();
 
+    boot_phase_begin(BOOT_PHASE_NVS);
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
         ESP_ERROR_CHECK(nvs_flash_erase());
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
+    boot_phase_end(BOOT_PHASE_NVS);
 
-    init_pm();
+    power_manager_init();
     init_variables();
     init_gpio();
+    power_manager_enable_wakeup();
+    nvs_writer_init();
+    boot_phase_begin(BOOT_PHASE_SETTINGS);
     init_global_settings();
+    boot_phase_end(BOOT_PHASE_SETTINGS);
+
+    // HID path first, USB host and BLE come up side by side. Everything else waits until reports can flow.
+    run_hid_bridge();
 
+    boot_phase_begin(BOOT_PHASE_DEFERRED);
     led_control_init(NUM_LEDS, GPIO_WS2812B_PIN);
     led_update_pattern(usb_hid_host_device_connected(), ble_hid_device_connected(), hid_bridge_is_ble_paused());
 
     rotary_enc_init();
     // rotary_enc_subscribe_long_press(rot_long_press_cb);
     rotary_enc_subscribe_click(rot_long_press_cb);
+    rotary_enc_subscribe(rot_cb);
 
-    run_hid_bridge();
+    battery_init();
     init_web_stack();
+    boot_phase_end(BOOT_PHASE_DEFERRED);
+    boot_profile_log();
+    heap_report_start();
 
+    // Woken by state changes only, so an idle bridge doesn't keep the CPU out of light sleep
     while (1) {
-        vTaskDelay(pdMS_TO_TICKS(35));
-        led_update_pattern(usb_hid_host_device_connected(), ble_hid_device_connected(), hid_bridge_is_ble_paused());
+        const bool pending = led_update_pattern(usb_hid_host_device_connected(), ble_hid_device_connected(),
+                                                hid_bridge_is_ble_paused());
+        power_manager_wait_state_change(pending ? pdMS_TO_TICKS(LED_RECHECK_MS) : portMAX_DELAY);
     }
 }
 
@@ -68,16 +93,8 @@ static void init_variables() {
     intrQueue = xQueueCreate(4, sizeof(int));
 }
 
-static void init_pm() {
-    const esp_pm_config_t cfg = {
-        .light_sleep_enable = false,
-        .max_freq_mhz = 80,
-        .min_freq_mhz = 10,
-    };
-    ESP_ERROR_CHECK(esp_pm_configure(&cfg));
-}
-
 static void run_hid_bridge() {
+    boot_phase_begin(BOOT_PHASE_HID_PATH);
     gpio_set_level(GPIO_MUX_OE, 0);
 
 #ifdef HW01
@@ -96,6 +113,7 @@ static void run_hid_bridge() {
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to start HID bridge: %s", esp_err_to_name(ret));
     }
+    boot_phase_end(BOOT_PHASE_HID_PATH);
 }
 
 static void init_web_stack(void) {
@@ -181,12 +199,13 @@ static void init_gpio(void) {
     };
     gpio_config(&input_nopull_conf);
 
+    // Decoded by PCNT, no interrupt per edge
     const gpio_config_t rot_conf = {
         .pin_bit_mask = (1ULL << GPIO_ROT_A) | (1ULL << GPIO_ROT_B),
         .mode = GPIO_MODE_INPUT,
         .pull_up_en = GPIO_PULLUP_ENABLE,
         .pull_down_en = GPIO_PULLDOWN_DISABLE,
-        .intr_type = GPIO_INTR_ANYEDGE
+        .intr_type = GPIO_INTR_DISABLE
     };
     gpio_config(&rot_conf);
 
@@ -227,6 +246,12 @@ static void init_gpio(void) {
     gpio_set_level(GPIO_5V_EN, 1);
 }
 
+static void rot_cb(const int8_t direction) {
+    if (ble_hid_device_num_hosts() > 1) {
+        ble_hid_device_cycle_host(direction);
+    }
+}
+
 static void rot_long_press_cb(void) {
     rotary_enc_deinit();
     rgb_enter_flash_mode();
@@ -0,0 +1,196 @@
+#include "descriptor_cache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "nvs.h"
+#include "nvs_writer.h"
+
+#define CACHE_NAMESPACE "desc_cache"
+#define CACHE_KEY_FMT   "entry%d"
+// Bump when the parser output changes meaning, the struct size alone doesn't catch that
+#define CACHE_VERSION   3
+#define CACHE_LAYOUT    ((CACHE_VERSION << 16) | sizeof(report_info_t))
+
+// Also the NVS blob, persisted entries from another layout are ignored
+typedef struct {
+    uint32_t layout;
+    descriptor_cache_key_t key;
+    uint8_t num_reports;
+    uint8_t report_ids[DESCRIPTOR_CACHE_MAX_REPORTS];
+    report_info_t reports[DESCRIPTOR_CACHE_MAX_REPORTS];
+    hid_res_mult_t res_mult;
+} cache_entry_t;
+
+static const char *TAG = "DESC_CACHE";
+static cache_entry_t s_entries[DESCRIPTOR_CACHE_ENTRIES];
+static uint32_t s_last_used[DESCRIPTOR_CACHE_ENTRIES];
+static uint32_t s_use_counter = 0;
+static uint32_t s_dirty = 0;
+static StaticSemaphore_t s_mutex_struct;
+static SemaphoreHandle_t s_mutex = NULL;
+static int8_t s_writer_id = -1;
+
+static bool entry_valid(const cache_entry_t *entry) {
+    return entry->layout == CACHE_LAYOUT && entry->num_reports > 0 &&
+           entry->num_reports <= DESCRIPTOR_CACHE_MAX_REPORTS;
+}
+
+static bool key_equal(const descriptor_cache_key_t *a, const descriptor_cache_key_t *b) {
+    return a->vid == b->vid && a->pid == b->pid && a->iface == b->iface && a->desc_len == b->desc_len &&
+           a->desc_crc == b->desc_crc;
+}
+
+#if DESCRIPTOR_CACHE_PERSIST
+// Runs on the write-behind task, entries are only ever replaced so only dirty slots are written
+static esp_err_t flush_entries(void *arg) {
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(CACHE_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    char name[16];
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    for (int i = 0; i < DESCRIPTOR_CACHE_ENTRIES && err == ESP_OK; i++) {
+        if (!(s_dirty & (1UL << i))) {
+            continue;
+        }
+        snprintf(name, sizeof(name), CACHE_KEY_FMT, i);
+        err = nvs_set_blob(nvs_handle, name, &s_entries[i], sizeof(cache_entry_t));
+        if (err == ESP_OK) {
+            s_dirty &= ~(1UL << i);
+        }
+    }
+    xSemaphoreGive(s_mutex);
+
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error writing cache: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+static void load_entries(void) {
+    nvs_handle_t nvs_handle;
+    if (nvs_open(CACHE_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK) {
+        // Nothing persisted yet
+        return;
+    }
+
+    char name[16];
+    int loaded = 0;
+    for (int i = 0; i < DESCRIPTOR_CACHE_ENTRIES; i++) {
+        size_t size = sizeof(cache_entry_t);
+        snprintf(name, sizeof(name), CACHE_KEY_FMT, i);
+        if (nvs_get_blob(nvs_handle, name, &s_entries[i], &size) != ESP_OK || size != sizeof(cache_entry_t) ||
+            !entry_valid(&s_entries[i])) {
+            memset(&s_entries[i], 0, sizeof(cache_entry_t));
+            continue;
+        }
+        loaded++;
+    }
+    nvs_close(nvs_handle);
+    ESP_LOGI(TAG, "Loaded %d cached descriptor(s)", loaded);
+}
+#endif
+
+esp_err_t descriptor_cache_init(void) {
+    if (s_mutex != NULL) {
+        return ESP_OK;
+    }
+
+    s_mutex = xSemaphoreCreateMutexStatic(&s_mutex_struct);
+    memset(s_entries, 0, sizeof(s_entries));
+#if DESCRIPTOR_CACHE_PERSIST
+    load_entries();
+    s_writer_id = nvs_writer_register(flush_entries, NULL);
+    if (s_writer_id < 0) {
+        ESP_LOGW(TAG, "No write-behind slot, cache stays in RAM");
+    }
+#endif
+    return ESP_OK;
+}
+
+void descriptor_cache_make_key(const uint16_t vid, const uint16_t pid, const uint8_t iface, const uint8_t *desc,
+                               const size_t desc_len, descriptor_cache_key_t *key) {
+    memset(key, 0, sizeof(descriptor_cache_key_t));
+    key->vid = vid;
+    key->pid = pid;
+    key->iface = iface;
+    key->desc_len = desc_len;
+    key->desc_crc = esp_rom_crc32_le(0, desc, desc_len);
+}
+
+bool descriptor_cache_lookup(const descriptor_cache_key_t *key, report_map_t *report_map) {
+    if (s_mutex == NULL) {
+        return false;
+    }
+
+    bool hit = false;
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    for (int i = 0; i < DESCRIPTOR_CACHE_ENTRIES; i++) {
+        const cache_entry_t *entry = &s_entries[i];
+        if (!entry_valid(entry) || !key_equal(&entry->key, key)) {
+            continue;
+        }
+
+        memset(report_map, 0, sizeof(report_map_t));
+        report_map->num_reports = entry->num_reports;
+        memcpy(report_map->report_ids, entry->report_ids, entry->num_reports);
+        memcpy(report_map->reports, entry->reports, entry->num_reports * sizeof(report_info_t));
+        report_map->res_mult = entry->res_mult;
+        s_last_used[i] = ++s_use_counter;
+        hit = true;
+        break;
+    }
+    xSemaphoreGive(s_mutex);
+    return hit;
+}
+
+void descriptor_cache_store(const descriptor_cache_key_t *key, const report_map_t *report_map) {
+    if (s_mutex == NULL || report_map->num_reports == 0) {
+        return;
+    }
+    if (report_map->num_reports > DESCRIPTOR_CACHE_MAX_REPORTS) {
+        ESP_LOGI(TAG, "%d reports, too many to cache", report_map->num_reports);
+        return;
+    }
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    int slot = 0;
+    for (int i = 0; i < DESCRIPTOR_CACHE_ENTRIES; i++) {
+        if (!entry_valid(&s_entries[i]) || key_equal(&s_entries[i].key, key)) {
+            slot = i;
+            break;
+        }
+        if (s_last_used[i] < s_last_used[slot]) {
+            slot = i;
+        }
+    }
+
+    cache_entry_t *entry = &s_entries[slot];
+    memset(entry, 0, sizeof(cache_entry_t));
+    entry->layout = CACHE_LAYOUT;
+    entry->key = *key;
+    entry->num_reports = report_map->num_reports;
+    memcpy(entry->report_ids, report_map->report_ids, report_map->num_reports);
+    memcpy(entry->reports, report_map->reports, report_map->num_reports * sizeof(report_info_t));
+    entry->res_mult = report_map->res_mult;
+    s_last_used[slot] = ++s_use_counter;
+    s_dirty |= 1UL << slot;
+    xSemaphoreGive(s_mutex);
+
+    ESP_LOGI(TAG, "Cached %04x:%04x interface %d in slot %d", key->vid, key->pid, key->iface, slot);
+    if (s_writer_id >= 0) {
+        nvs_writer_mark_dirty(s_writer_id);
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "hid_bridge.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DESCRIPTOR_CACHE_ENTRIES     4
+// Interfaces with more reports than this are parsed on every connect
+#define DESCRIPTOR_CACHE_MAX_REPORTS 4
+// Keep entries in NVS so the first connect after a reboot is a hit too
+#define DESCRIPTOR_CACHE_PERSIST     1
+
+/**
+ * A descriptor is identified by who sent it and what it hashes to, so a firmware update of the
+ * device (same VID/PID, different descriptor) is a miss rather than a stale plan.
+ */
+typedef struct {
+    uint16_t vid;
+    uint16_t pid;
+    uint8_t iface;
+    uint16_t desc_len;
+    uint32_t desc_crc;
+} descriptor_cache_key_t;
+
+/**
+ * @brief Load persisted entries, call once NVS is initialized
+ *
+ * @return esp_err_t ESP_OK on success, also when nothing was persisted yet
+ */
+esp_err_t descriptor_cache_init(void);
+
+/**
+ * @brief Build the key of a report descriptor
+ *
+ * @param vid Vendor ID of the device, 0 if unknown
+ * @param pid Product ID of the device, 0 if unknown
+ * @param iface Interface number
+ * @param desc Report descriptor
+ * @param desc_len Length of desc
+ * @param key Output key
+ */
+void descriptor_cache_make_key(uint16_t vid, uint16_t pid, uint8_t iface, const uint8_t *desc, size_t desc_len,
+                               descriptor_cache_key_t *key);
+
+/**
+ * @brief Fill a report map from the cache
+ *
+ * @param key Descriptor key
+ * @param report_map Output report map, untouched on a miss
+ * @return true on a hit
+ */
+bool descriptor_cache_lookup(const descriptor_cache_key_t *key, report_map_t *report_map);
+
+/**
+ * @brief Remember a parsed report map, evicting the least recently used entry
+ *
+ * @param key Descriptor key
+ * @param report_map Report map as returned by parse_report_descriptor()
+ */
+void descriptor_cache_store(const descriptor_cache_key_t *key, const report_map_t *report_map);
+
+#ifdef __cplusplus
+}
+#endif
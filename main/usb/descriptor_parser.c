@@ -7,6 +7,140 @@
 
 static const char *TAG = "HID_DSC_PARSE";
 
+static bool build_decode_op(const report_field_info_t *field, const uint16_t bits, const bool is_signed,
+                            hid_decode_op_t *op) {
+    memset(op, 0, sizeof(hid_decode_op_t));
+    if (!field) {
+        op->kind = HID_DECODE_NONE;
+        return true;
+    }
+
+    op->byte_offset = field->bit_offset / 8;
+    op->shift = field->bit_offset % 8;
+    op->bits = bits;
+    op->is_signed = is_signed;
+    op->num_bytes = (op->shift + bits + 7) / 8;
+    op->mask = bits >= 32 ? UINT32_MAX : (1UL << bits) - 1;
+
+    if (op->shift == 0 && bits == 8) {
+        op->kind = is_signed ? HID_DECODE_S8 : HID_DECODE_U8;
+    } else if (op->shift == 0 && bits == 16) {
+        op->kind = is_signed ? HID_DECODE_S16 : HID_DECODE_U16;
+    } else if (bits > 0 && op->shift + bits <= 32) {
+        op->kind = HID_DECODE_BITS;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static bool field_is_signed(const report_field_info_t *field) {
+    return field && (field->attr.logical_min < 0 || field->attr.relative);
+}
+
+static int8_t pointer_target(const report_field_info_t *field) {
+    if (field->attr.constant || !field->attr.variable) {
+        return -1;
+    }
+
+    // Absolute axes belong to gamepads and digitizers, forwarding them as motion would mangle them
+    switch (field->attr.usage_page) {
+        case HID_USAGE_PAGE_GENERIC_DESKTOP:
+            if (field->attr.usage == HID_USAGE_X && field->attr.relative) return HID_TARGET_X;
+            if (field->attr.usage == HID_USAGE_Y && field->attr.relative) return HID_TARGET_Y;
+            if (field->attr.usage == HID_USAGE_WHEEL) return HID_TARGET_WHEEL;
+            return -1;
+        case HID_USAGE_PAGE_CONSUMER:
+            return field->attr.usage == 0x238 ? HID_TARGET_PAN : -1;
+        case HID_USAGE_PAGE_BUTTON:
+            return field->attr.report_size == 1 && field->attr.usage >= 1 &&
+                   field->attr.usage <= HID_TRANSLATION_MAX_BUTTONS ? HID_TARGET_BUTTONS : -1;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Compile the pointer translation table of a report: one entry per source field, no per-device code.
+ * Returns true if the report has relative X and Y.
+ */
+static bool build_translation(const report_info_t *report, hid_translation_t *table) {
+    uint8_t seen = 0;
+    table->decodable = true;
+
+    for (int j = 0; j < report->num_fields && table->num_entries < HID_TRANSLATION_MAX_ENTRIES; j++) {
+        const report_field_info_t *field = &report->fields[j];
+        const int8_t target = pointer_target(field);
+        if (target < 0 || (target != HID_TARGET_BUTTONS && (seen & (1 << target)))) {
+            continue;
+        }
+
+        hid_translation_entry_t *entry = &table->entries[table->num_entries++];
+        entry->field_index = j;
+        entry->target = target;
+        entry->scale = 1;
+        seen |= 1 << target;
+
+        bool ok;
+        if (target == HID_TARGET_BUTTONS) {
+            entry->merge_bits = true;
+            entry->shift = field->attr.usage - 1;
+            const uint16_t bits = MIN(field->bit_size, HID_TRANSLATION_MAX_BUTTONS - entry->shift);
+            ok = build_decode_op(field, bits, false, &entry->op);
+        } else {
+            ok = build_decode_op(field, field->attr.report_size, field_is_signed(field), &entry->op);
+        }
+        table->decodable = table->decodable && ok;
+    }
+
+    return (seen & (1 << HID_TARGET_X)) && (seen & (1 << HID_TARGET_Y));
+}
+
+// Expects report->plan zeroed with the pointer table already compiled
+static void build_decode_plan(report_info_t *report) {
+    const report_field_info_t *modifier = NULL, *keys = NULL, *bitmap = NULL;
+    hid_decode_plan_t *plan = &report->plan;
+
+    for (int j = 0; j < report->num_fields; j++) {
+        const report_field_info_t *field = &report->fields[j];
+        if (field->attr.constant || field->attr.usage_page != HID_USAGE_KEYPAD) {
+            continue;
+        }
+
+        if (field->attr.variable && field->attr.usage == HID_KEY_LEFT_CTRL && !modifier) {
+            modifier = field;
+        } else if (field->attr.variable && field->attr.report_size == 1 && field->attr.usage <= 0xFF && !bitmap) {
+            bitmap = field;
+        } else if (field->attr.array && !keys) {
+            keys = field;
+        }
+    }
+
+    bool ok;
+    if (report->is_keyboard) {
+        // Boot style keycode array, NKRO bitmap, or both (some boards send 6 keys plus a bitmap for the rest)
+        const bool keys_ok = keys && keys->attr.report_size == 8 && keys->bit_offset % 8 == 0;
+        ok = (keys_ok || bitmap) && (!keys || keys_ok);
+        ok = ok && build_decode_op(modifier, modifier ? MIN(modifier->bit_size, 8) : 0, false, &plan->modifier);
+        if (ok && keys) {
+            plan->keys_byte_offset = keys->bit_offset / 8;
+            plan->keys_count = keys->attr.report_count;
+        }
+        if (ok && bitmap) {
+            plan->bitmap_bit_offset = bitmap->bit_offset;
+            plan->bitmap_usage_min = bitmap->attr.usage;
+            plan->bitmap_count = bitmap->attr.report_count;
+        }
+    } else if (report->is_mouse) {
+        ok = plan->pointer.decodable;
+    } else {
+        ok = false;
+    }
+
+    plan->valid = ok;
+}
+
 void parse_report_descriptor(const uint8_t *desc, const size_t length, const uint8_t interface_num,
                              report_map_t *report_map) {
     uint16_t current_usage_page = 0;
@@ -20,6 +154,13 @@ void parse_report_descriptor(const uint8_t *desc, const size_t length, const uin
     bool has_usage_range = false;
     uint8_t current_report_id = 0;
     bool is_relative = false;
+    int physical_max = 0;
+    // Feature reports are laid out apart from the input ones, only the Resolution Multiplier is kept
+    uint8_t feature_ids[MAX_REPORTS_PER_INTERFACE];
+    uint16_t feature_bits[MAX_REPORTS_PER_INTERFACE];
+    uint8_t num_feature_ids = 0;
+    hid_res_mult_t *res_mult = &report_map->res_mult;
+    memset(res_mult, 0, sizeof(hid_res_mult_t));
 
     report_info_t *current_report = &report_map->reports[0];
     report_map->report_ids[0] = 0;
@@ -29,6 +170,7 @@ void parse_report_descriptor(const uint8_t *desc, const size_t length, const uin
     current_report->usage_stack_pos = 0;
     current_report->is_mouse = false;
     current_report->is_keyboard = false;
+    current_report->is_consumer = false;
 
     for (size_t i = 0; i < length;) {
         const uint8_t item = desc[i++];
@@ -46,8 +188,63 @@ void parse_report_descriptor(const uint8_t *desc, const size_t length, const uin
         switch (item_type) {
             case 0: // Main
                 switch (item_tag) {
-                    case 8: // Input
                     case 9: // Output
+                        // Output reports have a layout of their own, none of it is part of the input report
+                        if (current_report) {
+                            current_report->usage_stack_pos = 0;
+                        }
+                        has_usage_range = false;
+                        usage_minimum = 0;
+                        usage_maximum = 0;
+                        break;
+                    case 11: { // Feature
+                        int index = -1;
+                        for (int j = 0; j < num_feature_ids; j++) {
+                            if (feature_ids[j] == current_report_id) {
+                                index = j;
+                                break;
+                            }
+                        }
+                        if (index < 0 && num_feature_ids < MAX_REPORTS_PER_INTERFACE) {
+                            index = num_feature_ids++;
+                            feature_ids[index] = current_report_id;
+                            feature_bits[index] = 0;
+                        }
+
+                        const uint16_t usage = current_report && current_report->usage_stack_pos > 0
+                                                   ? current_report->usage_stack[0] : current_usage;
+                        const bool is_multiplier = index >= 0 && !(data & 0x01) && (data & 0x02) &&
+                                                   current_usage_page == HID_USAGE_PAGE_GENERIC_DESKTOP &&
+                                                   usage == HID_USAGE_RESOLUTION_MULTIPLIER &&
+                                                   report_size <= 8 && logical_max > 0;
+                        if (is_multiplier && res_mult->num_fields < HID_RES_MULT_MAX_FIELDS &&
+                            (res_mult->num_fields == 0 || res_mult->report_id == current_report_id)) {
+                            // Physical range absent means the multiplier is the logical value itself
+                            const int multiplier = physical_max > 0 ? physical_max : logical_max;
+                            const uint8_t n = res_mult->num_fields++;
+                            res_mult->report_id = current_report_id;
+                            res_mult->bit_offset[n] = feature_bits[index];
+                            res_mult->bits[n] = report_size;
+                            res_mult->value[n] = logical_max;
+                            if (n == 0) {
+                                res_mult->multiplier = multiplier <= UINT8_MAX ? multiplier : 0;
+                            } else if (res_mult->multiplier != multiplier) {
+                                res_mult->multiplier = 0;
+                            }
+                        }
+                        if (index >= 0) {
+                            feature_bits[index] += report_size * report_count;
+                        }
+
+                        if (current_report) {
+                            current_report->usage_stack_pos = 0;
+                        }
+                        has_usage_range = false;
+                        usage_minimum = 0;
+                        usage_maximum = 0;
+                        break;
+                    }
+                    case 8: // Input
                         if (current_report && current_report->num_fields < MAX_REPORT_FIELDS) {
                             const bool is_constant = (data & 0x01) != 0;
                             const bool is_variable = (data & 0x02) != 0;
@@ -77,6 +274,7 @@ void parse_report_descriptor(const uint8_t *desc, const size_t length, const uin
                                     current_report->usage_stack_pos = 0;
                                     current_report->is_mouse = false;
                                     current_report->is_keyboard = false;
+                                    current_report->is_consumer = false;
                                     report_map->num_reports++;
                                 }
                             }
@@ -253,6 +451,15 @@ void parse_report_descriptor(const uint8_t *desc, const size_t length, const uin
                             logical_max = (int) data;
                         }
                         break;
+                    case 4: // Physical Maximum
+                        if (item_size == 1 && (data & 0x80)) {
+                            physical_max = (int8_t) data;
+                        } else if (item_size == 2 && (data & 0x8000)) {
+                            physical_max = (int16_t) data;
+                        } else {
+                            physical_max = (int) data;
+                        }
+                        break;
                     case 7: // Report Size
                         report_size = data;
                         break;
@@ -286,6 +493,12 @@ void parse_report_descriptor(const uint8_t *desc, const size_t length, const uin
         }
     }
 
+    for (int j = 0; j < num_feature_ids && res_mult->num_fields > 0; j++) {
+        if (feature_ids[j] == res_mult->report_id) {
+            res_mult->report_len = (feature_bits[j] + 7) / 8;
+        }
+    }
+
     // ESP_LOGI(TAG, "=== Report Descriptor Summary ===");
     // ESP_LOGI(TAG, "Interface: %d, Total Reports: %d", interface_num, report_map->num_reports);
     //
@@ -314,34 +527,135 @@ void parse_report_descriptor(const uint8_t *desc, const size_t length, const uin
 
     for (int i = 0; i < report_map->num_reports; i++) {
         report_info_t *report = &report_map->reports[i];
+        memset(&report->plan, 0, sizeof(hid_decode_plan_t));
+        report->is_mouse = build_translation(report, &report->plan.pointer);
         for (int j = 0; j < report->num_fields; j++) {
             const report_field_info_t *field = &report->fields[j];
 
-            if (field->attr.usage_page == HID_USAGE_PAGE_GENERIC_DESKTOP) {
-                if (field->attr.usage == HID_USAGE_X || field->attr.usage == HID_USAGE_Y) {
-                    report->is_mouse = true;
-                }
-                if (field->attr.usage == HID_USAGE_X) {
-                    report->mouse_fields.x = j;
-                } else if (field->attr.usage == HID_USAGE_Y) {
-                    report->mouse_fields.y = j;
-                } else if (field->attr.usage == HID_USAGE_WHEEL) {
-                    report->mouse_fields.wheel = j;
-                }
-            } else if (field->attr.usage == HID_USAGE_PAGE_GENERIC_DESKTOP && field->attr.usage_page == HID_USAGE_PAGE_BUTTON) {
-                report->mouse_fields.buttons = j;
-            } else if (field->attr.usage == 0x238) { // Pan
-                report->mouse_fields.pan = j;
-            }
-
             if (field->attr.usage_page == HID_USAGE_KEYPAD) {
                 report->is_keyboard = true;
+            } else if (field->attr.usage_page == HID_USAGE_PAGE_CONSUMER && !field->attr.constant &&
+                       field->attr.usage != 0x238) {
+                report->is_consumer = true;
             }
         }
 
         if (report->is_keyboard) {
             report->is_mouse = false;
         }
+        if (report->is_keyboard || report->is_mouse) {
+            report->is_consumer = false;
+        }
+
+        build_decode_plan(report);
+        if ((report->is_mouse || report->is_keyboard) && !report->plan.valid) {
+            ESP_LOGW(TAG, "No fast-path decode plan for interface %d report 0x%02x, using generic decoder",
+                     interface_num, report_map->report_ids[i]);
+        }
+    }
+}
+
+void set_wheel_resolution(report_map_t *report_map, const uint8_t counts_per_detent) {
+    const int16_t scale = counts_per_detent > 0 ? HID_WHEEL_RESOLUTION / counts_per_detent : HID_WHEEL_RESOLUTION;
+    for (int i = 0; i < report_map->num_reports; i++) {
+        hid_translation_t *table = &report_map->reports[i].plan.pointer;
+        for (int j = 0; j < table->num_entries; j++) {
+            if (table->entries[j].target == HID_TARGET_WHEEL || table->entries[j].target == HID_TARGET_PAN) {
+                table->entries[j].scale = scale;
+            }
+        }
+    }
+}
+
+__attribute__((section(".iram1.text"))) static inline int32_t decode_op(const hid_decode_op_t *op,
+                                                                        const uint8_t *data) {
+    const uint8_t *p = data + op->byte_offset;
+    switch (op->kind) {
+        case HID_DECODE_U8:
+            return p[0];
+        case HID_DECODE_S8:
+            return (int8_t) p[0];
+        case HID_DECODE_U16:
+            return (uint16_t) (p[0] | p[1] << 8);
+        case HID_DECODE_S16:
+            return (int16_t) (p[0] | p[1] << 8);
+        case HID_DECODE_BITS: {
+            uint32_t raw = 0;
+            for (uint8_t i = 0; i < op->num_bytes; i++) {
+                raw |= (uint32_t) p[i] << (i * 8);
+            }
+            raw = (raw >> op->shift) & op->mask;
+            if (op->is_signed && (raw & (1UL << (op->bits - 1)))) {
+                raw |= ~op->mask;
+            }
+            return (int32_t) raw;
+        }
+        default:
+            return 0;
+    }
+}
+
+__attribute__((section(".iram1.text"))) void decode_mouse_report(const hid_decode_plan_t *plan, const uint8_t *data,
+                                                                 hid_mouse_sample_t *out) {
+    memset(out, 0, sizeof(hid_mouse_sample_t));
+    const hid_translation_t *table = &plan->pointer;
+    for (uint8_t i = 0; i < table->num_entries; i++) {
+        const hid_translation_entry_t *entry = &table->entries[i];
+        const int32_t value = decode_op(&entry->op, data);
+        if (entry->merge_bits) {
+            out->targets[entry->target] |= (int32_t) ((uint32_t) value << entry->shift);
+        } else {
+            out->targets[entry->target] += value * entry->scale;
+        }
+    }
+}
+
+void decode_mouse_fields(const hid_translation_t *table, const usb_hid_field_t *fields, hid_mouse_sample_t *out) {
+    memset(out, 0, sizeof(hid_mouse_sample_t));
+    for (uint8_t i = 0; i < table->num_entries; i++) {
+        const hid_translation_entry_t *entry = &table->entries[i];
+        // Field values are sign-extended from the full field width, narrow them to what the op would decode
+        uint32_t raw = (uint32_t) *fields[entry->field_index].value & entry->op.mask;
+        if (entry->op.is_signed && entry->op.bits < 32 && (raw & (1UL << (entry->op.bits - 1)))) {
+            raw |= ~entry->op.mask;
+        }
+
+        if (entry->merge_bits) {
+            out->targets[entry->target] |= (int32_t) (raw << entry->shift);
+        } else {
+            out->targets[entry->target] += (int32_t) raw * entry->scale;
+        }
+    }
+}
+
+void decode_keyboard_fields(const report_info_t *info, const usb_hid_field_t *fields, key_bitmap_t *keys) {
+    key_bitmap_clear(keys);
+    for (int i = 0; i < info->num_fields; i++) {
+        const usb_hid_field_t *field = &fields[i];
+        if (field->value == NULL || field->attr.usage_page != HID_USAGE_KEYPAD || field->attr.constant) {
+            continue;
+        }
+
+        // Every field value holds up to 64 bits of the raw report, enough for 8 keycodes or a 64 key bitmap
+        const uint8_t *raw = (const uint8_t *) field->value;
+        const uint16_t bits = MIN(field->attr.report_size * field->attr.report_count, 64);
+        if (field->attr.array && field->attr.report_size == 8) {
+            key_bitmap_add_array(keys, raw, bits / 8);
+        } else if (field->attr.variable && field->attr.report_size == 1) {
+            key_bitmap_add_bits(keys, raw, 0, field->attr.usage, bits);
+        }
+    }
+}
+
+__attribute__((section(".iram1.text"))) void decode_keyboard_report(const hid_decode_plan_t *plan,
+                                                                    const uint8_t *data, hid_keyboard_sample_t *out) {
+    key_bitmap_clear(&out->keys);
+    key_bitmap_set_modifiers(&out->keys, (uint8_t) decode_op(&plan->modifier, data));
+    if (plan->keys_count) {
+        key_bitmap_add_array(&out->keys, data + plan->keys_byte_offset, plan->keys_count);
+    }
+    if (plan->bitmap_count) {
+        key_bitmap_add_bits(&out->keys, data, plan->bitmap_bit_offset, plan->bitmap_usage_min, plan->bitmap_count);
     }
 }
 
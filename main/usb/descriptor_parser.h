@@ -17,6 +17,13 @@ extern "C" {
  */
 void parse_report_descriptor(const uint8_t *desc, size_t length, uint8_t interface_num, report_map_t *report_map);
 
+/**
+ * @brief Scale wheel and pan of every report to HID_WHEEL_RESOLUTION counts per detent
+ * @param report_map Parsed report map
+ * @param counts_per_detent Counts the device reports per detent, 1 unless its Resolution Multiplier is set
+ */
+void set_wheel_resolution(report_map_t *report_map, uint8_t counts_per_detent);
+
 /**
  * @brief Extract a field value from raw report data
  * @param data Raw report data
@@ -26,6 +33,44 @@ void parse_report_descriptor(const uint8_t *desc, size_t length, uint8_t interfa
  */
 int64_t extract_field_value(const uint8_t *data, uint16_t bit_offset, uint16_t bit_size);
 
+/**
+ * @brief Decode a mouse report by running its translation table
+ * @param plan Valid decode plan of the report
+ * @param data Raw report data (without report ID)
+ * @param out Decoded buttons and axes
+ */
+void decode_mouse_report(const hid_decode_plan_t *plan, const uint8_t *data, hid_mouse_sample_t *out);
+
+/**
+ * @brief Run the translation table of a report on its decoded field values
+ *
+ * Generic path for reports whose table isn't decodable from raw data.
+ *
+ * @param table Translation table of the report
+ * @param fields Field values of the report
+ * @param out Decoded buttons and axes
+ */
+void decode_mouse_fields(const hid_translation_t *table, const usb_hid_field_t *fields, hid_mouse_sample_t *out);
+
+/**
+ * @brief Collect the keys of a keyboard report from its decoded field values
+ *
+ * Generic path for keyboard reports the parser couldn't build a decode plan for.
+ *
+ * @param info Report the fields belong to
+ * @param fields Field values of the report
+ * @param keys Output key state
+ */
+void decode_keyboard_fields(const report_info_t *info, const usb_hid_field_t *fields, key_bitmap_t *keys);
+
+/**
+ * @brief Decode a keyboard report using its precomputed plan
+ * @param plan Valid decode plan of the report
+ * @param data Raw report data (without report ID)
+ * @param out Decoded key state, array and bitmap fields alike
+ */
+void decode_keyboard_report(const hid_decode_plan_t *plan, const uint8_t *data, hid_keyboard_sample_t *out);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,314 @@
+#include "report_capture.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "hid_bridge.h"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+static const char *TAG = "USB_CAPTURE";
+
+typedef struct {
+    bool in_use;
+    uint8_t dev_addr;
+    uint8_t iface;
+    uint16_t len;
+    uint8_t *data;
+} captured_descriptor_t;
+
+atomic_bool g_report_capture_active = false;
+
+static uint8_t *s_buffer = NULL;
+static uint32_t s_size = 0;
+// Written by the recording side only, a start resets it, which makes an append in flight fail its exchange
+static atomic_uint_fast32_t s_used = 0;
+static volatile uint32_t s_dropped = 0;
+static int64_t s_start_us = 0;
+// USB callbacks inside report_capture_record(), the buffer is only resized or freed while none is
+static atomic_uint s_writers = 0;
+
+static captured_descriptor_t s_descriptors[USB_HID_MAX_SOURCES];
+static StaticSemaphore_t s_descriptors_mutex_struct;
+static SemaphoreHandle_t s_descriptors_mutex = NULL;
+
+static esp_err_t allocate_buffer(void) {
+    uint32_t size = REPORT_CAPTURE_SIZE;
+    s_buffer = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (s_buffer == NULL) {
+        // Leaves the reserve to WiFi and BLE, the capture runs while both are up
+        const size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        size = largest > REPORT_CAPTURE_RESERVE ? MIN(largest - REPORT_CAPTURE_RESERVE, REPORT_CAPTURE_SIZE) : 0;
+        if (size >= REPORT_CAPTURE_MIN_SIZE) {
+            s_buffer = heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        }
+    }
+
+    if (s_buffer == NULL) {
+        ESP_LOGE(TAG, "No memory for a capture buffer");
+        return ESP_ERR_NO_MEM;
+    }
+
+    s_size = size;
+    ESP_LOGI(TAG, "Capture buffer of %lu bytes", size);
+    return ESP_OK;
+}
+
+static void free_buffer(void) {
+    heap_caps_free(s_buffer);
+    s_buffer = NULL;
+    s_size = 0;
+    atomic_store(&s_used, 0);
+}
+
+// Call with g_report_capture_active cleared, a callback that saw it set may still be appending
+static void wait_for_writers(void) {
+    while (atomic_load(&s_writers) != 0) {
+        vTaskDelay(1);
+    }
+}
+
+static void clear_descriptors(void) {
+    for (int i = 0; i < USB_HID_MAX_SOURCES; i++) {
+        free(s_descriptors[i].data);
+        memset(&s_descriptors[i], 0, sizeof(captured_descriptor_t));
+    }
+}
+
+esp_err_t report_capture_start(void) {
+    if (s_descriptors_mutex == NULL) {
+        s_descriptors_mutex = xSemaphoreCreateMutexStatic(&s_descriptors_mutex_struct);
+    }
+
+    atomic_store(&g_report_capture_active, false);
+    wait_for_writers();
+
+    // A buffer shrunk by the previous stop is too small, start over with a fresh one
+    xSemaphoreTake(s_descriptors_mutex, portMAX_DELAY);
+    clear_descriptors();
+    free_buffer();
+    const esp_err_t err = allocate_buffer();
+    xSemaphoreGive(s_descriptors_mutex);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    s_start_us = esp_timer_get_time();
+    s_dropped = 0;
+    atomic_store(&s_used, 0);
+    atomic_store(&g_report_capture_active, true);
+    ESP_LOGI(TAG, "Capture started");
+    return ESP_OK;
+}
+
+void report_capture_stop(void) {
+    if (!atomic_exchange(&g_report_capture_active, false)) {
+        return;
+    }
+    wait_for_writers();
+
+    // Only the recorded part is needed for the download, hand the rest back to the heap
+    const uint32_t used = atomic_load(&s_used);
+    xSemaphoreTake(s_descriptors_mutex, portMAX_DELAY);
+    if (used == 0) {
+        free_buffer();
+    } else {
+        uint8_t *shrunk = heap_caps_realloc(s_buffer, used, MALLOC_CAP_8BIT);
+        if (shrunk != NULL) {
+            s_buffer = shrunk;
+            s_size = used;
+        }
+    }
+    xSemaphoreGive(s_descriptors_mutex);
+
+    ESP_LOGI(TAG, "Capture stopped, %lu bytes, %lu reports dropped", used, s_dropped);
+}
+
+void report_capture_release(void) {
+    if (s_descriptors_mutex == NULL) {
+        return;
+    }
+
+    atomic_store(&g_report_capture_active, false);
+    wait_for_writers();
+
+    xSemaphoreTake(s_descriptors_mutex, portMAX_DELAY);
+    clear_descriptors();
+    free_buffer();
+    xSemaphoreGive(s_descriptors_mutex);
+    ESP_LOGI(TAG, "Capture released");
+}
+
+void report_capture_add_descriptor(const uint8_t dev_addr, const uint8_t iface, const uint8_t *desc,
+                                   const size_t len) {
+    if (s_descriptors_mutex == NULL || !atomic_load(&g_report_capture_active)) {
+        return;
+    }
+
+    const uint16_t stored_len = MIN(len, REPORT_CAPTURE_MAX_DESC);
+    uint8_t *copy = malloc(stored_len);
+    if (copy == NULL) {
+        ESP_LOGW(TAG, "No memory for the descriptor of device %d interface %d", dev_addr, iface);
+        return;
+    }
+    memcpy(copy, desc, stored_len);
+
+    xSemaphoreTake(s_descriptors_mutex, portMAX_DELAY);
+    captured_descriptor_t *slot = NULL;
+    for (int i = 0; i < USB_HID_MAX_SOURCES; i++) {
+        captured_descriptor_t *entry = &s_descriptors[i];
+        if (entry->in_use && entry->dev_addr == dev_addr && entry->iface == iface) {
+            slot = entry;
+            break;
+        }
+        if (!entry->in_use && slot == NULL) {
+            slot = entry;
+        }
+    }
+
+    if (slot != NULL) {
+        free(slot->data);
+        *slot = (captured_descriptor_t) {
+            .in_use = true, .dev_addr = dev_addr, .iface = iface, .len = stored_len, .data = copy,
+        };
+        copy = NULL;
+    }
+    xSemaphoreGive(s_descriptors_mutex);
+
+    if (copy != NULL) {
+        ESP_LOGW(TAG, "No descriptor slot left for device %d interface %d", dev_addr, iface);
+        free(copy);
+    }
+}
+
+__attribute__((section(".iram1.text"))) void report_capture_record(const uint8_t dev_addr, const uint8_t iface,
+                                                                   const uint8_t *data, const size_t len,
+                                                                   const int64_t ts_us) {
+    // Announced before checking the flag, a stop clears the flag before waiting for writers
+    atomic_fetch_add(&s_writers, 1);
+    if (!atomic_load(&g_report_capture_active)) {
+        atomic_fetch_sub(&s_writers, 1);
+        return;
+    }
+
+    uint_fast32_t pos = atomic_load_explicit(&s_used, memory_order_relaxed);
+    const size_t need = sizeof(report_capture_record_t) + len;
+    if (s_buffer == NULL || pos + need > s_size) {
+        s_dropped++;
+        atomic_fetch_sub(&s_writers, 1);
+        return;
+    }
+
+    const report_capture_record_t record = {
+        .time_us = (uint32_t)(ts_us - s_start_us),
+        .len = len,
+        .type = REPORT_CAPTURE_INPUT,
+        .dev_addr = dev_addr,
+        .iface = iface,
+    };
+    memcpy(&s_buffer[pos], &record, sizeof(record));
+    memcpy(&s_buffer[pos + sizeof(record)], data, len);
+
+    // Publishes the record to readers, fails if a restart reset the buffer meanwhile
+    atomic_compare_exchange_strong_explicit(&s_used, &pos, pos + need, memory_order_release,
+                                            memory_order_relaxed);
+    atomic_fetch_sub(&s_writers, 1);
+}
+
+void report_capture_get_status(report_capture_status_t *status) {
+    status->active = atomic_load(&g_report_capture_active);
+    status->size = s_size;
+    status->used = atomic_load_explicit(&s_used, memory_order_acquire);
+    status->dropped = s_dropped;
+    status->descriptors = 0;
+    for (int i = 0; i < USB_HID_MAX_SOURCES; i++) {
+        status->descriptors += s_descriptors[i].in_use;
+    }
+}
+
+static size_t descriptors_size(void) {
+    size_t size = 0;
+    for (int i = 0; i < USB_HID_MAX_SOURCES; i++) {
+        if (s_descriptors[i].in_use) {
+            size += sizeof(report_capture_record_t) + s_descriptors[i].len;
+        }
+    }
+    return size;
+}
+
+size_t report_capture_file_size(void) {
+    if (s_descriptors_mutex == NULL) {
+        return 0;
+    }
+
+    xSemaphoreTake(s_descriptors_mutex, portMAX_DELAY);
+    const size_t size = s_buffer == NULL ? 0 : sizeof(report_capture_header_t) + descriptors_size() +
+                                                   atomic_load_explicit(&s_used, memory_order_acquire);
+    xSemaphoreGive(s_descriptors_mutex);
+    return size;
+}
+
+// Copies the part of [part, part + part_len) that overlaps the request, the file is read in pieces
+static void copy_part(const uint8_t *part, const size_t part_offset, const size_t part_len, size_t offset,
+                      uint8_t *buf, size_t len, size_t *copied) {
+    const size_t start = offset + *copied;
+    const size_t end = offset + len;
+    if (start >= part_offset + part_len || end <= part_offset || start >= end) {
+        return;
+    }
+
+    const size_t from = start - part_offset;
+    const size_t n = MIN(part_len - from, end - start);
+    memcpy(&buf[*copied], &part[from], n);
+    *copied += n;
+}
+
+size_t report_capture_read(const size_t offset, uint8_t *buf, const size_t len) {
+    if (s_descriptors_mutex == NULL) {
+        return 0;
+    }
+
+    report_capture_header_t header = {
+        .version = REPORT_CAPTURE_VERSION,
+        .dropped = s_dropped,
+    };
+    memcpy(header.magic, REPORT_CAPTURE_MAGIC, sizeof(header.magic));
+
+    size_t copied = 0;
+    size_t part_offset = 0;
+    copy_part((const uint8_t *)&header, part_offset, sizeof(header), offset, buf, len, &copied);
+    part_offset += sizeof(header);
+
+    xSemaphoreTake(s_descriptors_mutex, portMAX_DELAY);
+    for (int i = 0; i < USB_HID_MAX_SOURCES; i++) {
+        const captured_descriptor_t *entry = &s_descriptors[i];
+        if (!entry->in_use) {
+            continue;
+        }
+
+        const report_capture_record_t record = {
+            .len = entry->len,
+            .type = REPORT_CAPTURE_DESCRIPTOR,
+            .dev_addr = entry->dev_addr,
+            .iface = entry->iface,
+        };
+        copy_part((const uint8_t *)&record, part_offset, sizeof(record), offset, buf, len, &copied);
+        part_offset += sizeof(record);
+        copy_part(entry->data, part_offset, entry->len, offset, buf, len, &copied);
+        part_offset += entry->len;
+    }
+
+    if (s_buffer != NULL) {
+        copy_part(s_buffer, part_offset, atomic_load_explicit(&s_used, memory_order_acquire), offset, buf, len,
+                  &copied);
+    }
+    xSemaphoreGive(s_descriptors_mutex);
+    return copied;
+}
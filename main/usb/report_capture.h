@@ -0,0 +1,141 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Raw USB traffic capture, downloadable as one file the host benchmark (test/host_bench) replays:
+ *
+ *   report_capture_header_t
+ *   report_capture_record_t + descriptor, for every interface seen during the capture
+ *   report_capture_record_t + report, for every input report, in arrival order
+ *
+ * All fields little endian. Reports start with the report ID if the device uses them, exactly as
+ * the IN transfer carried them.
+ */
+#define REPORT_CAPTURE_MAGIC   "AWCP"
+#define REPORT_CAPTURE_VERSION 1
+// PSRAM when the board has it, otherwise the largest internal block less the reserve, capped at the size
+#define REPORT_CAPTURE_SIZE     (64 * 1024)
+#define REPORT_CAPTURE_MIN_SIZE (16 * 1024)
+#define REPORT_CAPTURE_RESERVE  (40 * 1024)
+#define REPORT_CAPTURE_MAX_DESC 1024
+
+typedef enum {
+    REPORT_CAPTURE_DESCRIPTOR = 1,
+    REPORT_CAPTURE_INPUT = 2,
+} report_capture_type_t;
+
+typedef struct __attribute__((packed)) {
+    char magic[4];
+    uint8_t version;
+    uint8_t reserved[3];
+    uint32_t dropped;       // reports not recorded because the buffer was full
+} report_capture_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t time_us;       // since the capture started
+    uint16_t len;           // bytes following the record
+    uint8_t type;           // report_capture_type_t
+    uint8_t dev_addr;
+    uint8_t iface;
+} report_capture_record_t;
+
+typedef struct {
+    bool active;
+    uint32_t size;          // buffer size, 0 while nothing is captured
+    uint32_t used;          // buffer bytes holding reports
+    uint32_t dropped;
+    uint8_t descriptors;
+} report_capture_status_t;
+
+extern atomic_bool g_report_capture_active;
+
+/**
+ * @brief Reset the capture and start recording into a newly allocated buffer
+ *
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NO_MEM if no buffer could be allocated
+ */
+esp_err_t report_capture_start(void);
+
+/**
+ * @brief Stop recording and shrink the buffer to what was recorded
+ *
+ * The recording stays readable until the next start or report_capture_release().
+ */
+void report_capture_stop(void);
+
+/**
+ * @brief Stop recording and free the buffer and the descriptors, once the file was downloaded
+ */
+void report_capture_release(void);
+
+/**
+ * @brief Record the report descriptor of an interface, replaces an earlier one of the same interface
+ *
+ * Not for the report path, takes a mutex.
+ *
+ * @param dev_addr USB device address
+ * @param iface Interface number
+ * @param desc Report descriptor
+ * @param len Length of desc, cut at REPORT_CAPTURE_MAX_DESC
+ */
+void report_capture_add_descriptor(uint8_t dev_addr, uint8_t iface, const uint8_t *desc, size_t len);
+
+/**
+ * @brief Append an input report, never blocks, drops the report when the buffer is full
+ *
+ * Only the USB interface callback may call this, the buffer has a single writer.
+ *
+ * @param dev_addr USB device address
+ * @param iface Interface number
+ * @param data Raw report
+ * @param len Length of data
+ * @param ts_us esp_timer_get_time() when the report arrived
+ */
+void report_capture_record(uint8_t dev_addr, uint8_t iface, const uint8_t *data, size_t len, int64_t ts_us);
+
+/**
+ * @brief Record a report if a capture runs, a single load when it doesn't
+ */
+static inline __attribute__((always_inline)) void report_capture_record_if_active(
+    const uint8_t dev_addr, const uint8_t iface, const uint8_t *data, const size_t len, const int64_t ts_us) {
+    if (atomic_load_explicit(&g_report_capture_active, memory_order_relaxed)) {
+        report_capture_record(dev_addr, iface, data, len, ts_us);
+    }
+}
+
+/**
+ * @brief Get the state of the capture
+ *
+ * @param status Output status
+ */
+void report_capture_get_status(report_capture_status_t *status);
+
+/**
+ * @brief Size of the capture file, stable while no capture runs
+ *
+ * @return File size in bytes, 0 when nothing is captured
+ */
+size_t report_capture_file_size(void);
+
+/**
+ * @brief Read part of the capture file
+ *
+ * @param offset Offset into the file
+ * @param buf Output buffer
+ * @param len Size of buf
+ * @return Bytes copied, 0 at the end of the file
+ */
+size_t report_capture_read(size_t offset, uint8_t *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -7,22 +7,31 @@
 #include "freertos/queue.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "usb/usb_host.h"
 #include "usb/hid_host.h"
 #include "usb_hid_host.h"
 
 #include <const.h>
 #include <task_monitor.h>
+#include <power_manager.h>
+#include <perf_counters.h>
 #include <lwip/mem.h>
 
 #include "descriptor_parser.h"
+#include "descriptor_cache.h"
+#include "report_capture.h"
 
 #define USB_STATS_INTERVAL_SEC  1
 #define HOST_HID_QUEUE_SIZE     2
 #define DEVICE_EVENT_QUEUE_SIZE 4
+#define REPORT_INDEX_NONE       0xFF
+#define PROBE_TRANSFERS         3
+#define PROBE_TIMEOUT_MS        2000
+#define SOURCE_DRAIN_TIMEOUT_MS 100
 
 static const char *TAG = "USB_HID";
-static QueueHandle_t g_report_queue = NULL;
+static hid_report_ring_t *g_report_ring = NULL;
 static QueueHandle_t g_device_event_queue = NULL;
 static TaskHandle_t g_device_task_handle = NULL;
 
@@ -31,23 +40,48 @@ typedef struct __attribute__((packed)) {
     hid_host_driver_event_t event;
 } usb_device_type_event_t;
 
-static bool g_device_connected = false;
+// Recreated in place on every host install, never from the heap
+static StaticQueue_t g_device_event_queue_struct;
+static uint8_t g_device_event_queue_storage[DEVICE_EVENT_QUEUE_SIZE * sizeof(usb_device_type_event_t)];
+
+/**
+ * One (device address, interface) pair. The interface callback gets its source as the callback argument,
+ * so the hot path never searches and two devices with the same interface number can't collide.
+ */
+typedef struct {
+    bool in_use;
+    bool started;
+    hid_host_device_handle_t handle;
+    uint8_t dev_addr;
+    uint8_t iface;
+    report_map_t report_map;
+    // Report ID -> index into report_map.reports, REPORT_INDEX_NONE if unknown
+    uint8_t report_index[256];
+    // Bumped on every release, survives it, queued reports of an older generation are stale
+    volatile uint32_t generation;
+} hid_source_t;
+
+// Devices opened by our own client for the Linux-like probe, closed again when they go away
+typedef struct {
+    uint8_t dev_addr;
+    usb_device_handle_t dev_hdl;
+    uint16_t vid;
+    uint16_t pid;
+    bool done;
+} probed_device_t;
+
+static hid_source_t g_sources[USB_HID_MAX_SOURCES];
+static volatile uint8_t s_sources_started = 0;
+static probed_device_t s_probed[USB_HID_MAX_SOURCES];
+static portMUX_TYPE s_probed_lock = portMUX_INITIALIZER_UNLOCKED;
 static TaskHandle_t g_usb_events_task_handle = NULL;
 static TaskHandle_t g_stats_task_handle = NULL;
-static uint16_t s_current_rps = 0;
 static StaticSemaphore_t g_report_maps_mutex_buffer;
 static SemaphoreHandle_t g_report_maps_mutex;
-static usb_hid_report_t g_report;
 static bool g_verbose = false;
 static usb_host_client_handle_t client_hdl;
-static uint8_t client_addr;
-static uint8_t g_num_fields;
-static bool usb_host_dev_connected = false;
-static usb_hid_field_t *g_fields = NULL;
-static int64_t *g_field_values = NULL;
-static report_map_t *g_interface_report_maps = NULL;
-static report_info_t ***report_lookup_table = NULL;
-static uint8_t **g_field_counts = NULL;
+// Task currently inside the report hot path, and heap calls seen from it (must stay 0)
+static volatile TaskHandle_t s_hot_path_task = NULL;
 
 static void usb_lib_task(void *arg);
 
@@ -61,162 +95,305 @@ static void hid_host_device_callback(hid_host_device_handle_t hid_device_handle,
 static void hid_host_interface_callback(hid_host_device_handle_t hid_device_handle, hid_host_interface_event_t event,
                                         void *arg);
 
-static void cleanup_interface_resources(uint8_t interface_num) {
-    if (g_field_counts && g_field_counts[interface_num]) {
-        free(g_field_counts[interface_num]);
-        g_field_counts[interface_num] = NULL;
+#ifdef CONFIG_HEAP_USE_HOOKS
+// Heap component hooks, called for every allocation and free in the system
+void esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps) {
+    if (s_hot_path_task != NULL && s_hot_path_task == xTaskGetCurrentTaskHandle()) {
+        perf_count(PERF_HOT_PATH_ALLOCS);
     }
+}
 
-    if (report_lookup_table && report_lookup_table[interface_num]) {
-        for (int i = 0; i < MAX_REPORTS_PER_INTERFACE; i++) {
-            if (report_lookup_table[interface_num][i]) {
-                free(report_lookup_table[interface_num][i]);
-                report_lookup_table[interface_num][i] = NULL;
-            }
+void esp_heap_trace_free_hook(void *ptr) {
+    if (s_hot_path_task != NULL && s_hot_path_task == xTaskGetCurrentTaskHandle()) {
+        perf_count(PERF_HOT_PATH_ALLOCS);
+    }
+}
+#endif
+
+static void update_started_count(void) {
+    uint8_t started = 0;
+    for (int i = 0; i < USB_HID_MAX_SOURCES; i++) {
+        started += g_sources[i].in_use && g_sources[i].started;
+    }
+    if (started != s_sources_started) {
+        s_sources_started = started;
+        power_manager_state_changed();
+    }
+}
+
+// Queued reports point into the report map: the bridge skips those of an older generation, but may be
+// processing one right now, so wait for it to hand back every slot of the source before clearing the map
+static void wait_source_drained(const hid_source_t *source) {
+    if (g_report_ring == NULL || g_report_ring->consumer == NULL) {
+        return;
+    }
+
+    const uint8_t index = source - g_sources;
+    const TickType_t start = xTaskGetTickCount();
+    while (hid_report_ring_source_held(g_report_ring, index) > 0) {
+        if (xTaskGetTickCount() - start >= pdMS_TO_TICKS(SOURCE_DRAIN_TIMEOUT_MS)) {
+            ESP_LOGW(TAG, "Reports of interface %d still queued, clearing its report map anyway", source->iface);
+            return;
         }
-        free(report_lookup_table[interface_num]);
-        report_lookup_table[interface_num] = NULL;
+        vTaskDelay(1);
     }
 }
 
-static void cleanup_all_resources(void) {
-    if (g_fields) {
-        free(g_fields);
-        g_fields = NULL;
+static void release_source(hid_source_t *source) {
+    const uint32_t generation = source->generation + 1;
+    source->generation = generation;
+    wait_source_drained(source);
+
+    memset(source, 0, sizeof(hid_source_t));
+    memset(source->report_index, REPORT_INDEX_NONE, sizeof(source->report_index));
+    source->generation = generation;
+    update_started_count();
+}
+
+// A reconnecting device gets its old source back, anything else the first free one
+static hid_source_t *claim_source(const uint8_t dev_addr, const uint8_t iface,
+                                  const hid_host_device_handle_t handle) {
+    hid_source_t *free_source = NULL;
+    for (int i = 0; i < USB_HID_MAX_SOURCES; i++) {
+        hid_source_t *source = &g_sources[i];
+        if (source->in_use && source->dev_addr == dev_addr && source->iface == iface) {
+            release_source(source);
+            free_source = source;
+            break;
+        }
+        if (!source->in_use && free_source == NULL) {
+            free_source = source;
+        }
     }
 
-    if (g_field_values) {
-        free(g_field_values);
-        g_field_values = NULL;
+    if (free_source != NULL) {
+        free_source->in_use = true;
+        free_source->dev_addr = dev_addr;
+        free_source->iface = iface;
+        free_source->handle = handle;
     }
+    return free_source;
+}
 
-    if (g_interface_report_maps) {
-        free(g_interface_report_maps);
-        g_interface_report_maps = NULL;
+static void cleanup_all_resources(void) {
+    for (int i = 0; i < USB_HID_MAX_SOURCES; i++) {
+        release_source(&g_sources[i]);
     }
+}
 
-    if (g_field_counts) {
-        for (int i = 0; i < USB_HOST_MAX_INTERFACES; i++) {
-            if (g_field_counts[i]) {
-                free(g_field_counts[i]);
-            }
+// True once every probe transfer to the device completed, or the probe gave up
+static bool device_probed(const uint8_t dev_addr, uint16_t *vid, uint16_t *pid) {
+    bool found = false;
+    taskENTER_CRITICAL(&s_probed_lock);
+    for (int i = 0; i < USB_HID_MAX_SOURCES; i++) {
+        if (s_probed[i].dev_hdl != NULL && s_probed[i].dev_addr == dev_addr && s_probed[i].done) {
+            *vid = s_probed[i].vid;
+            *pid = s_probed[i].pid;
+            found = true;
+            break;
         }
-        free(g_field_counts);
-        g_field_counts = NULL;
     }
+    taskEXIT_CRITICAL(&s_probed_lock);
+    return found;
+}
 
-    if (report_lookup_table) {
-        for (int i = 0; i < USB_HOST_MAX_INTERFACES; i++) {
-            if (report_lookup_table[i]) {
-                for (int j = 0; j < MAX_REPORTS_PER_INTERFACE; j++) {
-                    if (report_lookup_table[i][j]) {
-                        free(report_lookup_table[i][j]);
-                    }
-                }
-                free(report_lookup_table[i]);
-            }
+static void probe_finished(const usb_device_handle_t dev_hdl) {
+    taskENTER_CRITICAL(&s_probed_lock);
+    for (int i = 0; i < USB_HID_MAX_SOURCES; i++) {
+        if (s_probed[i].dev_hdl == dev_hdl) {
+            s_probed[i].done = true;
+            break;
         }
-        free(report_lookup_table);
-        report_lookup_table = NULL;
+    }
+    taskEXIT_CRITICAL(&s_probed_lock);
+
+    if (g_device_task_handle != NULL) {
+        xTaskNotifyGive(g_device_task_handle);
     }
 }
 
+// Each completion submits the next request on the same transfer, the context counts what is left
 static void control_transfer_cb(usb_transfer_t *transfer) {
+    const uintptr_t remaining = (uintptr_t) transfer->context;
+    if (transfer->status == USB_TRANSFER_STATUS_COMPLETED && remaining > 0) {
+        transfer->context = (void *) (remaining - 1);
+        if (usb_host_transfer_submit_control(client_hdl, transfer) == ESP_OK) {
+            return;
+        }
+    }
+
+    probe_finished(transfer->device_handle);
     usb_host_transfer_free(transfer);
 }
 
-static void send_linux_like_control_transfers() {
-    ESP_LOGI(TAG, "Pretending to be Linux");
+static void send_linux_like_control_transfers(const uint8_t dev_addr) {
+    ESP_LOGI(TAG, "Pretending to be Linux to device %d", dev_addr);
 
     usb_device_handle_t dev_hdl;
-    esp_err_t err = usb_host_device_open(client_hdl, client_addr, &dev_hdl);
+    esp_err_t err = usb_host_device_open(client_hdl, dev_addr, &dev_hdl);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to open device");
         return;
     }
 
-    for (int i = 0; i < 3; i++) {
-        usb_transfer_t *transfer;
-        err = usb_host_transfer_alloc(sizeof(usb_setup_packet_t) + 0xFF, 0, &transfer);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to allocate transfer: %s", esp_err_to_name(err));
-            continue;
-        }
+    probed_device_t probed = { .dev_addr = dev_addr, .dev_hdl = dev_hdl };
+    const usb_device_desc_t *dev_desc;
+    if (usb_host_get_device_descriptor(dev_hdl, &dev_desc) == ESP_OK) {
+        probed.vid = dev_desc->idVendor;
+        probed.pid = dev_desc->idProduct;
+    }
 
-        // Setup packet for GET_DESCRIPTOR (Device)
-        usb_setup_packet_t *setup = (usb_setup_packet_t *) transfer->data_buffer;
-        setup->bmRequestType = 0x80; // Device to Host, Standard, Device
-        setup->bRequest = 0x06; // GET_DESCRIPTOR
-        setup->wValue = (0x01 << 8); // Device Descriptor
-        setup->wIndex = 0;
-        setup->wLength = 0xFF; // Set to 0xFF for Linux detection
-
-        transfer->num_bytes = sizeof(usb_setup_packet_t) + 0xFF;
-        transfer->device_handle = dev_hdl;
-        transfer->bEndpointAddress = 0; // Control endpoint
-        transfer->callback = control_transfer_cb;
-        transfer->context = NULL;
-
-        err = usb_host_transfer_submit_control(client_hdl, transfer);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to submit control transfer: %s", esp_err_to_name(err));
-            usb_host_transfer_free(transfer);
-        } else {
-            vTaskDelay(pdMS_TO_TICKS(25));
+    // The client stays registered for the next device behind the hub. The handle can't be closed while
+    // transfers are in flight, it is closed when the device goes away.
+    bool stored = false;
+    taskENTER_CRITICAL(&s_probed_lock);
+    for (int i = 0; i < USB_HID_MAX_SOURCES; i++) {
+        if (s_probed[i].dev_hdl == NULL) {
+            s_probed[i] = probed;
+            stored = true;
+            break;
         }
     }
+    taskEXIT_CRITICAL(&s_probed_lock);
+    if (!stored) {
+        ESP_LOGW(TAG, "Too many devices, device %d stays open", dev_addr);
+    }
 
-    usb_host_client_deregister(client_hdl);
-    // usb_host_device_close(client_hdl, dev_hdl);
+    usb_transfer_t *transfer;
+    err = usb_host_transfer_alloc(sizeof(usb_setup_packet_t) + 0xFF, 0, &transfer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to allocate transfer: %s", esp_err_to_name(err));
+        probe_finished(dev_hdl);
+        return;
+    }
+
+    // Setup packet for GET_DESCRIPTOR (Device)
+    usb_setup_packet_t *setup = (usb_setup_packet_t *) transfer->data_buffer;
+    setup->bmRequestType = 0x80; // Device to Host, Standard, Device
+    setup->bRequest = 0x06; // GET_DESCRIPTOR
+    setup->wValue = (0x01 << 8); // Device Descriptor
+    setup->wIndex = 0;
+    setup->wLength = 0xFF; // Set to 0xFF for Linux detection
+
+    transfer->num_bytes = sizeof(usb_setup_packet_t) + 0xFF;
+    transfer->device_handle = dev_hdl;
+    transfer->bEndpointAddress = 0; // Control endpoint
+    transfer->callback = control_transfer_cb;
+    transfer->context = (void *) (PROBE_TRANSFERS - 1);
+
+    // Back to back instead of fixed sleeps, the device sees the next request as soon as it answered
+    err = usb_host_transfer_submit_control(client_hdl, transfer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to submit control transfer: %s", esp_err_to_name(err));
+        usb_host_transfer_free(transfer);
+        probe_finished(dev_hdl);
+        return;
+    }
     ESP_LOGI(TAG, "I'm Arch btw");
 }
 
-uint8_t usb_hid_host_get_num_fields(const uint8_t report_id, const uint8_t interface_num) {
-    if (!g_field_counts || !g_field_counts[interface_num]) {
-        return 0;
+static void close_probed_device(const usb_device_handle_t dev_hdl) {
+    taskENTER_CRITICAL(&s_probed_lock);
+    for (int i = 0; i < USB_HID_MAX_SOURCES; i++) {
+        if (s_probed[i].dev_hdl == dev_hdl) {
+            s_probed[i].dev_hdl = NULL;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&s_probed_lock);
+
+    const esp_err_t err = usb_host_device_close(client_hdl, dev_hdl);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to close probed device: %s", esp_err_to_name(err));
     }
-    return g_field_counts[interface_num][report_id];
 }
 
-static void client_event_callback(const usb_host_client_event_msg_t *event_msg, void *);
+uint32_t usb_hid_host_get_report_count(void) {
+    return perf_read(PERF_USB_REPORTS);
+}
 
-esp_err_t usb_hid_host_init(const QueueHandle_t report_queue, const bool verbose) {
-    ESP_LOGI(TAG, "Initializing USB HID Host");
-    if (report_queue == NULL) {
-        ESP_LOGE(TAG, "Invalid report queue parameter");
-        return ESP_ERR_INVALID_ARG;
-    }
+// Hi-res wheels report whole detents until their Resolution Multiplier is written, then scale to
+// HID_WHEEL_RESOLUTION either way. Failing that write only costs the sub-detent steps.
+static void enable_hi_res_wheel(const hid_host_device_handle_t handle, report_map_t *report_map) {
+    const hid_res_mult_t *res_mult = &report_map->res_mult;
+    uint8_t counts_per_detent = 1;
+    if (res_mult->num_fields > 0 && res_mult->multiplier > 0 && HID_WHEEL_RESOLUTION % res_mult->multiplier == 0) {
+        uint8_t report[1 + 8] = {0};
+        const uint8_t id_len = res_mult->report_id != 0 ? 1 : 0;
+        const uint8_t len = MIN(res_mult->report_len, sizeof(report) - id_len);
+        report[0] = res_mult->report_id;
+        for (int i = 0; i < res_mult->num_fields; i++) {
+            for (int bit = 0; bit < res_mult->bits[i]; bit++) {
+                const uint16_t pos = res_mult->bit_offset[i] + bit;
+                if (pos < len * 8 && (res_mult->value[i] & (1 << bit))) {
+                    report[id_len + pos / 8] |= 1 << (pos % 8);
+                }
+            }
+        }
 
-    // Allocate dynamic memory
-    g_interface_report_maps = calloc(USB_HOST_MAX_INTERFACES, sizeof(report_map_t));
-    if (!g_interface_report_maps) {
-        ESP_LOGE(TAG, "Failed to allocate report maps");
-        return ESP_ERR_NO_MEM;
+        const esp_err_t err = hid_class_request_set_report(handle, HID_TYPE_FEATURE, res_mult->report_id,
+                                                           report, id_len + len);
+        if (err == ESP_OK) {
+            counts_per_detent = res_mult->multiplier;
+            ESP_LOGI(TAG, "Hi-res wheel, %d counts per detent", counts_per_detent);
+        } else {
+            ESP_LOGW(TAG, "Failed to set the resolution multiplier: %s", esp_err_to_name(err));
+        }
+    } else if (res_mult->num_fields > 0) {
+        ESP_LOGW(TAG, "Resolution multiplier %d not supported, wheel stays at whole detents", res_mult->multiplier);
     }
 
-    g_field_counts = calloc(USB_HOST_MAX_INTERFACES, sizeof(uint8_t *));
-    if (!g_field_counts) {
-        cleanup_all_resources();
-        ESP_LOGE(TAG, "Failed to allocate field counts array");
-        return ESP_ERR_NO_MEM;
+    xSemaphoreTake(g_report_maps_mutex, portMAX_DELAY);
+    set_wheel_resolution(report_map, counts_per_detent);
+    xSemaphoreGive(g_report_maps_mutex);
+}
+
+void usb_hid_host_get_ring_stats(hid_report_ring_stats_t *stats) {
+    if (g_report_ring == NULL) {
+        memset(stats, 0, sizeof(hid_report_ring_stats_t));
+        return;
     }
+    hid_report_ring_get_stats(g_report_ring, stats);
+}
 
-    report_lookup_table = calloc(USB_HOST_MAX_INTERFACES, sizeof(report_info_t **));
-    if (!report_lookup_table) {
-        cleanup_all_resources();
-        ESP_LOGE(TAG, "Failed to allocate lookup table");
-        return ESP_ERR_NO_MEM;
+esp_err_t usb_hid_host_start_capture(void) {
+    const esp_err_t err = report_capture_start();
+    if (err != ESP_OK || g_report_maps_mutex == NULL) {
+        return err;
     }
 
-    for (int i = 0; i < USB_HOST_MAX_INTERFACES; i++) {
-        g_field_counts[i] = calloc(MAX_REPORTS_PER_INTERFACE, sizeof(uint8_t));
-        report_lookup_table[i] = calloc(MAX_REPORTS_PER_INTERFACE, sizeof(report_info_t *));
-        if (!g_field_counts[i] || !report_lookup_table[i]) {
-            cleanup_all_resources();
-            ESP_LOGE(TAG, "Failed to allocate interface resources");
-            return ESP_ERR_NO_MEM;
+    // Interfaces started before the capture won't fetch their descriptor again
+    xSemaphoreTake(g_report_maps_mutex, portMAX_DELAY);
+    for (int i = 0; i < USB_HID_MAX_SOURCES; i++) {
+        const hid_source_t *source = &g_sources[i];
+        if (!source->in_use || !source->started) {
+            continue;
+        }
+
+        size_t desc_len;
+        const uint8_t *desc = hid_host_get_report_descriptor(source->handle, &desc_len);
+        if (desc != NULL) {
+            report_capture_add_descriptor(source->dev_addr, source->iface, desc, desc_len);
         }
     }
+    xSemaphoreGive(g_report_maps_mutex);
+    return ESP_OK;
+}
+
+uint32_t usb_hid_host_get_hot_path_allocs(void) {
+    return perf_read(PERF_HOT_PATH_ALLOCS);
+}
+
+static void client_event_callback(const usb_host_client_event_msg_t *event_msg, void *);
+
+esp_err_t usb_hid_host_init(hid_report_ring_t *const report_ring, const bool verbose) {
+    ESP_LOGI(TAG, "Initializing USB HID Host");
+    if (report_ring == NULL) {
+        ESP_LOGE(TAG, "Invalid report ring parameter");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    cleanup_all_resources();
 
     if (verbose) {
         esp_err_t err = task_monitor_init();
@@ -232,20 +409,22 @@ esp_err_t usb_hid_host_init(const QueueHandle_t report_queue, const bool verbose
             return err;
         }
 
-        xTaskCreatePinnedToCore(usb_stats_task, "usb_stats", 1500, NULL, 5, &g_stats_task_handle, 1);
+        xTaskCreatePinnedToCore(usb_stats_task, "usb_stats", 1500, NULL, TASK_STATS_PRIO, &g_stats_task_handle,
+                                TASK_STATS_CORE);
     }
 
     g_verbose = verbose;
-    g_report_queue = report_queue;
-    g_device_event_queue = xQueueCreate(DEVICE_EVENT_QUEUE_SIZE, sizeof(usb_device_type_event_t));
+    g_report_ring = report_ring;
+    g_device_event_queue = xQueueCreateStatic(DEVICE_EVENT_QUEUE_SIZE, sizeof(usb_device_type_event_t),
+                                              g_device_event_queue_storage, &g_device_event_queue_struct);
     if (g_device_event_queue == NULL) {
         cleanup_all_resources();
         ESP_LOGE(TAG, "Failed to create device event queue");
         return ESP_ERR_NO_MEM;
     }
 
-    BaseType_t task_created = xTaskCreatePinnedToCore(device_event_task, "dev_evt", 2048, NULL, 6,
-                                                      &g_device_task_handle, 1);
+    BaseType_t task_created = xTaskCreatePinnedToCore(device_event_task, "dev_evt", 2048, NULL, TASK_DEV_EVT_PRIO,
+                                                      &g_device_task_handle, TASK_DEV_EVT_CORE);
     if (task_created != pdTRUE) {
         cleanup_all_resources();
         vQueueDelete(g_device_event_queue);
@@ -253,7 +432,7 @@ esp_err_t usb_hid_host_init(const QueueHandle_t report_queue, const bool verbose
     }
 
     g_report_maps_mutex = xSemaphoreCreateMutexStatic(&g_report_maps_mutex_buffer);
-    g_device_connected = false;
+    descriptor_cache_init();
     const usb_host_config_t host_config = {
         .skip_phy_setup = false,
         .intr_flags = ESP_INTR_FLAG_LEVEL1,
@@ -266,8 +445,10 @@ esp_err_t usb_hid_host_init(const QueueHandle_t report_queue, const bool verbose
         vQueueDelete(g_device_event_queue);
         return err;
     }
+    power_manager_set_usb_active(true);
 
-    task_created = xTaskCreatePinnedToCore(usb_lib_task, "usb_events", 1600, NULL, 13, &g_usb_events_task_handle, 1);
+    task_created = xTaskCreatePinnedToCore(usb_lib_task, "usb_events", 1600, NULL, TASK_USB_EVENTS_PRIO,
+                                           &g_usb_events_task_handle, TASK_USB_EVENTS_CORE);
     if (task_created != pdTRUE) {
         cleanup_all_resources();
         usb_host_uninstall();
@@ -294,9 +475,9 @@ esp_err_t usb_hid_host_init(const QueueHandle_t report_queue, const bool verbose
 
     const hid_host_driver_config_t hid_host_config = {
         .create_background_task = true,
-        .task_priority = 16,
+        .task_priority = TASK_HID_HOST_PRIO,
         .stack_size = 2000,
-        .core_id = 1,
+        .core_id = TASK_HID_HOST_CORE,
         .callback = hid_host_device_callback,
         .callback_arg = NULL
     };
@@ -325,31 +506,49 @@ esp_err_t usb_hid_host_deinit(void) {
     ret = usb_host_uninstall();
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to uninstall USB host: %d", ret);
+    } else {
+        power_manager_set_usb_active(false);
     }
 
     cleanup_all_resources();
-    g_report_queue = NULL;
-    g_device_connected = false;
+    g_report_ring = NULL;
     ESP_LOGI(TAG, "USB HID Host deinitialized");
     return ret;
 }
 
+__attribute__((section(".iram1.text"))) bool usb_hid_host_report_current(const uint8_t source,
+                                                                        const uint32_t generation) {
+    return source < USB_HID_MAX_SOURCES && g_sources[source].generation == generation;
+}
+
 bool usb_hid_host_device_connected(void) {
-    return g_device_connected;
+    return s_sources_started > 0;
+}
+
+uint8_t usb_hid_host_num_sources(void) {
+    return s_sources_started;
 }
 
 static uint8_t *data_ptr = NULL;
 
+__attribute__((section(".iram1.text"))) static void commit_report(hid_report_slot_t *const slot, const int64_t ts_usb) {
+    const int64_t now = esp_timer_get_time();
+    slot->report.ts_usb = ts_usb;
+    slot->report.ts_queued = now;
+    latency_trace_record(LAT_STAGE_USB_TO_QUEUE, now - ts_usb);
+    hid_report_ring_commit(g_report_ring);
+}
+
 __attribute__((section(".iram1.text"))) static void process_report(uint8_t *const data, const size_t length,
-                                                                   const uint8_t interface_num) {
-    s_current_rps++;
-    if (!data || !g_report_queue || length <= 1 || interface_num >= USB_HOST_MAX_INTERFACES) {
-        ESP_LOGE(TAG, "Invalid parameters: data=%p, queue=%p, len=%d, iface=%u", data, g_report_queue, length,
-                 interface_num);
+                                                                   hid_source_t *const source, const int64_t ts_usb) {
+    perf_count(PERF_USB_REPORTS);
+    if (!data || !g_report_ring || length <= 1 || source == NULL || !source->in_use) {
+        ESP_LOGE(TAG, "Invalid parameters: data=%p, ring=%p, len=%d, source=%p", data, g_report_ring, length,
+                 source);
         return;
     }
 
-    const report_map_t *const report_map = &g_interface_report_maps[interface_num];
+    report_map_t *const report_map = &source->report_map;
     data_ptr = data;
     size_t report_length = length;
     uint8_t report_id = 0;
@@ -362,42 +561,47 @@ __attribute__((section(".iram1.text"))) static void process_report(uint8_t *cons
         report_id = report_map->report_ids[0];
     }
 
-    report_info_t *const report_info = report_lookup_table[interface_num][report_id];
-    if (!report_info) {
-        ESP_LOGW(TAG, "Unknown report ID %d for interface %d", report_id, interface_num);
+    const uint8_t report_index = source->report_index[report_id];
+    if (report_index == REPORT_INDEX_NONE) {
+        ESP_LOGW(TAG, "Unknown report ID %d for device %d interface %d", report_id, source->dev_addr, source->iface);
         return;
     }
 
-    if (g_num_fields != report_info->num_fields) {
-        free(g_fields);
-        free(g_field_values);
-        g_fields = NULL;
-        g_field_values = NULL;
+    report_info_t *const report_info = &report_map->reports[report_index];
+
+    hid_report_slot_t *const slot = hid_report_ring_acquire(g_report_ring, source - g_sources);
+    if (!slot) {
+        // Ring full, the drop is also counted by the ring
+        perf_count(PERF_RING_DROPS);
+        return;
     }
 
-    if (!g_fields || !g_field_values) {
-        g_fields = calloc(report_info->num_fields, sizeof(usb_hid_field_t));
-        g_field_values = calloc(report_info->num_fields, sizeof(int64_t));
-        if (!g_fields || !g_field_values) {
-            ESP_LOGE(TAG, "Failed to allocate field buffers");
-            return;
+    slot->generation = source->generation;
+    slot->report.dev_addr = source->dev_addr;
+    slot->report.if_id = source->iface;
+    slot->report.report_id = report_id;
+    slot->report.type = USB_HID_FIELD_TYPE_INPUT;
+    slot->report.info = report_info;
+
+    if (report_info->plan.valid) {
+        slot->report.decoded = true;
+        if (report_info->is_keyboard) {
+            decode_keyboard_report(&report_info->plan, data_ptr, &slot->report.keyboard);
+        } else {
+            decode_mouse_report(&report_info->plan, data_ptr, &slot->report.mouse);
         }
+        commit_report(slot, ts_usb);
+        return;
     }
 
-    g_report.if_id = interface_num;
-    g_report.report_id = report_id;
-    g_report.type = USB_HID_FIELD_TYPE_INPUT;
-    g_report.fields = g_fields;
-    g_report.info = report_info;
-
+    slot->report.decoded = false;
     const report_field_info_t *const field_info = report_info->fields;
     for (uint8_t i = 0; i < report_info->num_fields; i++) {
-        g_field_values[i] = extract_field_value(data_ptr, field_info[i].bit_offset, field_info[i].bit_size);
-        g_fields[i].attr = field_info[i].attr;
-        g_fields[i].value = &g_field_values[i];
+        slot->values[i] = extract_field_value(data_ptr, field_info[i].bit_offset, field_info[i].bit_size);
+        slot->fields[i].attr = field_info[i].attr;
     }
 
-    xQueueSend(g_report_queue, &g_report, 0);
+    commit_report(slot, ts_usb);
 }
 
 static uint8_t cur_if_evt_data[256] = {0};
@@ -405,6 +609,7 @@ static uint8_t cur_if_evt_data[256] = {0};
 __attribute__((section(".iram1.text"))) static void hid_host_interface_callback(
     const hid_host_device_handle_t hid_device_handle,
     const hid_host_interface_event_t event, void *arg) {
+    const int64_t ts_usb = esp_timer_get_time();
     static size_t data_length = 0;
     static hid_host_dev_params_t dev_params;
     esp_err_t err;
@@ -423,13 +628,22 @@ __attribute__((section(".iram1.text"))) static void hid_host_interface_callback(
                 ESP_LOGE(TAG, "Failed to get raw input report: %d", err);
                 return;
             }
-            process_report(cur_if_evt_data, data_length, dev_params.iface_num);
+            s_hot_path_task = xTaskGetCurrentTaskHandle();
+            hid_source_t *const source = arg;
+            if (source != NULL) {
+                report_capture_record_if_active(source->dev_addr, source->iface, cur_if_evt_data, data_length,
+                                                ts_usb);
+            }
+            process_report(cur_if_evt_data, data_length, source, ts_usb);
+            s_hot_path_task = NULL;
             break;
 
         case HID_HOST_INTERFACE_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "HID Device Disconnected - Interface: %d", dev_params.iface_num);
-            g_device_connected = false;
-            cleanup_interface_resources(dev_params.iface_num);
+            if (xSemaphoreTake(g_report_maps_mutex, portMAX_DELAY) == pdTRUE) {
+                release_source((hid_source_t *) arg);
+                xSemaphoreGive(g_report_maps_mutex);
+            }
             err = hid_host_device_close(hid_device_handle);
             if (err != ESP_OK) {
                 ESP_LOGE(TAG, "Failed to close device: %d", err);
@@ -450,9 +664,9 @@ static void client_event_callback(const usb_host_client_event_msg_t *event_msg,
     ESP_LOGI(TAG, "HID Client Event Received: %d", event_msg->event);
 
     if (event_msg->event == USB_HOST_CLIENT_EVENT_NEW_DEV) {
-        client_addr = event_msg->new_dev.address;
-        send_linux_like_control_transfers();
-        usb_host_dev_connected = true;
+        send_linux_like_control_transfers(event_msg->new_dev.address);
+    } else if (event_msg->event == USB_HOST_CLIENT_EVENT_DEV_GONE) {
+        close_probed_device(event_msg->dev_gone.dev_hdl);
     }
 }
 
@@ -470,20 +684,37 @@ static void device_event_task(void *arg) {
             }
 
             if (evt.event == HID_HOST_DRIVER_EVENT_CONNECTED) {
-                uint8_t try = 0;
-                while (!usb_host_dev_connected && try < 100) {
-                    vTaskDelay(pdMS_TO_TICKS(20));
-                    try++;
+                // Woken by probe_finished(), the timeout only covers devices our client never saw
+                uint16_t vid = 0, pid = 0;
+                const TickType_t wait_start = xTaskGetTickCount();
+                while (!device_probed(dev_params.addr, &vid, &pid)) {
+                    const TickType_t waited = xTaskGetTickCount() - wait_start;
+                    if (waited >= pdMS_TO_TICKS(PROBE_TIMEOUT_MS)) {
+                        ESP_LOGW(TAG, "Device %d was not probed", dev_params.addr);
+                        break;
+                    }
+                    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PROBE_TIMEOUT_MS) - waited);
+                }
+
+                xSemaphoreTake(g_report_maps_mutex, portMAX_DELAY);
+                hid_source_t *source = claim_source(dev_params.addr, dev_params.iface_num, evt.device_handle);
+                xSemaphoreGive(g_report_maps_mutex);
+                if (source == NULL) {
+                    ESP_LOGE(TAG, "No free source for device %d interface %d", dev_params.addr, dev_params.iface_num);
+                    continue;
                 }
 
                 const hid_host_device_config_t dev_config = {
                     .callback = hid_host_interface_callback,
-                    .callback_arg = NULL
+                    .callback_arg = source
                 };
 
                 err = hid_host_device_open(evt.device_handle, &dev_config);
                 if (err != ESP_OK) {
                     ESP_LOGE(TAG, "Failed to open device: %d", err);
+                    xSemaphoreTake(g_report_maps_mutex, portMAX_DELAY);
+                    release_source(source);
+                    xSemaphoreGive(g_report_maps_mutex);
                     continue;
                 }
 
@@ -505,31 +736,41 @@ static void device_event_task(void *arg) {
                 const uint8_t *desc = hid_host_get_report_descriptor(evt.device_handle, &desc_len);
                 if (desc != NULL) {
                     ESP_LOGI(TAG, "Got report descriptor, length = %d", desc_len);
+                    report_capture_add_descriptor(dev_params.addr, dev_params.iface_num, desc, desc_len);
                     if (xSemaphoreTake(g_report_maps_mutex, portMAX_DELAY) == pdTRUE) {
-                        parse_report_descriptor(desc, desc_len, dev_params.iface_num,
-                                                &g_interface_report_maps[dev_params.iface_num]);
-                        report_map_t *report_map = &g_interface_report_maps[dev_params.iface_num];
+                        report_map_t *report_map = &source->report_map;
+                        descriptor_cache_key_t key;
+                        descriptor_cache_make_key(vid, pid, dev_params.iface_num, desc, desc_len, &key);
+                        if (descriptor_cache_lookup(&key, report_map)) {
+                            ESP_LOGI(TAG, "Report descriptor of %04x:%04x interface %d is cached", vid, pid,
+                                     dev_params.iface_num);
+                        } else {
+                            parse_report_descriptor(desc, desc_len, dev_params.iface_num, report_map);
+                            descriptor_cache_store(&key, report_map);
+                        }
                         for (int i = 0; i < report_map->num_reports; i++) {
-                            ESP_LOGI(TAG, "Expecting %d fields for interface=%d report=%d",
-                                     report_map->reports[i].num_fields, dev_params.iface_num,
+                            ESP_LOGI(TAG, "Expecting %d fields for device=%d interface=%d report=%d",
+                                     report_map->reports[i].num_fields, dev_params.addr, dev_params.iface_num,
                                      report_map->report_ids[i]);
-                            g_field_counts[dev_params.iface_num][report_map->report_ids[i]] = report_map->reports[i].
-                                    num_fields;
-                            report_lookup_table[dev_params.iface_num][report_map->report_ids[i]] = &report_map->reports[
-                                i];
+                            source->report_index[report_map->report_ids[i]] = i;
                         }
                         xSemaphoreGive(g_report_maps_mutex);
                     } else {
                         ESP_LOGE(TAG, "Failed to take report maps mutex");
                     }
                 }
+                enable_hi_res_wheel(evt.device_handle, &source->report_map);
 
                 err = hid_host_device_start(evt.device_handle);
                 if (err != ESP_OK) {
                     ESP_LOGE(TAG, "Failed to start device: %d", err);
                     continue;
                 }
-                g_device_connected = true;
+                source->started = true;
+                update_started_count();
+                perf_count(PERF_USB_ATTACHES);
+                ESP_LOGI(TAG, "Device %d interface %d started, %d source(s) active", dev_params.addr,
+                         dev_params.iface_num, s_sources_started);
             } else {
                 ESP_LOGI(TAG, "Unknown device event, subclass = %d, proto = %s, iface = %d",
                          dev_params.sub_class, dev_params.proto, dev_params.iface_num);
@@ -594,14 +835,31 @@ static void usb_lib_task(void *arg) {
 static void usb_stats_task(void *arg) {
     TickType_t last_wake_time = xTaskGetTickCount();
 
-    uint16_t s_prev_rps = 0;
+    uint32_t prev_reports = perf_read(PERF_USB_REPORTS);
+    uint32_t prev_dropped = 0;
+    hid_report_ring_stats_t ring_stats;
     while (1) {
-        const uint16_t reports_per_sec = (s_current_rps - s_prev_rps) / USB_STATS_INTERVAL_SEC;
+        const uint32_t reports = perf_read(PERF_USB_REPORTS);
+        const uint32_t reports_per_sec = (reports - prev_reports) / USB_STATS_INTERVAL_SEC;
         if (reports_per_sec > 0) {
             ESP_LOGI(TAG, "USB: %lu rps", reports_per_sec);
         }
 
-        s_prev_rps = s_current_rps;
+        const uint32_t hot_path_allocs = perf_read(PERF_HOT_PATH_ALLOCS);
+        if (hot_path_allocs != 0) {
+            ESP_LOGE(TAG, "Heap used %lu times on the report hot path", hot_path_allocs);
+        }
+
+        if (g_report_ring) {
+            hid_report_ring_get_stats(g_report_ring, &ring_stats);
+            if (ring_stats.dropped != prev_dropped) {
+                ESP_LOGW(TAG, "Report ring: %lu dropped (+%lu), high water %lu/%d", ring_stats.dropped,
+                         ring_stats.dropped - prev_dropped, ring_stats.high_water, HID_REPORT_RING_SIZE);
+                prev_dropped = ring_stats.dropped;
+            }
+        }
+
+        prev_reports = reports;
         vTaskDelayUntil(&last_wake_time, pdMS_TO_TICKS(USB_STATS_INTERVAL_SEC * 1000));
     }
 }
@@ -9,8 +9,8 @@
 #include <stdint.h>
 #include "esp_err.h"
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
 #include "hid_bridge.h"
+#include "hid_report_ring.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -37,11 +37,11 @@ typedef void (*usb_hid_report_callback_t)(usb_hid_report_t *report);
 
 /**
  * @brief Initialize the USB HID Host* 
- * @param report_queue Queue to receive HID reports
+ * @param report_ring Ring to publish HID reports into
  * @param verbose
  * @return esp_err_t ESP_OK on success, error code otherwise
  */
-esp_err_t usb_hid_host_init(QueueHandle_t report_queue, bool verbose);
+esp_err_t usb_hid_host_init(hid_report_ring_t *report_ring, bool verbose);
 
 /**
  * @brief Deinitialize the USB HID Host
@@ -59,12 +59,52 @@ esp_err_t usb_hid_host_deinit(void);
 bool usb_hid_host_device_connected(void);
 
 /**
- * @brief Get the number of fields for a given report ID
- * @param report_id Report ID to look up
- * @param interface_num Interface number
- * @return Number of fields, or 0 if report ID not found
+ * @brief Check that a queued report still belongs to the interface that produced it
+ *
+ * @param source Source index of the ring slot
+ * @param generation Generation stamped into the ring slot
+ * @return false once the source was released, the report's info no longer points to its report map
  */
-uint8_t usb_hid_host_get_num_fields(uint8_t report_id, uint8_t interface_num);
+bool usb_hid_host_report_current(uint8_t source, uint32_t generation);
+
+/**
+ * @brief Get the number of started HID interfaces over all connected devices
+ *
+ * @return Number of (device, interface) sources forwarding reports
+ */
+uint8_t usb_hid_host_num_sources(void);
+
+/**
+ * @brief Get the running count of input reports received, wraps at 32 bits
+ *
+ * @return Reports received so far, differences between two reads give the rate
+ */
+uint32_t usb_hid_host_get_report_count(void);
+
+/**
+ * @brief Get the counters of the report ring reports are handed to the bridge through
+ *
+ * @param stats Output counters, zeroed before usb_hid_host_init()
+ */
+void usb_hid_host_get_ring_stats(hid_report_ring_stats_t *stats);
+
+/**
+ * @brief Get the number of heap calls made from the report hot path
+ *
+ * Only counted when CONFIG_HEAP_USE_HOOKS is enabled. Anything other than 0 is a bug.
+ *
+ * @return Number of allocations/frees seen while processing an input report
+ */
+uint32_t usb_hid_host_get_hot_path_allocs(void);
+
+/**
+ * @brief Start a raw report capture, with the descriptors of the interfaces already running
+ *
+ * See report_capture.h, report_capture_stop() ends it.
+ *
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NO_MEM without a capture buffer
+ */
+esp_err_t usb_hid_host_start_capture(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,279 @@
+#include "battery.h"
+
+#include <string.h>
+#include "const.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "power_manager.h"
+#include "ble_hid_device.h"
+
+#ifdef HW02
+#include "driver/gpio.h"
+#include "esp_adc/adc_continuous.h"
+#include "esp_adc/adc_cali.h"
+#include "esp_adc/adc_cali_scheme.h"
+#endif
+
+static const char *TAG = "BATTERY";
+
+// Written by the esp_timer task only
+static battery_status_t s_status = {0};
+
+#ifdef HW02
+#define CHANNEL_BAT         0
+#define CHANNEL_VIN         1
+#define NUM_CHANNELS        2
+#define FRAME_BYTES         (BATTERY_SAMPLES_PER_CHANNEL * NUM_CHANNELS * SOC_ADC_DIGI_RESULT_BYTES)
+// One frame at BATTERY_SAMPLE_HZ plus margin, the read is retried a few times if it isn't complete
+#define BURST_US            (BATTERY_SAMPLES_PER_CHANNEL * NUM_CHANNELS * 1000000ULL / BATTERY_SAMPLE_HZ + 2000)
+#define BURST_RETRIES       3
+// A new reading weighs 1/4, the filtered voltage is kept in 1/16 mV
+#define FILTER_SHIFT        2
+#define FILTER_FRAC_BITS    4
+#define VIN_PRESENT_MV      4000
+#define FULL_MV             4150
+
+typedef struct {
+    uint16_t mv;
+    uint8_t soc;
+} soc_point_t;
+
+// Open circuit voltage of a single Li-ion cell, descending
+static const soc_point_t s_ocv_curve[] = {
+    {4200, 100}, {4150, 95}, {4110, 90}, {4080, 85}, {4020, 80}, {3980, 70}, {3950, 65},
+    {3910, 60}, {3870, 50}, {3840, 45}, {3800, 40}, {3790, 35}, {3770, 30}, {3750, 25},
+    {3730, 20}, {3710, 15}, {3690, 10}, {3610, 5}, {3400, 0},
+};
+
+static adc_continuous_handle_t s_adc = NULL;
+static adc_cali_handle_t s_cali[NUM_CHANNELS] = {NULL};
+static adc_channel_t s_channels[NUM_CHANNELS];
+static esp_timer_handle_t s_period_timer = NULL;
+static esp_timer_handle_t s_read_timer = NULL;
+static uint8_t s_frame[FRAME_BYTES];
+static int32_t s_filtered = 0;     // 0 until the first burst
+static int s_retries = 0;
+
+static uint8_t soc_from_mv(const uint32_t mv) {
+    const int n = sizeof(s_ocv_curve) / sizeof(s_ocv_curve[0]);
+    if (mv >= s_ocv_curve[0].mv) {
+        return 100;
+    }
+    for (int i = 1; i < n; i++) {
+        const soc_point_t *hi = &s_ocv_curve[i - 1];
+        const soc_point_t *lo = &s_ocv_curve[i];
+        if (mv >= lo->mv) {
+            return lo->soc + (mv - lo->mv) * (hi->soc - lo->soc) / (hi->mv - lo->mv);
+        }
+    }
+    return 0;
+}
+
+static void schedule_next(void) {
+    const bool active = power_manager_usb_active() || s_status.charging;
+    esp_timer_start_once(s_period_timer, (active ? BATTERY_PERIOD_ACTIVE_MS : BATTERY_PERIOD_IDLE_MS) * 1000ULL);
+}
+
+static void update(const uint32_t battery_mv, const uint32_t vin_mv) {
+    const bool external_power = vin_mv >= VIN_PRESENT_MV || gpio_get_level(GPIO_BAT_PGOOD) == 0;
+    const bool charging = external_power && gpio_get_level(GPIO_BAT_CHRG) == 0;
+    const bool plug_changed = s_status.valid && external_power != s_status.external_power;
+
+    // Plugging in or out steps the voltage by the charge current, the filter restarts from there
+    const int32_t sample = (int32_t)battery_mv << FILTER_FRAC_BITS;
+    if (s_filtered == 0 || plug_changed) {
+        s_filtered = sample;
+    } else {
+        s_filtered += (sample - s_filtered) >> FILTER_SHIFT;
+    }
+
+    const uint32_t filtered_mv = s_filtered >> FILTER_FRAC_BITS;
+    uint8_t soc = soc_from_mv(filtered_mv);
+    // Load and charge current move the voltage both ways, the charge itself only drops on battery
+    // and only rises on the charger
+    if (s_status.valid && !plug_changed) {
+        if (!external_power && soc > s_status.soc) {
+            soc = s_status.soc;
+        } else if (external_power && soc < s_status.soc) {
+            soc = s_status.soc;
+        }
+    }
+    if (charging && soc > 99) {
+        soc = 99;   // 100 only once the charger is done
+    } else if (external_power && !charging && filtered_mv >= FULL_MV) {
+        soc = 100;
+    }
+
+    const bool soc_changed = !s_status.valid || soc != s_status.soc;
+    if (soc_changed || plug_changed) {
+        ESP_LOGI(TAG, "Battery %d%%, %lu mV, %s", soc, filtered_mv,
+                 charging ? "charging" : external_power ? "external power" : "on battery");
+    }
+
+    s_status = (battery_status_t) {
+        .valid = true,
+        .soc = soc,
+        .battery_mv = filtered_mv,
+        .vin_mv = vin_mv,
+        .external_power = external_power,
+        .charging = charging,
+    };
+
+    if (soc_changed) {
+        ble_hid_device_set_battery_level(soc);
+    }
+    power_manager_set_battery(soc, external_power);
+}
+
+static void read_callback(void *arg) {
+    uint32_t len = 0;
+    const esp_err_t err = adc_continuous_read(s_adc, s_frame, FRAME_BYTES, &len, 0);
+    if (err == ESP_ERR_TIMEOUT && ++s_retries <= BURST_RETRIES) {
+        esp_timer_start_once(s_read_timer, BURST_US);
+        return;
+    }
+    adc_continuous_stop(s_adc);
+    adc_continuous_flush_pool(s_adc);
+
+    uint32_t sum[NUM_CHANNELS] = {0};
+    uint32_t count[NUM_CHANNELS] = {0};
+    for (uint32_t i = 0; err == ESP_OK && i + SOC_ADC_DIGI_RESULT_BYTES <= len; i += SOC_ADC_DIGI_RESULT_BYTES) {
+        const adc_digi_output_data_t *result = (const adc_digi_output_data_t *)&s_frame[i];
+        for (int c = 0; c < NUM_CHANNELS; c++) {
+            if (result->type2.channel == s_channels[c]) {
+                sum[c] += result->type2.data;
+                count[c]++;
+            }
+        }
+    }
+
+    if (count[CHANNEL_BAT] == 0 || count[CHANNEL_VIN] == 0) {
+        ESP_LOGW(TAG, "No samples in the burst: %s", esp_err_to_name(err));
+        schedule_next();
+        return;
+    }
+
+    int mv[NUM_CHANNELS] = {0};
+    for (int c = 0; c < NUM_CHANNELS; c++) {
+        const int raw = (int)((sum[c] + count[c] / 2) / count[c]);
+        if (s_cali[c] == NULL || adc_cali_raw_to_voltage(s_cali[c], raw, &mv[c]) != ESP_OK) {
+            mv[c] = raw * 3100 / 4095;  // uncalibrated, full scale at 12 dB
+        }
+    }
+
+    update(mv[CHANNEL_BAT] * ADC_BAT_DIVIDER, mv[CHANNEL_VIN] * ADC_VIN_DIVIDER);
+    schedule_next();
+}
+
+static void period_callback(void *arg) {
+    s_retries = 0;
+    const esp_err_t err = adc_continuous_start(s_adc);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to start a burst: %s", esp_err_to_name(err));
+        schedule_next();
+        return;
+    }
+    esp_timer_start_once(s_read_timer, BURST_US);
+}
+
+static esp_err_t init_adc(void) {
+    const int pins[NUM_CHANNELS] = {[CHANNEL_BAT] = GPIO_ADC_BAT, [CHANNEL_VIN] = GPIO_ADC_VIN};
+    adc_digi_pattern_config_t pattern[NUM_CHANNELS] = {0};
+    for (int c = 0; c < NUM_CHANNELS; c++) {
+        adc_unit_t unit;
+        esp_err_t err = adc_continuous_io_to_channel(pins[c], &unit, &s_channels[c]);
+        if (err != ESP_OK || unit != ADC_UNIT_1) {
+            ESP_LOGE(TAG, "GPIO %d is not an ADC1 pin", pins[c]);
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        pattern[c] = (adc_digi_pattern_config_t) {
+            .atten = ADC_ATTEN_DB_12,
+            .channel = s_channels[c] & 0x7,
+            .unit = ADC_UNIT_1,
+            .bit_width = SOC_ADC_DIGI_MAX_BITWIDTH,
+        };
+
+        const adc_cali_curve_fitting_config_t cali_config = {
+            .unit_id = ADC_UNIT_1,
+            .chan = s_channels[c],
+            .atten = ADC_ATTEN_DB_12,
+            .bitwidth = ADC_BITWIDTH_DEFAULT,
+        };
+        err = adc_cali_create_scheme_curve_fitting(&cali_config, &s_cali[c]);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "No calibration for GPIO %d: %s", pins[c], esp_err_to_name(err));
+            s_cali[c] = NULL;
+        }
+    }
+
+    const adc_continuous_handle_cfg_t handle_config = {
+        .max_store_buf_size = FRAME_BYTES * 2,
+        .conv_frame_size = FRAME_BYTES,
+    };
+    esp_err_t err = adc_continuous_new_handle(&handle_config, &s_adc);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create ADC handle: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    const adc_continuous_config_t config = {
+        .pattern_num = NUM_CHANNELS,
+        .adc_pattern = pattern,
+        .sample_freq_hz = BATTERY_SAMPLE_HZ,
+        .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+        .format = ADC_DIGI_OUTPUT_FORMAT_TYPE2,
+    };
+    err = adc_continuous_config(s_adc, &config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to configure ADC: %s", esp_err_to_name(err));
+        adc_continuous_deinit(s_adc);
+        s_adc = NULL;
+    }
+    return err;
+}
+
+esp_err_t battery_init(void) {
+    if (s_adc != NULL) {
+        return ESP_OK;
+    }
+
+    esp_err_t err = init_adc();
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    const esp_timer_create_args_t period_args = {
+        .callback = period_callback,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "battery",
+    };
+    err = esp_timer_create(&period_args, &s_period_timer);
+    if (err == ESP_OK) {
+        const esp_timer_create_args_t read_args = {
+            .callback = read_callback,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "battery_read",
+        };
+        err = esp_timer_create(&read_args, &s_read_timer);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create battery timers: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    // First reading right away, the level hosts see at connect is a real one
+    esp_timer_start_once(s_period_timer, 0);
+    ESP_LOGI(TAG, "Battery gauge, %d samples per channel at %d Hz", BATTERY_SAMPLES_PER_CHANNEL, BATTERY_SAMPLE_HZ);
+    return ESP_OK;
+}
+#else
+esp_err_t battery_init(void) {
+    ESP_LOGI(TAG, "No battery ADC on this board");
+    return ESP_ERR_NOT_SUPPORTED;
+}
+#endif
+
+void battery_get_status(battery_status_t *status) {
+    *status = s_status;
+}
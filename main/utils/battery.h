@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Battery gauge. Battery and input voltage are taken in short ADC continuous mode bursts, one DMA frame
+ * averaged per channel, started by an esp_timer: there is no task, and the ADC driver holds its PM lock
+ * only for the few milliseconds of a burst. Bursts come faster while USB is active or the battery charges.
+ *
+ * The charge level follows a Li-ion open circuit voltage curve over a filtered battery voltage. It
+ * goes to the BLE Battery Service, notified when the percentage changes, and to the power manager.
+ */
+#define BATTERY_PERIOD_ACTIVE_MS    (10 * 1000)     // USB host running or charging
+#define BATTERY_PERIOD_IDLE_MS      (60 * 1000)
+#define BATTERY_SAMPLE_HZ           20000
+#define BATTERY_SAMPLES_PER_CHANNEL 64
+
+typedef struct {
+    bool valid;             // false before the first burst and on boards without the battery ADC
+    uint8_t soc;            // state of charge, percent
+    uint16_t battery_mv;    // filtered
+    uint16_t vin_mv;
+    bool external_power;
+    bool charging;
+} battery_status_t;
+
+/**
+ * @brief Set up the ADC and start sampling
+ *
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NOT_SUPPORTED on boards without the battery ADC
+ */
+esp_err_t battery_init(void);
+
+/**
+ * @brief Get the last battery reading
+ *
+ * @param status Output status
+ */
+void battery_get_status(battery_status_t *status);
+
+#ifdef __cplusplus
+}
+#endif
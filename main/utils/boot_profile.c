@@ -0,0 +1,59 @@
+#include "boot_profile.h"
+
+#include <stdbool.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "const.h"
+
+static const char *TAG = "BOOT";
+
+typedef struct {
+    int64_t start_us;
+    int64_t end_us;
+} boot_span_t;
+
+static const char *const s_phase_names[BOOT_PHASE_COUNT] = {
+    [BOOT_PHASE_NVS] = "nvs",
+    [BOOT_PHASE_SETTINGS] = "settings",
+    [BOOT_PHASE_USB_HOST] = "usb host",
+    [BOOT_PHASE_BLE] = "ble",
+    [BOOT_PHASE_HID_PATH] = "hid path",
+    [BOOT_PHASE_DEFERRED] = "deferred",
+};
+
+// Phases run on different tasks, but each slot is written by one of them only
+static boot_span_t s_spans[BOOT_PHASE_COUNT];
+static volatile bool s_first_report_seen = false;
+
+void boot_phase_begin(const boot_phase_t phase) {
+    if (phase < BOOT_PHASE_COUNT && s_spans[phase].start_us == 0) {
+        s_spans[phase].start_us = esp_timer_get_time();
+    }
+}
+
+void boot_phase_end(const boot_phase_t phase) {
+    if (phase < BOOT_PHASE_COUNT && s_spans[phase].start_us != 0 && s_spans[phase].end_us == 0) {
+        s_spans[phase].end_us = esp_timer_get_time();
+    }
+}
+
+void boot_profile_log(void) {
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+        const boot_span_t *span = &s_spans[i];
+        if (span->end_us != 0) {
+            ESP_LOGI(TAG, "%-8s %6lld .. %6lld us, %lld us", s_phase_names[i], span->start_us, span->end_us,
+                     span->end_us - span->start_us);
+        }
+    }
+}
+
+void boot_profile_first_report(void) {
+    if (s_first_report_seen) {
+        return;
+    }
+
+    s_first_report_seen = true;
+    const int64_t now = esp_timer_get_time();
+    ESP_LOGI(TAG, "Firmware " FIRMWARE_VERSION ", HID path live at %lld ms, first report forwarded at %lld ms",
+             s_spans[BOOT_PHASE_HID_PATH].end_us / 1000, now / 1000);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Boot phase timing. Stamps are esp_timer_get_time(), which counts from early app startup, so the
+ * numbers compare release over release. Only the first run of a phase is recorded, a bridge
+ * restart later doesn't overwrite the boot.
+ */
+typedef enum {
+    BOOT_PHASE_NVS,
+    BOOT_PHASE_SETTINGS,
+    BOOT_PHASE_USB_HOST,    // runs next to BOOT_PHASE_BLE, on the USB core
+    BOOT_PHASE_BLE,
+    BOOT_PHASE_HID_PATH,    // bridge init until the bridge task runs, spans USB host and BLE
+    BOOT_PHASE_DEFERRED,    // LEDs, rotary encoder, battery, web stack check
+    BOOT_PHASE_COUNT
+} boot_phase_t;
+
+/**
+ * @brief Stamp the start of a phase
+ */
+void boot_phase_begin(boot_phase_t phase);
+
+/**
+ * @brief Stamp the end of a phase
+ */
+void boot_phase_end(boot_phase_t phase);
+
+/**
+ * @brief Stamp the first report forwarded to a BLE host and log the boot summary, only the first call counts
+ */
+void boot_profile_first_report(void);
+
+/**
+ * @brief Log the phases recorded so far
+ */
+void boot_profile_log(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,63 @@
+#include "heap_report.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "power_manager.h"
+
+static const char *TAG = "HEAP";
+
+static esp_timer_handle_t s_timer = NULL;
+static uint32_t s_baseline_free = 0;
+static volatile uint32_t s_min_largest_block = UINT32_MAX;
+
+void heap_report_get(heap_report_t *report) {
+    const uint32_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL);
+    if (largest < s_min_largest_block) {
+        s_min_largest_block = largest;
+    }
+
+    *report = (heap_report_t) {
+        .uptime_s = (uint32_t)(esp_timer_get_time() / 1000000),
+        .free = heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+        .min_free = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+        .largest_block = largest,
+        .min_largest_block = s_min_largest_block,
+        .baseline_free = s_baseline_free,
+    };
+}
+
+static void report_callback(void *arg) {
+    heap_report_t report;
+    heap_report_get(&report);
+    uint32_t sleeps, slept_ms;
+    power_manager_get_sleep_stats(&sleeps, &slept_ms);
+    ESP_LOGI(TAG, "Up %lu h %02lu m, free %lu (boot %lu, low %lu), largest block %lu (low %lu), "
+             "light sleep %lu times for %lu s",
+             report.uptime_s / 3600, report.uptime_s / 60 % 60, report.free, report.baseline_free,
+             report.min_free, report.largest_block, report.min_largest_block, sleeps, slept_ms / 1000);
+}
+
+esp_err_t heap_report_start(void) {
+    if (s_timer != NULL) {
+        return ESP_OK;
+    }
+
+    s_baseline_free = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    const esp_timer_create_args_t timer_args = {
+        .callback = report_callback,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "heap_report",
+    };
+    esp_err_t err = esp_timer_create(&timer_args, &s_timer);
+    if (err == ESP_OK) {
+        err = esp_timer_start_periodic(s_timer, HEAP_REPORT_PERIOD_MS * 1000ULL);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start heap report: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    report_callback(NULL);
+    return ESP_OK;
+}
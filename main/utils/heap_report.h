@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Heap low-water report. Every HEAP_REPORT_PERIOD_MS the internal heap is sampled and logged next to
+ * the uptime. Once boot is done the HID path and BLE restarts run from static storage, so over a long
+ * uptime the low-water mark and the smallest largest block should settle and stay, any drift is a leak
+ * or fragmentation.
+ */
+#define HEAP_REPORT_PERIOD_MS (10 * 60 * 1000)
+
+typedef struct {
+    uint32_t uptime_s;
+    uint32_t free;              // internal heap, bytes
+    uint32_t min_free;          // low-water mark since boot
+    uint32_t largest_block;     // largest free block now
+    uint32_t min_largest_block; // smallest largest block seen by the report
+    uint32_t baseline_free;     // free heap at heap_report_start()
+} heap_report_t;
+
+/**
+ * @brief Take the baseline and start the periodic report, call once boot is done
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t heap_report_start(void);
+
+/**
+ * @brief Sample the heap now
+ *
+ * @param report Output
+ */
+void heap_report_get(heap_report_t *report);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,158 @@
+#include "latency_trace.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "perf_counters.h"
+
+static const char *TAG = "LATENCY";
+
+typedef struct {
+    uint32_t buckets[LATENCY_HIST_BUCKETS];
+    uint32_t count;
+    uint32_t max_us;
+} latency_hist_t;
+
+static latency_hist_t s_hist[LAT_STAGE_COUNT];
+static portMUX_TYPE s_hist_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *const s_stage_names[LAT_STAGE_COUNT] = {
+    [LAT_STAGE_USB_TO_QUEUE] = "usb>q",
+    [LAT_STAGE_QUEUE_TO_BRIDGE] = "q>bridge",
+    [LAT_STAGE_BRIDGE_TO_BLE] = "bridge>ble",
+    [LAT_STAGE_ACCUMULATOR] = "acc",
+    [LAT_STAGE_END_TO_END] = "e2e",
+};
+
+__attribute__((section(".iram1.text"))) void latency_trace_record(const latency_stage_t stage, const int64_t us) {
+    if (stage >= LAT_STAGE_COUNT || us < 0) {
+        return;
+    }
+
+    const uint32_t value = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+    uint32_t bucket = value == 0 ? 0 : 32 - __builtin_clz(value);
+    if (bucket >= LATENCY_HIST_BUCKETS) {
+        bucket = LATENCY_HIST_BUCKETS - 1;
+    }
+
+    latency_hist_t *hist = &s_hist[stage];
+    portENTER_CRITICAL_SAFE(&s_hist_lock);
+    hist->buckets[bucket]++;
+    hist->count++;
+    if (value > hist->max_us) {
+        hist->max_us = value;
+    }
+    portEXIT_CRITICAL_SAFE(&s_hist_lock);
+}
+
+__attribute__((section(".iram1.text"))) void latency_trace_sent(const latency_stamp_t *stamp) {
+    if (stamp == NULL) {
+        return;
+    }
+
+    const int64_t now = esp_timer_get_time();
+    if (stamp->bridge_us) {
+        latency_trace_record(LAT_STAGE_BRIDGE_TO_BLE, now - stamp->bridge_us);
+    }
+    if (stamp->usb_us) {
+        const int64_t us = now - stamp->usb_us;
+        latency_trace_record(LAT_STAGE_END_TO_END, us);
+        if (us >= 0) {
+            perf_max(PERF_MAX_E2E_LATENCY_US, us > UINT32_MAX ? UINT32_MAX : (uint32_t)us);
+        }
+    }
+}
+
+void latency_trace_reset(void) {
+    portENTER_CRITICAL(&s_hist_lock);
+    memset(s_hist, 0, sizeof(s_hist));
+    portEXIT_CRITICAL(&s_hist_lock);
+}
+
+static uint32_t bucket_upper_bound(const uint32_t bucket) {
+    return bucket == 0 ? 1 : 1UL << bucket;
+}
+
+void latency_trace_get_summary(const latency_stage_t stage, latency_summary_t *summary) {
+    memset(summary, 0, sizeof(*summary));
+    if (stage >= LAT_STAGE_COUNT) {
+        return;
+    }
+
+    latency_hist_t hist;
+    portENTER_CRITICAL(&s_hist_lock);
+    hist = s_hist[stage];
+    portEXIT_CRITICAL(&s_hist_lock);
+
+    summary->count = hist.count;
+    summary->max_us = hist.max_us;
+    if (hist.count == 0) {
+        return;
+    }
+
+    // Ranks are 1-based: the p-th percentile is the first bucket whose cumulative count reaches ceil(count * p)
+    const uint32_t rank50 = (uint32_t)(((uint64_t)hist.count * 50 + 99) / 100);
+    const uint32_t rank99 = (uint32_t)(((uint64_t)hist.count * 99 + 99) / 100);
+    uint32_t cumulative = 0;
+    bool have_p50 = false;
+    for (uint32_t i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+        cumulative += hist.buckets[i];
+        if (!have_p50 && cumulative >= rank50) {
+            summary->p50_us = bucket_upper_bound(i);
+            have_p50 = true;
+        }
+        if (cumulative >= rank99) {
+            summary->p99_us = bucket_upper_bound(i);
+            break;
+        }
+    }
+
+    // A bucket bound can overshoot the real worst case
+    if (summary->p50_us > summary->max_us) summary->p50_us = summary->max_us;
+    if (summary->p99_us > summary->max_us) summary->p99_us = summary->max_us;
+}
+
+static uint8_t *put_u32_le(uint8_t *p, const uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+    return p + 4;
+}
+
+size_t latency_trace_serialize(uint8_t *buf, const size_t len) {
+    if (buf == NULL || len < LATENCY_MSG_SIZE) {
+        return 0;
+    }
+
+    uint8_t *p = buf;
+    *p++ = LATENCY_MSG_TYPE;
+    *p++ = LAT_STAGE_COUNT;
+    for (int i = 0; i < LAT_STAGE_COUNT; i++) {
+        latency_summary_t summary;
+        latency_trace_get_summary(i, &summary);
+        p = put_u32_le(p, summary.count);
+        p = put_u32_le(p, summary.p50_us);
+        p = put_u32_le(p, summary.p99_us);
+        p = put_u32_le(p, summary.max_us);
+    }
+
+    return p - buf;
+}
+
+void latency_trace_log(void) {
+    char line[256];
+    int pos = 0;
+    for (int i = 0; i < LAT_STAGE_COUNT && pos < (int)sizeof(line); i++) {
+        latency_summary_t summary;
+        latency_trace_get_summary(i, &summary);
+        pos += snprintf(line + pos, sizeof(line) - pos, "%s%s %"PRIu32"/%"PRIu32"/%"PRIu32,
+                        i ? " | " : "", s_stage_names[i], summary.p50_us, summary.p99_us, summary.max_us);
+    }
+
+    ESP_LOGI(TAG, "p50/p99/max us: %s", line);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bucket i holds samples in [2^(i-1), 2^i) us, bucket 0 holds 0 us, the last bucket is open-ended
+#define LATENCY_HIST_BUCKETS 20
+
+// Binary WebSocket message: type, stage count, then per stage 4 x uint32 LE (count, p50, p99, max)
+#define LATENCY_MSG_TYPE 0x01
+#define LATENCY_MSG_SIZE (2 + LAT_STAGE_COUNT * 4 * sizeof(uint32_t))
+
+typedef enum {
+    LAT_STAGE_USB_TO_QUEUE,     // USB IN callback -> report committed to the ring
+    LAT_STAGE_QUEUE_TO_BRIDGE,  // committed -> dequeued by the bridge task
+    LAT_STAGE_BRIDGE_TO_BLE,    // dequeued -> esp_ble_gatts_send_indicate()
+    LAT_STAGE_ACCUMULATOR,      // time a motion sample was held in the mouse accumulator
+    LAT_STAGE_END_TO_END,       // USB IN callback -> esp_ble_gatts_send_indicate()
+    LAT_STAGE_COUNT
+} latency_stage_t;
+
+/**
+ * @brief Timestamps carried with a report from USB to BLE
+ */
+typedef struct {
+    int64_t usb_us;     // esp_timer_get_time() in the USB HID host callback, 0 if unknown
+    int64_t bridge_us;  // esp_timer_get_time() when the bridge dequeued the report
+} latency_stamp_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t p50_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+} latency_summary_t;
+
+/**
+ * @brief Add one sample to a stage histogram
+ *
+ * @param stage Stage
+ * @param us Latency in microseconds, negative values are ignored
+ */
+void latency_trace_record(latency_stage_t stage, int64_t us);
+
+/**
+ * @brief Record the bridge->BLE and end-to-end stages for a report that was just handed to the BLE stack
+ *
+ * @param stamp Report timestamps, NULL is ignored
+ */
+void latency_trace_sent(const latency_stamp_t *stamp);
+
+/**
+ * @brief Clear all histograms
+ */
+void latency_trace_reset(void);
+
+/**
+ * @brief Get p50/p99/max of a stage
+ *
+ * Percentiles are bucket upper bounds, max is exact.
+ *
+ * @param stage Stage
+ * @param summary Output summary
+ */
+void latency_trace_get_summary(latency_stage_t stage, latency_summary_t *summary);
+
+/**
+ * @brief Serialize all stage summaries into the binary WebSocket message
+ *
+ * @param buf Output buffer
+ * @param len Size of buf, must be at least LATENCY_MSG_SIZE
+ * @return Number of bytes written, 0 if buf is too small
+ */
+size_t latency_trace_serialize(uint8_t *buf, size_t len);
+
+/**
+ * @brief Log all stage summaries on one line
+ */
+void latency_trace_log(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,158 @@
+#include "nvs_writer.h"
+
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "const.h"
+
+#define WRITER_TASK_STACK 2560
+
+typedef struct {
+    nvs_writer_flush_cb_t cb;
+    void *arg;
+} writer_client_t;
+
+static const char *TAG = "NVS_WRITER";
+static writer_client_t s_clients[NVS_WRITER_MAX_CLIENTS];
+static uint8_t s_num_clients = 0;
+static uint32_t s_dirty = 0;
+static int64_t s_dirty_since_us = 0;
+static volatile int64_t s_last_activity_us = 0;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static StaticSemaphore_t s_flush_mutex_struct;
+static SemaphoreHandle_t s_flush_mutex = NULL;
+static TaskHandle_t s_task_handle = NULL;
+
+static uint32_t take_dirty(void) {
+    taskENTER_CRITICAL(&s_lock);
+    const uint32_t dirty = s_dirty;
+    s_dirty = 0;
+    taskEXIT_CRITICAL(&s_lock);
+    return dirty;
+}
+
+static void set_dirty(const uint32_t bits) {
+    taskENTER_CRITICAL(&s_lock);
+    if (s_dirty == 0) {
+        s_dirty_since_us = esp_timer_get_time();
+    }
+    s_dirty |= bits;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+static esp_err_t flush_dirty(void) {
+    if (s_flush_mutex != NULL) {
+        xSemaphoreTake(s_flush_mutex, portMAX_DELAY);
+    }
+
+    esp_err_t result = ESP_OK;
+    const uint32_t dirty = take_dirty();
+    for (int i = 0; i < s_num_clients; i++) {
+        if (!(dirty & (1UL << i))) {
+            continue;
+        }
+
+        const esp_err_t ret = s_clients[i].cb(s_clients[i].arg);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Client %d flush failed: %s", i, esp_err_to_name(ret));
+            set_dirty(1UL << i);
+            result = ret;
+        }
+    }
+
+    if (s_flush_mutex != NULL) {
+        xSemaphoreGive(s_flush_mutex);
+    }
+    return result;
+}
+
+static void writer_task(void *arg) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // Flash writes stall both caches, hold them back until input goes quiet
+        while (1) {
+            const int64_t now = esp_timer_get_time();
+            const int64_t quiet_ms = (now - s_last_activity_us) / 1000;
+            const int64_t deferred_ms = (now - s_dirty_since_us) / 1000;
+            if (quiet_ms >= NVS_WRITER_QUIET_MS || deferred_ms >= NVS_WRITER_MAX_DEFER_MS) {
+                break;
+            }
+            vTaskDelay(pdMS_TO_TICKS(NVS_WRITER_QUIET_MS - quiet_ms));
+        }
+
+        if (flush_dirty() != ESP_OK) {
+            // Retry later rather than spinning on a broken partition
+            vTaskDelay(pdMS_TO_TICKS(NVS_WRITER_MAX_DEFER_MS));
+            xTaskNotifyGive(s_task_handle);
+        }
+    }
+}
+
+static void shutdown_handler(void) {
+    flush_dirty();
+}
+
+esp_err_t nvs_writer_init(void) {
+    if (s_task_handle != NULL) {
+        return ESP_OK;
+    }
+
+    s_flush_mutex = xSemaphoreCreateMutexStatic(&s_flush_mutex_struct);
+    if (xTaskCreatePinnedToCore(writer_task, "nvs_writer", WRITER_TASK_STACK, NULL, TASK_NVS_WRITER_PRIO,
+                                &s_task_handle, TASK_NVS_WRITER_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create writer task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_register_shutdown_handler(shutdown_handler);
+
+    // Anything marked before the task existed was flushed synchronously already
+    return ESP_OK;
+}
+
+int8_t nvs_writer_register(const nvs_writer_flush_cb_t cb, void *arg) {
+    if (cb == NULL) {
+        return -1;
+    }
+
+    for (int i = 0; i < s_num_clients; i++) {
+        if (s_clients[i].cb == cb && s_clients[i].arg == arg) {
+            return i;
+        }
+    }
+
+    if (s_num_clients >= NVS_WRITER_MAX_CLIENTS) {
+        ESP_LOGE(TAG, "No free client slot");
+        return -1;
+    }
+
+    s_clients[s_num_clients] = (writer_client_t) { .cb = cb, .arg = arg };
+    return s_num_clients++;
+}
+
+void nvs_writer_mark_dirty(const int8_t id) {
+    if (id < 0 || id >= s_num_clients) {
+        return;
+    }
+
+    set_dirty(1UL << id);
+    if (s_task_handle == NULL) {
+        flush_dirty();
+        return;
+    }
+
+    xTaskNotifyGive(s_task_handle);
+}
+
+__attribute__((section(".iram1.text"))) void nvs_writer_note_activity(void) {
+    s_last_activity_us = esp_timer_get_time();
+}
+
+esp_err_t nvs_writer_flush(void) {
+    return flush_dirty();
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Commits wait for this much input silence, but never longer than NVS_WRITER_MAX_DEFER_MS
+#define NVS_WRITER_QUIET_MS 1500
+#define NVS_WRITER_MAX_DEFER_MS (30 * 1000)
+#define NVS_WRITER_MAX_CLIENTS 4
+
+/**
+ * @brief Writes the client's RAM copy to NVS, including nvs_commit()
+ *
+ * Runs on the writer task (or the restarting task on shutdown), never concurrently with itself.
+ *
+ * @param arg User argument given to nvs_writer_register()
+ * @return esp_err_t ESP_OK on success, anything else keeps the client dirty
+ */
+typedef esp_err_t (*nvs_writer_flush_cb_t)(void *arg);
+
+/**
+ * @brief Start the low-priority writer task and flush everything on esp_restart()
+ *
+ * Until this is called nvs_writer_mark_dirty() flushes synchronously.
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t nvs_writer_init(void);
+
+/**
+ * @brief Register a client
+ *
+ * @param cb Flush callback
+ * @param arg User argument passed to cb
+ * @return Client ID, -1 if all slots are taken
+ */
+int8_t nvs_writer_register(nvs_writer_flush_cb_t cb, void *arg);
+
+/**
+ * @brief Schedule a flush of a client, repeated calls before the commit coalesce into one
+ *
+ * @param id Client ID from nvs_writer_register()
+ */
+void nvs_writer_mark_dirty(int8_t id);
+
+/**
+ * @brief Note input activity, pending commits are held back while reports are flowing
+ */
+void nvs_writer_note_activity(void);
+
+/**
+ * @brief Flush all dirty clients now, blocking
+ *
+ * @return esp_err_t ESP_OK if every client flushed
+ */
+esp_err_t nvs_writer_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
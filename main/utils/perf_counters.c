@@ -0,0 +1,51 @@
+#include "perf_counters.h"
+
+#include <string.h>
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+_Static_assert(PERF_FLUSH_HOST_SWITCH - PERF_FLUSH_DIRECT == 4, "flush counters follow ble_flush_reason_t");
+
+static const char *TAG = "PERF";
+
+// Each core only writes its own entry
+perf_core_counters_t g_perf_counters[portNUM_PROCESSORS];
+
+// Called in the context of the failing allocation, must not allocate
+static void alloc_failed_callback(const size_t size, const uint32_t caps, const char *function_name) {
+    perf_count(PERF_ALLOC_FAILURES);
+}
+
+esp_err_t perf_counters_init(void) {
+    const esp_err_t err = heap_caps_register_failed_alloc_callback(alloc_failed_callback);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to register the allocation failure callback: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+uint32_t perf_read(const perf_counter_t counter) {
+    uint32_t sum = 0;
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        sum += g_perf_counters[core].counts[counter];
+    }
+    return sum;
+}
+
+void perf_get_snapshot(perf_snapshot_t *snapshot) {
+    memset(snapshot, 0, sizeof(perf_snapshot_t));
+    snapshot->time_us = esp_timer_get_time();
+
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        const perf_core_counters_t *counters = &g_perf_counters[core];
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            snapshot->counts[i] += counters->counts[i];
+        }
+        for (int i = 0; i < PERF_MAX_COUNT; i++) {
+            if (counters->max[i] > snapshot->max[i]) {
+                snapshot->max[i] = counters->max[i];
+            }
+        }
+    }
+}
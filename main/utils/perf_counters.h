@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Always-on event counters for the report path. Every core increments its own copy with a plain
+ * add, so a count costs a load and a store without atomics or locks; readers sum the copies.
+ * All counters are 32 bits and wrap, differences between two snapshots give rates.
+ *
+ * The load and the store aren't atomic: whatever runs in between on the same core can lose one
+ * count, an ISR incrementing the same counter, or another task when the incrementing one is
+ * preempted there. A task preempted between xPortGetCoreID() and the add may also resume on the
+ * other core and race that core's owner. Counts are exact enough for rates, not for accounting.
+ */
+typedef enum {
+    PERF_USB_REPORTS,           // input reports received from USB
+    PERF_RING_DROPS,            // reports dropped because the ring or the source share was full
+    PERF_BRIDGE_REPORTS,        // reports dequeued by the bridge task
+    PERF_BLE_REPORTS,           // reports handed to the BLE side, after coalescing
+    PERF_BLE_NOTIFIES,          // esp_ble_gatts_send_indicate() calls that succeeded
+    PERF_BLE_NOTIFY_ERRORS,     // esp_ble_gatts_send_indicate() calls that failed
+    PERF_BLE_SUPPRESSED,        // repeated reports not sent
+    PERF_BLE_CONGESTED,         // ESP_GATTS_CONGEST_EVT with the congested flag set
+    PERF_BLE_TX_QUEUED,         // notifications held back by congestion
+    PERF_BLE_TX_MERGED,         // motion added into a held notification
+    PERF_BLE_TX_MOTION_DROPPED, // held motion deltas dropped because the queue of its report was full
+    PERF_BLE_TX_EDGE_DROPPED,   // held state changes dropped, only when the reserve for them ran out too
+    PERF_PACKED_SAMPLES,        // motion samples sent in packed notifications
+    PERF_FLUSH_DIRECT,          // accumulator flushes, in ble_flush_reason_t order
+    PERF_FLUSH_BUTTON,
+    PERF_FLUSH_FIRST,
+    PERF_FLUSH_CONN_EVENT,
+    PERF_FLUSH_HOST_SWITCH,
+    PERF_ALLOC_FAILURES,        // failed heap allocations anywhere in the system
+    PERF_HOT_PATH_ALLOCS,       // heap calls from the USB report task, needs CONFIG_HEAP_USE_HOOKS
+    PERF_BLE_CONNECTS,
+    PERF_BLE_DISCONNECTS,
+    PERF_BLE_RECONNECTS,        // reconnect attempts started because a host disconnected
+    PERF_USB_ATTACHES,          // HID interfaces started
+    PERF_COUNTER_COUNT
+} perf_counter_t;
+
+typedef enum {
+    PERF_MAX_E2E_LATENCY_US,    // USB IN callback -> esp_ble_gatts_send_indicate(), since boot
+    PERF_MAX_COUNT
+} perf_max_t;
+
+typedef struct {
+    int64_t time_us;                        // esp_timer_get_time() when taken
+    uint32_t counts[PERF_COUNTER_COUNT];    // summed over cores
+    uint32_t max[PERF_MAX_COUNT];           // maximum over cores
+} perf_snapshot_t;
+
+typedef struct {
+    uint32_t counts[PERF_COUNTER_COUNT];
+    uint32_t max[PERF_MAX_COUNT];
+} perf_core_counters_t;
+
+extern perf_core_counters_t g_perf_counters[portNUM_PROCESSORS];
+
+/**
+ * @brief Count one event, safe from IRAM code
+ *
+ * @param counter Counter
+ */
+static inline __attribute__((always_inline)) void perf_count(const perf_counter_t counter) {
+    g_perf_counters[xPortGetCoreID()].counts[counter]++;
+}
+
+/**
+ * @brief Raise a maximum, safe from IRAM code
+ *
+ * @param gauge Maximum to update
+ * @param value New sample
+ */
+static inline __attribute__((always_inline)) void perf_max(const perf_max_t gauge, const uint32_t value) {
+    uint32_t *const max = &g_perf_counters[xPortGetCoreID()].max[gauge];
+    if (value > *max) {
+        *max = value;
+    }
+}
+
+/**
+ * @brief Count failed heap allocations, call once from app_main
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t perf_counters_init(void);
+
+/**
+ * @brief Read one counter summed over cores
+ *
+ * @param counter Counter
+ * @return Current value, wraps at 32 bits
+ */
+uint32_t perf_read(perf_counter_t counter);
+
+/**
+ * @brief Read all counters at once
+ *
+ * Values are read without stopping the writers, each one is exact but they may be a few events apart.
+ *
+ * @param snapshot Output snapshot
+ */
+void perf_get_snapshot(perf_snapshot_t *snapshot);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,268 @@
+#include "power_manager.h"
+
+#include <const.h>
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "driver/gpio.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "storage.h"
+#include "usb_hid_host.h"
+
+static const char *TAG = "POWER";
+static esp_pm_lock_handle_t s_usb_lock = NULL;
+static esp_pm_lock_handle_t s_report_lock = NULL;
+static esp_pm_lock_handle_t s_boost_lock = NULL;
+static bool s_usb_active = false;
+static bool s_reports_busy = false;
+static esp_timer_handle_t s_governor_timer = NULL;
+static bool s_boosted = false;
+static int s_boost_rps = 0;
+static int s_boost_freq = PM_BOOST_FREQ_MHZ;
+static volatile bool s_boost_dirty = true;
+static uint32_t s_last_report_count = 0;
+static int s_calm_ms = 0;
+static StaticSemaphore_t s_state_sem_struct;
+static SemaphoreHandle_t s_state_sem = NULL;
+static volatile uint8_t s_sleep_scale = 100;
+// Updated on the way out of each light sleep
+static volatile uint32_t s_sleep_count = 0;
+static volatile uint32_t s_slept_ms = 0;
+
+#if CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+static uint32_t s_slept_rest_us = 0;
+
+// Runs with interrupts off, no logging
+__attribute__((section(".iram1.text"))) static esp_err_t sleep_exit_callback(const int64_t sleep_time_us, void *arg) {
+    const uint32_t total_us = s_slept_rest_us + (uint32_t)sleep_time_us;
+    s_slept_ms += total_us / 1000;
+    s_slept_rest_us = total_us % 1000;
+    s_sleep_count++;
+    return ESP_OK;
+}
+#endif
+
+// Buttons are active low, a press wakes the chip even when nothing else is scheduled
+void power_manager_enable_wakeup(void) {
+    const gpio_num_t buttons[] = {
+        GPIO_BUTTON_SW4,
+#ifdef HW02
+        GPIO_BUTTON_SW3,
+        GPIO_BUTTON_SW2,
+        GPIO_BUTTON_SW1,
+#endif
+    };
+
+    for (int i = 0; i < sizeof(buttons) / sizeof(buttons[0]); i++) {
+        const esp_err_t err = gpio_wakeup_enable(buttons[i], GPIO_INTR_LOW_LEVEL);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to enable wakeup on GPIO %d: %s", buttons[i], esp_err_to_name(err));
+        }
+    }
+    esp_sleep_enable_gpio_wakeup();
+}
+
+static esp_err_t configure_pm(const int max_freq_mhz) {
+    const esp_pm_config_t cfg = {
+        .max_freq_mhz = max_freq_mhz,
+        .min_freq_mhz = PM_MIN_FREQ_MHZ,
+        .light_sleep_enable = true,
+    };
+    return esp_pm_configure(&cfg);
+}
+
+static void set_boost(const bool boost) {
+    if (boost == s_boosted) {
+        return;
+    }
+
+    s_boosted = boost;
+    if (boost) {
+        esp_pm_lock_acquire(s_boost_lock);
+    } else {
+        esp_pm_lock_release(s_boost_lock);
+    }
+    ESP_LOGD(TAG, "CPU boost %s", boost ? "on" : "off");
+}
+
+// The boost lock runs the CPU at max_freq_mhz, so a new boost frequency is a new PM configuration
+static void apply_boost_settings(void) {
+    const device_settings_t *settings = storage_settings();
+    s_boost_rps = settings->power.boost_rps > 0 ? settings->power.boost_rps : 0;
+
+    const int freq = settings->power.boost_freq > 160 ? 240 : 160;
+    if (freq != s_boost_freq) {
+        const esp_err_t err = configure_pm(freq);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to set boost to %d MHz: %s", freq, esp_err_to_name(err));
+            return;
+        }
+        s_boost_freq = freq;
+    }
+    ESP_LOGI(TAG, "CPU boost to %d MHz above %d rps", s_boost_freq, s_boost_rps);
+}
+
+static void governor_callback(void *arg) {
+    if (s_boost_dirty) {
+        s_boost_dirty = false;
+        apply_boost_settings();
+    }
+
+    const uint32_t count = usb_hid_host_get_report_count();
+    const int rps = (count - s_last_report_count) * 1000 / PM_GOVERNOR_PERIOD_MS;
+    s_last_report_count = count;
+
+    if (s_boost_rps > 0 && rps >= s_boost_rps) {
+        s_calm_ms = 0;
+        set_boost(true);
+    } else if (s_boosted && (s_boost_rps == 0 || rps < s_boost_rps / 2)) {
+        s_calm_ms += PM_GOVERNOR_PERIOD_MS;
+        if (s_boost_rps == 0 || s_calm_ms >= PM_GOVERNOR_HOLD_MS) {
+            set_boost(false);
+        }
+    } else {
+        s_calm_ms = 0;
+    }
+}
+
+static void on_settings_changed(const uint32_t changed, const device_settings_t *settings, void *arg) {
+    s_boost_dirty = true;
+}
+
+esp_err_t power_manager_init(void) {
+    if (s_state_sem != NULL) {
+        return ESP_OK;
+    }
+
+    s_state_sem = xSemaphoreCreateBinaryStatic(&s_state_sem_struct);
+
+    esp_err_t err = esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "usb_host", &s_usb_lock);
+    if (err == ESP_OK) {
+        err = esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "reports", &s_report_lock);
+    }
+    if (err == ESP_OK) {
+        err = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "boost", &s_boost_lock);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create PM locks: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = governor_callback,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "pm_governor",
+    };
+    err = esp_timer_create(&timer_args, &s_governor_timer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create governor timer: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = configure_pm(s_boost_freq);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to configure PM: %s", esp_err_to_name(err));
+        return err;
+    }
+
+#if CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+    esp_pm_sleep_cbs_register_config_t sleep_cbs = {
+        .exit_cb = sleep_exit_callback,
+    };
+    if (esp_pm_light_sleep_register_cbs(&sleep_cbs) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to register the light sleep callback, sleep isn't counted");
+    }
+#endif
+
+    storage_subscribe(SETTING_BIT(SETTING_POWER_BOOST_RPS) | SETTING_BIT(SETTING_POWER_BOOST_FREQ),
+                      on_settings_changed, NULL);
+    ESP_LOGI(TAG, "DFS %d..%d MHz with automatic light sleep", PM_MIN_FREQ_MHZ, PM_REPORT_FREQ_MHZ);
+    return ESP_OK;
+}
+
+void power_manager_set_usb_active(const bool active) {
+    if (s_usb_lock == NULL || active == s_usb_active) {
+        return;
+    }
+
+    s_usb_active = active;
+    if (active) {
+        esp_pm_lock_acquire(s_usb_lock);
+        s_last_report_count = usb_hid_host_get_report_count();
+        s_calm_ms = 0;
+        esp_timer_start_periodic(s_governor_timer, PM_GOVERNOR_PERIOD_MS * 1000);
+    } else {
+        esp_timer_stop(s_governor_timer);
+        set_boost(false);
+        esp_pm_lock_release(s_usb_lock);
+    }
+}
+
+bool power_manager_usb_active(void) {
+    return s_usb_active;
+}
+
+void power_manager_set_battery(const uint8_t soc, const bool external_power) {
+    uint8_t scale = 100;
+    if (!external_power) {
+        // Stay in the lower band until the charge is clearly above its threshold
+        const int margin_critical = s_sleep_scale <= PM_BATTERY_CRITICAL_SCALE ? PM_BATTERY_HYSTERESIS : 0;
+        const int margin_low = s_sleep_scale <= PM_BATTERY_LOW_SCALE ? PM_BATTERY_HYSTERESIS : 0;
+        if (soc <= PM_BATTERY_CRITICAL_SOC + margin_critical) {
+            scale = PM_BATTERY_CRITICAL_SCALE;
+        } else if (soc <= PM_BATTERY_LOW_SOC + margin_low) {
+            scale = PM_BATTERY_LOW_SCALE;
+        }
+    }
+
+    if (scale != s_sleep_scale) {
+        ESP_LOGI(TAG, "Battery at %d%%, inactivity timeout at %d%%", soc, scale);
+        s_sleep_scale = scale;
+        power_manager_state_changed();
+    }
+}
+
+void power_manager_get_sleep_stats(uint32_t *count, uint32_t *slept_ms) {
+    *count = s_sleep_count;
+    *slept_ms = s_slept_ms;
+}
+
+uint8_t power_manager_sleep_scale(void) {
+    return s_sleep_scale;
+}
+
+// Only the bridge task calls these, the flag keeps the lock count at 0 or 1
+__attribute__((section(".iram1.text"))) void power_manager_reports_busy(void) {
+    if (s_report_lock == NULL || s_reports_busy) {
+        return;
+    }
+
+    s_reports_busy = true;
+    esp_pm_lock_acquire(s_report_lock);
+}
+
+__attribute__((section(".iram1.text"))) void power_manager_reports_idle(void) {
+    if (!s_reports_busy) {
+        return;
+    }
+
+    s_reports_busy = false;
+    esp_pm_lock_release(s_report_lock);
+}
+
+void power_manager_state_changed(void) {
+    if (s_state_sem != NULL) {
+        xSemaphoreGive(s_state_sem);
+    }
+}
+
+bool power_manager_wait_state_change(const TickType_t timeout) {
+    if (s_state_sem == NULL) {
+        vTaskDelay(timeout);
+        return false;
+    }
+
+    return xSemaphoreTake(s_state_sem, timeout) == pdTRUE;
+}
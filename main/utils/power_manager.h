@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Reports in flight run at the APB maximum, boost is only taken for high report rates
+#define PM_REPORT_FREQ_MHZ 80
+#define PM_MIN_FREQ_MHZ    10
+#define PM_BOOST_FREQ_MHZ  160
+
+// The governor samples the USB report counter at this period while the USB host runs
+#define PM_GOVERNOR_PERIOD_MS 250
+// Boost is dropped once the rate stayed below half the threshold for this long
+#define PM_GOVERNOR_HOLD_MS   1000
+
+#define PM_BATTERY_LOW_SOC          20
+#define PM_BATTERY_LOW_SCALE        50
+#define PM_BATTERY_CRITICAL_SOC     10
+#define PM_BATTERY_CRITICAL_SCALE   25
+#define PM_BATTERY_HYSTERESIS       3
+
+/**
+ * @brief Configure DFS with automatic light sleep and create the PM locks
+ *
+ * Tickless idle (CONFIG_FREERTOS_USE_TICKLESS_IDLE) lets the idle task sleep until the next timer, BLE
+ * connection events wake the chip through the controller. Nothing is held after init.
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t power_manager_init(void);
+
+/**
+ * @brief Let the buttons wake the chip from light sleep
+ *
+ * Call after the button pins are configured, gpio_config() resets the interrupt type and with it the
+ * level wakeup.
+ */
+void power_manager_enable_wakeup(void);
+
+/**
+ * @brief Keep the chip out of light sleep while the USB host runs, and run the frequency governor
+ *
+ * The host has to emit SOFs every millisecond and the IDF host stack can't suspend the bus, so there is no
+ * remote wakeup to sleep on. While active, the governor holds a CPU_FREQ_MAX lock at the boost frequency
+ * whenever the USB report rate is above power.boostRps.
+ *
+ * @param active true while the USB host is installed
+ */
+void power_manager_set_usb_active(bool active);
+
+/**
+ * @brief Check if the USB host runs
+ *
+ * @return true between power_manager_set_usb_active(true) and power_manager_set_usb_active(false)
+ */
+bool power_manager_usb_active(void);
+
+/**
+ * @brief Feed the battery state into the sleep policy, called by the battery gauge after each reading
+ *
+ * Below PM_BATTERY_LOW_SOC the inactivity timeout is cut to PM_BATTERY_LOW_SCALE percent, below
+ * PM_BATTERY_CRITICAL_SOC to PM_BATTERY_CRITICAL_SCALE. A band is left PM_BATTERY_HYSTERESIS points
+ * above its threshold. A band change signals power_manager_state_changed().
+ *
+ * @param soc State of charge, percent
+ * @param external_power true if running from USB power, the timeout is not scaled then
+ */
+void power_manager_set_battery(uint8_t soc, bool external_power);
+
+/**
+ * @brief Get the factor to apply to the inactivity timeout
+ *
+ * @return Percent of the configured timeout, 100 unless the battery is low
+ */
+uint8_t power_manager_sleep_scale(void);
+
+/**
+ * @brief Run at PM_REPORT_FREQ_MHZ or above until power_manager_reports_idle(), called when reports start flowing
+ */
+void power_manager_reports_busy(void);
+
+/**
+ * @brief Drop the report lock, called once every pending report was sent
+ */
+void power_manager_reports_idle(void);
+
+/**
+ * @brief Signal that USB, BLE or pause state changed, wakes power_manager_wait_state_change()
+ */
+void power_manager_state_changed(void);
+
+/**
+ * @brief Block until the next power_manager_state_changed() call or a timeout
+ *
+ * @param timeout Ticks to wait, portMAX_DELAY to wait for the next event
+ * @return true if woken by an event
+ */
+bool power_manager_wait_state_change(TickType_t timeout);
+
+/**
+ * @brief Light sleeps since boot, shows whether anything holds a lock that keeps the chip awake
+ *
+ * Counted only with CONFIG_PM_LIGHT_SLEEP_CALLBACKS, both stay 0 otherwise.
+ *
+ * @param count Output, light sleeps entered
+ * @param slept_ms Output, total time spent in light sleep
+ */
+void power_manager_get_sleep_stats(uint32_t *count, uint32_t *slept_ms);
+
+#ifdef __cplusplus
+}
+#endif
@@ -7,8 +7,11 @@
 #include "rgb_leds.h"
 #include "neopixel.h"
 #include <math.h>
+#include <stdlib.h>
+#include <sys/param.h>
 #include "esp_wifi.h"
 #include "storage.h"
+#include "const.h"
 
 #define BASE_FPS 120
 #define WAKEUP_DEBOUNCE_MS 200
@@ -18,50 +21,55 @@
 #define STATUS_BLINK_PERIOD_MS 500
 #define WIFI_BLINK_FAST_MS 350
 #define WIFI_BLINK_SLOW_MS 2000
+// Time for the last frame to leave the RMT channel before it's released
+#define OUTPUT_RELEASE_DELAY_MS 50
+#define GAMMA 2.2f
 
 static const char *TAG = "RGB_UTILS";
-static uint16_t s_current_fps = BASE_FPS;
 static int s_gpio_pin = 0;
 uint8_t g_rgb_brightness = 35;
 
-__attribute__((section(".iram1.text"))) static uint32_t get_cycle_time_ms(const uint8_t speed) {
+// Animation intensities go through the gamma table so ramps look even, colors through the brightness table
+static uint8_t s_gamma_lut[256];
+static uint8_t s_brightness_lut[256];
+
+static void build_gamma_lut(void) {
+    for (int i = 0; i < 256; i++) {
+        s_gamma_lut[i] = (uint8_t)(powf(i / 255.0f, GAMMA) * 255.0f + 0.5f);
+    }
+}
+
+static void build_brightness_lut(const uint8_t brightness) {
+    for (int i = 0; i < 256; i++) {
+        s_brightness_lut[i] = (i * brightness) / 100;
+    }
+}
+
+static uint32_t get_cycle_time_ms(const uint8_t speed) {
     if (speed == 0) return MAX_CYCLE_TIME_MS;
     return MIN_CYCLE_TIME_MS + ((MAX_CYCLE_TIME_MS - MIN_CYCLE_TIME_MS) * (100 - speed)) / 100;
 }
 
 // Color utility functions
-__attribute__((section(".iram1.text"))) static uint32_t color_with_brightness(const uint32_t color, const uint8_t brightness) {
-    uint8_t r = (color >> 16) & 0xFF;
-    uint8_t g = (color >> 8) & 0xFF;
-    uint8_t b = color & 0xFF;
-    
-    r = (r * brightness) / 100;
-    g = (g * brightness) / 100;
-    b = (b * brightness) / 100;
-    
-    return NP_RGB(r, g, b);
+static uint32_t color_with_brightness(const uint32_t color) {
+    return NP_RGB(s_brightness_lut[(color >> 16) & 0xFF], s_brightness_lut[(color >> 8) & 0xFF],
+                  s_brightness_lut[color & 0xFF]);
 }
 
-__attribute__((section(".iram1.text"))) static uint32_t blend_colors(const uint32_t color1, const uint32_t color2, const float blend_factor) {
-    const uint8_t r1 = (color1 >> 16) & 0xFF;
-    const uint8_t g1 = (color1 >> 8) & 0xFF;
-    const uint8_t b1 = color1 & 0xFF;
-
-    const uint8_t r2 = (color2 >> 16) & 0xFF;
-    const uint8_t g2 = (color2 >> 8) & 0xFF;
-    const uint8_t b2 = color2 & 0xFF;
-
-    const uint8_t r = r1 + (uint8_t)((float)(r2 - r1) * blend_factor);
-    const uint8_t g = g1 + (uint8_t)((float)(g2 - g1) * blend_factor);
-    const uint8_t b = b1 + (uint8_t)((float)(b2 - b1) * blend_factor);
-    
-    return NP_RGB(r, g, b);
+// intensity 0..255, 255 is the full color
+static uint32_t color_with_intensity(const uint32_t color, const uint8_t intensity) {
+    const uint32_t k = s_gamma_lut[intensity] + 1;
+    return NP_RGB(s_brightness_lut[(((color >> 16) & 0xFF) * k) >> 8], s_brightness_lut[(((color >> 8) & 0xFF) * k) >> 8],
+                  s_brightness_lut[((color & 0xFF) * k) >> 8]);
 }
 
-__attribute__((section(".iram1.text"))) static void extract_rgb(const uint32_t color, uint8_t *r, uint8_t *g, uint8_t *b) {
-    *r = (color >> 16) & 0xFF;
-    *g = (color >> 8) & 0xFF;
-    *b = color & 0xFF;
+// factor 0..256, 256 is color2
+static uint32_t blend_colors(const uint32_t color1, const uint32_t color2, const int32_t factor) {
+    const int32_t r1 = (color1 >> 16) & 0xFF, g1 = (color1 >> 8) & 0xFF, b1 = color1 & 0xFF;
+    const int32_t r2 = (color2 >> 16) & 0xFF, g2 = (color2 >> 8) & 0xFF, b2 = color2 & 0xFF;
+
+    return NP_RGB(r1 + (((r2 - r1) * factor) >> 8), g1 + (((g2 - g1) * factor) >> 8),
+                  b1 + (((b2 - b1) * factor) >> 8));
 }
 
 typedef enum {
@@ -74,22 +82,6 @@ typedef enum {
     BATTERY_CHARGE_LEVEL_LOW,
 } status_animation_type_t;
 
-// Animation state management
-typedef struct {
-    uint32_t start_time;
-    uint32_t cycle_time;
-    float progress;
-    bool direction_up;
-} animation_state_t;
-
-__attribute__((section(".text"))) static void update_animation_state(animation_state_t *state, const led_pattern_t *pattern) {
-    const uint32_t current_time = pdTICKS_TO_MS(xTaskGetTickCount());
-    state->cycle_time = get_cycle_time_ms(pattern->speed);
-    const uint32_t elapsed = current_time - state->start_time;
-    state->progress = (float)(elapsed % state->cycle_time) / state->cycle_time;
-    state->direction_up = pattern->direction_up;
-}
-
 // Status LED management
 typedef struct {
     uint32_t color;
@@ -99,40 +91,6 @@ typedef struct {
     status_animation_type_t animation;
 } status_led_state_t;
 
-__attribute__((section(".iram1.text"))) static void update_status_led_state(status_led_state_t *state, tNeopixel* pixel) {
-    const uint32_t current_time = pdTICKS_TO_MS(xTaskGetTickCount());
-    
-    if (state->animation != WIFI_ANIM_NONE) {
-        const uint32_t blink_period = (state->animation == WIFI_ANIM_APSTA_CONNECTED ||
-                               state->animation == WIFI_ANIM_STA_CONNECTED) ? 
-                               WIFI_BLINK_SLOW_MS : WIFI_BLINK_FAST_MS;
-        
-        if ((current_time - state->last_blink_time) >= blink_period) {
-            state->blink_state = !state->blink_state;
-            state->last_blink_time = current_time;
-        }
-        
-        pixel->rgb = state->blink_state ? color_with_brightness(state->color, g_rgb_brightness) : STATUS_COLOR_OFF;
-    } else {
-        switch (state->mode) {
-            case STATUS_MODE_ON:
-                pixel->rgb = color_with_brightness(state->color, g_rgb_brightness);
-                break;
-            case STATUS_MODE_BLINK:
-                if ((current_time - state->last_blink_time) >= STATUS_BLINK_PERIOD_MS) {
-                    state->blink_state = !state->blink_state;
-                    state->last_blink_time = current_time;
-                }
-                pixel->rgb = state->blink_state ? color_with_brightness(state->color, g_rgb_brightness) : STATUS_COLOR_OFF;
-                break;
-            case STATUS_MODE_OFF:
-            default:
-                pixel->rgb = STATUS_COLOR_OFF;
-                break;
-        }
-    }
-}
-
 static const led_pattern_t led_patterns[] __attribute__((section(".rodata"))) = {
     // IDLE 
     {
@@ -180,18 +138,18 @@ static int s_led_pattern = LED_PATTERN_IDLE;
 static tNeopixelContext* neopixel_ctx = NULL;
 static int s_num_leds = 0;
 static TaskHandle_t s_led_task_handle = NULL;
-static uint32_t s_last_pattern_change_time = 0;
 static bool s_in_wakeup_debounce = false;
 static uint32_t s_wakeup_debounce_start_time = 0;
 
-// Animation state
-static animation_state_t s_animation_state = {0};
-static bool s_use_secondary_color = false;
-
-// Transition state
+// Renderer state, only the LED task touches it
+static uint32_t s_animation_start_time = 0;
 static bool s_in_transition = false;
 static uint32_t s_transition_start_time = 0;
-static tNeopixel* s_previous_state = NULL;
+static uint32_t *s_frame = NULL;          // what the LEDs show
+static uint32_t *s_next_frame = NULL;
+static uint32_t *s_previous_frame = NULL; // shown when the pattern changed, blended out
+static bool s_frame_valid = false;
+static volatile bool s_pattern_changed = false;
 
 // Status LED state initialization in flash
 static const status_led_state_t s_status_led_state_init __attribute__((section(".rodata"))) = {
@@ -205,101 +163,64 @@ static const status_led_state_t s_status_led_state_init __attribute__((section("
 static status_led_state_t s_status_led_state;
 static bool s_wifi_apsta_mode = false;
 static bool s_wifi_connected = false;
-static void update_status_led(tNeopixel* pixels);
-static void apply_pattern(tNeopixel* pixels, const led_pattern_t* pattern);
 static void led_control_task(void *arg);
-static bool is_task_suspended = false;
 static bool is_in_flash_mode = false;
 
-// Function to check if the task should be suspended and handle suspension/resumption
-__attribute__((section(".iram1.text"))) static void check_and_update_task_suspension(void)
+// Every state change goes through here, the renderer sleeps otherwise
+static void notify_renderer(void)
 {
-    if (is_in_flash_mode) {
-        return;
-    }
-
-    static bool should_suspend = false;
-    
-    if (s_led_pattern >= 0 && s_led_pattern < sizeof(led_patterns)/sizeof(led_patterns[0])) {
-        const led_pattern_t* pattern = &led_patterns[s_led_pattern];
-        const bool only_zero_color = (pattern->colors[0] == 0);
-        const bool status_led_off = (s_status_led_state.mode == STATUS_MODE_OFF) &&
-                            (s_status_led_state.animation == WIFI_ANIM_NONE);
-        
-        should_suspend = only_zero_color && status_led_off;
-    }
-    
-    if (should_suspend && !is_task_suspended && s_led_task_handle != NULL) {
-        is_task_suspended = true;
-        ESP_LOGD(TAG, "Suspending LED task - no color and status LED off");
-        
-        if (neopixel_ctx != NULL) {
-            tNeopixel pixels[s_num_leds];
-            for (int i = 0; i < s_num_leds; i++) {
-                pixels[i].index = i;
-                pixels[i].rgb = 0;
-            }
-            neopixel_SetPixel(neopixel_ctx, pixels, s_num_leds);
-        }
-
-        vTaskDelay(pdMS_TO_TICKS(100));
-        neopixel_Deinit(neopixel_ctx);
-        vTaskDelay(pdMS_TO_TICKS(50));
-        vTaskSuspend(s_led_task_handle);
-    } else if (!should_suspend && is_task_suspended && s_led_task_handle != NULL) {
-        ESP_LOGD(TAG, "Resuming LED task - conditions changed");
-
-        neopixel_ctx = neopixel_Init(s_num_leds, s_gpio_pin);
-        if (neopixel_ctx == NULL) {
-            ESP_LOGE(TAG, "Failed to initialize NeoPixel");
-            return;
-        }
-
-        vTaskResume(s_led_task_handle);
-        is_task_suspended = false;
+    if (s_led_task_handle != NULL) {
+        xTaskNotifyGive(s_led_task_handle);
     }
 }
 
 uint32_t rgb_color(const uint8_t r, const uint8_t g, const uint8_t b)
 {
-    return color_with_brightness(NP_RGB(r, g, b), g_rgb_brightness);
+    return color_with_brightness(NP_RGB(r, g, b));
+}
+
+static void on_settings_changed(const uint32_t changed, const device_settings_t *settings, void *arg)
+{
+    if (settings->led.brightness >= 0 && settings->led.brightness <= 100) {
+        g_rgb_brightness = settings->led.brightness;
+        build_brightness_lut(g_rgb_brightness);
+        notify_renderer();
+    }
 }
 
 void led_control_init(const int num_leds, const int gpio_pin)
 {
-    int brightness;
-    if (storage_get_int_setting("led.brightness", &brightness) == ESP_OK) {
-        if (brightness >= 0 && brightness <= 100) {
-            g_rgb_brightness = brightness;
-            ESP_LOGI(TAG, "LED brightness set to %d%%", brightness);
-        } else {
-            ESP_LOGW(TAG, "Invalid brightness value %d, using default", brightness);
-        }
+    const int brightness = storage_settings()->led.brightness;
+    if (brightness >= 0 && brightness <= 100) {
+        g_rgb_brightness = brightness;
+        ESP_LOGI(TAG, "LED brightness set to %d%%", brightness);
     } else {
-        ESP_LOGW(TAG, "Failed to get brightness from settings, using default");
+        ESP_LOGW(TAG, "Invalid brightness value %d, using default", brightness);
     }
+    build_gamma_lut();
+    build_brightness_lut(g_rgb_brightness);
+    storage_subscribe(SETTING_BIT(SETTING_LED_BRIGHTNESS), on_settings_changed, NULL);
     
-    if (s_previous_state != NULL) {
-        free(s_previous_state);
-        s_previous_state = NULL;
+    if (s_frame != NULL) {
+        free(s_frame);
+        s_frame = NULL;
     }
 
     s_gpio_pin = gpio_pin;
     s_num_leds = num_leds;
     memcpy(&s_status_led_state, &s_status_led_state_init, sizeof(status_led_state_t));
-    neopixel_ctx = neopixel_Init(num_leds, gpio_pin);
-    if (neopixel_ctx == NULL) {
-        ESP_LOGE(TAG, "Failed to initialize NeoPixel");
-        return;
-    }
     
-    s_previous_state = (tNeopixel*)malloc(sizeof(tNeopixel) * num_leds);
-    if (s_previous_state == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate memory for LED transition state");
+    // One allocation for the three frames
+    s_frame = calloc(3 * num_leds, sizeof(uint32_t));
+    if (s_frame == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate memory for LED frames");
         return;
     }
+    s_next_frame = s_frame + num_leds;
+    s_previous_frame = s_frame + 2 * num_leds;
+    s_frame_valid = false;
     
-    xTaskCreatePinnedToCore(led_control_task, "led_control", 1960, NULL, 7, &s_led_task_handle, 1);
+    xTaskCreatePinnedToCore(led_control_task, "led_control", 1960, NULL, TASK_LED_PRIO, &s_led_task_handle, TASK_LED_CORE);
 }
 
 void led_control_deinit(void)
@@ -309,13 +230,14 @@ void led_control_deinit(void)
         s_led_task_handle = NULL;
     }
     
-    if (s_previous_state != NULL) {
-        free(s_previous_state);
-        s_previous_state = NULL;
+    if (s_frame != NULL) {
+        free(s_frame);
+        s_frame = NULL;
     }
 
     if (neopixel_ctx != NULL) {
         neopixel_Deinit(neopixel_ctx);
+        neopixel_ctx = NULL;
     }
 
     s_num_leds = 0;
@@ -323,10 +245,10 @@ void led_control_deinit(void)
     s_in_transition = false;
 }
 
-__attribute__((section(".iram1.text"))) void led_update_pattern(const bool usb_connected, const bool ble_connected, const bool ble_paused)
+bool led_update_pattern(const bool usb_connected, const bool ble_connected, const bool ble_paused)
 {
     if (is_in_flash_mode) {
-        return;
+        return false;
     }
 
     int new_pattern = LED_PATTERN_IDLE;
@@ -346,41 +268,24 @@ __attribute__((section(".iram1.text"))) void led_update_pattern(const bool usb_c
     if (s_led_pattern == LED_PATTERN_SLEEPING && new_pattern != LED_PATTERN_SLEEPING && !s_in_wakeup_debounce) {
         s_in_wakeup_debounce = true;
         s_wakeup_debounce_start_time = current_time;
-        return;
+        return true;
     }
     
     if (s_in_wakeup_debounce) {
         if (current_time - s_wakeup_debounce_start_time < WAKEUP_DEBOUNCE_MS) {
-            return;
+            return true;
         }
 
         s_in_wakeup_debounce = false;
     }
     
     if (new_pattern != s_led_pattern) {
-        tNeopixel pixels[s_num_leds];
-        for (int i = 0; i < s_num_leds; i++) {
-            pixels[i].index = i;
-            pixels[i].rgb = 0;
-        }
-        
-        update_status_led(pixels);
-        if (s_led_pattern >= 0 && s_led_pattern < sizeof(led_patterns)/sizeof(led_patterns[0])) {
-            apply_pattern(pixels, &led_patterns[s_led_pattern]);
-        }
-        
-        memcpy(s_previous_state, pixels, sizeof(tNeopixel) * s_num_leds);
-        
-        s_in_transition = true;
-        s_transition_start_time = current_time;
-        
         s_led_pattern = new_pattern;
-        s_animation_state.start_time = current_time;
-        s_last_pattern_change_time = current_time;
-        s_use_secondary_color = false;
+        s_pattern_changed = true;
+        notify_renderer();
     }
     
-    check_and_update_task_suspension();
+    return false;
 }
 
 void led_update_status(const uint32_t color, const uint8_t mode)
@@ -395,7 +300,7 @@ void led_update_status(const uint32_t color, const uint8_t mode)
     s_status_led_state.blink_state = false;
     s_status_led_state.last_blink_time = 0;
     
-    check_and_update_task_suspension();
+    notify_renderer();
 }
 
 void led_update_wifi_status(bool is_apsta_mode, bool is_connected)
@@ -418,7 +323,7 @@ void led_update_wifi_status(bool is_apsta_mode, bool is_connected)
     s_status_led_state.blink_state = false;
     s_status_led_state.last_blink_time = 0;
     
-    check_and_update_task_suspension();
+    notify_renderer();
 }
 
 void IRAM_ATTR rgb_enter_flash_mode(void)
@@ -430,177 +335,189 @@ void IRAM_ATTR rgb_enter_flash_mode(void)
     // ToDo
 }
 
-__attribute__((section(".text"))) static void update_status_led(tNeopixel* pixels)
+// Renders LED 0, returns the ms until it changes by itself or portMAX_DELAY if it doesn't
+static TickType_t render_status_led(uint32_t *pixel, const uint32_t current_time)
 {
-    if (is_in_flash_mode) {
-        return;
+    status_led_state_t *state = &s_status_led_state;
+    uint32_t blink_period = 0;
+
+    if (state->animation != WIFI_ANIM_NONE) {
+        blink_period = (state->animation == WIFI_ANIM_APSTA_CONNECTED ||
+                        state->animation == WIFI_ANIM_STA_CONNECTED) ? WIFI_BLINK_SLOW_MS : WIFI_BLINK_FAST_MS;
+    } else if (state->mode == STATUS_MODE_BLINK) {
+        blink_period = STATUS_BLINK_PERIOD_MS;
+    } else {
+        *pixel = state->mode == STATUS_MODE_ON ? color_with_brightness(state->color) : STATUS_COLOR_OFF;
+        return portMAX_DELAY;
     }
 
-    pixels[0].index = 0;
-    update_status_led_state(&s_status_led_state, &pixels[0]);
+    if ((current_time - state->last_blink_time) >= blink_period) {
+        state->blink_state = !state->blink_state;
+        state->last_blink_time = current_time;
+    }
+    *pixel = state->blink_state ? color_with_brightness(state->color) : STATUS_COLOR_OFF;
+    return pdMS_TO_TICKS(blink_period - (current_time - state->last_blink_time));
 }
 
-__attribute__((section(".iram1.text"))) static void apply_pattern(tNeopixel* pixels, const led_pattern_t* pattern)
+// 0..255 for a pixel distance_q8 (8 fractional bits) away from the head of a trail
+static uint8_t trail_intensity(const int32_t distance_q8, const uint8_t trail_length)
 {
-    if (is_task_suspended || is_in_flash_mode) {
-        return;
+    const int32_t trail_q8 = trail_length << 8;
+    if (distance_q8 > trail_q8) {
+        return 0;
+    }
+    return 255 - (distance_q8 * 255) / trail_q8;
+}
+
+// Renders LEDs 1..n, returns the ms until the next frame or portMAX_DELAY for a static pattern
+static TickType_t render_pattern(uint32_t *pixels, const led_pattern_t *pattern, const uint32_t current_time)
+{
+    if (pattern->colors[0] == 0) {
+        return portMAX_DELAY;
     }
 
     const int column_length = (s_num_leds - 1) / 2;
-    const uint32_t current_color = s_use_secondary_color ? pattern->colors[1] : pattern->colors[0];
-    
-    update_animation_state(&s_animation_state, pattern);
-    const float progress = s_animation_state.progress;
+    const uint32_t color = pattern->colors[0];
+    const uint32_t cycle_time = get_cycle_time_ms(pattern->speed);
+    // Q16, 0..65535 over one cycle
+    const int32_t progress = (int32_t)((((current_time - s_animation_start_time) % cycle_time) << 16) / cycle_time);
 
     switch (pattern->type) {
         case ANIM_TYPE_RUNNING_LIGHT_BOUNCE: {
-            float bounce_progress;
-            if (progress < 0.5f) {
-                bounce_progress = progress * 2.0f;
-            } else {
-                bounce_progress = 2.0f - (progress * 2.0f);
-            }
-            
-            const float center_pos = bounce_progress * (column_length - 1);
-            
+            const int32_t bounce = progress < 32768 ? progress * 2 : 131072 - progress * 2;
+            const int32_t center_q8 = (bounce * (column_length - 1)) >> 8;
+
             for (int col = 0; col < 2; col++) {
                 const int col_offset = 1 + (col * column_length);
-                
                 for (int i = 0; i < column_length; i++) {
-                    const float pos = col == 0 ? i - center_pos :
-                        (column_length - 1 - i) - center_pos;
-                    const float distance = fabsf(pos);
-                    if (distance <= pattern->trail_length) {
-                        const float intensity = 1.0f - (distance / pattern->trail_length);
-                        uint8_t r, g, b;
-                        extract_rgb(current_color, &r, &g, &b);
-                        pixels[col_offset + i].rgb = rgb_color(
-                            (r * (int)(intensity * 100)) / 100,
-                            (g * (int)(intensity * 100)) / 100,
-                            (b * (int)(intensity * 100)) / 100
-                        );
+                    const int32_t pos_q8 = ((col == 0 ? i : column_length - 1 - i) << 8) - center_q8;
+                    const uint8_t intensity = trail_intensity(abs(pos_q8), pattern->trail_length);
+                    if (intensity > 0) {
+                        pixels[col_offset + i] = color_with_intensity(color, intensity);
                     }
                 }
             }
             break;
         }
-            
-        case ANIM_TYPE_BREATHING: {
-            float brightness_progress = progress * 2;
-            if (brightness_progress > 1.0f) {
-                brightness_progress = 2.0f - brightness_progress;
-            }
 
-            uint8_t r, g, b;
-            extract_rgb(pattern->colors[0], &r, &g, &b);
-            const uint32_t result_color = rgb_color(
-                (r * (int)(brightness_progress * 100)) / 100,
-                (g * (int)(brightness_progress * 100)) / 100,
-                (b * (int)(brightness_progress * 100)) / 100
-            );
-            
+        case ANIM_TYPE_BREATHING: {
+            const int32_t level = progress < 32768 ? progress * 2 : 131072 - progress * 2;
+            const uint32_t result_color = color_with_intensity(color, (level * 255) >> 16);
             for (int i = 1; i < s_num_leds; i++) {
-                pixels[i].rgb = result_color;
+                pixels[i] = result_color;
             }
             break;
         }
 
         case ANIM_TYPE_RUNNING_LIGHT: {
-            const float base_pos = progress * column_length;
-            
+            const int32_t base_q8 = (progress * column_length) >> 8;
+            const int32_t head_q8 = pattern->direction_up ? base_q8 : (column_length << 8) - base_q8;
+
             for (int col = 0; col < 2; col++) {
                 const int col_offset = 1 + (col * column_length);
-                const float base_i = pattern->direction_up ?
-                    base_pos : (column_length - base_pos);
-                
                 for (int i = 0; i < column_length; i++) {
-                    float pos;
-                    if (col == 0) {
-                        pos = i - base_i;
-                    } else {
-                        pos = (column_length - 1 - i) - base_i;
+                    int32_t distance_q8 = abs(((col == 0 ? i : column_length - 1 - i) << 8) - head_q8);
+                    if (distance_q8 > ((column_length / 2) << 8)) {
+                        distance_q8 = (column_length << 8) - distance_q8;
                     }
-                    
-                    float distance = fabsf(pos);
-                    if (distance > column_length/2) {
-                        distance = column_length - distance;
-                    }
-                    
-                    if (distance <= pattern->trail_length) {
-                        const float intensity = 1.0f - (distance / pattern->trail_length);
-                        uint8_t r, g, b;
-                        extract_rgb(current_color, &r, &g, &b);
-                        pixels[col_offset + i].rgb = rgb_color(
-                            (r * (int)(intensity * 100)) / 100,
-                            (g * (int)(intensity * 100)) / 100,
-                            (b * (int)(intensity * 100)) / 100
-                        );
+                    const uint8_t intensity = trail_intensity(distance_q8, pattern->trail_length);
+                    if (intensity > 0) {
+                        pixels[col_offset + i] = color_with_intensity(color, intensity);
                     }
                 }
             }
             break;
         }
     }
+
+    return pdMS_TO_TICKS(1000 / BASE_FPS);
 }
 
-__attribute__((section(".iram1.text"))) static void blend_pixel_colors(tNeopixel* dest, const tNeopixel* src1, const tNeopixel* src2, const float blend_factor)
+static bool frame_is_dark(const uint32_t *frame)
 {
-    dest->rgb = blend_colors(src1->rgb, src2->rgb, blend_factor);
+    for (int i = 0; i < s_num_leds; i++) {
+        if (frame[i] != 0) {
+            return false;
+        }
+    }
+    return true;
 }
 
-__attribute__((section(".text"))) static void led_control_task(void *arg)
+static void push_frame(const uint32_t *frame)
 {
     if (neopixel_ctx == NULL) {
-        ESP_LOGE(TAG, "neopixel lib not initialized");
-        vTaskDelete(NULL);
-        return;
+        neopixel_ctx = neopixel_Init(s_num_leds, s_gpio_pin);
+        if (neopixel_ctx == NULL) {
+            ESP_LOGE(TAG, "Failed to initialize NeoPixel");
+            return;
+        }
     }
 
     tNeopixel pixels[s_num_leds];
-    tNeopixel new_state[s_num_leds];
-    
-    while (1) {
-        if (is_task_suspended) {
-            vTaskDelay(pdMS_TO_TICKS(100));
-            continue;
-        }
+    for (int i = 0; i < s_num_leds; i++) {
+        pixels[i].index = i;
+        pixels[i].rgb = frame[i];
+    }
+    neopixel_SetPixel(neopixel_ctx, pixels, s_num_leds);
+}
 
-        if (is_in_flash_mode) {
-            vTaskDelay(pdMS_TO_TICKS(100));
-            continue;
-        }
+// The RMT channel keeps a PM lock while it exists, a dark static frame gives it back
+static void release_output(void)
+{
+    if (neopixel_ctx == NULL) {
+        return;
+    }
 
-        for (int i = 0; i < s_num_leds; i++) {
-            pixels[i].index = i;
-            pixels[i].rgb = 0;
-            new_state[i].index = i;
-            new_state[i].rgb = 0;
+    vTaskDelay(pdMS_TO_TICKS(OUTPUT_RELEASE_DELAY_MS));
+    neopixel_Deinit(neopixel_ctx);
+    neopixel_ctx = NULL;
+    ESP_LOGD(TAG, "LEDs dark, output released");
+}
+
+// Renders only when something changed or animates, identical frames are not sent
+static void led_control_task(void *arg)
+{
+    while (1) {
+        const uint32_t current_time = pdTICKS_TO_MS(xTaskGetTickCount());
+
+        if (s_pattern_changed) {
+            s_pattern_changed = false;
+            memcpy(s_previous_frame, s_frame, sizeof(uint32_t) * s_num_leds);
+            s_in_transition = true;
+            s_transition_start_time = current_time;
+            s_animation_start_time = current_time;
         }
-        
-        update_status_led(new_state);
+
+        memset(s_next_frame, 0, sizeof(uint32_t) * s_num_leds);
+        TickType_t wait = render_status_led(&s_next_frame[0], current_time);
         if (s_led_pattern >= 0 && s_led_pattern < sizeof(led_patterns)/sizeof(led_patterns[0])) {
-            apply_pattern(new_state, &led_patterns[s_led_pattern]);
+            const TickType_t pattern_wait = render_pattern(s_next_frame, &led_patterns[s_led_pattern], current_time);
+            wait = MIN(wait, pattern_wait);
         }
-        
+
         if (s_in_transition) {
-            const uint32_t current_time = pdTICKS_TO_MS(xTaskGetTickCount());
             const uint32_t elapsed = current_time - s_transition_start_time;
-            
             if (elapsed >= TRANSITION_DURATION_MS) {
                 s_in_transition = false;
-                memcpy(pixels, new_state, sizeof(tNeopixel) * s_num_leds);
             } else {
-                const float blend_factor = (float)elapsed / TRANSITION_DURATION_MS;
-                
+                const int32_t factor = (elapsed << 8) / TRANSITION_DURATION_MS;
                 for (int i = 0; i < s_num_leds; i++) {
-                    blend_pixel_colors(&pixels[i], &s_previous_state[i], &new_state[i], blend_factor);
+                    s_next_frame[i] = blend_colors(s_previous_frame[i], s_next_frame[i], factor);
                 }
+                wait = pdMS_TO_TICKS(1000 / BASE_FPS);
             }
-        } else {
-            memcpy(pixels, new_state, sizeof(tNeopixel) * s_num_leds);
         }
 
-        neopixel_SetPixel(neopixel_ctx, pixels, s_num_leds);
-        vTaskDelay(pdMS_TO_TICKS(1000 / s_current_fps));
+        if (!s_frame_valid || memcmp(s_next_frame, s_frame, sizeof(uint32_t) * s_num_leds) != 0) {
+            memcpy(s_frame, s_next_frame, sizeof(uint32_t) * s_num_leds);
+            s_frame_valid = true;
+            push_frame(s_frame);
+        }
+
+        if (wait == portMAX_DELAY && frame_is_dark(s_frame)) {
+            release_output();
+        }
+
+        ulTaskNotifyTake(pdTRUE, wait);
     }
 }
@@ -57,8 +57,8 @@ void led_control_init(int num_leds, int gpio_pin);
 // Deinitialize LED control and free resources
 void led_control_deinit(void);
 
-// Update LED pattern based on connection status
-void led_update_pattern(bool usb_connected, bool ble_connected, bool ble_paused);
+// Update LED pattern based on connection status, returns true while a change is debounced and needs another call
+bool led_update_pattern(bool usb_connected, bool ble_connected, bool ble_paused);
 
 // Update status LED (LED 0)
 void led_update_status(uint32_t color, uint8_t mode);
@@ -1,52 +1,121 @@
 #include "rotary_enc.h"
+#include <stdatomic.h>
 #include "const.h"
 #include "driver/gpio.h"
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
+#include "driver/pulse_cnt.h"
+#include "esp_log.h"
 #include "freertos/queue.h"
 
-static QueueHandle_t enc_queue = NULL;
+#define ROTARY_QUEUE_SIZE   4
+#define CLICK_DEBOUNCE_MS   50
+#define LONG_PRESS_MS       1000
+#define TURN_CALLBACK_MS    50      // one callback per window at most, a flick moves one step
+
+typedef enum {
+    ROTARY_EVT_RELEASE = 0,
+    ROTARY_EVT_PRESS,
+    ROTARY_EVT_DETENT,
+} rotary_event_t;
+
+static const char *TAG = "ROTARY";
+static StaticQueue_t event_queue_struct;
+static uint8_t event_queue_storage[ROTARY_QUEUE_SIZE * sizeof(uint8_t)];
+static QueueHandle_t event_queue = NULL;
+static pcnt_unit_handle_t pcnt_unit = NULL;
+static atomic_int detents = 0;
+static volatile TaskHandle_t consumer_task = NULL;
 static rotary_callback_t user_callback = NULL;
 static rotary_click_callback_t user_click_callback = NULL;
 static rotary_long_press_callback_t user_long_press_callback = NULL;
-static QueueHandle_t button_state_queue = NULL;
 
 static void rotary_enc_task(void* arg);
 
-static void IRAM_ATTR enc_isr_handler(void* arg) {
-    static uint8_t prev_state = 0;
-    const uint8_t curr_state = (gpio_get_level(GPIO_ROT_A) << 1) | gpio_get_level(GPIO_ROT_B);
-    
-    static const int8_t transitions[] = {
-         0, -1,  1,  0,
-         1,  0,  0, -1,
-        -1,  0,  0,  1,
-         0,  1, -1,  0
-    };
-
-    const int8_t direction = transitions[(prev_state << 2) | curr_state];
-    prev_state = curr_state;
-    
-    if (direction != 0) {
-        xQueueSendFromISR(enc_queue, &direction, NULL);
+// The counter just wrapped at a limit, that's one detent
+static bool IRAM_ATTR detent_isr_handler(pcnt_unit_handle_t unit, const pcnt_watch_event_data_t *edata, void *arg) {
+    atomic_fetch_add(&detents, edata->watch_point_value > 0 ? 1 : -1);
+
+    BaseType_t woken = pdFALSE;
+    const TaskHandle_t consumer = consumer_task;
+    if (consumer != NULL) {
+        vTaskNotifyGiveFromISR(consumer, &woken);
+    } else {
+        const uint8_t event = ROTARY_EVT_DETENT;
+        xQueueSendFromISR(event_queue, &event, &woken);
     }
+    return woken == pdTRUE;
 }
 
 static void IRAM_ATTR click_isr_handler(void* arg) {
-    const uint8_t state = gpio_get_level(GPIO_ROT_E); // 1 for pressed, 0 for released
-    xQueueSendFromISR(button_state_queue, &state, NULL);
+    const uint8_t event = gpio_get_level(GPIO_ROT_E) ? ROTARY_EVT_PRESS : ROTARY_EVT_RELEASE;
+    xQueueSendFromISR(event_queue, &event, NULL);
+}
+
+static esp_err_t init_pcnt(void) {
+    const pcnt_unit_config_t unit_config = {
+        .low_limit = -ROTARY_COUNTS_PER_DETENT,
+        .high_limit = ROTARY_COUNTS_PER_DETENT,
+    };
+    esp_err_t err = pcnt_new_unit(&unit_config, &pcnt_unit);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // No glitch filter: it holds an APB_FREQ_MAX lock for as long as the unit is enabled, which keeps the
+    // chip out of light sleep for good. Bounce only moves the count around a resting position, the wrap
+    // at a full detent never sees it.
+    // Full quadrature: each channel counts the edges of one input, the other one gives the direction
+    pcnt_channel_handle_t chan_a = NULL, chan_b = NULL;
+    const pcnt_chan_config_t chan_a_config = {
+        .edge_gpio_num = GPIO_ROT_A,
+        .level_gpio_num = GPIO_ROT_B,
+    };
+    const pcnt_chan_config_t chan_b_config = {
+        .edge_gpio_num = GPIO_ROT_B,
+        .level_gpio_num = GPIO_ROT_A,
+    };
+    err = pcnt_new_channel(pcnt_unit, &chan_a_config, &chan_a);
+    if (err == ESP_OK) err = pcnt_new_channel(pcnt_unit, &chan_b_config, &chan_b);
+    if (err == ESP_OK) {
+        pcnt_channel_set_edge_action(chan_a, PCNT_CHANNEL_EDGE_ACTION_DECREASE, PCNT_CHANNEL_EDGE_ACTION_INCREASE);
+        pcnt_channel_set_level_action(chan_a, PCNT_CHANNEL_LEVEL_ACTION_KEEP, PCNT_CHANNEL_LEVEL_ACTION_INVERSE);
+        pcnt_channel_set_edge_action(chan_b, PCNT_CHANNEL_EDGE_ACTION_INCREASE, PCNT_CHANNEL_EDGE_ACTION_DECREASE);
+        pcnt_channel_set_level_action(chan_b, PCNT_CHANNEL_LEVEL_ACTION_KEEP, PCNT_CHANNEL_LEVEL_ACTION_INVERSE);
+        err = pcnt_unit_add_watch_point(pcnt_unit, ROTARY_COUNTS_PER_DETENT);
+    }
+    if (err == ESP_OK) err = pcnt_unit_add_watch_point(pcnt_unit, -ROTARY_COUNTS_PER_DETENT);
+    if (err == ESP_OK) {
+        const pcnt_event_callbacks_t callbacks = {
+            .on_reach = detent_isr_handler,
+        };
+        err = pcnt_unit_register_event_callbacks(pcnt_unit, &callbacks, NULL);
+    }
+    if (err == ESP_OK) err = pcnt_unit_enable(pcnt_unit);
+    if (err == ESP_OK) err = pcnt_unit_clear_count(pcnt_unit);
+    if (err == ESP_OK) err = pcnt_unit_start(pcnt_unit);
+
+    if (err != ESP_OK) {
+        if (chan_a != NULL) pcnt_del_channel(chan_a);
+        if (chan_b != NULL) pcnt_del_channel(chan_b);
+        pcnt_del_unit(pcnt_unit);
+        pcnt_unit = NULL;
+    }
+    return err;
 }
 
 void rotary_enc_init() {
-    enc_queue = xQueueCreate(4, sizeof(int8_t));
-    button_state_queue = xQueueCreate(4, sizeof(uint8_t));
+    if (event_queue == NULL) {
+        event_queue = xQueueCreateStatic(ROTARY_QUEUE_SIZE, sizeof(uint8_t), event_queue_storage, &event_queue_struct);
+    }
+
+    const esp_err_t err = init_pcnt();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to set up the encoder counter: %s", esp_err_to_name(err));
+    }
 
     gpio_install_isr_service(0);
-    gpio_isr_handler_add(GPIO_ROT_A, enc_isr_handler, NULL);
-    gpio_isr_handler_add(GPIO_ROT_B, enc_isr_handler, NULL);
     gpio_isr_handler_add(GPIO_ROT_E, click_isr_handler, NULL);
     
-    xTaskCreate(rotary_enc_task, "rotary_task", 1500, NULL, 18, NULL);
+    xTaskCreatePinnedToCore(rotary_enc_task, "rotary_task", 1500, NULL, TASK_ROTARY_PRIO, NULL, TASK_ROTARY_CORE);
 }
 
 void rotary_enc_subscribe(const rotary_callback_t callback) {
@@ -61,70 +130,92 @@ void rotary_enc_subscribe_long_press(const rotary_long_press_callback_t callback
     user_long_press_callback = callback;
 }
 
+void rotary_enc_set_consumer(const TaskHandle_t task) {
+    if (consumer_task == task) {
+        return;
+    }
+    // Detents counted for the previous owner don't carry over
+    consumer_task = task;
+    rotary_enc_take_detents();
+}
+
+int32_t rotary_enc_take_detents(void) {
+    return atomic_exchange(&detents, 0);
+}
+
 void rotary_enc_deinit() {
-    gpio_isr_handler_remove(GPIO_ROT_A);
-    gpio_isr_handler_remove(GPIO_ROT_B);
+    if (pcnt_unit != NULL) {
+        pcnt_unit_stop(pcnt_unit);
+        pcnt_unit_disable(pcnt_unit);
+    }
     gpio_isr_handler_remove(GPIO_ROT_E);
-    vQueueDelete(enc_queue);
-    vQueueDelete(button_state_queue);
+    consumer_task = NULL;
     user_callback = NULL;
     user_click_callback = NULL;
     user_long_press_callback = NULL;
 }
 
+// Sleeps until an event comes in, or until a held button turns into a long press
 static void rotary_enc_task(void* arg) {
-    int8_t direction;
-    uint8_t button_state;
+    uint8_t event;
     uint32_t last_click_time = 0;
     uint32_t press_start_time = 0;
-    uint32_t last_enc_callback_time = 0;
-    int8_t accumulated_value = 0;
+    uint32_t last_turn_time = 0;
     bool is_pressed = false;
     bool long_press_detected = false;
     
     while (1) {
-        const uint32_t current_time = xTaskGetTickCount() * portTICK_PERIOD_MS;
-
-        if (xQueueReceive(enc_queue, &direction, 0)) {
-            accumulated_value += direction;
+        const uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+        TickType_t wait = portMAX_DELAY;
+        if (is_pressed && !long_press_detected) {
+            const uint32_t held = now - press_start_time;
+            wait = held >= LONG_PRESS_MS ? 0 : pdMS_TO_TICKS(LONG_PRESS_MS - held);
         }
+        if (consumer_task == NULL && atomic_load(&detents) != 0) {
+            // Turned within the window, the rest is delivered when it ends
+            const uint32_t since = now - last_turn_time;
+            const TickType_t turn_wait = since >= TURN_CALLBACK_MS ? 0 : pdMS_TO_TICKS(TURN_CALLBACK_MS - since);
+            wait = turn_wait < wait ? turn_wait : wait;
+        }
+
+        const bool received = xQueueReceive(event_queue, &event, wait) == pdTRUE;
+        const uint32_t current_time = xTaskGetTickCount() * portTICK_PERIOD_MS;
 
-        if (accumulated_value != 0 && 
-            (current_time - last_enc_callback_time) >= 50 && 
-            user_callback) {
-            user_callback(accumulated_value > 0 ? 1 : -1);
-            accumulated_value = 0;
-            last_enc_callback_time = current_time;
+        // Detents that came in while a consumer task was set went there
+        if (consumer_task == NULL && current_time - last_turn_time >= TURN_CALLBACK_MS) {
+            const int32_t turned = rotary_enc_take_detents();
+            if (turned != 0 && user_callback) {
+                user_callback(turned > 0 ? 1 : -1);
+            }
+            if (turned != 0) {
+                last_turn_time = current_time;
+            }
         }
 
-        if (xQueueReceive(button_state_queue, &button_state, 0)) {
-            if (button_state) { // Button pressed
-                if (!is_pressed) {
-                    is_pressed = true;
-                    press_start_time = current_time;
-                    long_press_detected = false;
-                }
-            } else { // Button released
-                if (is_pressed) {
-                    is_pressed = false;
-                    if (!long_press_detected && user_click_callback && 
-                        (current_time - last_click_time) > 50) { // Debounce
-                        user_click_callback();
-                        last_click_time = current_time;
-                    }
+        if (received && event == ROTARY_EVT_PRESS) {
+            if (!is_pressed) {
+                is_pressed = true;
+                press_start_time = current_time;
+                long_press_detected = false;
+            }
+        } else if (received && event == ROTARY_EVT_RELEASE) {
+            if (is_pressed) {
+                is_pressed = false;
+                if (!long_press_detected && user_click_callback &&
+                    (current_time - last_click_time) > CLICK_DEBOUNCE_MS) {
+                    user_click_callback();
+                    last_click_time = current_time;
                 }
             }
         }
 
         // Check for long press only while button is held
         if (is_pressed && !long_press_detected && 
-            (current_time - press_start_time) >= 1000) { // 1 second for long press
+            (current_time - press_start_time) >= LONG_PRESS_MS) {
             long_press_detected = true;
             if (user_long_press_callback) {
                 user_long_press_callback();
             }
         }
-
-        vTaskDelay(pdMS_TO_TICKS(5));
     }
 }
@@ -2,6 +2,16 @@
 #define ROTARY_ENC_H
 
 #include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/**
+ * Rotary encoder, decoded by the PCNT peripheral. The counter wraps at ±ROTARY_COUNTS_PER_DETENT, so
+ * the only interrupt is one per detent and contact bounce around a resting position never gets past it.
+ * There is no glitch filter, its APB lock would keep the chip out of light sleep. Detents go to the rotary callback, at most one step per 50 ms
+ * whatever the spin, or straight to a consumer task set with rotary_enc_set_consumer().
+ */
+#define ROTARY_COUNTS_PER_DETENT 4      // quadrature edges per detent
 
 typedef void (*rotary_callback_t)(int8_t direction);
 typedef void (*rotary_click_callback_t)(void);
@@ -13,4 +23,25 @@ void rotary_enc_subscribe_click(rotary_click_callback_t callback);
 void rotary_enc_subscribe_long_press(rotary_long_press_callback_t callback);
 void rotary_enc_deinit(void);
 
+/**
+ * @brief Wake a task from the encoder interrupt on every detent instead of calling the rotary callback
+ *
+ * The task takes the detents with rotary_enc_take_detents(). Detents not taken yet are discarded when
+ * the consumer changes.
+ *
+ * The HID bridge sets its own task here instead of feeding the dial into the USB report ring: the ring
+ * is single producer and the USB host callback is that producer. The notification wakes the same
+ * consumer the ring does, so dial input still skips any polling and goes out through the same BLE path.
+ *
+ * @param task Task to notify, NULL to go back to the rotary callback
+ */
+void rotary_enc_set_consumer(TaskHandle_t task);
+
+/**
+ * @brief Take the detents turned since the last call
+ *
+ * @return Detents, positive clockwise
+ */
+int32_t rotary_enc_take_detents(void);
+
 #endif // ROTARY_ENC_H
@@ -5,53 +5,68 @@
 #include <cJSON.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <esp_mac.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "const.h"
-
-#define MAX_CACHE_SIZE 6
-#define MAX_PATH_LENGTH 48
+#include "nvs_writer.h"
 
 typedef enum {
-    CACHE_TYPE_STRING,
-    CACHE_TYPE_INT,
-    CACHE_TYPE_BOOL
-} cache_value_type_t;
+    SETTING_TYPE_BOOL,
+    SETTING_TYPE_INT,
+    SETTING_TYPE_STRING,
+} setting_type_t;
 
 typedef struct {
-    char path[MAX_PATH_LENGTH];
-    cache_value_type_t type;
-    union {
-        char str[48];
-        int num;
-        bool flag;
-    } value;
-} cache_entry_t;
+    const char *section;
+    const char *key;
+    setting_type_t type;
+    size_t offset;
+    size_t size;
+} setting_desc_t;
+
+#define SETTING_DESC(id, sec, k, t, field) \
+    [id] = { .section = sec, .key = k, .type = t, .offset = offsetof(device_settings_t, field), \
+             .size = sizeof(((device_settings_t *)0)->field) }
+
+// Maps every typed field to its place in the settings JSON
+static const setting_desc_t s_setting_descs[SETTING_COUNT] = {
+    SETTING_DESC(SETTING_DEVICE_NAME, "deviceInfo", "name", SETTING_TYPE_STRING, device_info.name),
+    SETTING_DESC(SETTING_POWER_LOW_POWER_MODE, "power", "lowPowerMode", SETTING_TYPE_BOOL, power.low_power_mode),
+    SETTING_DESC(SETTING_POWER_ENABLE_SLEEP, "power", "enableSleep", SETTING_TYPE_BOOL, power.enable_sleep),
+    SETTING_DESC(SETTING_POWER_SEPARATE_SLEEP_TIMEOUTS, "power", "separateSleepTimeouts", SETTING_TYPE_BOOL,
+                 power.separate_sleep_timeouts),
+    SETTING_DESC(SETTING_POWER_SLEEP_TIMEOUT, "power", "sleepTimeout", SETTING_TYPE_INT, power.sleep_timeout),
+    SETTING_DESC(SETTING_POWER_DEEP_SLEEP, "power", "deepSleep", SETTING_TYPE_BOOL, power.deep_sleep),
+    SETTING_DESC(SETTING_POWER_DEEP_SLEEP_TIMEOUT, "power", "deepSleepTimeout", SETTING_TYPE_INT,
+                 power.deep_sleep_timeout),
+    SETTING_DESC(SETTING_POWER_BOOST_RPS, "power", "boostRps", SETTING_TYPE_INT, power.boost_rps),
+    SETTING_DESC(SETTING_POWER_BOOST_FREQ, "power", "boostFreq", SETTING_TYPE_INT, power.boost_freq),
+    SETTING_DESC(SETTING_LED_BRIGHTNESS, "led", "brightness", SETTING_TYPE_INT, led.brightness),
+    SETTING_DESC(SETTING_MOUSE_SENSITIVITY, "mouse", "sensitivity", SETTING_TYPE_INT, mouse.sensitivity),
+    SETTING_DESC(SETTING_BLE_TX_POWER, "connectivity", "bleTxPower", SETTING_TYPE_STRING, connectivity.ble_tx_power),
+    SETTING_DESC(SETTING_WEB_IDLE_TIMEOUT, "connectivity", "webIdleTimeout", SETTING_TYPE_INT,
+                 connectivity.web_idle_timeout),
+    SETTING_DESC(SETTING_REMAP_KEYS, "remap", "keys", SETTING_TYPE_STRING, remap.keys),
+    SETTING_DESC(SETTING_REMAP_MACROS, "remap", "macros", SETTING_TYPE_STRING, remap.macros),
+    SETTING_DESC(SETTING_DIAL_MODE, "dial", "mode", SETTING_TYPE_STRING, dial.mode),
+};
 
 static const char *STORAGE_TAG = "STORAGE";
-static cache_entry_t cache[MAX_CACHE_SIZE];
-static int cache_count = 0;
+static device_settings_t s_settings;
+static portMUX_TYPE s_settings_lock = portMUX_INITIALIZER_UNLOCKED;
 
-static void cache_clear(void) {
-    cache_count = 0;
-}
+#define MAX_SUBSCRIBERS 8
 
-static cache_entry_t* cache_find(const char* path) {
-    for(int i = 0; i < cache_count; i++) {
-        if(strcmp(cache[i].path, path) == 0) {
-            return &cache[i];
-        }
-    }
-    return NULL;
-}
+typedef struct {
+    uint32_t mask;
+    storage_change_cb_t cb;
+    void *arg;
+} subscriber_t;
 
-static cache_entry_t* cache_add(const char* path) {
-    if(cache_count >= MAX_CACHE_SIZE) {
-        cache_count = 0;
-    }
-    strncpy(cache[cache_count].path, path, MAX_PATH_LENGTH - 1);
-    cache[cache_count].path[MAX_PATH_LENGTH - 1] = '\0';
-    return &cache[cache_count++];
-}
+static subscriber_t s_subscribers[MAX_SUBSCRIBERS];
+static uint32_t s_unapplied = 0;
 
 // Default settings JSON
 static const char *default_settings = "{"
@@ -64,11 +79,12 @@ static const char *default_settings = "{"
     "\"power\":{"
         "\"lowPowerMode\":false,"
         "\"enableSleep\":true,"
-        "\"highSpeedSubmode\":\"slow\","
         "\"separateSleepTimeouts\":true,"
         "\"sleepTimeout\":60,"
         "\"deepSleep\":true,"
-        "\"deepSleepTimeout\":180"
+        "\"deepSleepTimeout\":180,"
+        "\"boostRps\":400,"
+        "\"boostFreq\":160"
     "},"
     "\"led\":{"
         "\"brightness\":25"
@@ -78,12 +94,92 @@ static const char *default_settings = "{"
     "},"
     "\"connectivity\":{"
         "\"bleTxPower\":\"p3\","
-        "\"bleReconnectDelay\":3"
+        "\"webIdleTimeout\":10"
+    "},"
+    "\"remap\":{"
+        "\"keys\":\"\","
+        "\"macros\":\"\""
+    "},"
+    "\"dial\":{"
+        "\"mode\":\"hosts\""
     "}"
 "}";
 
-// Current settings
+// Current settings, rewritten under s_json_mutex because the write-behind task reads it. NULL until loaded,
+// then s_current_json. The buffers are static so reloads and updates never touch the heap.
 static char *current_settings = NULL;
+static char s_current_json[SETTINGS_JSON_MAX_LEN];
+static char s_scratch_json[SETTINGS_JSON_MAX_LEN];
+static StaticSemaphore_t s_json_mutex_struct;
+static SemaphoreHandle_t s_json_mutex = NULL;
+static int8_t s_writer_id = -1;
+
+// Copies every field present in settings_json into out, fields that are missing or have the wrong type are untouched
+static esp_err_t parse_typed_settings(const char *settings_json, device_settings_t *out) {
+    cJSON *root = cJSON_Parse(settings_json);
+    if (!root) {
+        ESP_LOGE(STORAGE_TAG, "Error parsing settings JSON");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    for (int i = 0; i < SETTING_COUNT; i++) {
+        const setting_desc_t *desc = &s_setting_descs[i];
+        const cJSON *item = cJSON_GetObjectItem(cJSON_GetObjectItem(root, desc->section), desc->key);
+        void *field = (char *)out + desc->offset;
+        switch (desc->type) {
+            case SETTING_TYPE_BOOL:
+                if (cJSON_IsBool(item)) *(bool *)field = cJSON_IsTrue(item);
+                break;
+            case SETTING_TYPE_INT:
+                if (cJSON_IsNumber(item)) *(int *)field = item->valueint;
+                break;
+            case SETTING_TYPE_STRING:
+                if (cJSON_IsString(item)) strlcpy(field, item->valuestring, desc->size);
+                break;
+        }
+    }
+
+    cJSON_Delete(root);
+    return ESP_OK;
+}
+
+// Rebuilds the typed settings: defaults first, so keys missing from older stored JSON keep their default.
+// Returns a SETTING_BIT() mask of the fields that changed.
+static uint32_t update_typed_settings(const char *settings_json) {
+    // Too large for the web server stack with the remap strings, callers don't run concurrently
+    static device_settings_t parsed;
+    memset(&parsed, 0, sizeof(parsed));
+    parse_typed_settings(default_settings, &parsed);
+    if (settings_json != NULL) {
+        parse_typed_settings(settings_json, &parsed);
+    }
+
+    uint32_t changed = 0;
+    taskENTER_CRITICAL(&s_settings_lock);
+    for (int i = 0; i < SETTING_COUNT; i++) {
+        const size_t offset = s_setting_descs[i].offset;
+        if (memcmp((const char *)&s_settings + offset, (const char *)&parsed + offset, s_setting_descs[i].size) != 0) {
+            changed |= SETTING_BIT(i);
+        }
+    }
+    s_settings = parsed;
+    taskEXIT_CRITICAL(&s_settings_lock);
+    return changed;
+}
+
+// Subscribers run in the caller's context and are expected to defer the actual work to their own task
+static void notify_subscribers(const uint32_t changed) {
+    uint32_t handled = 0;
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        const subscriber_t *sub = &s_subscribers[i];
+        if (sub->cb != NULL && (sub->mask & changed)) {
+            sub->cb(sub->mask & changed, &s_settings, sub->arg);
+            handled |= sub->mask;
+        }
+    }
+
+    s_unapplied = changed & ~handled;
+}
 
 // Helper function to get MAC address as a string
 static void get_mac_address_str(char *mac_str, const size_t size) {
@@ -93,24 +189,20 @@ static void get_mac_address_str(char *mac_str, const size_t size) {
              mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 }
 
-// Helper function to update MAC address in settings JSON
-static char* update_mac_address_in_settings(const char* settings_json) {
-    if (!settings_json) return NULL;
-    
-    // Parse the settings JSON
+// Writes settings_json with the MAC address filled in to out, false if it doesn't parse or fit
+static bool rewrite_mac_address(const char *settings_json, char *out, const size_t size) {
     cJSON *root = cJSON_Parse(settings_json);
     if (!root) {
         ESP_LOGE(STORAGE_TAG, "Error parsing settings JSON");
-        return strdup(settings_json); // Return original if parsing fails
+        return false;
     }
     
     // Get the deviceInfo object
     cJSON *device_info = cJSON_GetObjectItem(root, "deviceInfo");
     if (!device_info) {
         ESP_LOGE(STORAGE_TAG, "deviceInfo not found in settings");
-        char *result = strdup(settings_json);
         cJSON_Delete(root);
-        return result;
+        return false;
     }
     
     // Get the MAC address as a string
@@ -125,20 +217,75 @@ static char* update_mac_address_in_settings(const char* settings_json) {
         cJSON_AddStringToObject(device_info, "macAddress", mac_str);
     }
     
-    // Convert back to string
-    char *updated_settings = cJSON_PrintUnformatted(root);
+    const bool printed = cJSON_PrintPreallocated(root, out, (int)size, false);
     cJSON_Delete(root);
-    
-    return updated_settings;
+    if (!printed) {
+        ESP_LOGE(STORAGE_TAG, "Settings don't fit %d bytes", SETTINGS_JSON_MAX_LEN);
+    }
+    return printed;
+}
+
+// Replaces the current settings with settings_json and the MAC address, which may be the current settings.
+// Falls back to settings_json as is, then to the defaults.
+static void load_settings(const char *settings_json) {
+    xSemaphoreTake(s_json_mutex, portMAX_DELAY);
+    if (!rewrite_mac_address(settings_json, s_scratch_json, sizeof(s_scratch_json)) &&
+        strlcpy(s_scratch_json, settings_json, sizeof(s_scratch_json)) >= sizeof(s_scratch_json)) {
+        strlcpy(s_scratch_json, default_settings, sizeof(s_scratch_json));
+    }
+    memcpy(s_current_json, s_scratch_json, sizeof(s_current_json));
+    current_settings = s_current_json;
+    xSemaphoreGive(s_json_mutex);
+}
+
+// Writes the current settings JSON from the write-behind task
+static esp_err_t flush_settings(void *arg) {
+    if (current_settings == NULL) return ESP_ERR_INVALID_STATE;
+
+    // Only this task uses the copy, the flash write doesn't hold the mutex
+    static char settings_json[SETTINGS_JSON_MAX_LEN];
+    xSemaphoreTake(s_json_mutex, portMAX_DELAY);
+    memcpy(settings_json, current_settings, sizeof(settings_json));
+    xSemaphoreGive(s_json_mutex);
+
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(SETTINGS_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(STORAGE_TAG, "Error opening NVS: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_str(nvs_handle, SETTINGS_NVS_KEY, settings_json);
+    if (err != ESP_OK) {
+        ESP_LOGE(STORAGE_TAG, "Error saving settings to NVS: %s", esp_err_to_name(err));
+    } else if ((err = nvs_commit(nvs_handle)) != ESP_OK) {
+        ESP_LOGE(STORAGE_TAG, "Error committing NVS: %s", esp_err_to_name(err));
+    }
+
+    nvs_close(nvs_handle);
+    return err;
+}
+
+// Hands the current settings to the write-behind task, written right away if it has no slot
+static esp_err_t save_settings_behind(void) {
+    if (s_writer_id < 0) {
+        s_writer_id = nvs_writer_register(flush_settings, NULL);
+    }
+    if (s_writer_id >= 0) {
+        nvs_writer_mark_dirty(s_writer_id);
+        return ESP_OK;
+    }
+    return flush_settings(NULL);
 }
 
 // Initialize device settings from NVS or defaults
 esp_err_t init_global_settings(void) {
-    // Free any existing settings
-    if (current_settings != NULL) {
-        free(current_settings);
-        current_settings = NULL;
+    if (s_json_mutex == NULL) {
+        s_json_mutex = xSemaphoreCreateMutexStatic(&s_json_mutex_struct);
     }
+
+    // A pending write-behind commit goes out before the settings are reloaded
+    nvs_writer_flush();
     
     // Open NVS
     nvs_handle_t nvs_handle;
@@ -146,62 +293,42 @@ esp_err_t init_global_settings(void) {
     if (err != ESP_OK) {
         ESP_LOGE(STORAGE_TAG, "Error opening NVS: %s", esp_err_to_name(err));
         // Use default settings with updated MAC address
-        char *updated_settings = update_mac_address_in_settings(default_settings);
-        current_settings = updated_settings ? updated_settings : strdup(default_settings);
+        load_settings(default_settings);
+        update_typed_settings(current_settings);
         return err;
     }
     
-    // Try to get settings from NVS
+    // Try to get settings from NVS, straight into the buffer load_settings() rewrites from
     size_t required_size = 0;
     err = nvs_get_str(nvs_handle, SETTINGS_NVS_KEY, NULL, &required_size);
-    if (err == ESP_OK && required_size > 0) {
-        // Allocate memory for settings
-        char *nvs_settings = malloc(required_size);
-        if (nvs_settings == NULL) {
-            ESP_LOGE(STORAGE_TAG, "Failed to allocate memory for settings");
-            nvs_close(nvs_handle);
-            // Use default settings with updated MAC address
-            char *updated_settings = update_mac_address_in_settings(default_settings);
-            current_settings = updated_settings ? updated_settings : strdup(default_settings);
-            return ESP_ERR_NO_MEM;
-        }
-        
-        // Get settings from NVS
-        err = nvs_get_str(nvs_handle, SETTINGS_NVS_KEY, nvs_settings, &required_size);
+    if (err == ESP_OK && required_size > sizeof(s_current_json)) {
+        ESP_LOGE(STORAGE_TAG, "Stored settings are %u bytes, more than %d", required_size, SETTINGS_JSON_MAX_LEN);
+        load_settings(default_settings);
+    } else if (err == ESP_OK && required_size > 0) {
+        xSemaphoreTake(s_json_mutex, portMAX_DELAY);
+        err = nvs_get_str(nvs_handle, SETTINGS_NVS_KEY, s_current_json, &required_size);
+        xSemaphoreGive(s_json_mutex);
         if (err != ESP_OK) {
             ESP_LOGE(STORAGE_TAG, "Error getting settings from NVS: %s", esp_err_to_name(err));
-            free(nvs_settings);
             // Use default settings with updated MAC address
-            char *updated_settings = update_mac_address_in_settings(default_settings);
-            current_settings = updated_settings ? updated_settings : strdup(default_settings);
+            load_settings(default_settings);
         } else {
             // Update MAC address in the settings from NVS
-            char *updated_settings = update_mac_address_in_settings(nvs_settings);
-            current_settings = updated_settings ? updated_settings : strdup(nvs_settings);
-            free(nvs_settings);
+            load_settings(s_current_json);
         }
     } else {
         // No settings in NVS, use defaults with updated MAC address
         ESP_LOGI(STORAGE_TAG, "No settings found in NVS, using defaults");
-        char *updated_settings = update_mac_address_in_settings(default_settings);
-        current_settings = updated_settings ? updated_settings : strdup(default_settings);
+        load_settings(default_settings);
         
-        // Save settings with updated MAC address to NVS
-        if (current_settings) {
-            err = nvs_set_str(nvs_handle, SETTINGS_NVS_KEY, current_settings);
-            if (err != ESP_OK) {
-                ESP_LOGE(STORAGE_TAG, "Error saving settings to NVS: %s", esp_err_to_name(err));
-            } else {
-                err = nvs_commit(nvs_handle);
-                if (err != ESP_OK) {
-                    ESP_LOGE(STORAGE_TAG, "Error committing NVS: %s", esp_err_to_name(err));
-                }
-            }
-        }
+        // Saved with the MAC address by the write-behind task, boot doesn't wait for the flash write
+        save_settings_behind();
     }
     
     nvs_close(nvs_handle);
-    ESP_LOGI(STORAGE_TAG, "Current settings: %s", current_settings);
+    update_typed_settings(current_settings);
+    // The whole JSON takes tens of milliseconds on the console, boot only logs it at debug level
+    ESP_LOGD(STORAGE_TAG, "Current settings: %s", current_settings);
     return ESP_OK;
 }
 
@@ -213,180 +340,133 @@ const char* storage_get_settings(void) {
     }
     
     // Make sure MAC address is up to date
-    if (current_settings) {
-        char *updated_settings = update_mac_address_in_settings(current_settings);
-        if (updated_settings) {
-            free(current_settings);
-            current_settings = updated_settings;
-        }
-    }
-    
+    load_settings(current_settings);
     return current_settings;
 }
 
-// Update device settings with new JSON
+// Update device settings with new JSON, NVS is written behind
 esp_err_t storage_update_settings(const char* settings_json) {
     if (!settings_json) return ESP_ERR_INVALID_ARG;
-    
-    // Open NVS
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open(SETTINGS_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(STORAGE_TAG, "Error opening NVS: %s", esp_err_to_name(err));
-        return err;
+    if (strlen(settings_json) >= SETTINGS_JSON_MAX_LEN) return ESP_ERR_INVALID_SIZE;
+
+    xSemaphoreTake(s_json_mutex, portMAX_DELAY);
+    if (current_settings && strcmp(current_settings, settings_json) == 0) {
+        xSemaphoreGive(s_json_mutex);
+        s_unapplied = 0;
+        return ESP_OK;
     }
-    
-    // Save settings to NVS
-    err = nvs_set_str(nvs_handle, SETTINGS_NVS_KEY, settings_json);
-    if (err != ESP_OK) {
-        ESP_LOGE(STORAGE_TAG, "Error saving settings to NVS: %s", esp_err_to_name(err));
-        nvs_close(nvs_handle);
-        return err;
+
+    strlcpy(s_current_json, settings_json, sizeof(s_current_json));
+    current_settings = s_current_json;
+    xSemaphoreGive(s_json_mutex);
+
+    const esp_err_t err = save_settings_behind();
+    if (err != ESP_OK) return err;
+
+    // Update the typed copy
+    const uint32_t changed = update_typed_settings(current_settings);
+    ESP_LOGI(STORAGE_TAG, "Settings updated, changed mask 0x%lx", (unsigned long)changed);
+    notify_subscribers(changed);
+    return ESP_OK;
+}
+
+esp_err_t storage_subscribe(const uint32_t mask, const storage_change_cb_t cb, void *arg) {
+    if (cb == NULL || mask == 0) return ESP_ERR_INVALID_ARG;
+
+    subscriber_t *free_slot = NULL;
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        subscriber_t *sub = &s_subscribers[i];
+        if (sub->cb == cb && sub->arg == arg) {
+            sub->mask = mask;
+            return ESP_OK;
+        }
+        if (sub->cb == NULL && free_slot == NULL) {
+            free_slot = sub;
+        }
     }
-    
-    // Commit changes
-    err = nvs_commit(nvs_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(STORAGE_TAG, "Error committing NVS: %s", esp_err_to_name(err));
+
+    if (free_slot == NULL) {
+        ESP_LOGE(STORAGE_TAG, "No free settings subscriber slot");
+        return ESP_ERR_NO_MEM;
     }
-    
-    nvs_close(nvs_handle);
-    
-    // Update current settings and clear cache
-    if (err == ESP_OK) {
-        if (current_settings) {
-            free(current_settings);
+
+    free_slot->mask = mask;
+    free_slot->arg = arg;
+    free_slot->cb = cb;
+    return ESP_OK;
+}
+
+esp_err_t storage_unsubscribe(const storage_change_cb_t cb, void *arg) {
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        subscriber_t *sub = &s_subscribers[i];
+        if (sub->cb == cb && sub->arg == arg) {
+            sub->cb = NULL;
+            return ESP_OK;
         }
-        current_settings = strdup(settings_json);
-        cache_clear();
     }
-    
-    return err;
+    return ESP_ERR_NOT_FOUND;
 }
 
-// Helper function to find a JSON value by path
-static cJSON* find_json_by_path(const char* path) {
-    if (!path || !current_settings) return NULL;
-    
-    // Parse the settings JSON
-    cJSON *root = cJSON_Parse(current_settings);
-    if (!root) {
-        ESP_LOGE(STORAGE_TAG, "Error parsing settings JSON");
-        return NULL;
-    }
-    
-    // Split the path by dots
-    char *path_copy = strdup(path);
-    if (!path_copy) {
-        cJSON_Delete(root);
+bool storage_restart_required(void) {
+    return s_unapplied != 0;
+}
+
+// Looks up "section.key" in the descriptor table, no JSON involved
+static const setting_desc_t *find_setting(const char *path, const setting_type_t type) {
+    const char *dot = strchr(path, '.');
+    if (dot == NULL) {
         return NULL;
     }
-    
-    char *token;
-    char *rest = path_copy;
-    cJSON *current = root;
-    
-    while ((token = strtok_r(rest, ".", &rest))) {
-        current = cJSON_GetObjectItem(current, token);
-        if (!current) {
-            ESP_LOGE(STORAGE_TAG, "Path %s not found in settings", path);
-            free(path_copy);
-            cJSON_Delete(root);
-            return NULL;
+
+    const size_t section_len = dot - path;
+    for (int i = 0; i < SETTING_COUNT; i++) {
+        const setting_desc_t *desc = &s_setting_descs[i];
+        if (desc->type == type && strncmp(desc->section, path, section_len) == 0 &&
+            desc->section[section_len] == '\0' && strcmp(desc->key, dot + 1) == 0) {
+            return desc;
         }
     }
-    
-    free(path_copy);
-    
-    // Return a detached copy of the found item
-    cJSON *result = cJSON_Duplicate(current, true);
-    cJSON_Delete(root);
-    
-    return result;
+
+    return NULL;
+}
+
+const device_settings_t *storage_settings(void) {
+    return &s_settings;
 }
 
 // Get a specific setting value as a string
 esp_err_t storage_get_string_setting(const char* path, char* value, const size_t max_len) {
     if (!path || !value || max_len == 0) return ESP_ERR_INVALID_ARG;
-    
-    cache_entry_t* entry = cache_find(path);
-    if(entry && entry->type == CACHE_TYPE_STRING) {
-        strncpy(value, entry->value.str, max_len - 1);
-        value[max_len - 1] = '\0';
-        return ESP_OK;
-    }
-    
-    cJSON *item = find_json_by_path(path);
-    if (!item) return ESP_ERR_NOT_FOUND;
-    
-    if (cJSON_IsString(item)) {
-        entry = cache_add(path);
-        entry->type = CACHE_TYPE_STRING;
-        strncpy(entry->value.str, item->valuestring, sizeof(entry->value.str) - 1);
-        entry->value.str[sizeof(entry->value.str) - 1] = '\0';
-        
-        strncpy(value, item->valuestring, max_len - 1);
-        value[max_len - 1] = '\0';
-        cJSON_Delete(item);
-        return ESP_OK;
-    }
-    
-    cJSON_Delete(item);
-    return ESP_ERR_INVALID_ARG;
+
+    const setting_desc_t *desc = find_setting(path, SETTING_TYPE_STRING);
+    if (!desc) return ESP_ERR_NOT_FOUND;
+
+    taskENTER_CRITICAL(&s_settings_lock);
+    strlcpy(value, (const char *)&s_settings + desc->offset, max_len);
+    taskEXIT_CRITICAL(&s_settings_lock);
+    return ESP_OK;
 }
 
 // Get a specific setting value as an integer
 esp_err_t storage_get_int_setting(const char* path, int* value) {
     if (!path || !value) return ESP_ERR_INVALID_ARG;
-    
-    cache_entry_t* entry = cache_find(path);
-    if(entry && entry->type == CACHE_TYPE_INT) {
-        *value = entry->value.num;
-        return ESP_OK;
-    }
-    
-    cJSON *item = find_json_by_path(path);
-    if (!item) return ESP_ERR_NOT_FOUND;
-    
-    if (cJSON_IsNumber(item)) {
-        entry = cache_add(path);
-        entry->type = CACHE_TYPE_INT;
-        entry->value.num = item->valueint;
-        
-        *value = item->valueint;
-        cJSON_Delete(item);
-        return ESP_OK;
-    }
-    
-    cJSON_Delete(item);
-    return ESP_ERR_INVALID_ARG;
+
+    const setting_desc_t *desc = find_setting(path, SETTING_TYPE_INT);
+    if (!desc) return ESP_ERR_NOT_FOUND;
+
+    *value = *(const int *)((const char *)&s_settings + desc->offset);
+    return ESP_OK;
 }
 
 // Get a specific setting value as a boolean
 esp_err_t storage_get_bool_setting(const char* path, bool* value) {
     if (!path || !value) return ESP_ERR_INVALID_ARG;
-    
-    cache_entry_t* entry = cache_find(path);
-    if(entry && entry->type == CACHE_TYPE_BOOL) {
-        *value = entry->value.flag;
-        return ESP_OK;
-    }
-    
-    cJSON *item = find_json_by_path(path);
-    if (!item) return ESP_ERR_NOT_FOUND;
-    
-    if (cJSON_IsBool(item)) {
-        entry = cache_add(path);
-        entry->type = CACHE_TYPE_BOOL;
-        entry->value.flag = cJSON_IsTrue(item);
-        
-        *value = cJSON_IsTrue(item);
-        cJSON_Delete(item);
-        return ESP_OK;
-    }
-    
-    cJSON_Delete(item);
-    return ESP_ERR_INVALID_ARG;
+
+    const setting_desc_t *desc = find_setting(path, SETTING_TYPE_BOOL);
+    if (!desc) return ESP_ERR_NOT_FOUND;
+
+    *value = *(const bool *)((const char *)&s_settings + desc->offset);
+    return ESP_OK;
 }
 
 // Set the one-time boot with WiFi flag
@@ -2,12 +2,87 @@
 
 #include <esp_err.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 // Settings namespace and keys for NVS
 #define SETTINGS_NVS_NAMESPACE "device_settings"
 #define SETTINGS_NVS_KEY "settings"
 #define WIFI_CONFIG_NAMESPACE "wifi_config"
 #define BOOT_WIFI_KEY "boot_wifi"
+// Longest settings JSON, the defaults are about 600 bytes and the remap strings add up to 320
+#define SETTINGS_JSON_MAX_LEN 1536
+
+// Compile-time IDs of the settings mirrored into device_settings_t
+typedef enum {
+    SETTING_DEVICE_NAME,
+    SETTING_POWER_LOW_POWER_MODE,
+    SETTING_POWER_ENABLE_SLEEP,
+    SETTING_POWER_SEPARATE_SLEEP_TIMEOUTS,
+    SETTING_POWER_SLEEP_TIMEOUT,
+    SETTING_POWER_DEEP_SLEEP,
+    SETTING_POWER_DEEP_SLEEP_TIMEOUT,
+    SETTING_POWER_BOOST_RPS,
+    SETTING_POWER_BOOST_FREQ,
+    SETTING_LED_BRIGHTNESS,
+    SETTING_MOUSE_SENSITIVITY,
+    SETTING_BLE_TX_POWER,
+    SETTING_WEB_IDLE_TIMEOUT,
+    SETTING_REMAP_KEYS,
+    SETTING_REMAP_MACROS,
+    SETTING_DIAL_MODE,
+    SETTING_COUNT
+} setting_id_t;
+
+#define SETTING_BIT(id) (1UL << (id))
+
+/**
+ * @brief Settings parsed once from JSON, fields always hold a valid value (the default if the key is missing)
+ */
+typedef struct {
+    struct {
+        char name[32];
+    } device_info;
+    struct {
+        bool low_power_mode;
+        bool enable_sleep;
+        bool separate_sleep_timeouts;
+        int sleep_timeout;      // seconds
+        bool deep_sleep;
+        int deep_sleep_timeout; // seconds
+        int boost_rps;          // USB reports per second that switch to boost_freq, 0 never boosts
+        int boost_freq;         // MHz, 160 or 240
+    } power;
+    struct {
+        int brightness;         // percent
+    } led;
+    struct {
+        int sensitivity;        // percent
+    } mouse;
+    struct {
+        char ble_tx_power[8];   // "n6".."p9"
+        int web_idle_timeout;   // minutes without a request before the web stack shuts down, 0 never
+    } connectivity;
+    struct {
+        char keys[160];         // see key_remap.h
+        char macros[160];
+    } remap;
+    struct {
+        char mode[8];           // "hosts", "volume" or "scroll"
+    } dial;
+} device_settings_t;
+
+/**
+ * @brief Called after storage_update_settings() changed one or more subscribed settings
+ *
+ * Runs in the context of the caller of storage_update_settings() (the web server task).
+ * Subsystems should only latch the change here and apply it at a safe point of their own loop.
+ *
+ * @param changed SETTING_BIT() mask of the subscribed settings that changed
+ * @param settings New settings
+ * @param arg User argument given to storage_subscribe()
+ */
+typedef void (*storage_change_cb_t)(uint32_t changed, const device_settings_t *settings, void *arg);
 
 /**
  * @brief Initialize device settings from NVS or defaults
@@ -31,6 +106,43 @@ const char* storage_get_settings(void);
  */
 esp_err_t storage_update_settings(const char* settings_json);
 
+/**
+ * @brief Get the typed settings
+ *
+ * Rebuilt by init_global_settings() and storage_update_settings(), reading a field is a plain load.
+ *
+ * @return const device_settings_t* Current settings, never NULL
+ */
+const device_settings_t *storage_settings(void);
+
+/**
+ * @brief Subscribe to setting changes
+ *
+ * Subscribing again with the same cb and arg replaces the mask.
+ *
+ * @param mask SETTING_BIT() mask of the settings of interest
+ * @param cb Callback
+ * @param arg User argument passed to cb
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NO_MEM if all subscriber slots are taken
+ */
+esp_err_t storage_subscribe(uint32_t mask, storage_change_cb_t cb, void *arg);
+
+/**
+ * @brief Remove a subscription
+ *
+ * @param cb Callback given to storage_subscribe()
+ * @param arg User argument given to storage_subscribe()
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NOT_FOUND if not subscribed
+ */
+esp_err_t storage_unsubscribe(storage_change_cb_t cb, void *arg);
+
+/**
+ * @brief Check if the last storage_update_settings() changed a setting nobody applies live
+ *
+ * @return true if a restart is needed for the new settings to take effect
+ */
+bool storage_restart_required(void);
+
 /**
  * @brief Get a specific setting value as a string
  * 
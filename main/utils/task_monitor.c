@@ -11,17 +11,27 @@
 #include "task_monitor.h"
 #include "hid_bridge.h"
 #include "temp_sensor.h"
+#include "const.h"
 
 static const char *TAG = "mon";
 
 #define STATS_TICKS         pdMS_TO_TICKS(1000)
 #define MAX_TASKS           32
-#define STATS_TASK_PRIO     3
 
 static TaskStatus_t start_array[MAX_TASKS];
 static TaskStatus_t end_array[MAX_TASKS];
 static TaskHandle_t monitor_task_handle = NULL;
 
+typedef struct {
+    TaskHandle_t handle;
+    uint32_t run_time;
+} run_time_sample_t;
+
+static TaskStatus_t sample_array[MAX_TASKS];
+static run_time_sample_t prev_samples[MAX_TASKS];
+static UBaseType_t prev_sample_count = 0;
+static uint32_t prev_sample_time = 0;
+
 #define HEADER_FORMAT " Task (core %d)  |     Took |     | Free "
 #define HEADER_SEPARATOR "----------------|----------|-----|------"
 
@@ -123,6 +133,68 @@ static void monitor_task(void *pvParameter)
     }
 }
 
+static uint32_t prev_run_time(const TaskHandle_t handle)
+{
+    for (int i = 0; i < prev_sample_count; i++) {
+        if (prev_samples[i].handle == handle) {
+            return prev_samples[i].run_time;
+        }
+    }
+    return 0;
+}
+
+int task_monitor_sample_cpu(task_cpu_usage_t *tasks, const int max_tasks, uint8_t core_load[portNUM_PROCESSORS])
+{
+    uint32_t run_time;
+    const UBaseType_t count = uxTaskGetSystemState(sample_array, MAX_TASKS, &run_time);
+    const uint32_t elapsed = run_time - prev_sample_time;
+    const bool primed = prev_sample_count > 0 && elapsed > 0;
+
+    int written = 0;
+    for (int i = 0; i < portNUM_PROCESSORS; i++) {
+        core_load[i] = 0;
+    }
+
+    for (int i = 0; primed && i < count; i++) {
+        const TaskStatus_t *task = &sample_array[i];
+        const uint32_t delta = task->ulRunTimeCounter - prev_run_time(task->xHandle);
+        const uint32_t percent = (uint32_t)(((uint64_t)delta * 100) / elapsed);
+        const uint8_t clamped = percent > 100 ? 100 : percent;
+
+        if (strncmp(task->pcTaskName, "IDLE", 4) == 0) {
+            if (task->xCoreID < portNUM_PROCESSORS) {
+                core_load[task->xCoreID] = 100 - clamped;
+            }
+            continue;
+        }
+
+        // Insertion into the busiest-first output, quiet tasks fall off the end
+        int pos = written;
+        while (pos > 0 && tasks[pos - 1].percent < clamped) {
+            pos--;
+        }
+        if (pos >= max_tasks) {
+            continue;
+        }
+        const int last = written < max_tasks ? written : max_tasks - 1;
+        memmove(&tasks[pos + 1], &tasks[pos], (last - pos) * sizeof(task_cpu_usage_t));
+        strlcpy(tasks[pos].name, task->pcTaskName, sizeof(tasks[pos].name));
+        tasks[pos].core = task->xCoreID < portNUM_PROCESSORS ? task->xCoreID : TASK_CPU_NO_AFFINITY;
+        tasks[pos].percent = clamped;
+        if (written < max_tasks) {
+            written++;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        prev_samples[i].handle = sample_array[i].xHandle;
+        prev_samples[i].run_time = sample_array[i].ulRunTimeCounter;
+    }
+    prev_sample_count = count;
+    prev_sample_time = run_time;
+    return written;
+}
+
 esp_err_t task_monitor_init(void)
 {
     temp_sensor_init();
@@ -135,6 +207,7 @@ esp_err_t task_monitor_start(void)
         return ESP_ERR_INVALID_STATE;
     }
 
-    const BaseType_t ret = xTaskCreatePinnedToCore(monitor_task, "monitor", 2200, NULL, STATS_TASK_PRIO, &monitor_task_handle, 1);
+    const BaseType_t ret = xTaskCreatePinnedToCore(monitor_task, "monitor", 2200, NULL, TASK_MONITOR_PRIO, &monitor_task_handle,
+                                                   TASK_MONITOR_CORE);
     return (ret == pdPASS) ? ESP_OK : ESP_FAIL;
 }
@@ -7,6 +7,14 @@
 extern "C" {
 #endif
 
+#define TASK_CPU_NO_AFFINITY 0xFF
+
+typedef struct {
+    char name[configMAX_TASK_NAME_LEN];
+    uint8_t core;       // TASK_CPU_NO_AFFINITY if unpinned
+    uint8_t percent;    // share of one core since the previous sample
+} task_cpu_usage_t;
+
 /**
  * @brief Initialize task monitoring system
  * 
@@ -21,6 +29,19 @@ esp_err_t task_monitor_init(void);
  */
 esp_err_t task_monitor_start(void);
 
+/**
+ * @brief Sample CPU usage since the previous call, independent of the monitor task
+ *
+ * Only one caller is expected, the previous run time counters are kept in static storage.
+ * The first call only primes them and returns 0.
+ *
+ * @param tasks Output, busiest tasks first, IDLE tasks are left out
+ * @param max_tasks Size of tasks
+ * @param core_load Output, load of each core in percent
+ * @return Number of tasks written
+ */
+int task_monitor_sample_cpu(task_cpu_usage_t *tasks, int max_tasks, uint8_t core_load[portNUM_PROCESSORS]);
+
 #ifdef __cplusplus
 }
 #endif
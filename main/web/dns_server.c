@@ -13,6 +13,7 @@
 #include "esp_netif.h"
 #include "lwip/sockets.h"
 #include "lwip/netdb.h"
+#include "const.h"
 
 #define DNS_PORT (53)
 #define DNS_MAX_LEN (128)  
@@ -198,5 +199,5 @@ static void dns_server_task(void *pvParameters)
 void start_dns_server(TaskHandle_t *dns_task_handle)
 {
     vTaskDelay(pdMS_TO_TICKS(350));
-    xTaskCreatePinnedToCore(&dns_server_task, "dns_server", 2400, NULL, 3, dns_task_handle, 1);
+    xTaskCreatePinnedToCore(&dns_server_task, "dns_server", 2400, NULL, TASK_DNS_PRIO, dns_task_handle, TASK_DNS_CORE);
 }
@@ -7,8 +7,18 @@ const App = () => {
     const [systemInfo, setSystemInfo] = React.useState({
         heap: 0,
         temp: 0,
+        minHeap: 0,
+        largestBlock: 0,
+        battery: null,
+        batteryMv: 0,
+        charging: false,
     });
 
+    const [latency, setLatency] = React.useState(null);
+    const [telemetry, setTelemetry] = React.useState(null);
+    const [liveStats, setLiveStats] = React.useState(false);
+    const [capture, setCapture] = React.useState(null);
+
     const [settings, setSettings] = React.useState({
         deviceInfo: {
             name: 'TBD',
@@ -23,17 +33,25 @@ const App = () => {
             enableSleep: true,
             deepSleep: true,
             separateSleepTimeouts: true,
-            highSpeedSubmode: 'slow',
+            boostRps: 400,
+            boostFreq: 160,
         },
         led: {
             brightness: 80,
         },
         connectivity: {
             bleTxPower: 'low',
-            bleReconnectDelay: 3,
+            webIdleTimeout: 10,
         },
         mouse: {
             sensitivity: 100,
+        },
+        remap: {
+            keys: '',
+            macros: '',
+        },
+        dial: {
+            mode: 'hosts',
         }
     });
 
@@ -46,6 +64,9 @@ const App = () => {
     const wsCheckIntervalRef = React.useRef(null);
     const fileInputRef = React.useRef(null);
     const initialSettingsRef = React.useRef(null);
+    const liveStatsRef = React.useRef(false);
+    const telemetryHistoryRef = React.useRef([]);
+    const telemetryCanvasRef = React.useRef(null);
 
     const checkWebSocketActivity = () => {
         const now = Date.now();
@@ -84,6 +105,7 @@ const App = () => {
         const wsUrl = `${protocol}//${window.location.host}/ws`;
 
         const socket = new WebSocket(wsUrl);
+        socket.binaryType = 'arraybuffer';
         socketRef.current = socket;
 
         socket.onopen = () => {
@@ -92,6 +114,10 @@ const App = () => {
             setLoading(false);
             setLastMessageTime(Date.now());
             requestSettings();
+            socket.send(JSON.stringify({type: 'command', command: 'capture_status'}));
+            if (liveStatsRef.current) {
+                socket.send(JSON.stringify({type: 'command', command: 'telemetry_subscribe'}));
+            }
         };
 
         socket.onclose = () => {
@@ -112,9 +138,98 @@ const App = () => {
         };
     };
 
+    // type 0x01, stage count, then per stage uint32 LE count/p50/p99/max (see latency_trace.h)
+    const LATENCY_MSG_TYPE = 0x01;
+    const LATENCY_STAGE_E2E = 4;
+
+    // type 0x02, version, then the packed little endian telemetry_frame_t (see telemetry.h)
+    const TELEMETRY_MSG_TYPE = 0x02;
+    const TELEMETRY_VERSION = 2;
+    const TELEMETRY_HEADER_SIZE = 63;
+    const TELEMETRY_TASK_SIZE = 10;
+    const TELEMETRY_HISTORY = 200;
+    const FLUSH_REASONS = ['direct', 'button', 'first', 'conn event', 'host switch'];
+
+    const handleTelemetryMessage = (view) => {
+        if (view.byteLength < TELEMETRY_HEADER_SIZE || view.getUint8(1) !== TELEMETRY_VERSION) {
+            return;
+        }
+
+        const tasks = [];
+        const numTasks = view.getUint8(62);
+        for (let i = 0; i < numTasks; i++) {
+            const offset = TELEMETRY_HEADER_SIZE + i * TELEMETRY_TASK_SIZE;
+            if (view.byteLength < offset + TELEMETRY_TASK_SIZE) {
+                break;
+            }
+            let name = '';
+            for (let c = 0; c < 8 && view.getUint8(offset + c) !== 0; c++) {
+                name += String.fromCharCode(view.getUint8(offset + c));
+            }
+            tasks.push({name, core: view.getUint8(offset + 8), percent: view.getUint8(offset + 9)});
+        }
+
+        const sample = {
+            seq: view.getUint16(2, true),
+            usbRps: view.getUint16(8, true),
+            bleRps: view.getUint16(10, true),
+            dropped: view.getUint32(12, true),
+            highWater: view.getUint16(16, true),
+            suppressed: view.getUint16(18, true),
+            flushes: FLUSH_REASONS.map((_, i) => view.getUint16(20 + i * 2, true)),
+            connInterval: view.getUint32(30, true),
+            freeHeap: view.getUint32(34, true),
+            minFreeHeap: view.getUint32(38, true),
+            bridgeRps: view.getUint16(42, true),
+            notifyErrors: view.getUint32(44, true),
+            allocFailures: view.getUint32(48, true),
+            bleReconnects: view.getUint16(52, true),
+            usbAttaches: view.getUint16(54, true),
+            maxLatency: view.getUint32(56, true),
+            coreLoad: [view.getUint8(60), view.getUint8(61)],
+            tasks,
+        };
+
+        const history = telemetryHistoryRef.current;
+        history.push(sample);
+        if (history.length > TELEMETRY_HISTORY) {
+            history.shift();
+        }
+        setTelemetry(sample);
+    };
+
+    const handleBinaryMessage = (buffer) => {
+        const view = new DataView(buffer);
+        if (view.byteLength >= 2 && view.getUint8(0) === TELEMETRY_MSG_TYPE) {
+            handleTelemetryMessage(view);
+            return;
+        }
+        if (view.byteLength < 2 || view.getUint8(0) !== LATENCY_MSG_TYPE) {
+            return;
+        }
+
+        const stages = view.getUint8(1);
+        const offset = 2 + LATENCY_STAGE_E2E * 16;
+        if (stages <= LATENCY_STAGE_E2E || view.byteLength < offset + 16) {
+            return;
+        }
+
+        setLatency({
+            count: view.getUint32(offset, true),
+            p50: view.getUint32(offset + 4, true),
+            p99: view.getUint32(offset + 8, true),
+            max: view.getUint32(offset + 12, true),
+        });
+    };
+
     const handleWebSocketMessage = (data) => {
         setLastMessageTime(Date.now());
 
+        if (data instanceof ArrayBuffer) {
+            handleBinaryMessage(data);
+            return;
+        }
+
         try {
             const message = JSON.parse(data);
 
@@ -145,12 +260,19 @@ const App = () => {
                     }
                     break;
                 case 'settings_update_status':
-                    if (message.content.success) {
+                    if (message.content.success && message.content.restart === false) {
+                        showStatus('Settings applied.', 'success');
+                        initialSettingsRef.current = null;
+                        socketRef.current.send(JSON.stringify({type: 'command', command: 'get_settings'}));
+                    } else if (message.content.success) {
                         showStatus('Settings updated successfully. The device is restarting.', 'success');
                     } else {
                         showStatus(`Failed to update settings: ${message.content.error}`, 'error');
                     }
                     break;
+                case 'capture_status':
+                    setCapture(message.content);
+                    break;
                 case 'log':
                     console.log('Server log:', message.content);
                     break;
@@ -163,7 +285,12 @@ const App = () => {
 
                             setSystemInfo({
                                 heap: pingData.heap || 0,
-                                temp: pingData.temp || 0
+                                temp: pingData.temp || 0,
+                                minHeap: pingData.minHeap || 0,
+                                largestBlock: pingData.largestBlock || 0,
+                                battery: typeof pingData.battery === 'number' ? pingData.battery : null,
+                                batteryMv: pingData.batteryMv || 0,
+                                charging: !!pingData.charging
                             });
                         } catch (e) {
                             console.error('Error parsing ping data:', e);
@@ -178,6 +305,64 @@ const App = () => {
         }
     };
 
+    const sendCaptureCommand = (command) => {
+        if (socketRef.current && socketRef.current.readyState === WebSocket.OPEN) {
+            socketRef.current.send(JSON.stringify({type: 'command', command}));
+        }
+    };
+
+    // The device stops a running capture when the file is requested
+    const downloadCapture = () => {
+        window.location.href = '/capture.awcp';
+        setTimeout(() => sendCaptureCommand('capture_status'), 1000);
+    };
+
+    const toggleLiveStats = (enabled) => {
+        liveStatsRef.current = enabled;
+        setLiveStats(enabled);
+        telemetryHistoryRef.current = [];
+        setTelemetry(null);
+
+        if (socketRef.current && socketRef.current.readyState === WebSocket.OPEN) {
+            socketRef.current.send(JSON.stringify({
+                type: 'command',
+                command: enabled ? 'telemetry_subscribe' : 'telemetry_unsubscribe'
+            }));
+        }
+    };
+
+    // USB and BLE report rates over the last TELEMETRY_HISTORY frames, scaled to the larger peak
+    React.useEffect(() => {
+        const canvas = telemetryCanvasRef.current;
+        if (!canvas || !telemetry) {
+            return;
+        }
+
+        const ctx = canvas.getContext('2d');
+        const history = telemetryHistoryRef.current;
+        const peak = Math.max(100, ...history.map((s) => Math.max(s.usbRps, s.bleRps)));
+        const step = canvas.width / (TELEMETRY_HISTORY - 1);
+
+        ctx.clearRect(0, 0, canvas.width, canvas.height);
+        const plot = (key, color) => {
+            ctx.strokeStyle = color;
+            ctx.lineWidth = 1.5;
+            ctx.beginPath();
+            history.forEach((s, i) => {
+                const x = i * step;
+                const y = canvas.height - (s[key] / peak) * (canvas.height - 2) - 1;
+                if (i === 0) {
+                    ctx.moveTo(x, y);
+                } else {
+                    ctx.lineTo(x, y);
+                }
+            });
+            ctx.stroke();
+        };
+        plot('usbRps', '#4caf50');
+        plot('bleRps', '#2196f3');
+    }, [telemetry]);
+
     const requestSettings = () => {
         if (!socketRef.current || socketRef.current.readyState !== WebSocket.OPEN) {
             showStatus('WebSocket not connected.', 'error');
@@ -248,19 +433,33 @@ const App = () => {
         }
 
         const file = fileInput.files[0];
-        const formData = new FormData();
-        formData.append('firmware', file);
 
         setOtaInProgress(true);
         setOtaProgress(0);
         showStatus('Starting firmware upload…', 'info');
         window.scrollTo(0, 0);
 
-        fetch('/upload', {
-            method: 'POST',
-            body: formData
-        })
+        // The image is sent as the raw body, the device checks it against the hash when one is sent.
+        // crypto.subtle only exists in secure contexts, over plain HTTP the image is sent unhashed.
+        const digest = window.crypto && window.crypto.subtle
+            ? file.arrayBuffer()
+                .then(data => window.crypto.subtle.digest('SHA-256', data))
+                .then(hash => Array.from(new Uint8Array(hash)).map(b => b.toString(16).padStart(2, '0')).join(''))
+                .catch(() => null)
+            : Promise.resolve(null);
+
+        digest
+            .then(sha256 => fetch('/upload', {
+                method: 'POST',
+                headers: sha256
+                    ? {'Content-Type': 'application/octet-stream', 'X-OTA-SHA256': sha256}
+                    : {'Content-Type': 'application/octet-stream'},
+                body: file
+            }))
             .then(response => {
+                if (response.status === 409) {
+                    throw new Error('the delta package doesn\'t match the running firmware, upload the full image instead');
+                }
                 if (!response.ok) {
                     throw new Error(`HTTP error ${response.status}`);
                 }
@@ -342,35 +541,136 @@ const App = () => {
                             <div>{(systemInfo.heap / 1000).toFixed(0)} kb</div>
                         </div>
 
+                        <div className="setting-item">
+                            <div className="setting-title">Heap low water (free / largest block)</div>
+                            <div>{(systemInfo.minHeap / 1000).toFixed(0)} / {(systemInfo.largestBlock / 1000).toFixed(0)} kb</div>
+                        </div>
+
                         <div className="setting-item">
                             <div className="setting-title">SoC temperature</div>
                             <div>{systemInfo.temp.toFixed(0)}°C</div>
                         </div>
+
+                        {systemInfo.battery !== null && (
+                            <div className="setting-item">
+                                <div className="setting-title">Battery</div>
+                                <div>{systemInfo.battery}% ({(systemInfo.batteryMv / 1000).toFixed(2)} V){systemInfo.charging ? ', charging' : ''}</div>
+                            </div>
+                        )}
+
+                        {latency && latency.count > 0 && (
+                            <div className="setting-item">
+                                <div className="setting-title">Latency (p50 / p99 / max)</div>
+                                <div>{(latency.p50 / 1000).toFixed(1)} / {(latency.p99 / 1000).toFixed(1)} / {(latency.max / 1000).toFixed(1)} ms</div>
+                            </div>
+                        )}
+
+                        <div className="setting-item">
+                            <div className="setting-title">Live statistics</div>
+                            <label className="toggle-switch">
+                                <input
+                                    type="checkbox"
+                                    checked={liveStats}
+                                    disabled={!connected}
+                                    onChange={(e) => toggleLiveStats(e.target.checked)}
+                                />
+                                <span className="slider"></span>
+                            </label>
+                        </div>
+
+                        {liveStats && telemetry && (
+                            <div>
+                                <div className="setting-item">
+                                    <div className="setting-title">
+                                        <span style={{color: '#4caf50'}}>USB {telemetry.usbRps}</span> / <span style={{color: '#2196f3'}}>BLE {telemetry.bleRps}</span> rps
+                                    </div>
+                                </div>
+                                <canvas ref={telemetryCanvasRef} width="400" height="80" style={{width: '100%', height: '80px'}}></canvas>
+
+                                <div className="setting-item">
+                                    <div className="setting-title">Connection interval</div>
+                                    <div>{(telemetry.connInterval / 1000).toFixed(2)} ms</div>
+                                </div>
+
+                                <div className="setting-item">
+                                    <div className="setting-title">Ring drops / high water</div>
+                                    <div>{telemetry.dropped} / {telemetry.highWater}</div>
+                                </div>
+
+                                <div className="setting-item">
+                                    <div className="setting-title">Suppressed repeats</div>
+                                    <div>{telemetry.suppressed}/s</div>
+                                </div>
+
+                                <div className="setting-item">
+                                    <div className="setting-title">Flushes</div>
+                                    <div>{FLUSH_REASONS.map((reason, i) => `${reason} ${telemetry.flushes[i]}`).join(', ')} /s</div>
+                                </div>
+
+                                <div className="setting-item">
+                                    <div className="setting-title">Bridge</div>
+                                    <div>{telemetry.bridgeRps} rps</div>
+                                </div>
+
+                                <div className="setting-item">
+                                    <div className="setting-title">Worst latency</div>
+                                    <div>{(telemetry.maxLatency / 1000).toFixed(2)} ms</div>
+                                </div>
+
+                                <div className="setting-item">
+                                    <div className="setting-title">Notify errors / alloc failures</div>
+                                    <div>{telemetry.notifyErrors} / {telemetry.allocFailures}</div>
+                                </div>
+
+                                <div className="setting-item">
+                                    <div className="setting-title">BLE reconnects / USB attaches</div>
+                                    <div>{telemetry.bleReconnects} / {telemetry.usbAttaches}</div>
+                                </div>
+
+                                <div className="setting-item">
+                                    <div className="setting-title">Heap (free / min)</div>
+                                    <div>{(telemetry.freeHeap / 1000).toFixed(0)} / {(telemetry.minFreeHeap / 1000).toFixed(0)} kb</div>
+                                </div>
+
+                                <div className="setting-item">
+                                    <div className="setting-title">Core load</div>
+                                    <div>{telemetry.coreLoad[0]}% / {telemetry.coreLoad[1]}%</div>
+                                </div>
+
+                                {telemetry.tasks.map((task) => (
+                                    <div className="setting-item" key={task.name}>
+                                        <div className="setting-title">{task.name} ({task.core === 0xFF ? '-' : task.core})</div>
+                                        <div>{task.percent}%</div>
+                                    </div>
+                                ))}
+                            </div>
+                        )}
+
+                        <div className="setting-item">
+                            <div className="setting-title">USB capture</div>
+                            <div>
+                                {capture && capture.size > 0 && (
+                                    <span>
+                                        {(capture.used / 1000).toFixed(1)} / {(capture.size / 1000).toFixed(0)} kb, {capture.descriptors} interface(s){capture.dropped > 0 && `, ${capture.dropped} dropped`}
+                                    </span>
+                                )}
+                                <button
+                                    onClick={() => sendCaptureCommand(capture && capture.active ? 'capture_stop' : 'capture_start')}
+                                    disabled={!connected}
+                                >
+                                    {capture && capture.active ? 'Stop' : 'Record'}
+                                </button>
+                                <button onClick={downloadCapture} disabled={!connected || !capture || capture.size === 0}>
+                                    Download
+                                </button>
+                            </div>
+                        </div>
                     </div>
                 </div>
 
                 <div className="setting-group">
                     <h2>Connectivity</h2>
 
-                    <div className="setting-item">
-                        <div className="setting-title">BLE report rate</div>
-                        <div className="setting-description">
-                            For high speed (polling rate) devices, it is possible to choose higher BLE report rate.
-                            Please note that it is not supported by the BLE standard and may or may not work in your case.
-                            This option will not affect normal speed (125 rps) devices in any way.
-                            Values are calculated for a 1000 Hz USB device.
-                            Some modes might work better than others with your device(s).
-                        </div>
-                        <select
-                            value={settings.power.highSpeedSubmode}
-                            onChange={(e) => updateSetting('power', 'highSpeedSubmode', e.target.value)}
-                        >
-                            <option value="slow">±125 rps</option>
-                            <option value="fast">±175 rps</option>
-                            <option value="veryfast">±250 rps</option>
-                        </select>
-                    </div>
-
                     <div className="setting-item">
                         <div className="setting-title">BLE TX power</div>
                         <div className="setting-description">
@@ -390,17 +690,17 @@ const App = () => {
                     </div>
 
                     <div className="setting-item">
-                        <div className="setting-title">Reconnect delay</div>
+                        <div className="setting-title">Web idle timeout</div>
                         <div className="setting-description">
-                            Delay in seconds before attempting to reconnect after Bluetooth disconnect.
-                            Doesn't affect waking up from sleep.
+                            Minutes without any action on this page before Wi-Fi and the web interface shut down, so they stop sharing the radio with Bluetooth.
+                            A running telemetry stream counts as activity. 0 keeps them running until the next reboot.
                         </div>
                         <input
                             type="number"
-                            min="1"
-                            max="60"
-                            value={settings.connectivity.bleReconnectDelay}
-                            onChange={(e) => updateSetting('connectivity', 'bleReconnectDelay', parseInt(e.target.value))}
+                            min="0"
+                            max="240"
+                            value={settings.connectivity.webIdleTimeout}
+                            onChange={(e) => updateSetting('connectivity', 'webIdleTimeout', parseInt(e.target.value))}
                         />
                     </div>
                 </div>
@@ -489,6 +789,35 @@ const App = () => {
                             />
                         </div>
                     </div>
+
+                    <div className="setting-item">
+                        <div className="setting-title">CPU boost threshold</div>
+                        <div className="setting-description">
+                            USB reports per second above which the CPU runs at the boost frequency. 
+                            High polling rate mice need the headroom, at lower rates the CPU stays at 80 MHz or below to save battery. 0 disables boost.
+                        </div>
+                        <input
+                            type="number"
+                            min="0"
+                            max="8000"
+                            value={settings.power.boostRps}
+                            onChange={(e) => updateSetting('power', 'boostRps', parseInt(e.target.value))}
+                        />
+                    </div>
+
+                    <div className={`setting-item ${settings.power.boostRps > 0 ? 'animate-visible' : 'animate-hidden'}`}>
+                        <div className="setting-title">CPU boost frequency</div>
+                        <div className="setting-description">
+                            Clock used while the report rate is above the threshold.
+                        </div>
+                        <select
+                            value={settings.power.boostFreq}
+                            onChange={(e) => updateSetting('power', 'boostFreq', parseInt(e.target.value))}
+                        >
+                            <option value="160">160 MHz</option>
+                            <option value="240">240 MHz</option>
+                        </select>
+                    </div>
                 </div>
 
                 <div className="setting-group">
@@ -527,6 +856,59 @@ const App = () => {
                     </div>
                 </div>
 
+                <div className="setting-group">
+                    <h2>Remapping</h2>
+
+                    <div className="setting-item">
+                        <div className="setting-title">Key remaps</div>
+                        <div className="setting-description">
+                            Space separated <code>[layer:]from=to</code> entries with hex key usages, <code>b1</code>..<code>b8</code> for
+                            mouse buttons, <code>l1</code>..<code>l3</code> for layers held by a key and <code>m1</code>..<code>m8</code> for macros.
+                            For example, <code>39=e0 e6=l1 1:0b=50</code> turns Caps Lock into Control and H into Left Arrow while Right Alt is held.
+                        </div>
+                        <input
+                            type="text"
+                            maxLength="159"
+                            spellCheck="false"
+                            value={settings.remap.keys}
+                            onChange={(e) => updateSetting('remap', 'keys', e.target.value)}
+                        />
+                    </div>
+
+                    <div className="setting-item">
+                        <div className="setting-title">Macros</div>
+                        <div className="setting-description">
+                            Macros separated by <code>;</code>, each a list of keys tapped in order, <code>+</code> presses keys together.
+                        </div>
+                        <input
+                            type="text"
+                            maxLength="159"
+                            spellCheck="false"
+                            value={settings.remap.macros}
+                            onChange={(e) => updateSetting('remap', 'macros', e.target.value)}
+                        />
+                    </div>
+                </div>
+
+                <div className="setting-group">
+                    <h2>Dial</h2>
+
+                    <div className="setting-item">
+                        <div className="setting-title">Dial function</div>
+                        <div className="setting-description">
+                            What turning the dial does. Volume and scroll go to the active host like any other input.
+                        </div>
+                        <select
+                            value={settings.dial.mode}
+                            onChange={(e) => updateSetting('dial', 'mode', e.target.value)}
+                        >
+                            <option value="hosts">Switch hosts</option>
+                            <option value="volume">Volume</option>
+                            <option value="scroll">Scroll</option>
+                        </select>
+                    </div>
+                </div>
+
                 <div className="setting-group">
                     <h2>Firmware</h2>
 
@@ -555,7 +937,7 @@ const App = () => {
                                     <input
                                         type="file"
                                         ref={fileInputRef}
-                                        accept=".bin"
+                                        accept=".bin,.awot"
                                         style={{ display: 'none' }}
                                     />
                                     <button onClick={() => fileInputRef.current?.click()}>
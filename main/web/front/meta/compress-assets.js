@@ -0,0 +1,20 @@
+const fs = require('fs');
+const path = require('path');
+const zlib = require('zlib');
+
+// Browsers only offer brotli over HTTPS, the device serves plain HTTP so gzip it is
+const assets = [
+  'index.min.html',
+  'settings.min.html',
+  'settings.js',
+  'react.production.min.js',
+  'react-dom.production.min.js',
+];
+
+for (const asset of assets) {
+  const file = path.join('lib', asset);
+  const content = fs.readFileSync(file);
+  const compressed = zlib.gzipSync(content, { level: zlib.constants.Z_BEST_COMPRESSION });
+  fs.writeFileSync(file + '.gz', compressed);
+  console.log(`${asset}: ${content.length} -> ${compressed.length} bytes`);
+}
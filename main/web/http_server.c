@@ -4,19 +4,35 @@
 #include "ota_server.h"
 #include "wifi_manager.h"
 #include <esp_log.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/param.h>
+#include <esp_rom_crc.h>
 #include <esp_wifi.h>
 #include <esp_event.h>
 #include <esp_netif.h>
+#include <esp_coexist.h>
+#include <esp_timer.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "nvs_flash.h"
 #include "rgb_leds.h"
+#include "report_capture.h"
+#include "storage.h"
+#include "const.h"
 
 static const char *HTTP_TAG = "HTTP";
 static httpd_handle_t server = NULL;
 static TaskHandle_t dns_task_handle = NULL;
 static TaskHandle_t web_services_task_handle = NULL;
+
+// The task reads the timeout every second, a new one counts from now
+static void on_idle_timeout_changed(const uint32_t changed, const device_settings_t *settings, void *arg) {
+    web_note_activity();
+}
+
 EventGroupHandle_t wifi_event_group;
+static volatile int64_t s_last_activity_us = 0;
 
 #define WIFI_SSID      "Wirelessifier"
 #define WIFI_CHANNEL   1
@@ -25,69 +41,131 @@ EventGroupHandle_t wifi_event_group;
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT      BIT1
 
-static esp_err_t root_get_handler(httpd_req_t *req)
+#define ASSET(name) \
+    extern const uint8_t name##_start[] asm("_binary_" #name "_start"); \
+    extern const uint8_t name##_end[] asm("_binary_" #name "_end")
+
+ASSET(index_min_html_gz);
+ASSET(settings_min_html_gz);
+ASSET(settings_js_gz);
+ASSET(react_production_min_js_gz);
+ASSET(react_dom_production_min_js_gz);
+ASSET(opensans_regular_woff2);
+
+// Pages and settings.js change with the firmware under the same URL, so they are revalidated.
+// The vendored libraries and the font never do.
+#define CACHE_REVALIDATE "no-cache"
+#define CACHE_IMMUTABLE  "public, max-age=31536000, immutable"
+
+typedef struct {
+    const char *uri;
+    const char *type;
+    const uint8_t *start;
+    const uint8_t *end;
+    bool gzip;
+    const char *cache_control;
+    char etag[11];      // "crc32" in quotes, computed on first use
+} static_asset_t;
+
+static static_asset_t s_assets[] = {
+    {"/", "text/html", index_min_html_gz_start, index_min_html_gz_end, true, CACHE_REVALIDATE},
+    {"/settings", "text/html", settings_min_html_gz_start, settings_min_html_gz_end, true, CACHE_REVALIDATE},
+    {"/lib/settings.js", "application/javascript", settings_js_gz_start, settings_js_gz_end, true,
+     CACHE_REVALIDATE},
+    {"/lib/react.production.min.js", "application/javascript", react_production_min_js_gz_start,
+     react_production_min_js_gz_end, true, CACHE_IMMUTABLE},
+    {"/lib/react-dom.production.min.js", "application/javascript", react_dom_production_min_js_gz_start,
+     react_dom_production_min_js_gz_end, true, CACHE_IMMUTABLE},
+    {"/lib/opensans_regular.woff2", "font/woff2", opensans_regular_woff2_start, opensans_regular_woff2_end, false,
+     CACHE_IMMUTABLE},
+};
+
+static static_asset_t *find_asset(const char *uri)
 {
-    extern const char web_front_index_html_start[] asm("_binary_index_min_html_start");
-    extern const char web_front_index_html_end[] asm("_binary_index_min_html_end");
-    const size_t index_html_size = (web_front_index_html_end - web_front_index_html_start);
-    
-    httpd_resp_set_type(req, "text/html");
-    httpd_resp_send(req, web_front_index_html_start, index_html_size);
-    return ESP_OK;
+    const size_t len = strcspn(uri, "?");
+    for (int i = 0; i < sizeof(s_assets) / sizeof(s_assets[0]); i++) {
+        if (strlen(s_assets[i].uri) == len && strncmp(s_assets[i].uri, uri, len) == 0) {
+            return &s_assets[i];
+        }
+    }
+    return NULL;
 }
 
-static esp_err_t settings_get_handler(httpd_req_t *req)
+static bool etag_matches(httpd_req_t *req, const static_asset_t *asset)
 {
-    extern const char web_front_settings_html_start[] asm("_binary_settings_min_html_start");
-    extern const char web_front_settings_html_end[] asm("_binary_settings_min_html_end");
-    const size_t settings_html_size = (web_front_settings_html_end - web_front_settings_html_start);
-    
-    httpd_resp_set_type(req, "text/html");
-    httpd_resp_send(req, web_front_settings_html_start, settings_html_size);
-    return ESP_OK;
+    char value[64];
+    const size_t len = httpd_req_get_hdr_value_len(req, "If-None-Match");
+    if (len == 0 || len >= sizeof(value) ||
+        httpd_req_get_hdr_value_str(req, "If-None-Match", value, sizeof(value)) != ESP_OK) {
+        return false;
+    }
+    return strstr(value, asset->etag) != NULL;
 }
 
-static esp_err_t lib_get_handler(httpd_req_t *req)
+// Serves the table entry for the request URI as is, the content is compressed at build time
+static esp_err_t asset_get_handler(httpd_req_t *req)
 {
-    const char *req_uri = req->uri;
-    
-    if (strstr(req_uri, "react.production.min.js")) {
-        extern const char web_front_lib_react_production_min_js_start[] asm("_binary_react_production_min_js_start");
-        extern const char web_front_lib_react_production_min_js_end[] asm("_binary_react_production_min_js_end");
-        const size_t js_size = (web_front_lib_react_production_min_js_end - web_front_lib_react_production_min_js_start) - 1;
-        
-        httpd_resp_set_type(req, "application/javascript");
-        httpd_resp_send(req, web_front_lib_react_production_min_js_start, js_size);
-    } 
-    else if (strstr(req_uri, "react-dom.production.min.js")) {
-        extern const char web_front_lib_react_dom_production_min_js_start[] asm("_binary_react_dom_production_min_js_start");
-        extern const char web_front_lib_react_dom_production_min_js_end[] asm("_binary_react_dom_production_min_js_end");
-        const size_t js_size = (web_front_lib_react_dom_production_min_js_end - web_front_lib_react_dom_production_min_js_start) - 1;
-        
-        httpd_resp_set_type(req, "application/javascript");
-        httpd_resp_send(req, web_front_lib_react_dom_production_min_js_start, js_size);
+    web_note_activity();
+    static_asset_t *asset = find_asset(req->uri);
+    if (asset == NULL) {
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, NULL);
     }
-    else if (strstr(req_uri, "settings.js")) {
-        extern const char web_front_lib_settings_js_start[] asm("_binary_settings_js_start");
-        extern const char web_front_lib_settings_js_end[] asm("_binary_settings_js_end");
-        const size_t js_size = (web_front_lib_settings_js_end - web_front_lib_settings_js_start) - 1;
-        
-        httpd_resp_set_type(req, "application/javascript");
-        httpd_resp_send(req, web_front_lib_settings_js_start, js_size);
+
+    const size_t size = asset->end - asset->start;
+    if (asset->etag[0] == '\0') {
+        snprintf(asset->etag, sizeof(asset->etag), "\"%08" PRIx32 "\"", esp_rom_crc32_le(0, asset->start, size));
     }
-    else if (strstr(req_uri, "opensans_regular.woff2")) {
-        extern const char web_front_lib_opensans_regular_woff2_start[] asm("_binary_opensans_regular_woff2_start");
-        extern const char web_front_lib_opensans_regular_woff2_end[] asm("_binary_opensans_regular_woff2_end");
-        const size_t js_size = (web_front_lib_opensans_regular_woff2_end - web_front_lib_opensans_regular_woff2_start) - 1;
 
-        httpd_resp_set_type(req, "font/woff2");
-        httpd_resp_send(req, web_front_lib_opensans_regular_woff2_start, js_size);
+    httpd_resp_set_hdr(req, "ETag", asset->etag);
+    httpd_resp_set_hdr(req, "Cache-Control", asset->cache_control);
+    if (etag_matches(req, asset)) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
     }
-    else {
-        return ESP_ERR_NOT_FOUND;
+
+    httpd_resp_set_type(req, asset->type);
+    if (asset->gzip) {
+        httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+        httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
     }
-    
-    return ESP_OK;
+    return httpd_resp_send(req, (const char *)asset->start, size);
+}
+
+#define CAPTURE_CHUNK_SIZE 1024
+
+// Stops a running capture so the file doesn't change while it downloads
+static esp_err_t capture_get_handler(httpd_req_t *req)
+{
+    static uint8_t chunk[CAPTURE_CHUNK_SIZE];
+    web_note_activity();
+    report_capture_stop();
+
+    const size_t size = report_capture_file_size();
+    if (size == 0) {
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Nothing captured");
+    }
+
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"capture.awcp\"");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    for (size_t offset = 0; offset < size;) {
+        const size_t len = report_capture_read(offset, chunk, MIN(sizeof(chunk), size - offset));
+        if (len == 0) {
+            break;
+        }
+        const esp_err_t err = httpd_resp_send_chunk(req, (const char *)chunk, len);
+        if (err != ESP_OK) {
+            ESP_LOGW(HTTP_TAG, "Capture download aborted: %s", esp_err_to_name(err));
+            return err;
+        }
+        offset += len;
+    }
+
+    const esp_err_t err = httpd_resp_send_chunk(req, NULL, 0);
+    if (err == ESP_OK) {
+        report_capture_release();
+    }
+    return err;
 }
 
 // Redirect handler for captive portal
@@ -102,21 +180,28 @@ static esp_err_t redirect_handler(httpd_req_t *req)
 static const httpd_uri_t root = {
     .uri = "/",
     .method = HTTP_GET,
-    .handler = root_get_handler,
+    .handler = asset_get_handler,
     .user_ctx = NULL
 };
 
 static const httpd_uri_t settings = {
     .uri = "/settings",
     .method = HTTP_GET,
-    .handler = settings_get_handler,
+    .handler = asset_get_handler,
     .user_ctx = NULL
 };
 
 static const httpd_uri_t lib = {
     .uri = "/lib/*",
     .method = HTTP_GET,
-    .handler = lib_get_handler,
+    .handler = asset_get_handler,
+    .user_ctx = NULL
+};
+
+static const httpd_uri_t capture = {
+    .uri = "/capture.awcp",
+    .method = HTTP_GET,
+    .handler = capture_get_handler,
     .user_ctx = NULL
 };
 
@@ -209,6 +294,13 @@ void init_wifi_apsta(void)
 
     led_update_wifi_status(is_apsta_mode, false);
     ESP_ERROR_CHECK(esp_wifi_start());
+
+    // Input goes over BLE, the web page can wait. Modem sleep keeps the STA off the air between beacons,
+    // the softAP can't sleep and only the coexistence preference helps there.
+#if CONFIG_ESP_COEX_SW_COEXIST_ENABLE
+    esp_coex_preference_set(ESP_COEX_PREFER_BT);
+#endif
+    esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
 }
 
 httpd_handle_t start_webserver(void)
@@ -228,6 +320,7 @@ httpd_handle_t start_webserver(void)
     config.lru_purge_enable = true;
     config.recv_wait_timeout = 3;
     config.send_wait_timeout = 3;
+    config.core_id = TASK_WEB_CORE;
 
     ESP_LOGI(HTTP_TAG, "Starting server on port: '%d'", config.server_port);
     
@@ -238,6 +331,7 @@ httpd_handle_t start_webserver(void)
         httpd_register_uri_handler(server, &root);
         httpd_register_uri_handler(server, &settings);
         httpd_register_uri_handler(server, &lib);
+        httpd_register_uri_handler(server, &capture);
         httpd_register_uri_handler(server, &redirect);
         start_ws_ping_task();
 
@@ -260,6 +354,7 @@ void stop_webserver(void)
     }
     
     if (web_services_task_handle) {
+        storage_unsubscribe(on_idle_timeout_changed, NULL);
         vTaskDelete(web_services_task_handle);
         web_services_task_handle = NULL;
     }
@@ -303,17 +398,41 @@ static void web_services_task(void *pvParameters)
     }
 
     const httpd_handle_t srv = start_webserver();
+    web_note_activity();
+    storage_subscribe(SETTING_BIT(SETTING_WEB_IDLE_TIMEOUT), on_idle_timeout_changed, NULL);
     while (1) {
         vTaskDelay(pdMS_TO_TICKS(1000));
 
         if (!is_wifi_enabled()) {
+            storage_unsubscribe(on_idle_timeout_changed, NULL);
             httpd_stop(srv);
             vTaskDelete(NULL);
             break;
         }
+
+        // Watching the telemetry stream is using the page, even without sending anything
+        if (ws_num_telemetry_subscribers() > 0) {
+            web_note_activity();
+        }
+
+        const int idle_timeout = storage_settings()->connectivity.web_idle_timeout;
+        const int64_t idle_us = esp_timer_get_time() - s_last_activity_us;
+        if (idle_timeout > 0 && idle_us >= idle_timeout * 60 * 1000000LL) {
+            ESP_LOGI(HTTP_TAG, "No requests for %d minutes, shutting the web stack down", idle_timeout);
+            // This task ends itself, stop_webserver() must not delete it halfway through
+            web_services_task_handle = NULL;
+            storage_unsubscribe(on_idle_timeout_changed, NULL);
+            disable_wifi_and_web_stack();
+            vTaskDelete(NULL);
+        }
     }
 }
 
+void web_note_activity(void)
+{
+    s_last_activity_us = esp_timer_get_time();
+}
+
 void init_web_services(void)
 {
     if (!is_wifi_enabled())
@@ -321,5 +440,6 @@ void init_web_services(void)
 
     ESP_LOGI(HTTP_TAG, "Starting web services task");
     wifi_event_group = xEventGroupCreate();
-    xTaskCreatePinnedToCore(web_services_task, "web_services", 3000, NULL, 8, &web_services_task_handle, 1);
+    xTaskCreatePinnedToCore(web_services_task, "web_services", 3000, NULL, TASK_WEB_PRIO, &web_services_task_handle,
+                            TASK_WEB_CORE);
 }
@@ -42,3 +42,8 @@ void stop_webserver(void);
  * The task remains running to keep the web server alive.
  */
 void init_web_services(void);
+
+/**
+ * @brief Note a request from the page, connectivity.webIdleTimeout minutes without one shut the web stack down
+ */
+void web_note_activity(void);
@@ -0,0 +1,287 @@
+#include "ota_package.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "mbedtls/sha256.h"
+#include "miniz.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define WINDOW_SIZE   (1 << OTA_PACKAGE_WINDOW_BITS)
+#define CONTROL_SIZE  (3 * sizeof(int32_t))
+// Base image bytes are read from flash in pieces of this size
+#define BASE_READ_LEN 256
+
+static const char *TAG = "OTA_PKG";
+
+typedef enum {
+    PATCH_CONTROL,
+    PATCH_DIFF,
+    PATCH_EXTRA,
+} patch_state_t;
+
+struct ota_package {
+    ota_package_header_t header;
+    size_t header_fill;
+    ota_package_output_t out;
+    void *ctx;
+
+    tinfl_decompressor inflator;
+    uint8_t window[WINDOW_SIZE];
+    size_t window_pos;
+    bool inflate_done;
+
+    const esp_partition_t *base;
+    uint32_t base_pos;
+    patch_state_t patch_state;
+    uint8_t control[CONTROL_SIZE];
+    size_t control_fill;
+    uint32_t diff_left;
+    uint32_t extra_left;
+    int32_t seek;
+    uint8_t base_buf[BASE_READ_LEN];
+
+    mbedtls_sha256_context sha;
+    uint32_t written;
+};
+
+static int32_t read_i32_le(const uint8_t *p) {
+    return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static esp_err_t emit(ota_package_t *pkg, const uint8_t *data, const size_t len) {
+    if (pkg->written + len > pkg->header.image_size) {
+        ESP_LOGE(TAG, "Image larger than announced");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    mbedtls_sha256_update(&pkg->sha, data, len);
+    pkg->written += len;
+    return pkg->out(data, len, pkg->ctx);
+}
+
+// diff_len bytes of the new image are base bytes plus the payload, the rest comes as is
+static esp_err_t patch(ota_package_t *pkg, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        switch (pkg->patch_state) {
+            case PATCH_CONTROL: {
+                const size_t n = MIN(len, CONTROL_SIZE - pkg->control_fill);
+                memcpy(&pkg->control[pkg->control_fill], data, n);
+                pkg->control_fill += n;
+                data += n;
+                len -= n;
+                if (pkg->control_fill < CONTROL_SIZE) {
+                    break;
+                }
+
+                const int32_t diff_len = read_i32_le(&pkg->control[0]);
+                const int32_t extra_len = read_i32_le(&pkg->control[4]);
+                if (diff_len < 0 || extra_len < 0) {
+                    ESP_LOGE(TAG, "Corrupt delta record");
+                    return ESP_ERR_INVALID_ARG;
+                }
+                pkg->diff_left = diff_len;
+                pkg->extra_left = extra_len;
+                pkg->seek = read_i32_le(&pkg->control[8]);
+                pkg->control_fill = 0;
+                pkg->patch_state = PATCH_DIFF;
+                break;
+            }
+            case PATCH_DIFF: {
+                const size_t n = MIN(MIN(len, pkg->diff_left), BASE_READ_LEN);
+                if (n > 0) {
+                    if (pkg->base_pos + n > pkg->base->size) {
+                        ESP_LOGE(TAG, "Delta reads past the base image");
+                        return ESP_ERR_INVALID_ARG;
+                    }
+                    const esp_err_t err = esp_partition_read(pkg->base, pkg->base_pos, pkg->base_buf, n);
+                    if (err != ESP_OK) {
+                        return err;
+                    }
+                    for (size_t i = 0; i < n; i++) {
+                        pkg->base_buf[i] += data[i];
+                    }
+                    pkg->base_pos += n;
+                    pkg->diff_left -= n;
+                    data += n;
+                    len -= n;
+
+                    const esp_err_t out_err = emit(pkg, pkg->base_buf, n);
+                    if (out_err != ESP_OK) {
+                        return out_err;
+                    }
+                }
+                if (pkg->diff_left == 0) {
+                    pkg->patch_state = PATCH_EXTRA;
+                }
+                break;
+            }
+            case PATCH_EXTRA: {
+                const size_t n = MIN(len, pkg->extra_left);
+                if (n > 0) {
+                    const esp_err_t err = emit(pkg, data, n);
+                    if (err != ESP_OK) {
+                        return err;
+                    }
+                    pkg->extra_left -= n;
+                    data += n;
+                    len -= n;
+                }
+                if (pkg->extra_left == 0) {
+                    pkg->base_pos += pkg->seek;
+                    pkg->patch_state = PATCH_CONTROL;
+                }
+                break;
+            }
+        }
+    }
+
+    // A record with nothing left to copy finishes without waiting for more payload
+    if (pkg->patch_state == PATCH_DIFF && pkg->diff_left == 0) {
+        pkg->patch_state = PATCH_EXTRA;
+    }
+    if (pkg->patch_state == PATCH_EXTRA && pkg->extra_left == 0) {
+        pkg->base_pos += pkg->seek;
+        pkg->patch_state = PATCH_CONTROL;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t payload(ota_package_t *pkg, const uint8_t *data, const size_t len) {
+    return pkg->header.type == OTA_PACKAGE_DELTA ? patch(pkg, data, len) : emit(pkg, data, len);
+}
+
+// The window doubles as the output buffer, everything inflated is passed on before it wraps
+static esp_err_t inflate(ota_package_t *pkg, const uint8_t *data, size_t len, const bool more) {
+    const mz_uint32 flags = TINFL_FLAG_PARSE_ZLIB_HEADER | (more ? TINFL_FLAG_HAS_MORE_INPUT : 0);
+
+    while (!pkg->inflate_done) {
+        size_t in_len = len;
+        size_t out_len = WINDOW_SIZE - pkg->window_pos;
+        const tinfl_status status = tinfl_decompress(&pkg->inflator, data, &in_len, pkg->window,
+                                                     &pkg->window[pkg->window_pos], &out_len, flags);
+        data += in_len;
+        len -= in_len;
+
+        if (out_len > 0) {
+            const esp_err_t err = payload(pkg, &pkg->window[pkg->window_pos], out_len);
+            if (err != ESP_OK) {
+                return err;
+            }
+            pkg->window_pos = (pkg->window_pos + out_len) & (WINDOW_SIZE - 1);
+        }
+
+        if (status < TINFL_STATUS_DONE) {
+            ESP_LOGE(TAG, "Inflate failed: %d", status);
+            return ESP_ERR_INVALID_ARG;
+        }
+        if (status == TINFL_STATUS_DONE) {
+            pkg->inflate_done = true;
+        } else if (status == TINFL_STATUS_NEEDS_MORE_INPUT && len == 0) {
+            break;
+        }
+    }
+
+    return ESP_OK;
+}
+
+static esp_err_t check_header(ota_package_t *pkg) {
+    const ota_package_header_t *header = &pkg->header;
+    if (header->version != OTA_PACKAGE_VERSION ||
+        (header->type != OTA_PACKAGE_FULL && header->type != OTA_PACKAGE_DELTA)) {
+        ESP_LOGE(TAG, "Unsupported package version %d type %d", header->version, header->type);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    ESP_LOGI(TAG, "%s%s package, %" PRIu32 " byte image", header->type == OTA_PACKAGE_DELTA ? "Delta" : "Full",
+             header->flags & OTA_PACKAGE_FLAG_DEFLATE ? " compressed" : "", header->image_size);
+
+    if (header->type == OTA_PACKAGE_DELTA) {
+        pkg->base = esp_ota_get_running_partition();
+        uint8_t base_sha[32];
+        const esp_err_t err = esp_partition_get_sha256(pkg->base, base_sha);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (memcmp(base_sha, header->base_sha256, sizeof(base_sha)) != 0) {
+            ESP_LOGW(TAG, "Delta was made for another firmware, the full image is needed");
+            return ESP_ERR_INVALID_VERSION;
+        }
+    }
+
+    return ESP_OK;
+}
+
+bool ota_package_detect(const uint8_t *data, const size_t len) {
+    return len >= 4 && memcmp(data, OTA_PACKAGE_MAGIC, 4) == 0;
+}
+
+ota_package_t *ota_package_begin(const ota_package_output_t out, void *ctx) {
+    ota_package_t *pkg = calloc(1, sizeof(ota_package_t));
+    if (pkg == NULL) {
+        ESP_LOGE(TAG, "No memory for the decoder (%d bytes)", (int)sizeof(ota_package_t));
+        return NULL;
+    }
+
+    pkg->out = out;
+    pkg->ctx = ctx;
+    tinfl_init(&pkg->inflator);
+    mbedtls_sha256_init(&pkg->sha);
+    mbedtls_sha256_starts(&pkg->sha, 0);
+    return pkg;
+}
+
+esp_err_t ota_package_feed(ota_package_t *pkg, const uint8_t *data, size_t len, const bool more) {
+    if (pkg->header_fill < sizeof(ota_package_header_t)) {
+        const size_t n = MIN(len, sizeof(ota_package_header_t) - pkg->header_fill);
+        memcpy((uint8_t *)&pkg->header + pkg->header_fill, data, n);
+        pkg->header_fill += n;
+        data += n;
+        len -= n;
+
+        if (pkg->header_fill < sizeof(ota_package_header_t)) {
+            return ESP_OK;
+        }
+        const esp_err_t err = check_header(pkg);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    if (len == 0 && more) {
+        return ESP_OK;
+    }
+    return pkg->header.flags & OTA_PACKAGE_FLAG_DEFLATE ? inflate(pkg, data, len, more) : payload(pkg, data, len);
+}
+
+esp_err_t ota_package_end(ota_package_t *pkg) {
+    esp_err_t err = ESP_OK;
+    if (pkg->header_fill < sizeof(ota_package_header_t) ||
+        ((pkg->header.flags & OTA_PACKAGE_FLAG_DEFLATE) && !pkg->inflate_done) ||
+        (pkg->header.type == OTA_PACKAGE_DELTA && (pkg->patch_state != PATCH_CONTROL || pkg->control_fill > 0)) ||
+        pkg->written != pkg->header.image_size) {
+        ESP_LOGE(TAG, "Package truncated, %" PRIu32 " of %" PRIu32 " bytes", pkg->written, pkg->header.image_size);
+        err = ESP_ERR_INVALID_SIZE;
+    }
+
+    uint8_t sha[32];
+    mbedtls_sha256_finish(&pkg->sha, sha);
+    if (err == ESP_OK && memcmp(sha, pkg->header.image_sha256, sizeof(sha)) != 0) {
+        ESP_LOGE(TAG, "Image SHA-256 mismatch");
+        err = ESP_ERR_INVALID_CRC;
+    }
+
+    ota_package_abort(pkg);
+    return err;
+}
+
+void ota_package_abort(ota_package_t *pkg) {
+    if (pkg == NULL) {
+        return;
+    }
+    mbedtls_sha256_free(&pkg->sha);
+    free(pkg);
+}
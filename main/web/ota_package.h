@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Packaged OTA images, built by tools/ota_package.py. The header is followed by the payload:
+ *
+ *   OTA_PACKAGE_FULL   the application image
+ *   OTA_PACKAGE_DELTA  bsdiff-style records against the running image, each one
+ *                      int32 LE diff_len, extra_len, seek, then diff_len bytes added to the
+ *                      base image byte by byte, then extra_len literal bytes, then the base
+ *                      position moves by seek
+ *
+ * With OTA_PACKAGE_FLAG_DEFLATE the payload is a zlib stream with a window of at most
+ * 1 << OTA_PACKAGE_WINDOW_BITS bytes, so the inflater never needs more than that.
+ */
+#define OTA_PACKAGE_MAGIC        "AWOT"
+#define OTA_PACKAGE_VERSION      1
+#define OTA_PACKAGE_WINDOW_BITS  12
+#define OTA_PACKAGE_FLAG_DEFLATE 0x01
+
+typedef enum {
+    OTA_PACKAGE_FULL = 1,
+    OTA_PACKAGE_DELTA = 2,
+} ota_package_type_t;
+
+typedef struct __attribute__((packed)) {
+    char magic[4];
+    uint8_t version;
+    uint8_t type;               // ota_package_type_t
+    uint8_t flags;
+    uint8_t reserved;
+    uint32_t image_size;        // size of the resulting image
+    uint8_t base_sha256[32];    // delta only, esp_partition_get_sha256() of the running partition
+    uint8_t image_sha256[32];   // SHA-256 of the resulting image
+} ota_package_header_t;
+
+typedef struct ota_package ota_package_t;
+
+/**
+ * @brief Receives the decoded image, in order
+ *
+ * @param data Image bytes, only valid during the call
+ * @param len Length of data
+ * @param ctx Context passed to ota_package_begin()
+ * @return esp_err_t ESP_OK to continue, anything else stops decoding
+ */
+typedef esp_err_t (*ota_package_output_t)(const uint8_t *data, size_t len, void *ctx);
+
+/**
+ * @brief Check whether an upload starts with a package header rather than a plain image
+ *
+ * @param data First bytes of the upload
+ * @param len Length of data
+ * @return true for a package
+ */
+bool ota_package_detect(const uint8_t *data, size_t len);
+
+/**
+ * @brief Allocate a decoder, the whole state is one allocation of bounded size
+ *
+ * @param out Output callback
+ * @param ctx Passed to out
+ * @return Decoder, NULL when out of memory
+ */
+ota_package_t *ota_package_begin(ota_package_output_t out, void *ctx);
+
+/**
+ * @brief Decode the next part of the upload
+ *
+ * @param pkg Decoder
+ * @param data Upload bytes, starting with the header on the first call
+ * @param len Length of data
+ * @param more false on the last part
+ * @return esp_err_t ESP_OK on success, ESP_ERR_INVALID_VERSION if a delta doesn't apply to the running image
+ */
+esp_err_t ota_package_feed(ota_package_t *pkg, const uint8_t *data, size_t len, bool more);
+
+/**
+ * @brief Check the package was complete and the image matches its hash, frees the decoder
+ *
+ * @param pkg Decoder, invalid afterwards
+ * @return esp_err_t ESP_OK on success, ESP_ERR_INVALID_CRC on a hash mismatch
+ */
+esp_err_t ota_package_end(ota_package_t *pkg);
+
+/**
+ * @brief Free the decoder without checking anything
+ *
+ * @param pkg Decoder, may be NULL
+ */
+void ota_package_abort(ota_package_t *pkg);
+
+#ifdef __cplusplus
+}
+#endif
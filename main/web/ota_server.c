@@ -1,18 +1,47 @@
 #include "ota_server.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include "esp_ota_ops.h"
 #include "esp_partition.h"
 #include "esp_log.h"
 #include "esp_app_format.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "mbedtls/sha256.h"
+#include "const.h"
+#include "ota_package.h"
+#include "http_server.h"
 
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
-#define BUFFSIZE 256
-#define OTA_RECV_TIMEOUT 5000
+// One flash sector per buffer, the receiver fills one while the writer programs the other
+#define OTA_BUFFER_SIZE 4096
+#define OTA_BUFFER_COUNT 2
+#define OTA_PROGRESS_INTERVAL_MS 500
+#define OTA_WRITER_STACK_SIZE 3072
+#define OTA_SHA256_HEADER "X-OTA-SHA256"
 
 static const char *OTA_TAG = "OTA";
-static char ota_write_data[BUFFSIZE + 1] = {0};
+
+typedef struct {
+    uint8_t index;
+    uint16_t len;   // 0 stops the writer
+} ota_chunk_t;
+
+static uint8_t ota_buffers[OTA_BUFFER_COUNT][OTA_BUFFER_SIZE];
+static StaticQueue_t free_queue_struct;
+static StaticQueue_t filled_queue_struct;
+static uint8_t free_queue_storage[OTA_BUFFER_COUNT * sizeof(ota_chunk_t)];
+static uint8_t filled_queue_storage[(OTA_BUFFER_COUNT + 1) * sizeof(ota_chunk_t)];
+static QueueHandle_t free_queue = NULL;
+static QueueHandle_t filled_queue = NULL;
+static StaticSemaphore_t writer_done_struct;
+static SemaphoreHandle_t writer_done = NULL;
 
 // Forward declarations for external functions
 extern void ws_log(const char* text);
@@ -47,98 +76,341 @@ static esp_err_t validate_image_header(const esp_app_desc_t *new_app_info) {
 // Static variables for OTA state
 static esp_ota_handle_t update_handle = 0;
 static const esp_partition_t *update_partition = NULL;
-static bool image_header_was_checked = false;
+static volatile esp_err_t write_err = ESP_OK;
 static int last_progress = 0;
+static int64_t last_progress_us = 0;
+
+// Drains the filled queue into flash, buffers go back to the receiver even after an error
+static void ota_writer_task(void *arg) {
+    ota_chunk_t chunk;
+    while (xQueueReceive(filled_queue, &chunk, portMAX_DELAY) == pdTRUE && chunk.len > 0) {
+        if (write_err == ESP_OK) {
+            const esp_err_t err = esp_ota_write(update_handle, ota_buffers[chunk.index], chunk.len);
+            if (err != ESP_OK) {
+                ESP_LOGE(OTA_TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
+                write_err = err;
+            }
+        }
+        xQueueSend(free_queue, &chunk, portMAX_DELAY);
+    }
+
+    xSemaphoreGive(writer_done);
+    vTaskDelete(NULL);
+}
+
+static esp_err_t start_writer(void) {
+    if (free_queue == NULL) {
+        free_queue = xQueueCreateStatic(OTA_BUFFER_COUNT, sizeof(ota_chunk_t), free_queue_storage, &free_queue_struct);
+        filled_queue = xQueueCreateStatic(OTA_BUFFER_COUNT + 1, sizeof(ota_chunk_t), filled_queue_storage,
+                                          &filled_queue_struct);
+        writer_done = xSemaphoreCreateBinaryStatic(&writer_done_struct);
+    }
+
+    xQueueReset(free_queue);
+    xQueueReset(filled_queue);
+    for (uint8_t i = 0; i < OTA_BUFFER_COUNT; i++) {
+        const ota_chunk_t chunk = {.index = i, .len = 0};
+        xQueueSend(free_queue, &chunk, 0);
+    }
+    write_err = ESP_OK;
+
+    const BaseType_t ret = xTaskCreatePinnedToCore(ota_writer_task, "ota_writer", OTA_WRITER_STACK_SIZE, NULL,
+                                                   TASK_OTA_WRITER_PRIO, NULL, TASK_OTA_WRITER_CORE);
+    return ret == pdPASS ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+// Waits until every queued buffer is written, returns the first write error
+static esp_err_t stop_writer(void) {
+    const ota_chunk_t stop = {.index = 0, .len = 0};
+    xQueueSend(filled_queue, &stop, portMAX_DELAY);
+    xSemaphoreTake(writer_done, portMAX_DELAY);
+    return write_err;
+}
+
+static bool parse_sha256(httpd_req_t *req, uint8_t expected[32]) {
+    char hex[65];
+    if (httpd_req_get_hdr_value_len(req, OTA_SHA256_HEADER) != 64 ||
+        httpd_req_get_hdr_value_str(req, OTA_SHA256_HEADER, hex, sizeof(hex)) != ESP_OK) {
+        return false;
+    }
+
+    for (int i = 0; i < 32; i++) {
+        unsigned int byte;
+        if (sscanf(&hex[i * 2], "%2x", &byte) != 1) {
+            return false;
+        }
+        expected[i] = byte;
+    }
+    return true;
+}
+
+// Rate limited, at most one message per OTA_PROGRESS_INTERVAL_MS and only when the percentage moved
+static void update_progress(const int written, const int total_size) {
+    const int progress = (int)(((int64_t)written * 100) / total_size);
+    const int64_t now = esp_timer_get_time();
+    if (progress != last_progress && now - last_progress_us >= OTA_PROGRESS_INTERVAL_MS * 1000) {
+        last_progress = progress;
+        last_progress_us = now;
+        // 100 is only reported once the image is verified and set to boot
+        report_ota_progress(MIN(progress, 99));
+    }
+}
+
+// Where decoded image bytes collect before they go to the writer
+typedef struct {
+    ota_chunk_t chunk;
+    bool has_chunk;
+    size_t fill;
+    bool header_checked;
+} ota_sink_t;
+
+// Checks the image header on the first buffer and hands the buffer to the writer task
+static esp_err_t submit_chunk(ota_sink_t *sink, ota_chunk_t chunk, const size_t len) {
+    const uint8_t *buffer = ota_buffers[chunk.index];
+    if (!sink->header_checked) {
+        if (len <= sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
+            ESP_LOGE(OTA_TAG, "Image too small");
+            xQueueSend(free_queue, &chunk, 0);
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        esp_app_desc_t new_app_info;
+        memcpy(&new_app_info, &buffer[sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t)],
+               sizeof(esp_app_desc_t));
+        ESP_LOGI(OTA_TAG, "New firmware version: %s", new_app_info.version);
+
+        esp_err_t err = validate_image_header(&new_app_info);
+        if (err == ESP_OK) {
+            err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle);
+        }
+        if (err != ESP_OK) {
+            xQueueSend(free_queue, &chunk, 0);
+            return err;
+        }
+        sink->header_checked = true;
+    }
+
+    chunk.len = len;
+    xQueueSend(filled_queue, &chunk, portMAX_DELAY);
+    return write_err;
+}
+
+// Output of the package decoder, copied into writer buffers and submitted once full
+static esp_err_t sink_write(const uint8_t *data, size_t len, void *ctx) {
+    ota_sink_t *sink = ctx;
+    while (len > 0) {
+        if (!sink->has_chunk) {
+            xQueueReceive(free_queue, &sink->chunk, portMAX_DELAY);
+            sink->has_chunk = true;
+            sink->fill = 0;
+        }
+
+        const size_t n = MIN(len, OTA_BUFFER_SIZE - sink->fill);
+        memcpy(&ota_buffers[sink->chunk.index][sink->fill], data, n);
+        sink->fill += n;
+        data += n;
+        len -= n;
+
+        if (sink->fill == OTA_BUFFER_SIZE) {
+            sink->has_chunk = false;
+            const esp_err_t err = submit_chunk(sink, sink->chunk, sink->fill);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t sink_flush(ota_sink_t *sink) {
+    if (!sink->has_chunk) {
+        return ESP_OK;
+    }
+    sink->has_chunk = false;
+    if (sink->fill == 0) {
+        xQueueSend(free_queue, &sink->chunk, 0);
+        return ESP_OK;
+    }
+    return submit_chunk(sink, sink->chunk, sink->fill);
+}
+
+static int recv_full(httpd_req_t *req, uint8_t *buffer, const int want) {
+    int filled = 0;
+    while (filled < want) {
+        const int received = httpd_req_recv(req, (char *)buffer + filled, want - filled);
+        if (received == HTTPD_SOCK_ERR_TIMEOUT) {
+            continue;
+        }
+        if (received <= 0) {
+            ESP_LOGE(OTA_TAG, "Failed to receive file");
+            return -1;
+        }
+        filled += received;
+    }
+    return filled;
+}
+
+// Packages are received into a separate input buffer, the decoder fills the writer buffers
+static esp_err_t receive_package(httpd_req_t *req, ota_sink_t *sink, const ota_chunk_t first, const int first_len,
+                                 int remaining, mbedtls_sha256_context *sha) {
+    const int total_size = req->content_len;
+    uint8_t *input = malloc(OTA_BUFFER_SIZE);
+    ota_package_t *pkg = ota_package_begin(sink_write, sink);
+    if (input == NULL || pkg == NULL) {
+        free(input);
+        ota_package_abort(pkg);
+        xQueueSend(free_queue, &first, 0);
+        return ESP_ERR_NO_MEM;
+    }
+
+    memcpy(input, ota_buffers[first.index], first_len);
+    xQueueSend(free_queue, &first, 0);
+
+    int len = first_len;
+    esp_err_t err = ESP_OK;
+    while (err == ESP_OK) {
+        err = ota_package_feed(pkg, input, len, remaining > 0);
+        update_progress(total_size - remaining, total_size);
+        if (err != ESP_OK || remaining == 0) {
+            break;
+        }
+
+        len = recv_full(req, input, MIN(remaining, OTA_BUFFER_SIZE));
+        if (len < 0) {
+            err = ESP_FAIL;
+            break;
+        }
+        if (sha != NULL) {
+            mbedtls_sha256_update(sha, input, len);
+        }
+        remaining -= len;
+    }
+
+    if (err == ESP_OK) {
+        err = sink_flush(sink);
+    } else if (sink->has_chunk) {
+        sink->has_chunk = false;
+        xQueueSend(free_queue, &sink->chunk, 0);
+    }
+
+    if (err == ESP_OK) {
+        err = ota_package_end(pkg);
+    } else {
+        ota_package_abort(pkg);
+    }
+    free(input);
+    return err;
+}
+
+// Fills buffers from the socket and hands them to the writer task, plain images go to flash as received
+static esp_err_t receive_image(httpd_req_t *req, mbedtls_sha256_context *sha) {
+    const int total_size = req->content_len;
+    int remaining = total_size;
+    bool first = true;
+    ota_sink_t sink = {0};
+
+    while (remaining > 0 && write_err == ESP_OK) {
+        ota_chunk_t chunk;
+        xQueueReceive(free_queue, &chunk, portMAX_DELAY);
+
+        const int filled = recv_full(req, ota_buffers[chunk.index], MIN(remaining, OTA_BUFFER_SIZE));
+        if (filled < 0) {
+            xQueueSend(free_queue, &chunk, 0);
+            return ESP_FAIL;
+        }
+        if (sha != NULL) {
+            mbedtls_sha256_update(sha, ota_buffers[chunk.index], filled);
+        }
+        remaining -= filled;
+
+        if (first && ota_package_detect(ota_buffers[chunk.index], filled)) {
+            return receive_package(req, &sink, chunk, filled, remaining, sha);
+        }
+        first = false;
+
+        const esp_err_t err = submit_chunk(&sink, chunk, filled);
+        if (err != ESP_OK) {
+            return err;
+        }
+        update_progress(total_size - remaining, total_size);
+    }
+
+    return ESP_OK;
+}
 
 static esp_err_t handle_ota_upload(httpd_req_t *req) {
     esp_err_t err;
     update_handle = 0;
-    image_header_was_checked = false;
     last_progress = 0;
+    last_progress_us = 0;
 
     ESP_LOGI(OTA_TAG, "Starting OTA update...");
-    // ws_log("Starting OTA update...");
+
+    if (req->content_len == 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
 
     const esp_partition_t *running = esp_ota_get_running_partition();
     update_partition = esp_ota_get_next_update_partition(running);
     if (update_partition == NULL) {
-        // ws_log("Error: No OTA partition available");
         return ESP_FAIL;
     }
 
     ESP_LOGI(OTA_TAG, "Writing to partition subtype %d at offset 0x%" PRIx32,
              update_partition->subtype, update_partition->address);
 
-    const int total_size = req->content_len;
-    int remaining = total_size;
-    int received = 0;
+    uint8_t expected_sha[32];
+    const bool check_sha = parse_sha256(req, expected_sha);
+    mbedtls_sha256_context sha;
+    if (check_sha) {
+        mbedtls_sha256_init(&sha);
+        mbedtls_sha256_starts(&sha, 0);
+    }
 
-    while (remaining > 0) {
-        const int recv_len = MIN(remaining, BUFFSIZE);
-        if ((received = httpd_req_recv(req, ota_write_data, recv_len)) <= 0) {
-            if (received == HTTPD_SOCK_ERR_TIMEOUT) {
-                continue;
-            }
-            // ws_log("Error: Failed to receive file");
-            return ESP_FAIL;
-        }
+    err = start_writer();
+    if (err != ESP_OK) {
+        ESP_LOGE(OTA_TAG, "Failed to start OTA writer");
+        return err;
+    }
 
-        if (image_header_was_checked == false) {
-            esp_app_desc_t new_app_info;
-            if (received > sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
-                memcpy(&new_app_info, &ota_write_data[sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t)], sizeof(esp_app_desc_t));
-                ESP_LOGI(OTA_TAG, "New firmware version: %s", new_app_info.version);
-                // ws_log("Validating firmware image...");
-                
-                err = validate_image_header(&new_app_info);
-                if (err != ESP_OK) {
-                    // ws_log("Error: Invalid firmware image");
-                    return err;
-                }
-
-                image_header_was_checked = true;
-
-                err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle);
-                if (err != ESP_OK) {
-                    // ws_log("Error: Failed to begin OTA update");
-                    return err;
-                }
-            }
-        }
+    err = receive_image(req, check_sha ? &sha : NULL);
+    const esp_err_t writer_err = stop_writer();
+    if (err == ESP_OK) {
+        err = writer_err;
+    }
 
-        err = esp_ota_write(update_handle, ota_write_data, received);
-        if (err != ESP_OK) {
-            // ws_log("Error: Failed to write OTA data");
-            esp_ota_abort(update_handle);
-            return err;
+    if (check_sha) {
+        uint8_t actual_sha[32];
+        mbedtls_sha256_finish(&sha, actual_sha);
+        mbedtls_sha256_free(&sha);
+        if (err == ESP_OK && memcmp(actual_sha, expected_sha, sizeof(actual_sha)) != 0) {
+            ESP_LOGE(OTA_TAG, "SHA-256 mismatch");
+            err = ESP_ERR_INVALID_CRC;
         }
+    }
 
-        remaining -= received;
-        
-        // Report progress every 10%
-        const int progress = ((total_size - remaining) * 100) / total_size;
-        if (progress / 10 != last_progress / 10) {
-            last_progress = progress;
-            report_ota_progress(progress);
+    if (err != ESP_OK) {
+        if (update_handle != 0) {
+            esp_ota_abort(update_handle);
         }
+        return err;
     }
 
     err = esp_ota_end(update_handle);
     if (err != ESP_OK) {
-        // ws_log("Error: Failed to complete OTA update");
         if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
-            // ws_log("Image validation failed, image is corrupted");
+            ESP_LOGE(OTA_TAG, "Image validation failed, image is corrupted");
         }
         return err;
     }
 
     err = esp_ota_set_boot_partition(update_partition);
     if (err != ESP_OK) {
-        // ws_log("Error: Failed to set boot partition");
         return err;
     }
 
-    // ws_log("OTA update successful! Rebooting...");
+    report_ota_progress(100);
+    ESP_LOGI(OTA_TAG, "OTA update successful%s, rebooting", check_sha ? " and SHA-256 verified" : "");
     
     // Send success response before reboot
     httpd_resp_set_status(req, "200 OK");
@@ -152,8 +424,15 @@ static esp_err_t handle_ota_upload(httpd_req_t *req) {
 }
 
 static esp_err_t ota_upload_handler(httpd_req_t *req) {
+    web_note_activity();
     const esp_err_t err = handle_ota_upload(req);
-    if (err != ESP_OK) {
+    web_note_activity();
+    if (err == ESP_ERR_INVALID_VERSION) {
+        // The page falls back to the full image on this status
+        httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_set_type(req, "text/plain");
+        httpd_resp_sendstr(req, "Delta doesn't match the running firmware");
+    } else if (err != ESP_OK) {
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "OTA update failed");
     }
     return err;
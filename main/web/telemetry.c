@@ -0,0 +1,148 @@
+#include "telemetry.h"
+
+#include <stddef.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "const.h"
+#include "perf_counters.h"
+#include "task_monitor.h"
+#include "usb_hid_host.h"
+#include "ws_server.h"
+
+#define TELEMETRY_TASK_STACK_SIZE 2600
+
+// settings.jsx reads the frame at fixed offsets
+_Static_assert(offsetof(telemetry_frame_t, tasks) == 63, "telemetry header layout changed, bump TELEMETRY_VERSION");
+_Static_assert(sizeof(telemetry_task_t) == 10, "telemetry task layout changed, bump TELEMETRY_VERSION");
+
+static const char *TAG = "TELEMETRY";
+static TaskHandle_t s_task_handle = NULL;
+static telemetry_frame_t s_frame;
+
+typedef struct {
+    perf_snapshot_t perf;
+    uint32_t conn_interval_us;
+} counters_t;
+
+static uint16_t per_second(const uint32_t delta, const int64_t elapsed_us) {
+    const uint64_t rate = (uint64_t)delta * 1000000 / elapsed_us;
+    return rate > UINT16_MAX ? UINT16_MAX : rate;
+}
+
+static uint16_t saturate_u16(const uint32_t value) {
+    return value > UINT16_MAX ? UINT16_MAX : value;
+}
+
+static void sample_counters(counters_t *counters) {
+    perf_get_snapshot(&counters->perf);
+    counters->conn_interval_us = ble_hid_device_get_conn_interval_us();
+}
+
+static void sample_cpu(void) {
+    static task_cpu_usage_t usage[TELEMETRY_MAX_TASKS];
+    const int count = task_monitor_sample_cpu(usage, TELEMETRY_MAX_TASKS, s_frame.core_load);
+
+    for (int i = 0; i < count; i++) {
+        memcpy(s_frame.tasks[i].name, usage[i].name, TELEMETRY_TASK_NAME_LEN);
+        s_frame.tasks[i].core = usage[i].core;
+        s_frame.tasks[i].percent = usage[i].percent;
+    }
+    s_frame.num_tasks = count;
+}
+
+// Everything is written in place, the frame is the send buffer
+static size_t build_frame(const counters_t *prev, const counters_t *now, const bool cpu) {
+    const int64_t elapsed_us = now->perf.time_us - prev->perf.time_us;
+    const uint32_t *counts = now->perf.counts;
+    const uint32_t *prev_counts = prev->perf.counts;
+    if (elapsed_us <= 0) {
+        return 0;
+    }
+
+    hid_report_ring_stats_t ring;
+    usb_hid_host_get_ring_stats(&ring);
+
+    s_frame.seq++;
+    s_frame.uptime_ms = now->perf.time_us / 1000;
+    s_frame.usb_rps = per_second(counts[PERF_USB_REPORTS] - prev_counts[PERF_USB_REPORTS], elapsed_us);
+    s_frame.ble_rps = per_second(counts[PERF_BLE_REPORTS] - prev_counts[PERF_BLE_REPORTS], elapsed_us);
+    s_frame.ring_dropped = ring.dropped;
+    s_frame.ring_high_water = saturate_u16(ring.high_water);
+    s_frame.suppressed_ps = per_second(counts[PERF_BLE_SUPPRESSED] - prev_counts[PERF_BLE_SUPPRESSED], elapsed_us);
+    for (int i = 0; i < BLE_FLUSH_REASON_COUNT; i++) {
+        const int counter = PERF_FLUSH_DIRECT + i;
+        s_frame.flush_ps[i] = per_second(counts[counter] - prev_counts[counter], elapsed_us);
+    }
+    s_frame.conn_interval_us = now->conn_interval_us;
+    s_frame.free_heap = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    s_frame.min_free_heap = heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT);
+    s_frame.bridge_rps = per_second(counts[PERF_BRIDGE_REPORTS] - prev_counts[PERF_BRIDGE_REPORTS], elapsed_us);
+    s_frame.notify_errors = counts[PERF_BLE_NOTIFY_ERRORS];
+    s_frame.alloc_failures = counts[PERF_ALLOC_FAILURES];
+    s_frame.ble_reconnects = saturate_u16(counts[PERF_BLE_RECONNECTS]);
+    s_frame.usb_attaches = saturate_u16(counts[PERF_USB_ATTACHES]);
+    s_frame.max_latency_us = now->perf.max[PERF_MAX_E2E_LATENCY_US];
+    if (cpu) {
+        sample_cpu();
+    }
+
+    return offsetof(telemetry_frame_t, tasks) + s_frame.num_tasks * sizeof(telemetry_task_t);
+}
+
+static void telemetry_task(void *arg) {
+    counters_t prev, now;
+    TickType_t last_wake_time;
+    uint8_t ticks = 0;
+
+    while (1) {
+        if (ws_num_telemetry_subscribers() == 0) {
+            ESP_LOGI(TAG, "No subscribers, stopping");
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        ESP_LOGI(TAG, "Streaming at %d Hz", TELEMETRY_RATE_HZ);
+        sample_counters(&prev);
+        // Primes the run time counters, the first frames carry a window since the last session
+        sample_cpu();
+        last_wake_time = xTaskGetTickCount();
+        ticks = 0;
+
+        while (ws_num_telemetry_subscribers() > 0) {
+            vTaskDelayUntil(&last_wake_time, pdMS_TO_TICKS(1000 / TELEMETRY_RATE_HZ));
+
+            sample_counters(&now);
+            if (++ticks >= TELEMETRY_CPU_DIVIDER) {
+                ticks = 0;
+            }
+            const size_t len = build_frame(&prev, &now, ticks == 0);
+            prev = now;
+            if (len > 0) {
+                ws_wait_input_gap(1000 / TELEMETRY_RATE_HZ / 2);
+                ws_send_binary_to_subscribers((const uint8_t *)&s_frame, len);
+            }
+        }
+    }
+}
+
+esp_err_t telemetry_start(void) {
+    if (s_task_handle != NULL) {
+        xTaskNotifyGive(s_task_handle);
+        return ESP_OK;
+    }
+
+    s_frame.type = TELEMETRY_MSG_TYPE;
+    s_frame.version = TELEMETRY_VERSION;
+
+    const BaseType_t ret = xTaskCreatePinnedToCore(telemetry_task, "telemetry", TELEMETRY_TASK_STACK_SIZE, NULL,
+                                                   TASK_TELEMETRY_PRIO, &s_task_handle, TASK_TELEMETRY_CORE);
+    if (ret != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create telemetry task");
+        s_task_handle = NULL;
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "ble_hid_device.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Binary WebSocket message, see telemetry_frame_t, all fields little endian
+#define TELEMETRY_MSG_TYPE 0x02
+// Bump on any layout change, the page ignores versions it doesn't know
+#define TELEMETRY_VERSION  2
+
+#define TELEMETRY_RATE_HZ       20
+// Task run times are sampled every few frames, a 50 ms window is too short to mean much
+#define TELEMETRY_CPU_DIVIDER   5
+#define TELEMETRY_MAX_TASKS     8
+#define TELEMETRY_TASK_NAME_LEN 8
+
+typedef struct __attribute__((packed)) {
+    char name[TELEMETRY_TASK_NAME_LEN];     // not terminated when 8 characters long
+    uint8_t core;                           // 0xFF if unpinned
+    uint8_t percent;
+} telemetry_task_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint8_t version;
+    uint16_t seq;
+    uint32_t uptime_ms;
+    uint16_t usb_rps;                               // reports received per second
+    uint16_t ble_rps;                               // notifications sent per second
+    uint32_t ring_dropped;                          // total since boot
+    uint16_t ring_high_water;
+    uint16_t suppressed_ps;                         // repeated reports not sent, per second
+    uint16_t flush_ps[BLE_FLUSH_REASON_COUNT];      // accumulator flushes per second, by ble_flush_reason_t
+    uint32_t conn_interval_us;
+    uint32_t free_heap;
+    uint32_t min_free_heap;
+    uint16_t bridge_rps;                            // reports dequeued by the bridge per second
+    uint32_t notify_errors;                         // failed notifications, total since boot
+    uint32_t alloc_failures;                        // failed heap allocations, total since boot
+    uint16_t ble_reconnects;                        // advertising restarts to get a host back, since boot
+    uint16_t usb_attaches;                          // HID interfaces started, since boot
+    uint32_t max_latency_us;                        // worst USB -> BLE latency since boot
+    uint8_t core_load[2];
+    uint8_t num_tasks;
+    telemetry_task_t tasks[TELEMETRY_MAX_TASKS];    // busiest first, only num_tasks are sent
+} telemetry_frame_t;
+
+/**
+ * @brief Start the telemetry task, or wake it if it waits for a subscriber
+ *
+ * The task builds one frame per tick and sends it to the clients subscribed with the
+ * telemetry_subscribe command. It blocks while nobody is subscribed.
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t telemetry_start(void);
+
+#ifdef __cplusplus
+}
+#endif
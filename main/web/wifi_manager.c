@@ -15,7 +15,11 @@
 #include "ws_server.h"
 #include "http_server.h"
 #include "temp_sensor.h"
+#include "battery.h"
+#include "heap_report.h"
 #include "rgb_leds.h"
+#include "latency_trace.h"
+#include "const.h"
 
 static const char *WIFI_TAG = "WIFI_MGR";
 
@@ -23,6 +27,7 @@ static const char *WIFI_TAG = "WIFI_MGR";
 #define WS_PING_TASK_STACK_SIZE 2048
 #define WS_PING_TASK_PRIORITY 3
 #define WS_PING_INTERVAL_MS 250
+#define WS_LATENCY_EVERY_PINGS 4
 
 // NVS keys
 #define NVS_NAMESPACE "wifi_config"
@@ -507,13 +512,37 @@ static void ws_ping_task(void *pvParameters) {
         }
 
         const uint32_t free_heap = esp_get_free_heap_size();
+        heap_report_t heap;
+        heap_report_get(&heap);
         static float temp = 0;
         temp_sensor_get_temperature(&temp);
         
-        char ping_data[64];
-        snprintf(ping_data, sizeof(ping_data), "{\"heap\":%lu,\"temp\":%.1f}", free_heap, temp);
+        battery_status_t battery;
+        battery_get_status(&battery);
+
+        char ping_data[192];
+        int len = snprintf(ping_data, sizeof(ping_data), "{\"heap\":%lu,\"temp\":%.1f,\"minHeap\":%lu,\"largestBlock\":%lu",
+                           free_heap, temp, heap.min_free, heap.min_largest_block);
+        if (battery.valid) {
+            len += snprintf(&ping_data[len], sizeof(ping_data) - len,
+                            ",\"battery\":%d,\"batteryMv\":%d,\"charging\":%s",
+                            battery.soc, battery.battery_mv, battery.charging ? "true" : "false");
+        }
+        snprintf(&ping_data[len], sizeof(ping_data) - len, "}");
         
+        ws_wait_input_gap(WS_PING_INTERVAL_MS / 2);
         ws_broadcast_json("ping", ping_data);
+
+        static uint8_t pings = 0;
+        if (++pings >= WS_LATENCY_EVERY_PINGS) {
+            pings = 0;
+            static uint8_t latency_msg[LATENCY_MSG_SIZE];
+            const size_t len = latency_trace_serialize(latency_msg, sizeof(latency_msg));
+            if (len > 0) {
+                ws_send_binary_to_all_clients(latency_msg, len);
+            }
+        }
+
         vTaskDelay(pdMS_TO_TICKS(WS_PING_INTERVAL_MS));
     }
     
@@ -523,7 +552,7 @@ static void ws_ping_task(void *pvParameters) {
 void start_ws_ping_task(void) {
     if (ping_task_handle == NULL) {
         const BaseType_t result = xTaskCreatePinnedToCore(ws_ping_task,
-            "ws_ping_task", WS_PING_TASK_STACK_SIZE, NULL, WS_PING_TASK_PRIORITY, &ping_task_handle, 0);
+            "ws_ping_task", WS_PING_TASK_STACK_SIZE, NULL, WS_PING_TASK_PRIORITY, &ping_task_handle, TASK_WEB_CORE);
         
         if (result != pdPASS) {
             ESP_LOGE(WIFI_TAG, "Failed to create WebSocket ping task");
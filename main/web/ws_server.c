@@ -1,10 +1,18 @@
 #include "ws_server.h"
 #include <esp_log.h>
+#include <sys/param.h>
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include <cJSON.h>
 #include "storage.h"
 #include "ble_hid_device.h"
 #include "esp_gap_ble_api.h"
+#include "telemetry.h"
+#include "usb_hid_host.h"
+#include "report_capture.h"
+#include "hid_bridge.h"
+#include "http_server.h"
+#include "esp_timer.h"
 
 static const char *WS_TAG = "WS";
 static httpd_handle_t server = NULL;
@@ -14,14 +22,40 @@ static httpd_handle_t server = NULL;
 #define WS_SMALL_MESSAGE_LEN 128
 
 typedef struct {
-    int *fds;
-    int *failed;
+    int fds[MAX_CLIENTS];
+    int failed[MAX_CLIENTS];
     int failed_count;
+    int subscribed[MAX_CLIENTS];
+    int subscribed_count;
     size_t max_clients;
     httpd_ws_frame_t frame;
+    httpd_ws_frame_t telemetry_frame;
 } ws_client_ctx_t;
 
+// Reset on every server start, NULL until the first one
+static ws_client_ctx_t s_client_ctx;
 static ws_client_ctx_t *client_ctx = NULL;
+// Subscriptions change on the httpd task, the telemetry task reads them
+static portMUX_TYPE subscribed_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void set_subscribed(const int fd, const bool subscribe) {
+    if (!client_ctx) return;
+
+    taskENTER_CRITICAL(&subscribed_lock);
+    int index = -1;
+    for (int i = 0; i < client_ctx->subscribed_count; i++) {
+        if (client_ctx->subscribed[i] == fd) {
+            index = i;
+            break;
+        }
+    }
+    if (subscribe && index < 0 && client_ctx->subscribed_count < client_ctx->max_clients) {
+        client_ctx->subscribed[client_ctx->subscribed_count++] = fd;
+    } else if (!subscribe && index >= 0) {
+        client_ctx->subscribed[index] = client_ctx->subscribed[--client_ctx->subscribed_count];
+    }
+    taskEXIT_CRITICAL(&subscribed_lock);
+}
 
 static bool is_failed_client(const int fd) {
     if (!client_ctx) return false;
@@ -40,9 +74,10 @@ static void add_failed_client(const int fd) {
     if (client_ctx->failed_count < client_ctx->max_clients) {
         client_ctx->failed[client_ctx->failed_count++] = fd;
     }
+    set_subscribed(fd, false);
 }
 
-esp_err_t ws_send_frame_to_all_clients(const char *data, const size_t len) {
+static esp_err_t ws_send_to_all_clients(const uint8_t *data, const size_t len, const httpd_ws_type_t type) {
     if (!server || !client_ctx) {
         return ESP_FAIL;
     }
@@ -53,6 +88,7 @@ esp_err_t ws_send_frame_to_all_clients(const char *data, const size_t len) {
         return ret;
     }
 
+    client_ctx->frame.type = type;
     client_ctx->frame.payload = (uint8_t*)data;
     client_ctx->frame.len = len;
 
@@ -75,6 +111,54 @@ esp_err_t ws_send_frame_to_all_clients(const char *data, const size_t len) {
     return ESP_OK;
 }
 
+esp_err_t ws_send_frame_to_all_clients(const char *data, const size_t len) {
+    return ws_send_to_all_clients((const uint8_t*)data, len, HTTPD_WS_TYPE_TEXT);
+}
+
+esp_err_t ws_send_binary_to_all_clients(const uint8_t *data, const size_t len) {
+    return ws_send_to_all_clients(data, len, HTTPD_WS_TYPE_BINARY);
+}
+
+int ws_num_telemetry_subscribers(void) {
+    return client_ctx ? client_ctx->subscribed_count : 0;
+}
+
+esp_err_t ws_send_binary_to_subscribers(const uint8_t *data, const size_t len) {
+    if (!server || !client_ctx) {
+        return ESP_FAIL;
+    }
+
+    int fds[CONFIG_LWIP_MAX_LISTENING_TCP];
+    taskENTER_CRITICAL(&subscribed_lock);
+    const int count = client_ctx->subscribed_count;
+    memcpy(fds, client_ctx->subscribed, count * sizeof(int));
+    taskEXIT_CRITICAL(&subscribed_lock);
+
+    if (count == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // One frame for all subscribers, the payload is only referenced
+    client_ctx->telemetry_frame.payload = (uint8_t*)data;
+    client_ctx->telemetry_frame.len = len;
+
+    for (int i = 0; i < count; i++) {
+        if (httpd_ws_get_fd_info(server, fds[i]) != HTTPD_WS_CLIENT_WEBSOCKET) {
+            set_subscribed(fds[i], false);
+            continue;
+        }
+
+        const esp_err_t err = httpd_ws_send_frame_async(server, fds[i], &client_ctx->telemetry_frame);
+        if (err != ESP_OK) {
+            ESP_LOGW(WS_TAG, "Failed to send telemetry to client %d", fds[i]);
+            httpd_sess_trigger_close(server, fds[i]);
+            add_failed_client(fds[i]);
+        }
+    }
+
+    return ESP_OK;
+}
+
 void ws_broadcast_json(const char *type, const char *content) {
     if (!type || !content) return;
     
@@ -87,7 +171,18 @@ void ws_broadcast_json(const char *type, const char *content) {
 
 
 extern void process_wifi_ws_message(const char* message);
-static void process_settings_ws_message(const char* message);
+static void process_settings_ws_message(const char* message, int sockfd);
+
+static void broadcast_capture_status(void) {
+    report_capture_status_t status;
+    report_capture_get_status(&status);
+
+    char content[128];
+    snprintf(content, sizeof(content),
+             "{\"active\":%s,\"size\":%lu,\"used\":%lu,\"dropped\":%lu,\"descriptors\":%d}",
+             status.active ? "true" : "false", status.size, status.used, status.dropped, status.descriptors);
+    ws_broadcast_json("capture_status", content);
+}
 
 static void remove_failed_client(const int fd) {
     for (int i = 0; i < client_ctx->failed_count; i++) {
@@ -109,6 +204,8 @@ static esp_err_t ws_handler(httpd_req_t *req) {
         if (sockfd != -1) {
             ESP_LOGI(WS_TAG, "New WebSocket client connected: %d", sockfd);
             remove_failed_client(sockfd);
+            // A reused descriptor doesn't inherit the subscription of the previous client
+            set_subscribed(sockfd, false);
         }
         
         return ESP_OK;
@@ -153,9 +250,10 @@ static esp_err_t ws_handler(httpd_req_t *req) {
             return ret;
         }
         frame_buffer[ws_pkt.len] = '\0';
+        web_note_activity();
         ESP_LOGI(WS_TAG, "Got packet with message: %s", frame_buffer);
         
-        process_settings_ws_message((const char *)frame_buffer);
+        process_settings_ws_message((const char *)frame_buffer, httpd_req_to_sockfd(req));
         process_wifi_ws_message((const char *)frame_buffer);
 
         const esp_err_t send_ret = httpd_ws_send_frame(req, &ws_pkt);
@@ -188,29 +286,20 @@ static const httpd_uri_t ws = {
 
 void init_websocket(const httpd_handle_t server_handle) {
     server = server_handle;
-    client_ctx = calloc(1, sizeof(ws_client_ctx_t));
-    if (!client_ctx) {
-        ESP_LOGE(WS_TAG, "Failed to allocate client context");
-        return;
-    }
-    
-    client_ctx->max_clients = CONFIG_LWIP_MAX_LISTENING_TCP;
-    client_ctx->fds = calloc(client_ctx->max_clients, sizeof(int));
-    client_ctx->failed = calloc(client_ctx->max_clients, sizeof(int));
-    
-    if (!client_ctx->fds || !client_ctx->failed) {
-        ESP_LOGE(WS_TAG, "Failed to allocate client arrays");
-        free(client_ctx->fds);
-        free(client_ctx->failed);
-        free(client_ctx);
-        client_ctx = NULL;
-        return;
-    }
+    taskENTER_CRITICAL(&subscribed_lock);
+    memset(&s_client_ctx, 0, sizeof(s_client_ctx));
+    client_ctx = &s_client_ctx;
+    taskEXIT_CRITICAL(&subscribed_lock);
     
+    client_ctx->max_clients = MAX_CLIENTS;
     client_ctx->failed_count = 0;
     client_ctx->frame.final = true;
     client_ctx->frame.fragmented = false;
     client_ctx->frame.type = HTTPD_WS_TYPE_TEXT;
+    client_ctx->subscribed_count = 0;
+    client_ctx->telemetry_frame.final = true;
+    client_ctx->telemetry_frame.fragmented = false;
+    client_ctx->telemetry_frame.type = HTTPD_WS_TYPE_BINARY;
     
     ESP_LOGI(WS_TAG, "Registering WebSocket handler");
     httpd_register_uri_handler(server, &ws);
@@ -245,6 +334,18 @@ void ws_log(const char* text) {
     // free(buffer);
 }
 
+void ws_wait_input_gap(const uint32_t max_wait_ms) {
+    const int64_t deadline_us = esp_timer_get_time() + max_wait_ms * 1000LL;
+    while (1) {
+        const int64_t now = esp_timer_get_time();
+        const int64_t quiet_ms = (now - hid_bridge_last_input_us()) / 1000;
+        if (quiet_ms >= WS_INPUT_GAP_MS || now >= deadline_us) {
+            return;
+        }
+        vTaskDelay(MAX(1, pdMS_TO_TICKS(WS_INPUT_GAP_MS - quiet_ms)));
+    }
+}
+
 esp_err_t init_device_settings(void) {
     return init_global_settings();
 }
@@ -262,7 +363,7 @@ esp_err_t init_device_settings(void) {
 //     free(dev_list);
 // }
 
-static void process_settings_ws_message(const char* message) {
+static void process_settings_ws_message(const char* message, const int sockfd) {
     if (!message) return;
     
     cJSON *root = cJSON_Parse(message);
@@ -309,26 +410,47 @@ static void process_settings_ws_message(const char* message) {
                 return;
             }
             
-            char *new_settings = cJSON_PrintUnformatted(content_obj);
-            if (!new_settings) {
+            // Only the httpd task gets here
+            static char new_settings[SETTINGS_JSON_MAX_LEN];
+            if (!cJSON_PrintPreallocated(content_obj, new_settings, sizeof(new_settings), false)) {
                 ESP_LOGE(WS_TAG, "Error converting settings to string");
                 cJSON_Delete(root);
                 return;
             }
 
             const esp_err_t err = storage_update_settings(new_settings);
+            const bool restart = err == ESP_OK && storage_restart_required();
             if (err == ESP_OK) {
-                ws_broadcast_json("settings_update_status", "{\"success\":true}");
+                ws_broadcast_json("settings_update_status", restart ? "{\"success\":true,\"restart\":true}"
+                                                                    : "{\"success\":true,\"restart\":false}");
             } else {
                 char error_msg[100];
                 snprintf(error_msg, sizeof(error_msg), "{\"success\":false,\"error\":\"%s\"}", esp_err_to_name(err));
                 ws_broadcast_json("settings_update_status", error_msg);
             }
             
-            free(new_settings);
-            storage_set_boot_with_wifi();
-            vTaskDelay(pdMS_TO_TICKS(250));
-            esp_restart();
+            // Subscribed settings are applied live, anything else still needs a restart
+            if (restart) {
+                storage_set_boot_with_wifi();
+                vTaskDelay(pdMS_TO_TICKS(250));
+                esp_restart();
+            }
+        } else if (strcmp(command, "telemetry_subscribe") == 0 && sockfd != -1) {
+            set_subscribed(sockfd, true);
+            telemetry_start();
+        } else if (strcmp(command, "telemetry_unsubscribe") == 0 && sockfd != -1) {
+            set_subscribed(sockfd, false);
+        } else if (strcmp(command, "capture_start") == 0) {
+            const esp_err_t err = usb_hid_host_start_capture();
+            if (err != ESP_OK) {
+                ESP_LOGE(WS_TAG, "Failed to start capture: %s", esp_err_to_name(err));
+            }
+            broadcast_capture_status();
+        } else if (strcmp(command, "capture_stop") == 0) {
+            report_capture_stop();
+            broadcast_capture_status();
+        } else if (strcmp(command, "capture_status") == 0) {
+            broadcast_capture_status();
         }
     }
     
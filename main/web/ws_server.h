@@ -29,6 +29,35 @@ esp_err_t init_device_settings(void);
  */
 esp_err_t ws_send_frame_to_all_clients(const char *data, size_t len);
 
+/**
+ * @brief Send a binary frame to all connected WebSocket clients
+ * 
+ * The first byte of every binary message is its type (see LATENCY_MSG_TYPE in latency_trace.h)
+ * 
+ * @param data The data to send
+ * @param len Length of the data
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t ws_send_binary_to_all_clients(const uint8_t *data, size_t len);
+
+/**
+ * @brief Send a binary frame to the clients that sent the telemetry_subscribe command
+ * 
+ * All subscribers share one frame referencing data, nothing is copied per client.
+ * 
+ * @param data The data to send, must stay valid until the call returns
+ * @param len Length of the data
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NOT_FOUND if nobody is subscribed
+ */
+esp_err_t ws_send_binary_to_subscribers(const uint8_t *data, size_t len);
+
+/**
+ * @brief Get the number of clients subscribed to telemetry
+ * 
+ * @return Number of subscribers
+ */
+int ws_num_telemetry_subscribers(void);
+
 /**
  * @brief Broadcast a JSON message to all connected clients
  * 
@@ -50,3 +79,16 @@ void ws_queue_message(const char *data);
  * @param text Message to log
  */
 void ws_log(const char* text);
+
+// Input counts as paused after this long without a report
+#define WS_INPUT_GAP_MS 20
+
+/**
+ * @brief Wait for a pause in keyboard and mouse input before a periodic send
+ *
+ * Wi-Fi and BLE share the radio, a send that lands between reports doesn't delay a notification.
+ * Periodic senders call this so their traffic bunches into the pauses.
+ *
+ * @param max_wait_ms Longest wait, the send goes out anyway once it passed
+ */
+void ws_wait_input_gap(uint32_t max_wait_ms);
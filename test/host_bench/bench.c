@@ -0,0 +1,642 @@
+/**
+ * Replays captured descriptor and report traces through the decoder the firmware runs, on the host.
+ *
+ * Every report is decoded by the fast path (the decode plan) and by the generic path (every field
+ * extracted, then the translation table or the keyboard field walk), the two must agree with each
+ * other and with the expected values of the trace. The time per report and the heap calls made
+ * while decoding are reported per device.
+ *
+ * Trace format, one item per line, # starts a comment:
+ *
+ *   name <text>                    device name for the report
+ *   desc <hex bytes>               report descriptor, several lines are concatenated
+ *   mouse <hex bytes> = <buttons> <x> <y> <wheel> <pan>
+ *   keyboard <hex bytes> = <modifiers> [<usage> ...]
+ *   report <hex bytes>             decoded both ways without an expected value
+ *
+ * Report bytes are what the USB IN transfer carries, with the report ID if the device uses them.
+ * Numbers after = are decimal, or hex with 0x.
+ *
+ * Capture files downloaded from the device (*.awcp, see report_capture.h) are replayed directly,
+ * one trace per captured interface, without expected values.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/param.h>
+#include "descriptor_parser.h"
+#include "hid_bridge.h"
+#include "key_bitmap.h"
+#include "report_capture.h"
+
+#define MAX_DESC_LEN      1024
+#define MAX_REPORT_LEN    64
+#define MAX_CAPTURE_IFACES 16
+#define MAX_LINE_LEN      1024
+#define MAX_PATHS         64
+#define DEFAULT_PASSES    20000
+#define PARSE_DIVIDER     10
+
+typedef enum {
+    EXPECT_NONE,
+    EXPECT_MOUSE,
+    EXPECT_KEYBOARD,
+} expect_t;
+
+typedef struct {
+    uint8_t data[MAX_REPORT_LEN];
+    uint8_t len;
+    uint8_t expect;
+    int line;
+    hid_mouse_sample_t mouse;
+    key_bitmap_t keys;
+} trace_report_t;
+
+typedef struct {
+    char name[64];
+    uint8_t desc[MAX_DESC_LEN];
+    size_t desc_len;
+    trace_report_t *reports;
+    int num_reports;
+    int capacity;
+    uint8_t capture_dev;    // interface of a capture file
+    uint8_t capture_iface;
+} trace_t;
+
+typedef struct {
+    const report_info_t *info;
+    const uint8_t *data;
+} selected_report_t;
+
+// Heap calls of the decoder sources, counted while s_count_allocs is set. Volatile, the compiler
+// would otherwise move the flag stores across the bench's own heap calls
+static volatile bool s_count_allocs = false;
+static volatile uint32_t s_allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(const size_t size) {
+    s_allocs += s_count_allocs;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(const size_t count, const size_t size) {
+    s_allocs += s_count_allocs;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, const size_t size) {
+    s_allocs += s_count_allocs;
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+    s_allocs += s_count_allocs && ptr != NULL;
+    __real_free(ptr);
+}
+
+static volatile int32_t s_sink;
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int parse_hex_bytes(char *text, uint8_t *out, const int max, const char *path, const int line) {
+    int count = 0;
+    for (char *token = strtok(text, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n")) {
+        char *end;
+        const unsigned long value = strtoul(token, &end, 16);
+        if (*end != '\0' || value > 0xFF) {
+            fprintf(stderr, "%s:%d: bad byte '%s'\n", path, line, token);
+            return -1;
+        }
+        if (count >= max) {
+            fprintf(stderr, "%s:%d: more than %d bytes\n", path, line, max);
+            return -1;
+        }
+        out[count++] = value;
+    }
+    return count;
+}
+
+static bool parse_expected(char *text, trace_report_t *report, const char *path, const int line) {
+    long values[2 + 6 * 8];
+    int count = 0;
+    for (char *token = strtok(text, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n")) {
+        char *end;
+        if (count >= (int)(sizeof(values) / sizeof(values[0]))) {
+            fprintf(stderr, "%s:%d: too many values\n", path, line);
+            return false;
+        }
+        values[count++] = strtol(token, &end, 0);
+        if (*end != '\0') {
+            fprintf(stderr, "%s:%d: bad value '%s'\n", path, line, token);
+            return false;
+        }
+    }
+
+    if (report->expect == EXPECT_MOUSE) {
+        if (count != HID_TARGET_COUNT) {
+            fprintf(stderr, "%s:%d: expected buttons x y wheel pan\n", path, line);
+            return false;
+        }
+        for (int i = 0; i < HID_TARGET_COUNT; i++) {
+            report->mouse.targets[i] = values[i];
+        }
+        return true;
+    }
+
+    if (count < 1) {
+        fprintf(stderr, "%s:%d: expected modifiers and keys\n", path, line);
+        return false;
+    }
+    key_bitmap_clear(&report->keys);
+    key_bitmap_set_modifiers(&report->keys, values[0]);
+    for (int i = 1; i < count; i++) {
+        key_bitmap_set(&report->keys, values[i]);
+    }
+    return true;
+}
+
+static void reset_trace(trace_t *trace) {
+    free(trace->reports);
+    memset(trace, 0, sizeof(trace_t));
+}
+
+static trace_report_t *add_report(trace_t *trace) {
+    if (trace->num_reports == trace->capacity) {
+        const int capacity = trace->capacity ? trace->capacity * 2 : 64;
+        trace_report_t *reports = realloc(trace->reports, capacity * sizeof(trace_report_t));
+        if (reports == NULL) {
+            return NULL;
+        }
+        trace->reports = reports;
+        trace->capacity = capacity;
+    }
+
+    trace_report_t *report = &trace->reports[trace->num_reports++];
+    memset(report, 0, sizeof(trace_report_t));
+    return report;
+}
+
+static bool load_trace(const char *path, trace_t *trace) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    reset_trace(trace);
+    const char *base = strrchr(path, '/');
+    snprintf(trace->name, sizeof(trace->name), "%s", base ? base + 1 : path);
+
+    char line[MAX_LINE_LEN];
+    int line_num = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file) != NULL) {
+        line_num++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        char *rest = line + strspn(line, " \t");
+        const size_t keyword_len = strcspn(rest, " \t\r\n");
+        if (keyword_len == 0) {
+            continue;
+        }
+        char *args = rest + keyword_len;
+
+        if (strncmp(rest, "name", keyword_len) == 0) {
+            args += strspn(args, " \t");
+            args[strcspn(args, "\r\n")] = '\0';
+            snprintf(trace->name, sizeof(trace->name), "%s", args);
+        } else if (strncmp(rest, "desc", keyword_len) == 0) {
+            const int n = parse_hex_bytes(args, trace->desc + trace->desc_len, MAX_DESC_LEN - trace->desc_len,
+                                          path, line_num);
+            ok = n >= 0;
+            trace->desc_len += ok ? n : 0;
+        } else if (strncmp(rest, "mouse", keyword_len) == 0 || strncmp(rest, "keyboard", keyword_len) == 0 ||
+                   strncmp(rest, "report", keyword_len) == 0) {
+            trace_report_t *report = add_report(trace);
+            if (report == NULL) {
+                fprintf(stderr, "%s:%d: out of memory\n", path, line_num);
+                ok = false;
+                break;
+            }
+            report->line = line_num;
+            report->expect = rest[0] == 'm' ? EXPECT_MOUSE : rest[0] == 'k' ? EXPECT_KEYBOARD : EXPECT_NONE;
+            char *expected = strchr(args, '=');
+            if (expected != NULL) {
+                *expected++ = '\0';
+            }
+            if ((report->expect != EXPECT_NONE) != (expected != NULL)) {
+                fprintf(stderr, "%s:%d: '=' goes with mouse and keyboard lines only\n", path, line_num);
+                ok = false;
+                break;
+            }
+
+            const int n = parse_hex_bytes(args, report->data, sizeof(report->data), path, line_num);
+            ok = n > 0 && (expected == NULL || parse_expected(expected, report, path, line_num));
+            report->len = ok ? n : 0;
+        } else {
+            fprintf(stderr, "%s:%d: unknown item '%.*s'\n", path, line_num, (int)keyword_len, rest);
+            ok = false;
+        }
+    }
+
+    fclose(file);
+    if (ok && trace->desc_len == 0) {
+        fprintf(stderr, "%s: no descriptor\n", path);
+        ok = false;
+    }
+    return ok;
+}
+
+// Same report selection as process_report() in usb_hid_host.c
+static bool select_report(const report_map_t *map, const trace_report_t *report, selected_report_t *out) {
+    uint8_t report_id = 0;
+    out->data = report->data;
+    if (map->num_reports > 1) {
+        report_id = report->data[0];
+        out->data++;
+    } else if (map->num_reports == 1) {
+        report_id = map->report_ids[0];
+    }
+
+    for (int i = 0; i < map->num_reports; i++) {
+        if (map->report_ids[i] == report_id) {
+            out->info = &map->reports[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+static void extract_fields(const report_info_t *info, const uint8_t *data, usb_hid_field_t *fields,
+                           int64_t *values) {
+    for (int i = 0; i < info->num_fields; i++) {
+        values[i] = extract_field_value(data, info->fields[i].bit_offset, info->fields[i].bit_size);
+        fields[i].attr = info->fields[i].attr;
+        fields[i].value = &values[i];
+    }
+}
+
+static void print_mouse(const char *label, const hid_mouse_sample_t *sample) {
+    fprintf(stderr, "  %-8s buttons 0x%" PRIx32 " x %" PRId32 " y %" PRId32 " wheel %" PRId32 " pan %" PRId32 "\n",
+            label, sample->buttons, sample->x, sample->y, sample->wheel, sample->pan);
+}
+
+static void print_keys(const char *label, const key_bitmap_t *keys) {
+    fprintf(stderr, "  %-8s modifiers 0x%02x keys", label, key_bitmap_modifiers(keys));
+    for (int usage = 0; usage < 0xE0; usage++) {
+        if (key_bitmap_test(keys, usage)) {
+            fprintf(stderr, " 0x%02x", usage);
+        }
+    }
+    fprintf(stderr, "\n");
+}
+
+// extract_field_value() stops at 64 bits, wider fields (NKRO bitmaps) only decode on the fast path
+static bool has_wide_field(const report_info_t *info) {
+    for (int i = 0; i < info->num_fields; i++) {
+        if (info->fields[i].bit_size > 64) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Fast and generic path must agree, and both must match the trace when it has an expected value
+static bool check_report(const char *path, const report_map_t *map, const trace_report_t *report) {
+    selected_report_t selected;
+    if (!select_report(map, report, &selected)) {
+        fprintf(stderr, "%s:%d: report ID 0x%02x not in the descriptor\n", path, report->line, report->data[0]);
+        return false;
+    }
+
+    const report_info_t *info = selected.info;
+    usb_hid_field_t fields[MAX_REPORT_FIELDS];
+    int64_t values[MAX_REPORT_FIELDS];
+    extract_fields(info, selected.data, fields, values);
+
+    const bool fast_only = info->plan.valid && has_wide_field(info);
+    if (info->is_mouse) {
+        hid_mouse_sample_t generic, fast;
+        decode_mouse_fields(&info->plan.pointer, fields, &generic);
+        if (info->plan.valid) {
+            decode_mouse_report(&info->plan, selected.data, &fast);
+        }
+        const hid_mouse_sample_t *decoded = fast_only ? &fast : &generic;
+        const bool fast_ok = !info->plan.valid || fast_only || memcmp(&fast, &generic, sizeof(fast)) == 0;
+        const bool expected_ok = report->expect != EXPECT_MOUSE ||
+                                 memcmp(&report->mouse, decoded, sizeof(hid_mouse_sample_t)) == 0;
+        if (report->expect == EXPECT_KEYBOARD || !fast_ok || !expected_ok) {
+            fprintf(stderr, "%s:%d: mouse decode mismatch\n", path, report->line);
+            if (!fast_only) {
+                print_mouse("generic", &generic);
+            }
+            if (info->plan.valid) {
+                print_mouse("fast", &fast);
+            }
+            if (report->expect == EXPECT_MOUSE) {
+                print_mouse("expected", &report->mouse);
+            }
+            return false;
+        }
+    } else if (info->is_keyboard) {
+        hid_keyboard_sample_t fast;
+        key_bitmap_t generic;
+        decode_keyboard_fields(info, fields, &generic);
+        if (info->plan.valid) {
+            decode_keyboard_report(&info->plan, selected.data, &fast);
+        }
+        const key_bitmap_t *decoded = fast_only ? &fast.keys : &generic;
+        const bool fast_ok = !info->plan.valid || fast_only || key_bitmap_equal(&fast.keys, &generic);
+        const bool expected_ok = report->expect != EXPECT_KEYBOARD || key_bitmap_equal(&report->keys, decoded);
+        if (report->expect == EXPECT_MOUSE || !fast_ok || !expected_ok) {
+            fprintf(stderr, "%s:%d: keyboard decode mismatch\n", path, report->line);
+            if (!fast_only) {
+                print_keys("generic", &generic);
+            }
+            if (info->plan.valid) {
+                print_keys("fast", &fast.keys);
+            }
+            if (report->expect == EXPECT_KEYBOARD) {
+                print_keys("expected", &report->keys);
+            }
+            return false;
+        }
+    } else if (report->expect != EXPECT_NONE) {
+        fprintf(stderr, "%s:%d: report is neither mouse nor keyboard\n", path, report->line);
+        return false;
+    }
+
+    return true;
+}
+
+// Decodes every report of the trace once per pass, the way the USB callback would
+static int64_t run_decode(const report_map_t *map, const trace_t *trace, const int passes, const bool fast) {
+    selected_report_t *selected = malloc(trace->num_reports * sizeof(selected_report_t));
+    for (int i = 0; i < trace->num_reports; i++) {
+        select_report(map, &trace->reports[i], &selected[i]);
+    }
+
+    usb_hid_field_t fields[MAX_REPORT_FIELDS];
+    int64_t values[MAX_REPORT_FIELDS];
+    hid_mouse_sample_t mouse;
+    hid_keyboard_sample_t keyboard;
+
+    s_count_allocs = true;
+    const int64_t start = now_ns();
+    for (int pass = 0; pass < passes; pass++) {
+        for (int i = 0; i < trace->num_reports; i++) {
+            const report_info_t *info = selected[i].info;
+            const uint8_t *data = selected[i].data;
+            if (fast && info->plan.valid) {
+                if (info->is_keyboard) {
+                    decode_keyboard_report(&info->plan, data, &keyboard);
+                    s_sink += keyboard.keys.words[0];
+                } else {
+                    decode_mouse_report(&info->plan, data, &mouse);
+                    s_sink += mouse.x;
+                }
+                continue;
+            }
+
+            extract_fields(info, data, fields, values);
+            if (info->is_mouse) {
+                decode_mouse_fields(&info->plan.pointer, fields, &mouse);
+                s_sink += mouse.x;
+            } else if (info->is_keyboard) {
+                decode_keyboard_fields(info, fields, &keyboard.keys);
+                s_sink += keyboard.keys.words[0];
+            }
+        }
+    }
+    const int64_t elapsed = now_ns() - start;
+    s_count_allocs = false;
+    free(selected);
+    return elapsed;
+}
+
+static int64_t run_parse(const trace_t *trace, report_map_t *map, const int passes) {
+    s_count_allocs = true;
+    const int64_t start = now_ns();
+    for (int pass = 0; pass < passes; pass++) {
+        memset(map, 0, sizeof(report_map_t));
+        parse_report_descriptor(trace->desc, trace->desc_len, 0, map);
+    }
+    const int64_t elapsed = now_ns() - start;
+    s_count_allocs = false;
+    return elapsed;
+}
+
+static bool bench_trace(const char *path, const trace_t *trace, const int passes) {
+    static report_map_t map;
+    memset(&map, 0, sizeof(map));
+    parse_report_descriptor(trace->desc, trace->desc_len, 0, &map);
+
+    bool ok = true;
+    for (int i = 0; i < trace->num_reports; i++) {
+        ok = check_report(path, &map, &trace->reports[i]) && ok;
+    }
+    if (!ok || trace->num_reports == 0) {
+        printf("%-34s %7d %10s %12s %14s %7s  %s\n", trace->name, trace->num_reports, "-", "-", "-", "-",
+               ok ? "no reports" : "FAIL");
+        return ok;
+    }
+
+    s_allocs = 0;
+    const int parse_passes = passes / PARSE_DIVIDER > 0 ? passes / PARSE_DIVIDER : 1;
+    const int64_t parse_ns = run_parse(trace, &map, parse_passes);
+    const int64_t fast_ns = run_decode(&map, trace, passes, true);
+    const int64_t generic_ns = run_decode(&map, trace, passes, false);
+
+    const int64_t decodes = (int64_t)passes * trace->num_reports;
+    ok = s_allocs == 0;
+    printf("%-34s %7d %10.0f %12.1f %14.1f %7" PRIu32 "  %s\n", trace->name, trace->num_reports,
+           (double)parse_ns / parse_passes, (double)fast_ns / decodes, (double)generic_ns / decodes, s_allocs,
+           ok ? "ok" : "FAIL");
+    return ok;
+}
+
+static uint16_t read_u16_le(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+// One trace per captured interface, reports of interfaces without a descriptor are skipped
+static int load_capture(const char *path, trace_t *traces, const int max) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    report_capture_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, REPORT_CAPTURE_MAGIC, 4) != 0 ||
+        header.version != REPORT_CAPTURE_VERSION) {
+        fprintf(stderr, "%s: not a version %d capture\n", path, REPORT_CAPTURE_VERSION);
+        fclose(file);
+        return -1;
+    }
+    if (header.dropped > 0) {
+        fprintf(stderr, "%s: %" PRIu32 " reports were dropped on the device\n", path, header.dropped);
+    }
+
+    const char *base = strrchr(path, '/');
+    int count = 0;
+    uint32_t skipped = 0;
+    uint8_t raw[sizeof(report_capture_record_t)];
+    static uint8_t data[UINT16_MAX];
+    while (fread(raw, sizeof(raw), 1, file) == 1) {
+        const uint16_t len = read_u16_le(&raw[offsetof(report_capture_record_t, len)]);
+        const uint8_t type = raw[offsetof(report_capture_record_t, type)];
+        const uint8_t dev_addr = raw[offsetof(report_capture_record_t, dev_addr)];
+        const uint8_t iface = raw[offsetof(report_capture_record_t, iface)];
+        if (len > 0 && fread(data, len, 1, file) != 1) {
+            fprintf(stderr, "%s: truncated record\n", path);
+            break;
+        }
+
+        trace_t *trace = NULL;
+        for (int i = 0; i < count && trace == NULL; i++) {
+            trace = traces[i].capture_dev == dev_addr && traces[i].capture_iface == iface ? &traces[i] : NULL;
+        }
+
+        if (type == REPORT_CAPTURE_DESCRIPTOR) {
+            if (trace == NULL && count < max) {
+                trace = &traces[count++];
+                memset(trace, 0, sizeof(trace_t));
+                trace->capture_dev = dev_addr;
+                trace->capture_iface = iface;
+                snprintf(trace->name, sizeof(trace->name), "%s dev %d if %d", base ? base + 1 : path, dev_addr,
+                         iface);
+            }
+            if (trace != NULL) {
+                trace->desc_len = MIN(len, MAX_DESC_LEN);
+                memcpy(trace->desc, data, trace->desc_len);
+            }
+        } else if (type == REPORT_CAPTURE_INPUT) {
+            trace_report_t *report = trace != NULL && len > 0 && len <= MAX_REPORT_LEN ? add_report(trace) : NULL;
+            if (report == NULL) {
+                skipped++;
+                continue;
+            }
+            memcpy(report->data, data, len);
+            report->len = len;
+            report->line = trace->num_reports;
+        }
+    }
+
+    fclose(file);
+    if (skipped > 0) {
+        fprintf(stderr, "%s: %" PRIu32 " reports skipped\n", path, skipped);
+    }
+    return count;
+}
+
+static bool has_suffix(const char *name, const char *suffix) {
+    const size_t len = strlen(name);
+    const size_t suffix_len = strlen(suffix);
+    return len > suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+// Returns the number of failed traces
+static int run_file(const char *path, const int passes) {
+    static trace_t traces[MAX_CAPTURE_IFACES];
+    int count;
+    if (has_suffix(path, ".awcp")) {
+        count = load_capture(path, traces, MAX_CAPTURE_IFACES);
+    } else {
+        count = load_trace(path, &traces[0]) ? 1 : -1;
+    }
+    if (count < 0) {
+        return 1;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        failed += !bench_trace(path, &traces[i], passes);
+        reset_trace(&traces[i]);
+    }
+    return failed;
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// A directory stands for the *.trace and *.awcp files in it, in name order
+static int collect_paths(const char *arg, char **paths, int count) {
+    DIR *dir = opendir(arg);
+    if (dir == NULL) {
+        if (count < MAX_PATHS) {
+            paths[count++] = strdup(arg);
+        }
+        return count;
+    }
+
+    const int first = count;
+    const struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && count < MAX_PATHS) {
+        const size_t len = strlen(entry->d_name);
+        if (has_suffix(entry->d_name, ".trace") || has_suffix(entry->d_name, ".awcp")) {
+            char *path = malloc(strlen(arg) + len + 2);
+            sprintf(path, "%s/%s", arg, entry->d_name);
+            paths[count++] = path;
+        }
+    }
+    closedir(dir);
+    qsort(&paths[first], count - first, sizeof(char *), compare_paths);
+    return count;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-n passes] <trace file or directory>...\n", argv0);
+}
+
+int main(const int argc, char **argv) {
+    int passes = DEFAULT_PASSES;
+    char *paths[MAX_PATHS];
+    int num_paths = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            passes = atoi(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 2;
+        } else {
+            num_paths = collect_paths(argv[i], paths, num_paths);
+        }
+    }
+    if (num_paths == 0 || passes <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    printf("%-34s %7s %10s %12s %14s %7s  %s\n", "device", "reports", "parse ns", "fast ns/rpt", "generic ns/rpt",
+           "allocs", "result");
+    int failed = 0;
+    for (int i = 0; i < num_paths; i++) {
+        failed += run_file(paths[i], passes);
+        free(paths[i]);
+    }
+
+    if (failed > 0) {
+        printf("%d traces failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+
+// Host build stand-in, the decoder only needs the types its headers mention
+
+typedef void *TaskHandle_t;
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
@@ -0,0 +1,15 @@
+#pragma once
+
+// Host build stand-in for the USB HID host class driver types
+
+typedef void *hid_host_device_handle_t;
+
+typedef enum {
+    HID_HOST_DRIVER_EVENT_CONNECTED = 0,
+} hid_host_driver_event_t;
+
+typedef enum {
+    HID_HOST_INTERFACE_EVENT_INPUT_REPORT = 0,
+    HID_HOST_INTERFACE_EVENT_TRANSFER_ERROR,
+    HID_HOST_INTERFACE_EVENT_DISCONNECTED,
+} hid_host_interface_event_t;
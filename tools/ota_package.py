@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+"""Build compressed or delta OTA packages for /upload, see main/web/ota_package.h for the format.
+
+    ota_package.py build/esp32s3-project.bin -o update.awot
+    ota_package.py build/esp32s3-project.bin --base previous.bin -o update.awot
+
+A delta only applies to the image it was made against. The device answers 409 when the running
+firmware is a different one, upload the full image (or a package without --base) in that case.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+import zlib
+
+MAGIC = b'AWOT'
+VERSION = 1
+TYPE_FULL = 1
+TYPE_DELTA = 2
+FLAG_DEFLATE = 0x01
+# The device inflates into a window of this size, OTA_PACKAGE_WINDOW_BITS in ota_package.h
+WINDOW_BITS = 12
+
+IMAGE_MAGIC = 0xE9
+IMAGE_HEADER_LEN = 24
+SEGMENT_HEADER_LEN = 8
+
+# Matches are looked up by this many bytes at block aligned positions of the base image
+KEY_LEN = 32
+BLOCK = 16
+# Approximate matches end once this many of the last WINDOW bytes differ
+MISMATCH_WINDOW = 16
+MISMATCH_LIMIT = 8
+
+
+def image_sha256(image):
+    """What esp_partition_get_sha256() reports for an app partition holding this image."""
+    if len(image) < IMAGE_HEADER_LEN or image[0] != IMAGE_MAGIC:
+        sys.exit('not an ESP application image')
+
+    segments = image[1]
+    hash_appended = image[23] == 1
+    pos = IMAGE_HEADER_LEN
+    for _ in range(segments):
+        _, length = struct.unpack_from('<II', image, pos)
+        pos += SEGMENT_HEADER_LEN + length
+    # Checksum byte at the end of the next 16 byte boundary
+    pos = (pos + 16) & ~15
+
+    if hash_appended:
+        return image[pos:pos + 32]
+    return hashlib.sha256(image[:pos]).digest()
+
+
+def approximate_end(new, old, n, o):
+    """Extend a match forward allowing sparse differences, bsdiff style, and return its length."""
+    length = 0
+    recent = []
+    last_equal = 0
+    while n + length < len(new) and o + length < len(old):
+        equal = new[n + length] == old[o + length]
+        recent.append(equal)
+        if len(recent) > MISMATCH_WINDOW:
+            recent.pop(0)
+        length += 1
+        if equal:
+            last_equal = length
+        elif recent.count(False) > MISMATCH_LIMIT:
+            break
+    return last_equal
+
+
+def make_delta(new, old):
+    index = {}
+    for pos in range(0, len(old) - KEY_LEN + 1, BLOCK):
+        index.setdefault(old[pos:pos + KEY_LEN], pos)
+
+    matches = []
+    pos = 0
+    covered = 0
+    while pos + KEY_LEN <= len(new):
+        o = index.get(new[pos:pos + KEY_LEN])
+        if o is None:
+            pos += 1
+            continue
+
+        n = pos
+        while n > covered and o > 0 and new[n - 1] == old[o - 1]:
+            n -= 1
+            o -= 1
+        length = approximate_end(new, old, n, o)
+        matches.append((n, o, length))
+        covered = pos = n + length
+
+    records = bytearray()
+    for i, (n, o, length) in enumerate(matches):
+        if i == 0:
+            records += struct.pack('<iii', 0, n, o)
+            records += new[:n]
+        diff = bytes((new[n + k] - old[o + k]) & 0xFF for k in range(length))
+        next_n, next_o = (matches[i + 1][0], matches[i + 1][1]) if i + 1 < len(matches) else (len(new), o + length)
+        extra = new[n + length:next_n]
+        records += struct.pack('<iii', length, len(extra), next_o - (o + length))
+        records += diff + extra
+
+    if not matches:
+        records += struct.pack('<iii', 0, len(new), 0) + new
+    return bytes(records)
+
+
+def deflate(data):
+    compressor = zlib.compressobj(9, zlib.DEFLATED, WINDOW_BITS)
+    return compressor.compress(data) + compressor.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('image', help='new application image (.bin)')
+    parser.add_argument('--base', help='image the device runs now, builds a delta against it')
+    parser.add_argument('--no-deflate', action='store_true', help='leave the payload uncompressed')
+    parser.add_argument('-o', '--output', required=True)
+    args = parser.parse_args()
+
+    with open(args.image, 'rb') as f:
+        image = f.read()
+    image_sha256(image)
+
+    base_sha = bytes(32)
+    package_type = TYPE_FULL
+    payload = image
+    if args.base:
+        with open(args.base, 'rb') as f:
+            base = f.read()
+        base_sha = image_sha256(base)
+        package_type = TYPE_DELTA
+        payload = make_delta(image, base)
+
+    flags = 0
+    if not args.no_deflate:
+        flags |= FLAG_DEFLATE
+        payload = deflate(payload)
+
+    header = struct.pack('<4sBBBBI32s32s', MAGIC, VERSION, package_type, flags, 0, len(image), base_sha,
+                         hashlib.sha256(image).digest())
+    with open(args.output, 'wb') as f:
+        f.write(header + payload)
+
+    kind = 'delta' if package_type == TYPE_DELTA else 'full'
+    print(f'{kind} package: {len(image)} byte image -> {len(header) + len(payload)} bytes')
+
+
+if __name__ == '__main__':
+    main()